@@ -1,5 +1,20 @@
 #include "allocators.hpp"
 
-linear_allocator_t linear_allocator_global;
+double_buffered_linear_allocator_t frame_allocator_global;
 stack_allocator_t stack_allocator_global;
-free_list_allocator_t free_list_allocator_global;
\ No newline at end of file
+free_list_allocator_t free_list_allocator_global;
+
+thread_local linear_allocator_t *thread_linear_allocator = nullptr;
+
+void initialize_global_allocators(void) {
+    initialize_double_buffered_linear_impl(FRAME_LINEAR_RESERVE_SIZE, FRAME_LINEAR_RETAINED_SIZE, VIRTUAL_MEMORY_HUGE_PAGES, &frame_allocator_global);
+    thread_linear_allocator = &frame_allocator_global.arenas[frame_allocator_global.current];
+
+    initialize_stack_impl(STACK_RESERVE_SIZE, 0, &stack_allocator_global);
+
+    free_list_allocator_global.available_bytes = (uint32_t)FREE_LIST_INITIAL_SIZE;
+    free_list_allocator_global.reserved_bytes = (uint32_t)FREE_LIST_RESERVE_SIZE;
+    free_list_allocator_global.start = reserve_virtual_memory(FREE_LIST_RESERVE_SIZE, 0);
+    commit_virtual_memory(free_list_allocator_global.start, FREE_LIST_INITIAL_SIZE);
+    initialize_free_list_impl(&free_list_allocator_global);
+}
@@ -1,19 +1,54 @@
 #pragma once
 
 #include "memory.hpp"
+#include <new>
+#include <string.h>
+#include <cassert>
 
-extern linear_allocator_t linear_allocator_global;
+// Only address space gets reserved for these, physical memory gets used as they grow
+#define FRAME_LINEAR_RESERVE_SIZE gigabytes(1)
+#define FRAME_LINEAR_RETAINED_SIZE megabytes(8)
+#define STACK_RESERVE_SIZE megabytes(256)
+// Free list commits more of its range (at least doubling) when no block is big enough. Offsets are 32 bit (has to stay under 4 GB)
+#define FREE_LIST_RESERVE_SIZE gigabytes(1)
+#define FREE_LIST_INITIAL_SIZE megabytes(64)
+
+// Only gets used by the main thread: swapped once per frame
+extern double_buffered_linear_allocator_t frame_allocator_global;
 extern stack_allocator_t stack_allocator_global;
 extern free_list_allocator_t free_list_allocator_global;
 
-inline void *allocate_linear(uint32_t alloc_size, alignment_t alignment = 1, const char *name = "", linear_allocator_t *allocator = &linear_allocator_global) {
+// Scratch arena of the calling thread: current frame arena on the main thread, own arena on the worker threads (no locking)
+extern thread_local linear_allocator_t *thread_linear_allocator;
+
+inline linear_allocator_t *get_thread_linear_allocator(void) {
+    return(thread_linear_allocator);
+}
+
+// Lifetime: main thread - until the end of the next frame; worker threads - until the thread's process returns (or clear_linear gets called)
+inline void *allocate_linear(uint64_t alloc_size, alignment_t alignment = 1, const char *name = "", linear_allocator_t *allocator = get_thread_linear_allocator()) {
     return(allocate_linear_impl(alloc_size, alignment, name, allocator));
 }
 
-inline void clear_linear(linear_allocator_t *allocator = &linear_allocator_global) {
+inline void clear_linear(linear_allocator_t *allocator = get_thread_linear_allocator()) {
     clear_linear_impl(allocator);
 }
 
+// Main thread, before anything gets allocated
+void initialize_global_allocators(void);
+
+// Main thread, at the end of every frame: frees what was allocated during the previous frame
+inline void swap_frame_linear(void) {
+    thread_linear_allocator = swap_double_buffered_linear_impl(&frame_allocator_global);
+    end_memory_tracking_frame();
+}
+
+// Worker threads, when they start
+inline void initialize_thread_linear(uint64_t reserve_size, uint64_t retained_size, linear_allocator_t *allocator) {
+    initialize_linear_impl(reserve_size, retained_size, 0, allocator);
+    thread_linear_allocator = allocator;
+}
+
 inline void *allocate_stack(uint32_t allocation_size, alignment_t alignment = 1, const char *name = "", stack_allocator_t *allocator = &stack_allocator_global) {
     return(allocate_stack_impl(allocation_size, alignment, name, allocator));
 }
@@ -36,6 +71,141 @@ inline void deallocate_free_list(void *pointer, free_list_allocator_t *allocator
     deallocate_free_list_impl(pointer, allocator);
 }
 
+inline free_list_stats_t get_free_list_stats(free_list_allocator_t *allocator = &free_list_allocator_global) {
+    return(get_free_list_stats_impl(allocator));
+}
+
+
+#define POOL_NULL_INDEX 0xFFFFFFFF
+#define POOL_POISON_BYTE 0xDD
+
+// Objects of one type: slabs of Slab_Size objects come from the free list (objects never move), free objects are linked through their own memory
+// allocate() value-initializes the object (T()). In debug builds, freed objects get poisoned and the poison gets checked on reuse
+template <typename T, uint32_t Slab_Size = 64> struct pool_allocator_t {
+    struct slot_t {
+        // Free slot: holds the index of the next free slot
+        alignas(T) uint8_t object[sizeof(T) < sizeof(uint32_t) ? sizeof(uint32_t) : sizeof(T)];
+        uint32_t live;
+        uint32_t index;
+    };
+
+    const char *name;
+
+    slot_t **slabs;
+    uint32_t slab_count;
+    uint32_t max_slab_count;
+
+    uint32_t first_free;
+    uint32_t live_count;
+
+    void initialize(const char *pool_name) {
+        name = pool_name;
+        slabs = nullptr;
+        slab_count = 0;
+        max_slab_count = 0;
+        first_free = POOL_NULL_INDEX;
+        live_count = 0;
+    }
+
+    void deinitialize(void) {
+        for (uint32_t i = 0; i < slab_count; ++i) {
+            deallocate_free_list(slabs[i]);
+        }
+        if (slabs) {
+            deallocate_free_list(slabs);
+        }
+
+        initialize(name);
+    }
+
+    T *allocate(void) {
+        if (first_free == POOL_NULL_INDEX) {
+            add_slab();
+        }
+
+        slot_t *slot = get_slot(first_free);
+
+#if DEBUG
+        // Poison was overwritten: something used the object after it got deallocated
+        for (uint32_t i = sizeof(uint32_t); i < sizeof(slot->object); ++i) {
+            assert(slot->object[i] == POOL_POISON_BYTE);
+        }
+#endif
+
+        memcpy(&first_free, slot->object, sizeof(uint32_t));
+        slot->live = 1;
+        ++live_count;
+
+        return(new (slot->object) T());
+    }
+
+    void deallocate(T *object) {
+        slot_t *slot = (slot_t *)object;
+        assert(slot->live);
+
+        object->~T();
+        slot->live = 0;
+        --live_count;
+
+#if DEBUG
+        memset(slot->object, POOL_POISON_BYTE, sizeof(slot->object));
+#endif
+
+        memcpy(slot->object, &first_free, sizeof(uint32_t));
+        first_free = slot->index;
+    }
+
+    uint32_t get_index(T *object) {
+        slot_t *slot = (slot_t *)object;
+        return(slot->index);
+    }
+
+    // For going through all the live objects: index < get_capacity(), nullptr if the slot is free
+    T *get_live(uint32_t index) {
+        slot_t *slot = get_slot(index);
+        return(slot->live ? (T *)slot->object : nullptr);
+    }
+
+    uint32_t get_capacity(void) {
+        return(slab_count * Slab_Size);
+    }
+
+    slot_t *get_slot(uint32_t index) {
+        return(&slabs[index / Slab_Size][index % Slab_Size]);
+    }
+
+    void add_slab(void) {
+        if (slab_count == max_slab_count) {
+            uint32_t new_max_slab_count = max_slab_count ? max_slab_count * 2 : 4;
+            slot_t **new_slabs = (slot_t **)allocate_free_list(sizeof(slot_t *) * new_max_slab_count, 1, name);
+            if (slabs) {
+                memcpy(new_slabs, slabs, sizeof(slot_t *) * slab_count);
+                deallocate_free_list(slabs);
+            }
+
+            slabs = new_slabs;
+            max_slab_count = new_max_slab_count;
+        }
+
+        slot_t *slab = (slot_t *)allocate_free_list(sizeof(slot_t) * Slab_Size, alignof(slot_t), name);
+        uint32_t first_index = slab_count * Slab_Size;
+        slabs[slab_count++] = slab;
+
+        for (uint32_t i = 0; i < Slab_Size; ++i) {
+            slot_t *slot = &slab[i];
+#if DEBUG
+            memset(slot->object, POOL_POISON_BYTE, sizeof(slot->object));
+#endif
+            uint32_t next = (i == Slab_Size - 1) ? first_free : first_index + i + 1;
+            memcpy(slot->object, &next, sizeof(uint32_t));
+            slot->live = 0;
+            slot->index = first_index + i;
+        }
+
+        first_free = first_index;
+    }
+};
 
-#define FL_MALLOC(type, n) (type *)allocate_free_list(sizeof(type) * n)
-#define LN_MALLOC(type, n) (type *)allocate_linear(sizeof(type) * n)
+// Allocations get tagged with the type's name
+#define FL_MALLOC(type, n) (type *)allocate_free_list(sizeof(type) * n, 1, #type)
+#define LN_MALLOC(type, n) (type *)allocate_linear(sizeof(type) * n, 1, #type)
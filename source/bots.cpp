@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "net.hpp"
+#include "core.hpp"
+#include "bots.hpp"
+#include "player.hpp"
+#include "packets.hpp"
+#include "serializer.hpp"
+
+
+#define MAX_BOTS MAX_CLIENTS
+// Bots make up one player state per frame, like a client running at 60 fps
+#define BOT_COMMAND_RATE 60.0f
+#define MAX_BOT_COMMANDS_PER_PACKET 32
+// Bots join one after the other (every join makes the server send the whole map)
+#define BOT_JOIN_INTERVAL 0.5f
+// Every time a bot changes what it is doing, it has this probability of terraforming
+#define BOT_TERRAFORM_PROBABILITY 0.3f
+#define BOT_MAX_MOUSE_DIFF 10.0f
+#define MAX_RECEIVED_BATCHES_PER_BOT 16
+#define BOT_STATS_INTERVAL 5.0f
+#define BOT_VOXEL_DELTA_RESERVE_SIZE megabytes(16)
+#define BOT_VOXEL_DELTA_RETAINED_SIZE kilobytes(256)
+
+
+struct bot_t {
+    network_socket_t socket;
+    char name[CLIENT_NAME_MAX_LENGTH];
+
+    bool sent_join;
+    bool joined;
+    uint16_t client_id;
+    uint64_t current_packet_count;
+    uint64_t current_tick;
+    uint64_t command_count;
+
+    // Random input: bots keep doing the same thing for a little while
+    uint32_t action_flags;
+    float32_t mouse_x_diff;
+    float32_t mouse_y_diff;
+    float32_t time_until_action_change;
+
+    float32_t time_since_last_command;
+    float32_t time_since_last_input_state;
+    uint32_t commands_to_send;
+    client_input_state_packet_t commands[MAX_BOT_COMMANDS_PER_PACKET];
+
+    // Last state of the bot's player that the server sent (gets sent back with the commands)
+    vector3_t ws_position;
+    vector3_t ws_direction;
+
+    // Snapshots are delta compressed against the ones the bot acknowledged
+    game_state_baselines_t *received_game_states;
+
+    // For the stats
+    uint32_t snapshot_count;
+    float32_t time_since_last_snapshot;
+    float32_t max_time_between_snapshots;
+};
+
+
+struct bot_driver_t {
+    uint32_t bot_count;
+    char server_ip_address[16];
+    network_address_t server_address;
+
+    bot_t bots[MAX_BOTS];
+    uint32_t joining_bot;
+    float32_t time_since_last_join;
+
+    // Datagrams get handled as soon as they get received: all the bots can use the same buffers
+    datagram_t datagrams[MAX_DATAGRAM_BATCH];
+
+    float32_t time_since_report;
+    uint32_t undecodable_snapshot_count;
+    net_channel_stats_t previous_channel_stats;
+
+    // Voxel deltas of a snapshot only need to live while the snapshot gets read
+    linear_allocator_t voxel_delta_allocator;
+};
+
+static bot_driver_t driver;
+
+
+void configure_bots(uint32_t bot_count, const char *server_ip_address) {
+    if (bot_count > MAX_BOTS) {
+        output_to_debug_console("Can't have more than ", (int32_t)MAX_BOTS, " bots (server can't take more clients)\n");
+    }
+
+    driver.bot_count = MIN(bot_count, (uint32_t)MAX_BOTS);
+    snprintf(driver.server_ip_address, sizeof(driver.server_ip_address), "%s", server_ip_address);
+}
+
+
+void initialize_bots(void) {
+    // Main socket only gets used to wait for incoming data
+    initialize_socket_api(0);
+
+    driver.server_address = network_address_t{ (uint16_t)host_to_network_byte_order(GAME_OUTPUT_PORT_SERVER), str_to_ipv4_int32(driver.server_ip_address) };
+
+    char *datagrams_memory = (char *)malloc(MAX_PACKET_SIZE * MAX_DATAGRAM_BATCH);
+    for (uint32_t i = 0; i < MAX_DATAGRAM_BATCH; ++i) {
+        driver.datagrams[i].buffer = datagrams_memory + MAX_PACKET_SIZE * i;
+        driver.datagrams[i].buffer_size = MAX_PACKET_SIZE;
+    }
+
+    initialize_linear_impl(BOT_VOXEL_DELTA_RESERVE_SIZE, BOT_VOXEL_DELTA_RETAINED_SIZE, 0, &driver.voxel_delta_allocator);
+
+    for (uint32_t i = 0; i < driver.bot_count; ++i) {
+        bot_t *bot = &driver.bots[i];
+        snprintf(bot->name, sizeof(bot->name), "bot%u", i);
+
+        initialize_udp_socket(&bot->socket, 0);
+        watch_network_socket(&bot->socket);
+
+        bot->received_game_states = (game_state_baselines_t *)malloc(sizeof(game_state_baselines_t));
+        memset(bot->received_game_states, 0, sizeof(game_state_baselines_t));
+    }
+
+    driver.joining_bot = 0;
+    driver.time_since_last_join = BOT_JOIN_INTERVAL;
+
+    output_to_debug_console("Starting ", (int32_t)driver.bot_count, " bots (server: ", driver.server_ip_address, ")\n");
+}
+
+
+static void s_fill_client_header(bot_t *bot, packet_header_t *header, client_packet_type_t type) {
+    header->packet_mode = packet_mode_t::PM_CLIENT_MODE;
+    header->packet_type = type;
+    header->client_id = bot->client_id;
+    header->current_tick = bot->current_tick;
+    header->current_packet_id = ++bot->current_packet_count;
+}
+
+
+static void s_send_join(bot_t *bot) {
+    packet_header_t header = {};
+    client_join_packet_t packet = {};
+    packet.client_name = bot->name;
+    packet.is_bot = 1;
+
+    header.packet_mode = packet_mode_t::PM_CLIENT_MODE;
+    header.packet_type = client_packet_type_t::CPT_CLIENT_JOIN;
+    header.total_packet_size = sizeof_packet_header() + sizeof_client_join_packet(&packet);
+    header.client_id = 0xFFFF;
+    header.current_packet_id = bot->current_packet_count = 0;
+
+    serializer_t serializer = {};
+    serializer.initialize(header.total_packet_size);
+    serializer.serialize_packet_header(&header);
+    serializer.serialize_client_join_packet(&packet);
+
+    // Start a new session with the server
+    remove_net_channel(driver.server_address, &bot->socket);
+    serializer.queue_serialized_message(driver.server_address, nullptr, CT_RELIABLE_ORDERED, &bot->socket);
+
+    bot->sent_join = 1;
+}
+
+
+void deinitialize_bots(void) {
+    for (uint32_t i = 0; i < driver.bot_count; ++i) {
+        bot_t *bot = &driver.bots[i];
+
+        if (bot->joined) {
+            packet_header_t header = {};
+            s_fill_client_header(bot, &header, client_packet_type_t::CPT_DISCONNECT);
+            header.total_packet_size = sizeof_packet_header();
+
+            serializer_t serializer = {};
+            serializer.initialize(header.total_packet_size);
+            serializer.serialize_packet_header(&header);
+            serializer.queue_serialized_message(driver.server_address, nullptr, CT_RELIABLE_ORDERED, &bot->socket);
+
+            bot->joined = 0;
+        }
+    }
+
+    flush_channel_datagrams();
+}
+
+
+static float32_t s_random_float(float32_t min, float32_t max) {
+    return(min + (max - min) * ((float32_t)rand() / (float32_t)RAND_MAX));
+}
+
+
+static void s_change_bot_actions(bot_t *bot) {
+    uint32_t action_flags = 0;
+
+    // Mostly going forward
+    switch (rand() % 8) {
+    case 0: { action_flags |= (1 << action_flags_t::ACTION_LEFT); } break;
+    case 1: { action_flags |= (1 << action_flags_t::ACTION_RIGHT); } break;
+    case 2: { action_flags |= (1 << action_flags_t::ACTION_BACK); } break;
+    default: { action_flags |= (1 << action_flags_t::ACTION_FORWARD); } break;
+    }
+
+    if (rand() % 4 == 0) action_flags |= (1 << action_flags_t::ACTION_RUN);
+    if (rand() % 6 == 0) action_flags |= (1 << action_flags_t::ACTION_UP);
+
+    if (s_random_float(0.0f, 1.0f) < BOT_TERRAFORM_PROBABILITY) {
+        action_flags |= (1 << ((rand() & 1) ? action_flags_t::ACTION_TERRAFORM_DESTROY : action_flags_t::ACTION_TERRAFORM_ADD));
+    }
+
+    bot->action_flags = action_flags;
+    bot->mouse_x_diff = s_random_float(-BOT_MAX_MOUSE_DIFF, BOT_MAX_MOUSE_DIFF);
+    bot->mouse_y_diff = s_random_float(-BOT_MAX_MOUSE_DIFF, BOT_MAX_MOUSE_DIFF) * 0.2f;
+    bot->time_until_action_change = s_random_float(0.5f, 2.0f);
+}
+
+
+static void s_make_up_command(bot_t *bot, float32_t dt) {
+    bot->time_until_action_change -= dt;
+    if (bot->time_until_action_change <= 0.0f) {
+        s_change_bot_actions(bot);
+    }
+
+    client_input_state_packet_t *command = &bot->commands[bot->commands_to_send++];
+    command->action_flags = bot->action_flags;
+    command->mouse_x_diff = bot->mouse_x_diff;
+    command->mouse_y_diff = bot->mouse_y_diff;
+    command->flags_byte = 0;
+    command->dt = dt;
+    command->command_id = bot->command_count++;
+
+    ++bot->current_tick;
+}
+
+
+// Same format as the input state packets that the client sends (see client.cpp)
+static void s_send_commands(bot_t *bot) {
+    packet_header_t header = {};
+    s_fill_client_header(bot, &header, client_packet_type_t::CPT_INPUT_STATE);
+
+    // Bots don't modify the voxels themselves: the server does it when running their terraforming commands
+    client_modified_voxels_packet_t voxel_packet = {};
+
+    uint32_t max_input_bits = max_varint_bits(32, 7) +
+        sizeof_max_client_input_state_packet_bits() * bot->commands_to_send +
+        max_varint_bits(32, 7) * 3 +
+        QUANTIZED_UNIT_VECTOR_BITS * 2;
+    uint32_t max_packet_size = sizeof_packet_header() + (max_input_bits + 7) / 8 + sizeof_modified_voxels_packet(0, nullptr);
+
+    serializer_t serializer = {};
+    serializer.initialize(max_packet_size);
+
+    // Header gets serialized at the end, once the size is known
+    serializer.grow_data_buffer(sizeof_packet_header());
+
+    bit_serializer_t input_bits = {};
+    input_bits.begin(&serializer);
+
+    input_bits.serialize_varint(bot->commands_to_send);
+    for (uint32_t i = 0; i < bot->commands_to_send; ++i) {
+        input_bits.serialize_client_input_state_packet(&bot->commands[i], i ? &bot->commands[i - 1] : nullptr);
+    }
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        input_bits.serialize_fixed_point(bot->ws_position[i], QUANTIZED_POSITION_SCALE);
+    }
+    input_bits.serialize_unit_vector(bot->ws_direction);
+
+    input_bits.end(&serializer);
+
+    serializer.serialize_client_modified_voxels_packet(&voxel_packet);
+
+    header.total_packet_size = serializer.data_buffer_head;
+    uint32_t packet_end = serializer.data_buffer_head;
+    serializer.data_buffer_head = 0;
+    serializer.serialize_packet_header(&header);
+    serializer.data_buffer_head = packet_end;
+
+    serializer.queue_serialized_message(driver.server_address, nullptr, CT_UNRELIABLE_SEQUENCED, &bot->socket);
+
+    bot->commands_to_send = 0;
+}
+
+
+static void s_send_game_state_acknowledgement(bot_t *bot, uint64_t game_state_tick) {
+    packet_header_t header = {};
+    s_fill_client_header(bot, &header, client_packet_type_t::CPT_ACKNOWLEDGED_GAME_STATE_RECEPTION);
+    header.total_packet_size = sizeof_packet_header() + sizeof(uint64_t);
+
+    serializer_t serializer = {};
+    serializer.initialize(header.total_packet_size);
+    serializer.serialize_packet_header(&header);
+    serializer.serialize_uint64(game_state_tick);
+
+    serializer.queue_serialized_message(driver.server_address, nullptr, CT_UNRELIABLE_SEQUENCED, &bot->socket);
+}
+
+
+static void s_handle_server_handshake(bot_t *bot, packet_header_t *header, serializer_t *in_serializer) {
+    player_state_initialize_packet_t players[MAX_CLIENTS];
+    reused_chunk_t reused_chunks[MAX_CACHED_CHUNKS];
+    game_state_initialize_packet_t game_state_init_packet = {};
+    game_state_init_packet.player = players;
+    game_state_init_packet.reused_chunks = reused_chunks;
+    in_serializer->deserialize_game_state_initialize_packet(&game_state_init_packet);
+
+    bot->client_id = (uint16_t)game_state_init_packet.client_index;
+    bot->current_tick = header->current_tick;
+
+    for (uint32_t i = 0; i < game_state_init_packet.player_count; ++i) {
+        player_state_initialize_packet_t *player = &game_state_init_packet.player[i];
+        if (player->client_id == bot->client_id) {
+            bot->ws_position = player->ws_position;
+            bot->ws_direction = player->ws_direction;
+        }
+    }
+
+    bot->joined = 1;
+    s_change_bot_actions(bot);
+
+    output_to_debug_console(bot->name, " joined (client id ", (int32_t)bot->client_id, ")\n");
+}
+
+
+// Goes through the snapshot like the client does (see client.cpp) but only keeps the state of the bot's player
+static void s_handle_game_state_snapshot(bot_t *bot, serializer_t *in_serializer) {
+    uint64_t game_state_tick = in_serializer->deserialize_uint64();
+    uint64_t baseline_tick = in_serializer->deserialize_uint64();
+
+    game_state_baseline_t *baseline = bot->received_game_states->get(baseline_tick);
+
+    // Section specific to this client (bots never need to correct anything)
+    in_serializer->deserialize_uint64();
+    client_modified_voxels_packet_t modified_voxels = {};
+    in_serializer->deserialize_client_modified_voxels_packet(&modified_voxels, 0);
+    in_serializer->deserialize_uint8();
+
+    clear_linear(&driver.voxel_delta_allocator);
+    game_snapshot_voxel_delta_packet_t voxel_packet = {};
+    in_serializer->deserialize_game_snapshot_voxel_delta_packet(&voxel_packet, &driver.voxel_delta_allocator);
+
+    // Only the player snapshots need the baseline
+    if (baseline_tick && !baseline) {
+        ++driver.undecodable_snapshot_count;
+        return;
+    }
+
+    bit_serializer_t player_bits = {};
+    player_bits.begin(in_serializer);
+
+    game_state_baseline_t *current_game_state = bot->received_game_states->push(game_state_tick);
+    current_game_state->player_count = MIN((uint32_t)player_bits.deserialize_varint(), (uint32_t)MAX_CLIENTS);
+
+    for (uint32_t i = 0; i < current_game_state->player_count; ++i) {
+        quantized_player_snapshot_t *quantized_player = &current_game_state->players[i];
+        quantized_player->client_id = (uint16_t)player_bits.deserialize_varint();
+        player_bits.deserialize_player_snapshot_delta(quantized_player, baseline ? baseline->find_player(quantized_player->client_id) : nullptr);
+    }
+
+    // Truncated / corrupted: can't be used as a baseline
+    if (player_bits.overflowed) {
+        ++driver.undecodable_snapshot_count;
+        current_game_state->game_state_tick = 0;
+        return;
+    }
+
+    quantized_player_snapshot_t *quantized_player = current_game_state->find_player(bot->client_id);
+    if (quantized_player) {
+        game_snapshot_player_state_packet_t player_snapshot_packet = {};
+        dequantize_player_snapshot(quantized_player, &player_snapshot_packet);
+
+        bot->ws_position = player_snapshot_packet.ws_position;
+        bot->ws_direction = player_snapshot_packet.ws_direction;
+    }
+
+    s_send_game_state_acknowledgement(bot, game_state_tick);
+
+    ++bot->snapshot_count;
+    bot->max_time_between_snapshots = MAX(bot->max_time_between_snapshots, bot->time_since_last_snapshot);
+    bot->time_since_last_snapshot = 0.0f;
+}
+
+
+static void s_handle_received_packet(char *message, uint32_t message_size, network_address_t address, void *data) {
+    bot_t *bot = (bot_t *)data;
+
+    serializer_t in_serializer = {};
+    in_serializer.data_buffer = (uint8_t *)message;
+    in_serializer.data_buffer_size = message_size;
+
+    packet_header_t header = {};
+    in_serializer.deserialize_packet_header(&header);
+
+    // Chunk hard updates, other clients joining...: only count as traffic
+    if (header.packet_mode == packet_mode_t::PM_SERVER_MODE) {
+        switch(header.packet_type) {
+        case server_packet_type_t::SPT_SERVER_HANDSHAKE: { s_handle_server_handshake(bot, &header, &in_serializer); } break;
+        case server_packet_type_t::SPT_GAME_STATE_SNAPSHOT: { if (bot->joined) s_handle_game_state_snapshot(bot, &in_serializer); } break;
+        }
+    }
+}
+
+
+static void s_receive_bot_datagrams(bot_t *bot) {
+    for (uint32_t batch = 0; batch < MAX_RECEIVED_BATCHES_PER_BOT; ++batch) {
+        uint32_t received_count = receive_from_batch(driver.datagrams, MAX_DATAGRAM_BATCH, &bot->socket);
+
+        for (uint32_t i = 0; i < received_count; ++i) {
+            datagram_t *datagram = &driver.datagrams[i];
+            receive_channel_datagram((uint8_t *)datagram->buffer, datagram->bytes_received, datagram->address, &s_handle_received_packet, bot, &bot->socket);
+        }
+
+        if (received_count < MAX_DATAGRAM_BATCH) {
+            break;
+        }
+    }
+}
+
+
+static void s_tick_bot_input(bot_t *bot, float32_t dt) {
+    float32_t command_dt = 1.0f / BOT_COMMAND_RATE;
+
+    bot->time_since_last_command += dt;
+    while (bot->time_since_last_command >= command_dt && bot->commands_to_send < MAX_BOT_COMMANDS_PER_PACKET) {
+        s_make_up_command(bot, command_dt);
+        bot->time_since_last_command -= command_dt;
+    }
+
+    // Bot driver was too slow: don't try to catch up
+    if (bot->commands_to_send == MAX_BOT_COMMANDS_PER_PACKET) {
+        bot->time_since_last_command = 0.0f;
+    }
+
+    bot->time_since_last_input_state += dt;
+    if ((bot->time_since_last_input_state > 1.0f / get_snapshot_client_rate() || bot->commands_to_send == MAX_BOT_COMMANDS_PER_PACKET) && bot->commands_to_send) {
+        s_send_commands(bot);
+        bot->time_since_last_input_state = 0.0f;
+    }
+}
+
+
+static void s_report_bot_stats(float32_t dt) {
+    driver.time_since_report += dt;
+
+    if (driver.time_since_report < BOT_STATS_INTERVAL) {
+        return;
+    }
+
+    float32_t time = driver.time_since_report;
+
+    uint32_t joined_count = 0;
+    uint32_t snapshot_count = 0;
+    float32_t max_time_between_snapshots = 0.0f;
+    for (uint32_t i = 0; i < driver.bot_count; ++i) {
+        bot_t *bot = &driver.bots[i];
+        if (bot->joined) {
+            ++joined_count;
+            snapshot_count += bot->snapshot_count;
+            max_time_between_snapshots = MAX(max_time_between_snapshots, bot->max_time_between_snapshots);
+        }
+
+        bot->snapshot_count = 0;
+        bot->max_time_between_snapshots = 0.0f;
+    }
+
+    net_channel_stats_t channel_stats = get_net_channel_stats();
+    net_channel_stats_t *previous = &driver.previous_channel_stats;
+
+    output_to_debug_console("bots: ", (int32_t)joined_count, "/", (int32_t)driver.bot_count, " in game | ",
+                            "snapshots ", (float32_t)snapshot_count / (time * (float32_t)MAX(joined_count, 1u)), "/s per bot, max gap ", max_time_between_snapshots * 1000.0f, " ms, ",
+                            (int32_t)driver.undecodable_snapshot_count, " undecodable | ",
+                            "in ", (float32_t)(channel_stats.bytes_received - previous->bytes_received) * 8.0f / (1000.0f * time), " kbps | ",
+                            "out ", (float32_t)(channel_stats.bytes_sent - previous->bytes_sent) * 8.0f / (1000.0f * time), " kbps\n");
+
+    driver.previous_channel_stats = channel_stats;
+    driver.undecodable_snapshot_count = 0;
+    driver.time_since_report = 0.0f;
+}
+
+
+void tick_bots(float32_t dt) {
+    // Next bot only joins once the previous one is in game
+    driver.time_since_last_join += dt;
+    if (driver.joining_bot < driver.bot_count && driver.time_since_last_join > BOT_JOIN_INTERVAL) {
+        bot_t *bot = &driver.bots[driver.joining_bot];
+
+        if (!bot->sent_join) {
+            s_send_join(bot);
+        }
+        else if (bot->joined) {
+            ++driver.joining_bot;
+            driver.time_since_last_join = 0.0f;
+        }
+    }
+
+    for (uint32_t i = 0; i < driver.bot_count; ++i) {
+        bot_t *bot = &driver.bots[i];
+
+        s_receive_bot_datagrams(bot);
+
+        if (bot->joined) {
+            bot->time_since_last_snapshot += dt;
+            s_tick_bot_input(bot, dt);
+        }
+    }
+
+    // Acknowledgements, resends and flush
+    tick_net_channels(dt);
+
+    s_report_bot_stats(dt);
+
+    // Don't take the CPU away from the server (usually on the same machine)
+    wait_for_incoming_data((uint32_t)(1000.0f / BOT_COMMAND_RATE));
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "utility.hpp"
+
+
+// Headless clients for load testing a server (BOT_MODE): "bt <bot count> <server ip address>" on the command line
+// Every bot has its own socket so the server sees them as different clients
+// Bots join like normal clients, send random input (moving around, terraforming...) and acknowledge snapshots, but there is no world / prediction
+// Server gets told that they are bots when they join: it doesn't check their predictions
+// Traffic and snapshot rate get printed every few seconds (server prints its tick timings on its side)
+
+
+// Needs to be called before initialize_net()
+void configure_bots(uint32_t bot_count, const char *server_ip_address);
+
+void initialize_bots(void);
+// Bots which are in game send a disconnect packet
+void deinitialize_bots(void);
+// Sleeps until something arrives or until the bots need to send input again
+void tick_bots(float32_t dt);
@@ -0,0 +1,1113 @@
+#include <time.h>
+#include <stdlib.h>
+
+#include "net.hpp"
+#include "core.hpp"
+#include "channel.hpp"
+#include "serializer.hpp"
+
+
+#define MAX_NET_CHANNELS (MAX_CLIENTS + 8)
+#define MAX_FRAGMENT_BUFFERS 4096
+#define MAX_FRAGMENTS_PER_MESSAGE 32
+// Sequence numbers are 16 bits: needs to divide 65536
+#define MAX_RELIABLE_MESSAGES_IN_FLIGHT 256
+#define MAX_UNRELIABLE_REASSEMBLIES 4
+#define MAX_PENDING_ACKNOWLEDGEMENTS 64
+#define MAX_RESENT_FRAGMENTS_PER_TICK 64
+#define MIN_RESEND_TIME 0.05f
+#define INVALID_FRAGMENT_BUFFER 0xFFFF
+#define MAX_PENDING_RELIABLE_MESSAGES 4096
+// Reliable messages can't take the last fragment buffers: those are for receiving and for unreliable messages
+#define RESERVED_FRAGMENT_BUFFERS 512
+// Channels which wait for acknowledgements get removed if the other side doesn't send anything for that long
+#define CHANNEL_TIMEOUT 10.0f
+
+// Type, session, acknowledgement count, then (sequence, fragment mask) for each acknowledgement
+#define ACKNOWLEDGEMENTS_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t))
+#define ACKNOWLEDGEMENT_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
+
+static_assert(MAX_FRAGMENTS_PER_MESSAGE * FRAGMENT_PAYLOAD_SIZE >= MAX_MESSAGE_BUFFER_SIZE, "Biggest message needs to fit in MAX_FRAGMENTS_PER_MESSAGE fragments");
+
+
+struct channel_message_t {
+    bool in_use;
+    bool was_resent;
+    uint16_t sequence;
+    uint32_t fragment_count;
+    // Sending: fragments which were acknowledged, receiving: fragments which were received
+    uint32_t fragment_mask;
+    float32_t time_sent;
+    uint16_t fragments[MAX_FRAGMENTS_PER_MESSAGE];
+};
+
+struct channel_acknowledgement_t {
+    uint16_t sequence;
+    uint32_t fragment_mask;
+};
+
+// Reliable message which couldn't be sent yet (window full / out of fragment buffers), message and body get copied right after it
+struct pending_channel_message_t {
+    pending_channel_message_t *next;
+    uint32_t size;
+};
+
+struct channel_fragment_t {
+    uint16_t sequence;
+    uint32_t index;
+    uint32_t count;
+    uint8_t *payload;
+    uint32_t payload_size;
+};
+
+struct net_channel_t {
+    bool in_use;
+    network_address_t address;
+    // Local socket the channel goes through (null = main socket): several local sockets can talk to the same address
+    network_socket_t *socket;
+    float32_t time;
+    float32_t round_trip_time;
+    // Or the time at which the channel started waiting for acknowledgements
+    float32_t last_receive_time;
+
+    // If one side restarts, its sequences restart too: the other side needs to know to reset
+    uint16_t local_session;
+    uint16_t remote_session;
+    bool has_remote_session;
+
+    // Sending
+    uint16_t next_unreliable_sequence;
+    uint16_t next_reliable_sequence;
+    uint16_t oldest_unacknowledged_sequence;
+    channel_message_t sent_reliable[MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+    // Get sent in order by tick_net_channels() once acknowledgements free the window / fragment buffers
+    pending_channel_message_t *first_pending;
+    pending_channel_message_t *last_pending;
+    uint32_t pending_count;
+
+    // Receiving
+    bool received_unreliable;
+    uint16_t last_unreliable_sequence;
+    channel_message_t unreliable_reassemblies[MAX_UNRELIABLE_REASSEMBLIES];
+    uint16_t next_reliable_sequence_to_receive;
+    channel_message_t received_reliable[MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+
+    uint32_t pending_acknowledgement_count;
+    channel_acknowledgement_t pending_acknowledgements[MAX_PENDING_ACKNOWLEDGEMENTS];
+};
+
+
+static net_channel_t channels[MAX_NET_CHANNELS];
+
+// Sent reliable fragments (until acknowledged) and received fragments (until the message is complete) live here
+static uint8_t *fragment_buffers;
+static uint16_t fragment_sizes[MAX_FRAGMENT_BUFFERS];
+static uint16_t free_fragment_buffers[MAX_FRAGMENT_BUFFERS];
+static uint32_t free_fragment_buffer_count = 0;
+
+// Datagrams which can be forgotten as soon as they get sent (unreliable fragments, acknowledgements)
+static uint16_t transient_fragment_buffers[MAX_FRAGMENT_BUFFERS];
+static uint32_t transient_fragment_buffer_count = 0;
+
+// Messages which were split into several fragments get handed out from here
+static uint8_t reassembly_buffer[MAX_FRAGMENTS_PER_MESSAGE * FRAGMENT_PAYLOAD_SIZE];
+
+static uint16_t session_seed;
+static uint16_t next_session;
+static float32_t simulated_packet_loss = 0.0f;
+static bool outgoing_datagrams_discarded = 0;
+static net_channel_stats_t stats = {};
+
+
+void initialize_net_channels(void) {
+    fragment_buffers = (uint8_t *)malloc(MAX_FRAGMENT_BUFFERS * MAX_PACKET_SIZE);
+
+    for (uint32_t i = 0; i < MAX_FRAGMENT_BUFFERS; ++i) {
+        free_fragment_buffers[i] = (uint16_t)(MAX_FRAGMENT_BUFFERS - 1 - i);
+    }
+    free_fragment_buffer_count = MAX_FRAGMENT_BUFFERS;
+
+    // Needs to be different from one run to the next
+    set_net_channel_session_seed((uint16_t)time(nullptr));
+}
+
+uint16_t get_net_channel_session_seed(void) {
+    return(session_seed);
+}
+
+// Needs to be called before any channel gets created
+void set_net_channel_session_seed(uint16_t seed) {
+    session_seed = seed;
+    next_session = seed;
+}
+
+
+static uint8_t *s_get_fragment_buffer(uint16_t index) {
+    return(&fragment_buffers[index * MAX_PACKET_SIZE]);
+}
+
+
+static uint16_t s_allocate_fragment_buffer(void) {
+    if (!free_fragment_buffer_count) {
+        output_to_debug_console("Ran out of fragment buffers\n");
+        return(INVALID_FRAGMENT_BUFFER);
+    }
+
+    return(free_fragment_buffers[--free_fragment_buffer_count]);
+}
+
+
+static void s_free_fragment_buffer(uint16_t index) {
+    if (index != INVALID_FRAGMENT_BUFFER) {
+        free_fragment_buffers[free_fragment_buffer_count++] = index;
+    }
+}
+
+
+static uint16_t s_allocate_transient_fragment_buffer(void) {
+    uint16_t index = s_allocate_fragment_buffer();
+    if (index != INVALID_FRAGMENT_BUFFER) {
+        transient_fragment_buffers[transient_fragment_buffer_count++] = index;
+    }
+
+    return(index);
+}
+
+
+static uint32_t s_full_fragment_mask(uint32_t fragment_count) {
+    return(fragment_count == 32 ? 0xFFFFFFFF : (1u << fragment_count) - 1);
+}
+
+
+// Sequences wrap around
+static bool s_sequence_more_recent(uint16_t a, uint16_t b) {
+    return((int16_t)(a - b) > 0);
+}
+
+
+static void s_start_channel_message(channel_message_t *message, uint16_t sequence, uint32_t fragment_count) {
+    message->in_use = 1;
+    message->was_resent = 0;
+    message->sequence = sequence;
+    message->fragment_count = fragment_count;
+    message->fragment_mask = 0;
+
+    for (uint32_t i = 0; i < MAX_FRAGMENTS_PER_MESSAGE; ++i) {
+        message->fragments[i] = INVALID_FRAGMENT_BUFFER;
+    }
+}
+
+
+static void s_free_channel_message(channel_message_t *message) {
+    for (uint32_t i = 0; i < message->fragment_count; ++i) {
+        s_free_fragment_buffer(message->fragments[i]);
+        message->fragments[i] = INVALID_FRAGMENT_BUFFER;
+    }
+
+    message->in_use = 0;
+}
+
+
+static void s_free_pending_messages(net_channel_t *channel) {
+    while (channel->first_pending) {
+        pending_channel_message_t *pending = channel->first_pending;
+        channel->first_pending = pending->next;
+        free(pending);
+    }
+
+    channel->last_pending = nullptr;
+    channel->pending_count = 0;
+}
+
+
+static void s_reset_sending_state(net_channel_t *channel) {
+    for (uint32_t i = 0; i < MAX_RELIABLE_MESSAGES_IN_FLIGHT; ++i) {
+        if (channel->sent_reliable[i].in_use) {
+            s_free_channel_message(&channel->sent_reliable[i]);
+        }
+    }
+
+    s_free_pending_messages(channel);
+
+    channel->local_session = next_session++;
+    channel->next_unreliable_sequence = 0;
+    channel->next_reliable_sequence = 0;
+    channel->oldest_unacknowledged_sequence = 0;
+}
+
+
+static void s_reset_receiving_state(net_channel_t *channel) {
+    for (uint32_t i = 0; i < MAX_UNRELIABLE_REASSEMBLIES; ++i) {
+        if (channel->unreliable_reassemblies[i].in_use) {
+            s_free_channel_message(&channel->unreliable_reassemblies[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < MAX_RELIABLE_MESSAGES_IN_FLIGHT; ++i) {
+        if (channel->received_reliable[i].in_use) {
+            s_free_channel_message(&channel->received_reliable[i]);
+        }
+    }
+
+    channel->received_unreliable = 0;
+    channel->last_unreliable_sequence = 0;
+    channel->next_reliable_sequence_to_receive = 0;
+    channel->pending_acknowledgement_count = 0;
+}
+
+
+static net_channel_t *s_get_net_channel(network_address_t address, network_socket_t *socket, bool create) {
+    net_channel_t *free_channel = nullptr;
+
+    for (uint32_t i = 0; i < MAX_NET_CHANNELS; ++i) {
+        net_channel_t *channel = &channels[i];
+        if (channel->in_use) {
+            if (channel->address.ipv4_address == address.ipv4_address && channel->address.port == address.port && channel->socket == socket) {
+                return(channel);
+            }
+        }
+        else if (!free_channel) {
+            free_channel = channel;
+        }
+    }
+
+    if (!create) {
+        return(nullptr);
+    }
+
+    if (!free_channel) {
+        output_to_debug_console("Ran out of net channels\n");
+        return(nullptr);
+    }
+
+    memset(free_channel, 0, sizeof(net_channel_t));
+    free_channel->in_use = 1;
+    free_channel->address = address;
+    free_channel->socket = socket;
+    free_channel->round_trip_time = 0.1f;
+    free_channel->local_session = next_session++;
+
+    return(free_channel);
+}
+
+
+static void s_remove_net_channel(net_channel_t *channel) {
+    s_reset_sending_state(channel);
+    s_reset_receiving_state(channel);
+    channel->in_use = 0;
+}
+
+
+void remove_net_channel(network_address_t address, network_socket_t *socket) {
+    net_channel_t *channel = s_get_net_channel(address, socket, 0);
+
+    if (channel) {
+        s_remove_net_channel(channel);
+    }
+}
+
+
+uint32_t get_channel_pending_message_count(network_address_t address, network_socket_t *socket) {
+    net_channel_t *channel = s_get_net_channel(address, socket, 0);
+    return(channel ? channel->pending_count : 0);
+}
+
+
+void set_simulated_packet_loss(float32_t probability) {
+    simulated_packet_loss = probability;
+}
+
+
+void set_outgoing_datagrams_discarded(bool discarded) {
+    outgoing_datagrams_discarded = discarded;
+}
+
+
+net_channel_stats_t get_net_channel_stats(void) {
+    return(stats);
+}
+
+
+// body (optional) gets sent right after the fragment buffer in the same datagram, without being copied
+static void s_queue_datagram(net_channel_t *channel, uint16_t fragment_buffer, uint8_t *body = nullptr, uint32_t body_size = 0) {
+    if (simulated_packet_loss > 0.0f && (float32_t)rand() / (float32_t)RAND_MAX < simulated_packet_loss) {
+        return;
+    }
+
+    ++stats.datagrams_sent;
+    stats.bytes_sent += fragment_sizes[fragment_buffer] + body_size;
+
+    if (outgoing_datagrams_discarded) {
+        return;
+    }
+
+    queue_send_to(channel->address, (char *)s_get_fragment_buffer(fragment_buffer), fragment_sizes[fragment_buffer], (char *)body, body_size, channel->socket);
+}
+
+
+void flush_channel_datagrams(void) {
+    flush_queued_datagrams();
+    // Bodies of the unreliable messages which were just sent
+    release_flushed_packet_buffers();
+
+    for (uint32_t i = 0; i < transient_fragment_buffer_count; ++i) {
+        s_free_fragment_buffer(transient_fragment_buffers[i]);
+    }
+
+    transient_fragment_buffer_count = 0;
+}
+
+
+// Message and body get treated as one contiguous message
+static void s_copy_message_range(uint8_t *dst, uint8_t *message, uint32_t message_size, uint8_t *body, uint32_t offset, uint32_t size) {
+    if (offset < message_size) {
+        uint32_t from_message = MIN(size, message_size - offset);
+        memcpy(dst, &message[offset], from_message);
+
+        dst += from_message;
+        size -= from_message;
+        offset = message_size;
+    }
+
+    if (size) {
+        memcpy(dst, &body[offset - message_size], size);
+    }
+}
+
+
+static uint32_t s_fragment_count(uint32_t total_size) {
+    return(MAX(1, (total_size + FRAGMENT_PAYLOAD_SIZE - 1) / FRAGMENT_PAYLOAD_SIZE));
+}
+
+
+static uint32_t s_serialize_fragment_header(uint8_t *buffer, channel_type_t type, uint16_t session, uint16_t sequence, uint32_t index, uint32_t count) {
+    serializer_t serializer = {};
+    serializer.data_buffer = buffer;
+    serializer.data_buffer_size = MAX_PACKET_SIZE;
+    serializer.serialize_uint8(type);
+    serializer.serialize_uint16(session);
+    serializer.serialize_uint16(sequence);
+    serializer.serialize_uint8((uint8_t)index);
+    serializer.serialize_uint8((uint8_t)count);
+
+    return(serializer.data_buffer_head);
+}
+
+
+static bool s_has_reliable_state(net_channel_t *channel) {
+    return(channel->first_pending || channel->oldest_unacknowledged_sequence != channel->next_reliable_sequence);
+}
+
+
+static bool s_can_send_reliable_message(net_channel_t *channel, uint32_t fragment_count) {
+    if ((uint16_t)(channel->next_reliable_sequence - channel->oldest_unacknowledged_sequence) >= MAX_RELIABLE_MESSAGES_IN_FLIGHT) {
+        return(0);
+    }
+
+    if (free_fragment_buffer_count < fragment_count + RESERVED_FRAGMENT_BUFFERS) {
+        // Frees the transient buffers
+        flush_channel_datagrams();
+    }
+
+    return(free_fragment_buffer_count >= fragment_count + RESERVED_FRAGMENT_BUFFERS);
+}
+
+
+// Fragments stay in the fragment buffers until they get acknowledged (need to check s_can_send_reliable_message() first)
+static void s_send_reliable_message(net_channel_t *channel, uint8_t *message, uint32_t message_size, uint8_t *body, uint32_t body_size) {
+    uint32_t total_size = message_size + body_size;
+    uint32_t fragment_count = s_fragment_count(total_size);
+
+    uint16_t sequence = channel->next_reliable_sequence++;
+    channel_message_t *sent = &channel->sent_reliable[sequence % MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+    s_start_channel_message(sent, sequence, fragment_count);
+    sent->time_sent = channel->time;
+
+    ++stats.reliable_messages_sent;
+
+    for (uint32_t i = 0; i < fragment_count; ++i) {
+        uint16_t buffer_index = s_allocate_fragment_buffer();
+        uint8_t *buffer = s_get_fragment_buffer(buffer_index);
+        uint32_t header_size = s_serialize_fragment_header(buffer, CT_RELIABLE_ORDERED, channel->local_session, sequence, i, fragment_count);
+
+        uint32_t offset = i * FRAGMENT_PAYLOAD_SIZE;
+        uint32_t payload_size = MIN(FRAGMENT_PAYLOAD_SIZE, total_size - offset);
+        s_copy_message_range(&buffer[header_size], message, message_size, body, offset, payload_size);
+
+        fragment_sizes[buffer_index] = (uint16_t)(header_size + payload_size);
+        sent->fragments[i] = buffer_index;
+
+        s_queue_datagram(channel, buffer_index);
+    }
+}
+
+
+static bool s_push_pending_message(net_channel_t *channel, uint8_t *message, uint32_t message_size, uint8_t *body, uint32_t body_size) {
+    if (channel->pending_count == MAX_PENDING_RELIABLE_MESSAGES) {
+        output_to_debug_console("Too many reliable messages waiting to be sent\n");
+        return(0);
+    }
+
+    pending_channel_message_t *pending = (pending_channel_message_t *)malloc(sizeof(pending_channel_message_t) + message_size + body_size);
+    pending->next = nullptr;
+    pending->size = message_size + body_size;
+
+    uint8_t *data = (uint8_t *)(pending + 1);
+    memcpy(data, message, message_size);
+    if (body_size) {
+        memcpy(&data[message_size], body, body_size);
+    }
+
+    if (channel->last_pending) {
+        channel->last_pending->next = pending;
+    }
+    else {
+        channel->first_pending = pending;
+    }
+
+    channel->last_pending = pending;
+    ++channel->pending_count;
+
+    return(1);
+}
+
+
+static void s_send_pending_messages(net_channel_t *channel) {
+    while (channel->first_pending) {
+        pending_channel_message_t *pending = channel->first_pending;
+        if (!s_can_send_reliable_message(channel, s_fragment_count(pending->size))) {
+            break;
+        }
+
+        s_send_reliable_message(channel, (uint8_t *)(pending + 1), pending->size, nullptr, 0);
+
+        channel->first_pending = pending->next;
+        if (!channel->first_pending) {
+            channel->last_pending = nullptr;
+        }
+
+        --channel->pending_count;
+        free(pending);
+    }
+}
+
+
+bool send_channel_message(network_address_t address, channel_type_t type, uint8_t *message, uint32_t message_size, uint8_t *body, uint32_t body_size, network_socket_t *socket) {
+    net_channel_t *channel = s_get_net_channel(address, socket, 1);
+    if (!channel) {
+        return(0);
+    }
+
+    uint32_t total_size = message_size + body_size;
+    uint32_t fragment_count = s_fragment_count(total_size);
+
+    if (fragment_count > MAX_FRAGMENTS_PER_MESSAGE) {
+        output_to_debug_console("Message is too big to be sent (", (int32_t)total_size, " bytes)\n");
+        return(0);
+    }
+
+    if (type == CT_RELIABLE_ORDERED) {
+        // Timeout counts from the moment the channel starts waiting for the other side
+        if (!s_has_reliable_state(channel)) {
+            channel->last_receive_time = channel->time;
+        }
+
+        // Messages which are already waiting need to go first
+        if (channel->first_pending || !s_can_send_reliable_message(channel, fragment_count)) {
+            return(s_push_pending_message(channel, message, message_size, body, body_size));
+        }
+
+        s_send_reliable_message(channel, message, message_size, body, body_size);
+
+        return(1);
+    }
+
+    if (free_fragment_buffer_count < fragment_count) {
+        // Frees the transient buffers
+        flush_channel_datagrams();
+    }
+
+    uint16_t sequence = channel->next_unreliable_sequence++;
+
+    for (uint32_t i = 0; i < fragment_count; ++i) {
+        // Transient buffers get freed with the next flush anyway
+        uint16_t buffer_index = s_allocate_transient_fragment_buffer();
+        if (buffer_index == INVALID_FRAGMENT_BUFFER) {
+            // Unreliable anyway: the next message will replace it
+            return(0);
+        }
+
+        uint8_t *buffer = s_get_fragment_buffer(buffer_index);
+        uint32_t header_size = s_serialize_fragment_header(buffer, type, channel->local_session, sequence, i, fragment_count);
+
+        uint32_t offset = i * FRAGMENT_PAYLOAD_SIZE;
+        uint32_t payload_size = MIN(FRAGMENT_PAYLOAD_SIZE, total_size - offset);
+
+        // Only the part which comes from the message gets copied: the body goes out as the second buffer of the datagram
+        uint32_t from_message = offset < message_size ? MIN(payload_size, message_size - offset) : 0;
+        if (from_message) {
+            memcpy(&buffer[header_size], &message[offset], from_message);
+        }
+
+        uint32_t from_body = payload_size - from_message;
+
+        fragment_sizes[buffer_index] = (uint16_t)(header_size + from_message);
+        s_queue_datagram(channel, buffer_index, from_body ? &body[offset + from_message - message_size] : nullptr, from_body);
+    }
+
+    return(1);
+}
+
+
+static void s_send_acknowledgements(net_channel_t *channel) {
+    if (!channel->pending_acknowledgement_count) {
+        return;
+    }
+
+    if (!free_fragment_buffer_count) {
+        flush_channel_datagrams();
+    }
+
+    uint16_t buffer_index = s_allocate_transient_fragment_buffer();
+    if (buffer_index == INVALID_FRAGMENT_BUFFER) {
+        return;
+    }
+
+    serializer_t serializer = {};
+    serializer.data_buffer = s_get_fragment_buffer(buffer_index);
+    serializer.data_buffer_size = MAX_PACKET_SIZE;
+    serializer.serialize_uint8(CT_ACKNOWLEDGEMENTS);
+    // Session of the side which sent the messages being acknowledged
+    serializer.serialize_uint16(channel->remote_session);
+    serializer.serialize_uint8((uint8_t)channel->pending_acknowledgement_count);
+
+    for (uint32_t i = 0; i < channel->pending_acknowledgement_count; ++i) {
+        serializer.serialize_uint16(channel->pending_acknowledgements[i].sequence);
+        serializer.serialize_uint32(channel->pending_acknowledgements[i].fragment_mask);
+    }
+
+    fragment_sizes[buffer_index] = (uint16_t)serializer.data_buffer_head;
+    s_queue_datagram(channel, buffer_index);
+
+    channel->pending_acknowledgement_count = 0;
+}
+
+
+static void s_push_acknowledgement(net_channel_t *channel, uint16_t sequence, uint32_t fragment_mask) {
+    for (uint32_t i = 0; i < channel->pending_acknowledgement_count; ++i) {
+        if (channel->pending_acknowledgements[i].sequence == sequence) {
+            channel->pending_acknowledgements[i].fragment_mask |= fragment_mask;
+            return;
+        }
+    }
+
+    if (channel->pending_acknowledgement_count == MAX_PENDING_ACKNOWLEDGEMENTS) {
+        s_send_acknowledgements(channel);
+    }
+
+    channel_acknowledgement_t *acknowledgement = &channel->pending_acknowledgements[channel->pending_acknowledgement_count++];
+    acknowledgement->sequence = sequence;
+    acknowledgement->fragment_mask = fragment_mask;
+}
+
+
+static void s_handle_acknowledgements(net_channel_t *channel, serializer_t *in_serializer) {
+    uint32_t acknowledgement_count = in_serializer->deserialize_uint8();
+    if (in_serializer->data_buffer_size < ACKNOWLEDGEMENTS_HEADER_SIZE + acknowledgement_count * ACKNOWLEDGEMENT_SIZE) {
+        return;
+    }
+
+    uint16_t in_flight_count = channel->next_reliable_sequence - channel->oldest_unacknowledged_sequence;
+
+    for (uint32_t i = 0; i < acknowledgement_count; ++i) {
+        uint16_t sequence = in_serializer->deserialize_uint16();
+        uint32_t fragment_mask = in_serializer->deserialize_uint32();
+
+        if ((uint16_t)(sequence - channel->oldest_unacknowledged_sequence) >= in_flight_count) {
+            continue;
+        }
+
+        channel_message_t *message = &channel->sent_reliable[sequence % MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+        if (!message->in_use || message->sequence != sequence) {
+            continue;
+        }
+
+        uint32_t full_mask = s_full_fragment_mask(message->fragment_count);
+        uint32_t newly_acknowledged = fragment_mask & ~message->fragment_mask & full_mask;
+
+        // Only the fragments which were lost will get resent
+        for (uint32_t fragment = 0; fragment < message->fragment_count; ++fragment) {
+            if (newly_acknowledged & (1u << fragment)) {
+                s_free_fragment_buffer(message->fragments[fragment]);
+                message->fragments[fragment] = INVALID_FRAGMENT_BUFFER;
+            }
+        }
+
+        message->fragment_mask |= newly_acknowledged;
+
+        if (message->fragment_mask == full_mask) {
+            // Resent messages would give wrong round trip times
+            if (!message->was_resent) {
+                channel->round_trip_time = channel->round_trip_time * 0.875f + (channel->time - message->time_sent) * 0.125f;
+            }
+
+            message->in_use = 0;
+
+            ++stats.reliable_messages_acknowledged;
+        }
+    }
+
+    while (channel->oldest_unacknowledged_sequence != channel->next_reliable_sequence &&
+           !channel->sent_reliable[channel->oldest_unacknowledged_sequence % MAX_RELIABLE_MESSAGES_IN_FLIGHT].in_use) {
+        ++channel->oldest_unacknowledged_sequence;
+    }
+}
+
+
+static bool s_store_fragment(channel_message_t *message, channel_fragment_t *fragment) {
+    uint16_t buffer_index = s_allocate_fragment_buffer();
+    if (buffer_index == INVALID_FRAGMENT_BUFFER) {
+        return(0);
+    }
+
+    memcpy(s_get_fragment_buffer(buffer_index), fragment->payload, fragment->payload_size);
+    fragment_sizes[buffer_index] = (uint16_t)fragment->payload_size;
+
+    message->fragments[fragment->index] = buffer_index;
+    message->fragment_mask |= 1u << fragment->index;
+
+    return(1);
+}
+
+
+static uint32_t s_reassemble_message(channel_message_t *message) {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < message->fragment_count; ++i) {
+        uint16_t buffer_index = message->fragments[i];
+        memcpy(&reassembly_buffer[i * FRAGMENT_PAYLOAD_SIZE], s_get_fragment_buffer(buffer_index), fragment_sizes[buffer_index]);
+        size += fragment_sizes[buffer_index];
+    }
+
+    return(size);
+}
+
+
+static void s_hand_out_reliable_messages(net_channel_t *channel, channel_message_handler_t handler, void *data) {
+    for (;;) {
+        uint16_t sequence = channel->next_reliable_sequence_to_receive;
+        channel_message_t *message = &channel->received_reliable[sequence % MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+
+        if (!message->in_use || message->sequence != sequence || message->fragment_mask != s_full_fragment_mask(message->fragment_count)) {
+            break;
+        }
+
+        uint32_t size = s_reassemble_message(message);
+        s_free_channel_message(message);
+        ++channel->next_reliable_sequence_to_receive;
+
+        handler((char *)reassembly_buffer, size, channel->address, data);
+
+        // Handler may have removed the channel (disconnect)
+        if (!channel->in_use) {
+            return;
+        }
+    }
+}
+
+
+static void s_receive_reliable_fragment(net_channel_t *channel, channel_fragment_t *fragment, channel_message_handler_t handler, void *data) {
+    int16_t distance = (int16_t)(fragment->sequence - channel->next_reliable_sequence_to_receive);
+    uint32_t fragment_bit = 1u << fragment->index;
+
+    if (distance < 0) {
+        // Was already handed out: acknowledgement must have been lost
+        s_push_acknowledgement(channel, fragment->sequence, fragment_bit);
+        return;
+    }
+
+    if (distance >= MAX_RELIABLE_MESSAGES_IN_FLIGHT) {
+        return;
+    }
+
+    channel_message_t *message = &channel->received_reliable[fragment->sequence % MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+    if (!message->in_use) {
+        s_start_channel_message(message, fragment->sequence, fragment->count);
+    }
+    else if (message->sequence != fragment->sequence || message->fragment_count != fragment->count) {
+        return;
+    }
+
+    if (message->fragment_mask & fragment_bit) {
+        s_push_acknowledgement(channel, fragment->sequence, fragment_bit);
+        return;
+    }
+
+    if (distance == 0 && fragment->count == 1) {
+        // Most messages fit in one datagram and arrive in order: no need to copy
+        s_push_acknowledgement(channel, fragment->sequence, fragment_bit);
+
+        message->in_use = 0;
+        ++channel->next_reliable_sequence_to_receive;
+
+        handler((char *)fragment->payload, fragment->payload_size, channel->address, data);
+
+        if (!channel->in_use) {
+            return;
+        }
+    }
+    else {
+        // If there is no space, the fragment will just get resent
+        if (!s_store_fragment(message, fragment)) {
+            return;
+        }
+
+        s_push_acknowledgement(channel, fragment->sequence, fragment_bit);
+    }
+
+    s_hand_out_reliable_messages(channel, handler, data);
+}
+
+
+// Everything up to (and including) this sequence is now too old
+static void s_drop_old_unreliable_messages(net_channel_t *channel, uint16_t sequence) {
+    channel->received_unreliable = 1;
+    channel->last_unreliable_sequence = sequence;
+
+    for (uint32_t i = 0; i < MAX_UNRELIABLE_REASSEMBLIES; ++i) {
+        channel_message_t *message = &channel->unreliable_reassemblies[i];
+        if (message->in_use && !s_sequence_more_recent(message->sequence, sequence)) {
+            s_free_channel_message(message);
+        }
+    }
+}
+
+
+static void s_receive_unreliable_fragment(net_channel_t *channel, channel_fragment_t *fragment, channel_message_handler_t handler, void *data) {
+    if (channel->received_unreliable && !s_sequence_more_recent(fragment->sequence, channel->last_unreliable_sequence)) {
+        return;
+    }
+
+    if (fragment->count == 1) {
+        s_drop_old_unreliable_messages(channel, fragment->sequence);
+        handler((char *)fragment->payload, fragment->payload_size, channel->address, data);
+        return;
+    }
+
+    channel_message_t *message = nullptr;
+    channel_message_t *oldest = nullptr;
+    for (uint32_t i = 0; i < MAX_UNRELIABLE_REASSEMBLIES; ++i) {
+        channel_message_t *current = &channel->unreliable_reassemblies[i];
+        if (!current->in_use) {
+            if (!message) {
+                message = current;
+            }
+        }
+        else if (current->sequence == fragment->sequence) {
+            message = current;
+            break;
+        }
+        else if (!oldest || s_sequence_more_recent(oldest->sequence, current->sequence)) {
+            oldest = current;
+        }
+    }
+
+    if (!message) {
+        // Oldest incomplete message is probably never going to be completed
+        s_free_channel_message(oldest);
+        message = oldest;
+    }
+
+    if (!message->in_use) {
+        s_start_channel_message(message, fragment->sequence, fragment->count);
+    }
+    else if (message->fragment_count != fragment->count || (message->fragment_mask & (1u << fragment->index))) {
+        return;
+    }
+
+    if (!s_store_fragment(message, fragment)) {
+        return;
+    }
+
+    if (message->fragment_mask == s_full_fragment_mask(message->fragment_count)) {
+        uint32_t size = s_reassemble_message(message);
+        s_drop_old_unreliable_messages(channel, fragment->sequence);
+
+        handler((char *)reassembly_buffer, size, channel->address, data);
+    }
+}
+
+
+void receive_channel_datagram(uint8_t *datagram, uint32_t datagram_size, network_address_t address, channel_message_handler_t handler, void *data, network_socket_t *socket) {
+    ++stats.datagrams_received;
+    stats.bytes_received += datagram_size;
+
+    if (datagram_size < ACKNOWLEDGEMENTS_HEADER_SIZE) {
+        return;
+    }
+
+    serializer_t in_serializer = {};
+    in_serializer.data_buffer = datagram;
+    in_serializer.data_buffer_size = datagram_size;
+
+    channel_type_t type = (channel_type_t)in_serializer.deserialize_uint8();
+    uint16_t session = in_serializer.deserialize_uint16();
+
+    if (type == CT_ACKNOWLEDGEMENTS) {
+        net_channel_t *channel = s_get_net_channel(address, socket, 0);
+        if (channel && session == channel->local_session) {
+            channel->last_receive_time = channel->time;
+            s_handle_acknowledgements(channel, &in_serializer);
+        }
+
+        return;
+    }
+
+    if (datagram_size < CHANNEL_HEADER_SIZE || type > CT_RELIABLE_ORDERED) {
+        return;
+    }
+
+    channel_fragment_t fragment = {};
+    fragment.sequence = in_serializer.deserialize_uint16();
+    fragment.index = in_serializer.deserialize_uint8();
+    fragment.count = in_serializer.deserialize_uint8();
+    fragment.payload = &datagram[in_serializer.data_buffer_head];
+    fragment.payload_size = datagram_size - in_serializer.data_buffer_head;
+
+    // Only the last fragment can be smaller than the others
+    if (fragment.count == 0 || fragment.count > MAX_FRAGMENTS_PER_MESSAGE || fragment.index >= fragment.count ||
+        fragment.payload_size > FRAGMENT_PAYLOAD_SIZE || (fragment.index < fragment.count - 1 && fragment.payload_size != FRAGMENT_PAYLOAD_SIZE)) {
+        return;
+    }
+
+    net_channel_t *channel = s_get_net_channel(address, socket, 1);
+    if (!channel) {
+        return;
+    }
+
+    channel->last_receive_time = channel->time;
+
+    if (!channel->has_remote_session || channel->remote_session != session) {
+        // Other side restarted: everything that was sent to its previous session is lost
+        if (channel->has_remote_session) {
+            s_reset_sending_state(channel);
+        }
+
+        s_reset_receiving_state(channel);
+        channel->remote_session = session;
+        channel->has_remote_session = 1;
+    }
+
+    if (type == CT_RELIABLE_ORDERED) {
+        s_receive_reliable_fragment(channel, &fragment, handler, data);
+    }
+    else {
+        s_receive_unreliable_fragment(channel, &fragment, handler, data);
+    }
+}
+
+
+void tick_net_channels(float32_t dt) {
+    for (uint32_t i = 0; i < MAX_NET_CHANNELS; ++i) {
+        net_channel_t *channel = &channels[i];
+        if (!channel->in_use) {
+            continue;
+        }
+
+        channel->time += dt;
+
+        // Other side is gone: nothing would ever acknowledge the messages (and free their fragment buffers)
+        if (s_has_reliable_state(channel) && channel->time - channel->last_receive_time > CHANNEL_TIMEOUT) {
+            output_to_debug_console("Net channel timed out (", (int32_t)channel->pending_count, " messages weren't sent)\n");
+            s_remove_net_channel(channel);
+            continue;
+        }
+
+        s_send_acknowledgements(channel);
+
+        float32_t resend_time = MAX(channel->round_trip_time * 2.0f, MIN_RESEND_TIME);
+        uint32_t resent_fragment_count = 0;
+
+        for (uint16_t sequence = channel->oldest_unacknowledged_sequence;
+             sequence != channel->next_reliable_sequence && resent_fragment_count < MAX_RESENT_FRAGMENTS_PER_TICK;
+             ++sequence) {
+            channel_message_t *message = &channel->sent_reliable[sequence % MAX_RELIABLE_MESSAGES_IN_FLIGHT];
+
+            if (message->in_use && channel->time - message->time_sent > resend_time) {
+                for (uint32_t fragment = 0; fragment < message->fragment_count; ++fragment) {
+                    if (!(message->fragment_mask & (1u << fragment))) {
+                        s_queue_datagram(channel, message->fragments[fragment]);
+                        ++resent_fragment_count;
+                    }
+                }
+
+                message->time_sent = channel->time;
+                message->was_resent = 1;
+            }
+        }
+
+        // Acknowledgements which came in since the last tick may have made space
+        s_send_pending_messages(channel);
+    }
+
+    flush_channel_datagrams();
+}
+
+
+// Debugging: loopback test
+#define CHANNEL_TEST_PORT 6010
+#define CHANNEL_TEST_MAX_MESSAGE_SIZE (FRAGMENT_PAYLOAD_SIZE * 5)
+#define CHANNEL_TEST_UNRELIABLE_BIT 0x80000000
+#define CHANNEL_TEST_DT (1.0f / 60.0f)
+#define CHANNEL_TEST_MAX_TICKS 60000
+
+struct channel_test_t {
+    uint32_t reliable_received;
+    uint32_t unreliable_received;
+    uint32_t last_unreliable;
+    bool out_of_order;
+    bool corrupted;
+};
+
+
+// Mix of messages which fit in one datagram and of fragmented ones
+static uint32_t s_channel_test_message_size(uint32_t index) {
+    return(sizeof(uint32_t) + (index * 2654435761u) % (CHANNEL_TEST_MAX_MESSAGE_SIZE - sizeof(uint32_t)));
+}
+
+
+static void s_fill_channel_test_message(uint8_t *message, uint32_t index) {
+    uint32_t size = s_channel_test_message_size(index);
+    memcpy(message, &index, sizeof(uint32_t));
+
+    for (uint32_t i = sizeof(uint32_t); i < size; ++i) {
+        message[i] = (uint8_t)(index * 31 + i);
+    }
+}
+
+
+static void s_handle_channel_test_message(char *message, uint32_t message_size, network_address_t /*address*/, void *data) {
+    channel_test_t *test = (channel_test_t *)data;
+
+    uint32_t index = 0;
+    if (message_size >= sizeof(uint32_t)) {
+        memcpy(&index, message, sizeof(uint32_t));
+    }
+
+    if (message_size < sizeof(uint32_t) || message_size != s_channel_test_message_size(index)) {
+        test->corrupted = 1;
+        return;
+    }
+
+    for (uint32_t i = sizeof(uint32_t); i < message_size; ++i) {
+        if ((uint8_t)message[i] != (uint8_t)(index * 31 + i)) {
+            test->corrupted = 1;
+            return;
+        }
+    }
+
+    if (index & CHANNEL_TEST_UNRELIABLE_BIT) {
+        index &= ~CHANNEL_TEST_UNRELIABLE_BIT;
+        // Sequenced: can be lost, but never older than the last one
+        if (test->unreliable_received && index <= test->last_unreliable) {
+            test->out_of_order = 1;
+        }
+
+        test->last_unreliable = index;
+        ++test->unreliable_received;
+    }
+    else {
+        if (index != test->reliable_received) {
+            test->out_of_order = 1;
+        }
+
+        ++test->reliable_received;
+    }
+}
+
+
+static void s_receive_channel_test_datagrams(network_socket_t *socket, channel_test_t *test) {
+    static char datagram_memory[MAX_DATAGRAM_BATCH][MAX_PACKET_SIZE];
+
+    datagram_t datagrams[MAX_DATAGRAM_BATCH];
+    for (uint32_t i = 0; i < MAX_DATAGRAM_BATCH; ++i) {
+        datagrams[i].buffer = datagram_memory[i];
+        datagrams[i].buffer_size = MAX_PACKET_SIZE;
+    }
+
+    uint32_t received_count;
+    while ((received_count = receive_from_batch(datagrams, MAX_DATAGRAM_BATCH, socket)) > 0) {
+        for (uint32_t i = 0; i < received_count; ++i) {
+            if (test) {
+                receive_channel_datagram((uint8_t *)datagrams[i].buffer, datagrams[i].bytes_received, datagrams[i].address, &s_handle_channel_test_message, test, socket);
+            }
+        }
+    }
+}
+
+
+bool run_channel_loopback_test(uint32_t message_count, float32_t packet_loss) {
+    // Socket 0 sends, socket 1 receives (and sends the acknowledgements back)
+    static network_socket_t sockets[2];
+    static bool sockets_initialized = 0;
+    if (!sockets_initialized) {
+        initialize_udp_socket(&sockets[0], CHANNEL_TEST_PORT);
+        initialize_udp_socket(&sockets[1], CHANNEL_TEST_PORT + 1);
+        sockets_initialized = 1;
+    }
+
+    network_address_t addresses[2];
+    for (uint32_t i = 0; i < 2; ++i) {
+        addresses[i].port = (uint16_t)host_to_network_byte_order(CHANNEL_TEST_PORT + i);
+        addresses[i].ipv4_address = str_to_ipv4_int32("127.0.0.1");
+    }
+
+    float32_t previous_packet_loss = simulated_packet_loss;
+    simulated_packet_loss = packet_loss;
+    net_channel_stats_t previous_stats = stats;
+
+    static uint8_t reliable_message[CHANNEL_TEST_MAX_MESSAGE_SIZE];
+    static uint8_t unreliable_message[CHANNEL_TEST_MAX_MESSAGE_SIZE];
+
+    // Way more than MAX_RELIABLE_MESSAGES_IN_FLIGHT: most of them go through the pending queue
+    bool all_accepted = 1;
+    for (uint32_t i = 0; i < message_count; ++i) {
+        s_fill_channel_test_message(reliable_message, i);
+        all_accepted &= send_channel_message(addresses[1], CT_RELIABLE_ORDERED, reliable_message, s_channel_test_message_size(i), nullptr, 0, &sockets[0]);
+    }
+
+    channel_test_t test = {};
+    uint32_t unreliable_sent = 0;
+    uint32_t tick = 0;
+    for (; tick < CHANNEL_TEST_MAX_TICKS && test.reliable_received < message_count; ++tick) {
+        // Second half goes out as the body (doesn't get copied, buffer stays untouched until the flush in tick_net_channels())
+        uint32_t unreliable_index = unreliable_sent++ | CHANNEL_TEST_UNRELIABLE_BIT;
+        uint32_t unreliable_size = s_channel_test_message_size(unreliable_index);
+        s_fill_channel_test_message(unreliable_message, unreliable_index);
+        send_channel_message(addresses[1], CT_UNRELIABLE_SEQUENCED, unreliable_message, unreliable_size / 2, &unreliable_message[unreliable_size / 2], unreliable_size - unreliable_size / 2, &sockets[0]);
+
+        tick_net_channels(CHANNEL_TEST_DT);
+
+        s_receive_channel_test_datagrams(&sockets[1], &test);
+        s_receive_channel_test_datagrams(&sockets[0], &test);
+    }
+
+    simulated_packet_loss = previous_packet_loss;
+
+    remove_net_channel(addresses[1], &sockets[0]);
+    remove_net_channel(addresses[0], &sockets[1]);
+
+    // Next run starts clean
+    s_receive_channel_test_datagrams(&sockets[0], nullptr);
+    s_receive_channel_test_datagrams(&sockets[1], nullptr);
+
+    bool passed = all_accepted && test.reliable_received == message_count && test.unreliable_received && !test.out_of_order && !test.corrupted;
+
+    output_to_debug_console("Channel test (", (int32_t)(packet_loss * 100.0f), "% loss): ",
+                            (int32_t)test.reliable_received, "/", (int32_t)message_count, " reliable, ",
+                            (int32_t)test.unreliable_received, "/", (int32_t)unreliable_sent, " unreliable in ",
+                            (int32_t)tick, " ticks, ", (int32_t)(stats.datagrams_sent - previous_stats.datagrams_sent), " datagrams sent",
+                            test.out_of_order ? ", out of order" : "", test.corrupted ? ", corrupted" : "",
+                            passed ? " - passed\n" : " - FAILED\n");
+
+    return(passed);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "utils.hpp"
+#include "sockets.hpp"
+
+
+// Every message goes through a channel: gets split into fragments which fit in MAX_PACKET_SIZE and gets reassembled on the other side
+// Unreliable sequenced: lost messages stay lost, messages older than the last one received get dropped (snapshots, input commands)
+// Reliable ordered: fragments get resent until acknowledged, messages get handed out in the order they were sent (join, chunks)
+enum channel_type_t : uint8_t { CT_UNRELIABLE_SEQUENCED, CT_RELIABLE_ORDERED, CT_ACKNOWLEDGEMENTS };
+
+// Type, session, sequence, fragment index, fragment count
+#define CHANNEL_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint16_t) * 2 + sizeof(uint8_t) * 2)
+// Messages which need to fit in a single datagram (no fragmentation) need to be packed to this size
+#define FRAGMENT_PAYLOAD_SIZE (MAX_PACKET_SIZE - CHANNEL_HEADER_SIZE)
+
+
+typedef void (*channel_message_handler_t)(char *message, uint32_t message_size, network_address_t address, void *data);
+
+
+void initialize_net_channels(void);
+
+// Sessions of the channels get derived from this seed (different for every run)
+// Replaying a packet capture needs the seed of the recorded run, or the replayed acknowledgements won't match
+uint16_t get_net_channel_session_seed(void);
+void set_net_channel_session_seed(uint16_t seed);
+
+// Channels are identified by the remote address and by the local socket (null = main socket, see receive_from_batch())
+
+// Body is optional, gets sent as if it was right after the message
+// Reliable: message and body get copied (buffers can be freed straight away), waits in the channel's pending queue if too many messages are in flight
+// Unreliable: message gets copied, body doesn't (scatter / gather) and needs to stay valid until the next flush_channel_datagrams()
+// Only gets sent with the next flush_channel_datagrams() / tick_net_channels(), returns false if the message got dropped
+bool send_channel_message(network_address_t address, channel_type_t type, uint8_t *message, uint32_t message_size, uint8_t *body = nullptr, uint32_t body_size = 0, network_socket_t *socket = nullptr);
+
+// Reliable messages which couldn't be sent yet: senders can hold back what can wait (e.g. stale chunks)
+uint32_t get_channel_pending_message_count(network_address_t address, network_socket_t *socket = nullptr);
+
+// Handler gets called for every message that gets completed by this datagram
+void receive_channel_datagram(uint8_t *datagram, uint32_t datagram_size, network_address_t address, channel_message_handler_t handler, void *data = nullptr, network_socket_t *socket = nullptr);
+
+void flush_channel_datagrams(void);
+
+// Sends acknowledgements, resends the fragments that weren't acknowledged in time, sends the pending messages and flushes
+// Channels which wait for acknowledgements from a peer that stopped sending anything get removed
+void tick_net_channels(float32_t dt);
+
+// When a client disconnects / joins another server
+void remove_net_channel(network_address_t address, network_socket_t *socket = nullptr);
+
+// Debugging: outgoing datagrams get dropped with this probability
+void set_simulated_packet_loss(float32_t probability);
+
+// Debugging: sends messages between two channels through loopback sockets with simulated loss, checks that they arrive intact and in order
+// Ticks every channel with simulated time: meant to be run before joining / hosting
+// From the game's console: channel_test(message count, packet loss percentage), from the command line: saska.exe ct [message count] [packet loss percentage]
+bool run_channel_loopback_test(uint32_t message_count, float32_t packet_loss);
+
+// Replaying a packet capture (see server.hpp): datagrams still get built and counted, but never reach a socket
+void set_outgoing_datagrams_discarded(bool discarded);
+
+
+// Totals since startup, for every channel (datagram sizes include the channel headers)
+struct net_channel_stats_t {
+    uint64_t datagrams_sent;
+    uint64_t bytes_sent;
+    uint64_t datagrams_received;
+    uint64_t bytes_received;
+    uint64_t reliable_messages_sent;
+    uint64_t reliable_messages_acknowledged;
+};
+
+net_channel_stats_t get_net_channel_stats(void);
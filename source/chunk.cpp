@@ -4,6 +4,7 @@
 #include "game.hpp"
 
 #include "chunks_gstate.hpp"
+#include "packets.hpp"
 
 // For updating mesh
 #include "ttable.inc"
@@ -23,15 +24,148 @@ void chunk_t::initialize(const vector3_t &position, ivector3_t in_chunk_coord, b
     //push_k.color = vector4_t(122.0 / 255.0, 177.0 / 255.0, 213.0 / 255.0, 1.0f);
     push_k.color = vector4_t(122.0 / 255.0, 213.0 / 255.0, 77.0 / 255.0, 1.0f);
 
+    version = 0;
+    hash = 0;
+
+    vertex_count = 0;
+    added_to_history = 0;
+    flags = 0;
+
     if (allocate_history) {
         voxel_history = (uint8_t *)allocate_free_list(sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
-        memset(voxel_history, 255, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+        memset(voxel_history, VOXEL_HAS_NOT_BEEN_APPENDED_TO_HISTORY, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
         modified_voxels_list_count = 0;
         list_of_modified_voxels = (uint16_t *)allocate_free_list(sizeof(uint16_t) * (CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH) / 4);
+
+        version_history = (chunk_version_t *)allocate_free_list(sizeof(chunk_version_t) * CHUNK_VERSION_HISTORY);
+        memset(version_history, 0, sizeof(chunk_version_t) * CHUNK_VERSION_HISTORY);
+    }
+}
+
+
+// Voxels get hashed separately and summed up: a voxel changing only needs its old hash subtracted and its new hash added
+// (avalanche from xxh3, the index and the value fit in one integer)
+static uint64_t s_hash_voxel(uint16_t index, uint8_t value) {
+    uint64_t h = (((uint64_t)index << 8) | value) * 0x9E3779B185EBCA87ull;
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    h ^= h >> 32;
+    return(h);
+}
+
+
+void chunk_t::push_version(void) {
+    ++version;
+
+    chunk_version_t *entry = &version_history[version % CHUNK_VERSION_HISTORY];
+    if (entry->changes) {
+        deallocate_free_list(entry->changes);
+        entry->changes = nullptr;
+    }
+
+    entry->version = version;
+    entry->change_count = modified_voxels_list_count;
+
+    if (modified_voxels_list_count) {
+        entry->changes = (chunk_voxel_change_t *)allocate_free_list(sizeof(chunk_voxel_change_t) * modified_voxels_list_count);
+        for (uint32_t i = 0; i < modified_voxels_list_count; ++i) {
+            uint16_t index = list_of_modified_voxels[i];
+            entry->changes[i].index = index;
+            entry->changes[i].previous_value = voxel_history[index];
+
+            voxel_coordinate_t coord = convert_1d_to_3d_coord(index, CHUNK_EDGE_LENGTH);
+            uint8_t next_value = voxels[coord.x][coord.y][coord.z];
+            if (voxel_history[index]) {
+                hash -= s_hash_voxel(index, voxel_history[index]);
+            }
+            if (next_value) {
+                hash += s_hash_voxel(index, next_value);
+            }
+        }
     }
 }
 
 
+bool chunk_t::gather_modified_voxels_since(uint32_t since_version, modified_voxel_t *dst, uint32_t max_count, uint32_t *count) {
+    *count = 0;
+
+    if (version - since_version > CHUNK_VERSION_HISTORY) {
+        return(0);
+    }
+
+    // Voxels which changed in several versions only get sent once: previous value = value at since_version (first change after it)
+    uint8_t gathered[(CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH) / 8] = {};
+
+    for (uint32_t current = since_version + 1; current <= version; ++current) {
+        chunk_version_t *entry = &version_history[current % CHUNK_VERSION_HISTORY];
+
+        for (uint32_t i = 0; i < entry->change_count; ++i) {
+            uint16_t index = entry->changes[i].index;
+            uint8_t bit = (uint8_t)(1 << (index & 7));
+
+            if (gathered[index >> 3] & bit) {
+                continue;
+            }
+
+            if (*count == max_count) {
+                return(0);
+            }
+
+            gathered[index >> 3] |= bit;
+
+            voxel_coordinate_t coord = convert_1d_to_3d_coord(index, CHUNK_EDGE_LENGTH);
+            modified_voxel_t *voxel = &dst[(*count)++];
+            voxel->index = index;
+            voxel->previous_value = entry->changes[i].previous_value;
+            voxel->next_value = voxels[coord.x][coord.y][coord.z];
+        }
+    }
+
+    return(1);
+}
+
+
+void chunk_t::compute_hash(void) {
+    hash = 0;
+
+    // Same indices as the voxel history
+    for (uint32_t z = 0; z < CHUNK_EDGE_LENGTH; ++z) {
+        for (uint32_t y = 0; y < CHUNK_EDGE_LENGTH; ++y) {
+            for (uint32_t x = 0; x < CHUNK_EDGE_LENGTH; ++x) {
+                uint16_t index = (uint16_t)(z * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH + y * CHUNK_EDGE_LENGTH + x);
+                uint8_t value = voxels[x][y][z];
+                if (voxel_history && voxel_history[index] != VOXEL_HAS_NOT_BEEN_APPENDED_TO_HISTORY) {
+                    value = voxel_history[index];
+                }
+
+                if (value) {
+                    hash += s_hash_voxel(index, value);
+                }
+            }
+        }
+    }
+}
+
+
+void chunk_t::set_voxel(uint32_t x, uint32_t y, uint32_t z, uint8_t value) {
+    uint16_t index = (uint16_t)convert_3d_to_1d_index(x, y, z, CHUNK_EDGE_LENGTH);
+    uint8_t *voxel = &voxels[x][y][z];
+
+    // Voxel is waiting in the history: push_version will hash the change from the previous value to whatever the voxel is then
+    bool is_in_history = voxel_history && voxel_history[index] != VOXEL_HAS_NOT_BEEN_APPENDED_TO_HISTORY;
+    if (!is_in_history) {
+        if (*voxel) {
+            hash -= s_hash_voxel(index, *voxel);
+        }
+        if (value) {
+            hash += s_hash_voxel(index, value);
+        }
+    }
+
+    *voxel = value;
+}
+
+
 void chunk_t::initialize_for_rendering(model_t *chunk_model) {
     uint32_t buffer_size = sizeof(vector3_t) * MAX_VERTICES_PER_CHUNK;
 
@@ -55,6 +189,16 @@ void chunk_t::deinitialize(void) {
         modified_voxels_list_count = 0;
         deallocate_free_list(list_of_modified_voxels);
     }
+    if (version_history) {
+        for (uint32_t i = 0; i < CHUNK_VERSION_HISTORY; ++i) {
+            if (version_history[i].changes) {
+                deallocate_free_list(version_history[i].changes);
+            }
+        }
+
+        deallocate_free_list(version_history);
+        version_history = nullptr;
+    }
 }
 
 
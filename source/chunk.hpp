@@ -7,6 +7,23 @@
 
 #define CHUNK_EDGE_LENGTH 16
 #define MAX_VERTICES_PER_CHUNK 5 * (CHUNK_EDGE_LENGTH - 1) * (CHUNK_EDGE_LENGTH - 1) * (CHUNK_EDGE_LENGTH - 1)
+// Server keeps what changed in the last few versions of every chunk (clients which are further behind get sent the whole chunk)
+#define CHUNK_VERSION_HISTORY 8
+
+constexpr uint8_t VOXEL_HAS_NOT_BEEN_APPENDED_TO_HISTORY = 255;
+
+
+// Server: voxel which changed in a version of a chunk, with the value it had before
+struct chunk_voxel_change_t {
+    uint16_t index;
+    uint8_t previous_value;
+};
+
+struct chunk_version_t {
+    uint32_t version;
+    uint32_t change_count;
+    chunk_voxel_change_t *changes;
+};
 
 
 // Will always be allocated on the heap
@@ -23,6 +40,15 @@ struct chunk_t {
     uint32_t modified_voxels_list_count = 0;
     uint16_t *list_of_modified_voxels = nullptr;
 
+    // Server: gets bumped every snapshot in which the chunk got modified, client: latest version received
+    uint32_t version = 0;
+    // Server: ring of the last CHUNK_VERSION_HISTORY versions (indexed with version % CHUNK_VERSION_HISTORY)
+    chunk_version_t *version_history = nullptr;
+
+    // Sum of the hashes of every (index, value) pair of the non-empty voxels (empty chunk = 0)
+    // Server: kept up to date with every version, client: needs compute_hash() before being compared
+    uint64_t hash = 0;
+
     uint32_t vertex_count;
     vector3_t mesh_vertices[MAX_VERTICES_PER_CHUNK];
 
@@ -57,6 +83,17 @@ struct chunk_t {
     void update_mesh(uint8_t surface_level, struct gpu_command_queue_t *queue);
 
     uint8_t chunk_edge_voxel_value(int32_t x, int32_t y, int32_t z, bool *doesnt_exist);
+
+    // Server: voxels which got modified since the last snapshot become a new version
+    void push_version(void);
+    // Server: every voxel which changed since version (once, with its current value), max_count = capacity of dst
+    // Returns false if the history doesn't go back that far or if too many voxels changed (whole chunk needs to be sent)
+    bool gather_modified_voxels_since(uint32_t since_version, struct modified_voxel_t *dst, uint32_t max_count, uint32_t *count);
+    // Hashes the whole chunk (only for when voxels got written without going through the history, e.g. map loading)
+    // Voxels which are waiting in the history count with their previous value: push_version hashes their change
+    void compute_hash(void);
+    // For writes that don't go through the history (editor tools): keeps the hash up to date without recomputing it
+    void set_voxel(uint32_t x, uint32_t y, uint32_t z, uint8_t value);
 private:
     void update_chunk_mesh_voxel_pair(uint8_t *voxel_values, uint32_t x, uint32_t y, uint32_t z, uint8_t surface_level);
     void push_vertex_to_triangle_array(uint8_t v0, uint8_t v1, vector3_t *vertices, uint8_t *voxel_values, uint8_t surface_level);
@@ -10,7 +10,6 @@
 
 #include "deferred_renderer.hpp"
 
-constexpr uint8_t VOXEL_HAS_NOT_BEEN_APPENDED_TO_HISTORY = 255;
 constexpr float32_t MAX_VOXEL_VALUE = 254.0f;
 constexpr uint32_t MAX_VOXEL_COLOR_BEACON_COUNT = 50;
 
@@ -39,7 +38,8 @@ static gpu_material_submission_queue_t gpu_queue;
 static uint32_t chunks_to_render_count = 0;
 static chunk_t **chunks_to_update;
 static uint32_t to_sync_count = 0;
-static uint32_t chunks_to_gpu_sync[20];
+// Every chunk can get queued at once (when joining)
+static uint32_t chunks_to_gpu_sync[20 * 20 * 20];
 
 static alignas(16) struct {
 
@@ -60,9 +60,15 @@ static float32_t elapsed_interpolation_time = 0.0f;
 
 static chunks_state_flags_t flags;
 
-static linear_allocator_t voxel_linear_allocator_front = {};
+// Voxel delta of the latest snapshot has to stay around until the next snapshot arrives (interpolation runs over several frames)
+// so it can't go in the frame arena: gets swapped in reset_voxel_interpolation instead
+#define VOXEL_DELTA_RESERVE_SIZE megabytes(64)
+#define VOXEL_DELTA_RETAINED_SIZE kilobytes(256)
+static double_buffered_linear_allocator_t voxel_delta_allocator = {};
 static game_snapshot_voxel_delta_packet_t *previous_voxel_delta_packet_front = nullptr;
 
+static pool_allocator_t<chunk_t> chunk_pool;
+
 
 
 // Static declarations
@@ -83,6 +89,8 @@ static int32_t s_lua_save_map(lua_State *state);
 
 // "Public" definitions
 void initialize_chunks_state(void) {
+    chunk_pool.initialize("chunk_t");
+
     add_global_to_lua(script_primitive_type_t::FUNCTION, "clear_voxels", &s_lua_clear_voxels);
     add_global_to_lua(script_primitive_type_t::FUNCTION, "create_sphere", &s_lua_create_sphere);
     add_global_to_lua(script_primitive_type_t::FUNCTION, "save_map", &s_lua_save_map);
@@ -228,8 +236,7 @@ void initialize_chunks_state(void) {
     default: break;
     }
     
-    voxel_linear_allocator_front.current = voxel_linear_allocator_front.start = allocate_free_list(sizeof(uint8_t) * 5000);
-    voxel_linear_allocator_front.capacity = sizeof(uint8_t) * 5000;
+    initialize_double_buffered_linear_impl(VOXEL_DELTA_RESERVE_SIZE, VOXEL_DELTA_RETAINED_SIZE, 0, &voxel_delta_allocator);
 
     memset(dummy_voxels, 255, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
     previous_voxel_delta_packet_front = (game_snapshot_voxel_delta_packet_t *)allocate_free_list(sizeof(game_snapshot_voxel_delta_packet_t));
@@ -269,7 +276,7 @@ void populate_chunks_state(game_state_initialize_packet_t *packet) {
             for (uint32_t y = 0; y < grid_edge_size; ++y) {
                 for (uint32_t x = 0; x < grid_edge_size; ++x) {
                     chunk_t **chunk_pptr = get_chunk((int32_t)i);
-                    *chunk_pptr = (chunk_t *)allocate_free_list(sizeof(chunk_t));
+                    *chunk_pptr = allocate_chunk();
 
                     vector3_t position = vector3_t(x, y, z) * (float32_t)(CHUNK_EDGE_LENGTH)-vector3_t((float32_t)grid_edge_size / 2) * (float32_t)(CHUNK_EDGE_LENGTH);
 
@@ -305,7 +312,7 @@ void populate_chunks_state(game_state_initialize_packet_t *packet) {
             for (uint32_t y = 0; y < grid_edge_size; ++y) {
                 for (uint32_t x = 0; x < grid_edge_size; ++x) {
                     chunk_t **chunk_pptr = get_chunk((int32_t)i);
-                    *chunk_pptr = (chunk_t *)allocate_free_list(sizeof(chunk_t));
+                    *chunk_pptr = allocate_chunk();
 
                     vector3_t position = vector3_t(x, y, z) * (float32_t)(CHUNK_EDGE_LENGTH)-vector3_t((float32_t)grid_edge_size / 2) * (float32_t)(CHUNK_EDGE_LENGTH);
 
@@ -357,7 +364,7 @@ void deinitialize_chunks_state(void) {
                 chunk_t *chunk_ptr = *chunk_pptr;
                 chunk_ptr->deinitialize();
                 
-                deallocate_free_list(chunk_ptr);
+                deallocate_chunk(chunk_ptr);
     
                 ++i;
             }    
@@ -367,6 +374,8 @@ void deinitialize_chunks_state(void) {
     deallocate_free_list(chunks);
     deallocate_free_list(chunks_to_update);
 
+    chunk_pool.deinitialize();
+
     grid_edge_size = 0;
     chunk_size = 0;
     chunk_count = 0;
@@ -390,6 +399,7 @@ voxel_chunk_values_packet_t *initialize_chunk_values_packets(uint32_t *count) {
         packets[i].chunk_coord_x = chunk->chunk_coord.x;
         packets[i].chunk_coord_y = chunk->chunk_coord.y;
         packets[i].chunk_coord_z = chunk->chunk_coord.z;
+        packets[i].version = chunk->version;
         packets[i].voxels = &chunk->voxels[0][0][0];
     }
 
@@ -617,7 +627,7 @@ void reset_voxel_interpolation(void) {
         //previous_voxel_delta_packet = nullptr;
     };
 
-    clear_linear(&voxel_linear_allocator_front);
+    swap_double_buffered_linear_impl(&voxel_delta_allocator);
     if (get_previous_voxel_delta_packet()) {
         get_previous_voxel_delta_packet()->modified_count = 0;
     }
@@ -816,13 +826,42 @@ float32_t get_chunk_grid_size(void) {
 }
 
 
+uint32_t gather_cached_chunks(cached_chunk_t *dst, uint32_t max_chunks) {
+    uint32_t count = 0;
+    
+    for (uint32_t i = 0; i < grid_edge_size * grid_edge_size * grid_edge_size && count < max_chunks; ++i) {
+        chunk_t *chunk = *get_chunk((int32_t)i);
+        chunk->compute_hash();
+
+        // Empty chunks don't need to be cached
+        if (chunk->hash) {
+            dst[count].chunk_index = (uint16_t)i;
+            dst[count].hash = chunk->hash;
+            ++count;
+        }
+    }
+
+    return(count);
+}
+
+
 float32_t get_chunk_size(void) {
     return chunk_size;
 }
 
 
 struct linear_allocator_t *get_voxel_linear_allocator(void) {
-    return &voxel_linear_allocator_front;
+    return &voxel_delta_allocator.arenas[voxel_delta_allocator.current];
+}
+
+
+chunk_t *allocate_chunk(void) {
+    return(chunk_pool.allocate());
+}
+
+
+void deallocate_chunk(chunk_t *chunk) {
+    chunk_pool.deallocate(chunk);
 }
 
 
@@ -851,7 +890,7 @@ static void s_construct_plane(const vector3_t &ws_plane_origin, float32_t radius
             ivector3_t cs_vcoord = ivector3_t(v_f) - chunk->xs_bottom_corner;
 
             if (is_within_boundaries(cs_vcoord, CHUNK_EDGE_LENGTH)) {
-                chunk->voxels[(uint32_t)cs_vcoord.x][(uint32_t)cs_vcoord.y][(uint32_t)cs_vcoord.z] = (uint8_t)MAX_VOXEL_VALUE;
+                chunk->set_voxel((uint32_t)cs_vcoord.x, (uint32_t)cs_vcoord.y, (uint32_t)cs_vcoord.z, (uint8_t)MAX_VOXEL_VALUE);
             }
             else {
                 chunk = get_chunk_encompassing_point(ivector3_t(v_f));
@@ -860,7 +899,7 @@ static void s_construct_plane(const vector3_t &ws_plane_origin, float32_t radius
                 
                 cs_vcoord = ivector3_t(v_f) - chunk->xs_bottom_corner;
 
-                chunk->voxels[(uint32_t)cs_vcoord.x][(uint32_t)cs_vcoord.y][(uint32_t)cs_vcoord.z] = (uint8_t)MAX_VOXEL_VALUE;
+                chunk->set_voxel((uint32_t)cs_vcoord.x, (uint32_t)cs_vcoord.y, (uint32_t)cs_vcoord.z, (uint8_t)MAX_VOXEL_VALUE);
             }
         }
     }
@@ -897,7 +936,7 @@ static void s_construct_sphere(const vector3_t &ws_sphere_position, float32_t ra
 
                     if (is_within_boundaries(cs_vcoord, CHUNK_EDGE_LENGTH)) {
                         float32_t proportion = 1.0f - (real_distance_squared / radius_squared);
-                        chunk->voxels[(uint32_t)cs_vcoord.x][(uint32_t)cs_vcoord.y][(uint32_t)cs_vcoord.z] = (uint32_t)((proportion) * (float32_t)MAX_VOXEL_VALUE);
+                        chunk->set_voxel((uint32_t)cs_vcoord.x, (uint32_t)cs_vcoord.y, (uint32_t)cs_vcoord.z, (uint8_t)((proportion) * (float32_t)MAX_VOXEL_VALUE));
                     }
                     else {
                         chunk = get_chunk_encompassing_point(ivector3_t(v_f));
@@ -908,7 +947,7 @@ static void s_construct_sphere(const vector3_t &ws_sphere_position, float32_t ra
 
                         float32_t proportion = 1.0f - (real_distance_squared / radius_squared);
                         
-                        chunk->voxels[(uint32_t)cs_vcoord.x][(uint32_t)cs_vcoord.y][(uint32_t)cs_vcoord.z] = (uint32_t)((proportion) * (float32_t)MAX_VOXEL_VALUE);
+                        chunk->set_voxel((uint32_t)cs_vcoord.x, (uint32_t)cs_vcoord.y, (uint32_t)cs_vcoord.z, (uint8_t)((proportion) * (float32_t)MAX_VOXEL_VALUE));
                     }
                 }
             }
@@ -1037,6 +1076,7 @@ static void s_clear_voxels() {
 
         c->vertex_count = 0;
         memset(c->voxels, 0, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+        c->compute_hash();
     }
 
     chunks_to_render_count = 0;
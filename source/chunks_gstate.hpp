@@ -53,6 +53,10 @@ vector3_t ws_to_xs(const vector3_t &ws_position);
 chunk_t **get_chunk(int32_t index);
 chunk_t **get_chunk(uint32_t x, uint32_t y, uint32_t z);
 
+// Chunks come from a pool (chunk_t::initialize still needs to be called)
+chunk_t *allocate_chunk(void);
+void deallocate_chunk(chunk_t *chunk);
+
 chunks_state_flags_t *get_chunks_state_flags(void);
 
 chunk_t *get_chunk_encompassing_point(const vector3_t &xs_position);
@@ -66,4 +70,6 @@ struct game_snapshot_voxel_delta_packet_t *&get_previous_voxel_delta_packet(void
 
 chunk_t **get_modified_chunks(uint32_t *count);
 float32_t get_chunk_grid_size(void);
+// Client: hashes of the non-empty chunks that it has (from the previous session, or from its copy of the map)
+uint32_t gather_cached_chunks(struct cached_chunk_t *dst, uint32_t max_chunks);
 float32_t get_chunk_size(void);
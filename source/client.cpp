@@ -1,5 +1,6 @@
 #include "ui.hpp"
 #include "net.hpp"
+#include "interest.hpp"
 #include "script.hpp"
 #include "sockets.hpp"
 #include "client.hpp"
@@ -16,6 +17,10 @@
 struct remote_client_t {
     uint32_t client_id, player_handle;
     const char *name;
+
+    // Players which are far get sent less often (server does interest management)
+    uint64_t last_game_state_tick;
+    remote_player_snapshot_t last_snapshot;
 };
 
 
@@ -36,17 +41,106 @@ void client_event_callback(void *object, event_t *e) {
 static int32_t s_lua_join_server(lua_State *state);
 static int32_t s_lua_join_loop_back(lua_State *state);
 
+// Power of 2: the log is a ring, and the oldest history instances get overwritten if the client terraforms a lot
+#define VOXEL_MODIFICATION_LOG_SIZE (64 * 1024)
+
+// Chunk count, then for every chunk: chunk index, voxel count and the voxels (delta of the voxel index with the previous one + value)
+// Voxel indices are varints, so most modified voxels take 2 bytes instead of a whole local_client_modified_voxel_t slot
+struct voxel_modification_log_t {
+    uint8_t *data = nullptr;
+    // Amount of bytes that were ever written (data[head % VOXEL_MODIFICATION_LOG_SIZE] is the next byte to write)
+    uint64_t head = 0;
+
+    void write_byte(uint8_t byte) {
+        data[(head++) & (VOXEL_MODIFICATION_LOG_SIZE - 1)] = byte;
+    }
+
+    uint8_t read_byte(uint64_t *position) {
+        return(data[((*position)++) & (VOXEL_MODIFICATION_LOG_SIZE - 1)]);
+    }
+
+    void write_varint(uint32_t value) {
+        while (value >= 0x80) {
+            write_byte((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        write_byte((uint8_t)value);
+    }
+
+    uint32_t read_varint(uint64_t *position) {
+        uint32_t value = 0;
+        uint32_t shift = 0;
+        uint8_t byte;
+        do {
+            byte = read_byte(position);
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        return(value);
+    }
+
+    void write_signed_varint(int32_t value) {
+        write_varint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+    }
+
+    int32_t read_signed_varint(uint64_t *position) {
+        uint32_t zigzag = read_varint(position);
+        return((int32_t)((zigzag >> 1) ^ (0 - (zigzag & 1))));
+    }
+
+    // Whether the bytes starting at position haven't been overwritten yet
+    bool is_valid(uint64_t position) {
+        return(head - position <= VOXEL_MODIFICATION_LOG_SIZE);
+    }
+};
+
 struct local_client_voxel_modification_history_t {
-    // The voxel modifications will actually store the "previous value"
-    client_modified_chunk_nl_t modified_chunks[10];
-    uint32_t modified_chunks_count = 0;
+    // Where the modifications of this tick are in the voxel modification log: stores the "previous value" of the voxels
+    uint64_t log_start;
     uint64_t tick;
 };
 
+// Enough for a couple of seconds of latency: corrections which are older than that make the player snap to the server's state
+#define MAX_LOCAL_PLAYER_TICKS 256
+
+// What the physics of the local player depend on
+struct local_player_physics_state_t {
+    vector3_t ws_position;
+    vector3_t ws_direction;
+    vector3_t ws_velocity;
+    vector3_t ws_up;
+    vector3_t ws_camera_up;
+    vector3_t ws_camera_next_up;
+    vector3_t previous_velocity;
+    float32_t entering_acceleration;
+    uint8_t physics_state;
+    uint8_t is_entering;
+};
+
+// One for every cached player state: corrections restore the server's state and only replay the ticks which came after
+struct local_player_tick_t {
+    uint32_t action_flags;
+    float32_t mouse_x_diff;
+    float32_t mouse_y_diff;
+    float32_t dt;
+    uint8_t flags_byte;
+    // Player state got dropped instead of sent (simulated packet loss): server never simulates it
+    uint8_t dropped;
+    // Tick of the input state packet which contained the player state (0 = not sent yet)
+    uint64_t sent_tick;
+
+    // State after the tick got simulated
+    local_player_physics_state_t state;
+};
+
 struct this_client_t {
     client_t user_client;
     circular_buffer_t<player_state_t> player_state_cbuffer;
+    circular_buffer_t<local_player_tick_t> local_player_ticks;
     circular_buffer_t<local_client_voxel_modification_history_t> vmod_history; // Voxel-modification history
+    voxel_modification_log_t vmod_log;
+    // Decoded game states - snapshots are delta compressed against these
+    game_state_baselines_t received_game_states;
 
     struct {
         uint32_t sent_active_action_flags : 1;
@@ -64,7 +158,117 @@ void initialize_client(char *msg_buffer, event_dispatcher_t *dispatcher) {
     add_global_to_lua(script_primitive_type_t::FUNCTION, "lb", &s_lua_join_loop_back);
 
     this_client.player_state_cbuffer.initialize(40);
+    this_client.local_player_ticks.initialize(MAX_LOCAL_PLAYER_TICKS);
     this_client.vmod_history.initialize(MAX_HISTORY_INSTANCES);
+    this_client.vmod_log.data = (uint8_t *)allocate_free_list(VOXEL_MODIFICATION_LOG_SIZE);
+}
+
+
+// Lists only ever get appended at the end of the arena (or extended if they already are at the end)
+// If the arena is full, it grows and only the voxels which are still in use get copied over
+static void s_reserve_modified_voxels(client_t *client, client_modified_chunk_nl_t *chunk, uint32_t max_voxel_count) {
+    uint32_t extra_voxels = max_voxel_count - chunk->modified_voxel_count;
+    bool is_at_end_of_arena = chunk->modified_voxels &&
+        chunk->modified_voxels + chunk->max_voxel_count == client->voxel_modification_arena + client->voxel_modification_arena_used;
+
+    if (is_at_end_of_arena && client->voxel_modification_arena_used + max_voxel_count - chunk->max_voxel_count <= client->voxel_modification_arena_size) {
+        client->voxel_modification_arena_used += max_voxel_count - chunk->max_voxel_count;
+        chunk->max_voxel_count = max_voxel_count;
+        return;
+    }
+
+    if (client->voxel_modification_arena_used + max_voxel_count > client->voxel_modification_arena_size) {
+        // Worst case: the chunk's list gets copied twice (if it doesn't end up at the end of the arena)
+        uint32_t required_size = max_voxel_count;
+        for (uint32_t i = 0; i < client->modified_chunks_count; ++i) {
+            required_size += client->previous_received_voxel_modifications[i].modified_voxel_count;
+        }
+
+        uint32_t new_size = MAX(client->voxel_modification_arena_size * 2, INITIAL_VOXEL_MODIFICATION_ARENA_SIZE);
+        while (new_size < required_size) {
+            new_size *= 2;
+        }
+
+        local_client_modified_voxel_t *new_arena = FL_MALLOC(local_client_modified_voxel_t, new_size);
+        uint32_t used = 0;
+
+        for (uint32_t i = 0; i < client->modified_chunks_count; ++i) {
+            client_modified_chunk_nl_t *list = &client->previous_received_voxel_modifications[i];
+            if (list->modified_voxel_count) {
+                memcpy(new_arena + used, list->modified_voxels, sizeof(local_client_modified_voxel_t) * list->modified_voxel_count);
+            }
+            list->modified_voxels = new_arena + used;
+            list->max_voxel_count = list->modified_voxel_count;
+            used += list->modified_voxel_count;
+        }
+
+        if (client->voxel_modification_arena) {
+            deallocate_free_list(client->voxel_modification_arena);
+        }
+
+        client->voxel_modification_arena = new_arena;
+        client->voxel_modification_arena_size = new_size;
+        client->voxel_modification_arena_used = used;
+
+        // The chunk now is at the end of the arena (it was just copied last) if it was the last one to get added
+        if (chunk->modified_voxels + chunk->max_voxel_count == new_arena + used) {
+            client->voxel_modification_arena_used += extra_voxels;
+            chunk->max_voxel_count = max_voxel_count;
+            return;
+        }
+    }
+
+    local_client_modified_voxel_t *list = client->voxel_modification_arena + client->voxel_modification_arena_used;
+    if (chunk->modified_voxel_count) {
+        memcpy(list, chunk->modified_voxels, sizeof(local_client_modified_voxel_t) * chunk->modified_voxel_count);
+    }
+
+    chunk->modified_voxels = list;
+    chunk->max_voxel_count = max_voxel_count;
+    client->voxel_modification_arena_used += max_voxel_count;
+}
+
+client_modified_chunk_nl_t *client_t::add_modified_chunk(uint16_t chunk_index, uint32_t voxel_count) {
+    if (modified_chunks_count == MAX_CHUNKS_MODIFIED_PER_SNAPSHOT) {
+        return(nullptr);
+    }
+
+    client_modified_chunk_nl_t *chunk = &previous_received_voxel_modifications[modified_chunks_count++];
+    chunk->chunk_index = chunk_index;
+    chunk->modified_voxels = nullptr;
+    chunk->modified_voxel_count = 0;
+    chunk->max_voxel_count = 0;
+
+    if (voxel_count) {
+        s_reserve_modified_voxels(this, chunk, voxel_count);
+    }
+
+    return(chunk);
+}
+
+local_client_modified_voxel_t *client_t::add_modified_voxel(client_modified_chunk_nl_t *chunk) {
+    if (chunk->modified_voxel_count == chunk->max_voxel_count) {
+        s_reserve_modified_voxels(this, chunk, MAX(chunk->max_voxel_count * 2, 16));
+    }
+
+    return(&chunk->modified_voxels[chunk->modified_voxel_count++]);
+}
+
+void client_t::clear_modified_chunks(void) {
+    // Arena gets kept around: a client which terraforms will most likely do so again before the next snapshot
+    modified_chunks_count = 0;
+    voxel_modification_arena_used = 0;
+}
+
+void client_t::deinitialize_voxel_modification_arena(void) {
+    if (voxel_modification_arena) {
+        deallocate_free_list(voxel_modification_arena);
+    }
+
+    voxel_modification_arena = nullptr;
+    voxel_modification_arena_size = 0;
+    voxel_modification_arena_used = 0;
+    modified_chunks_count = 0;
 }
 
 
@@ -94,12 +298,13 @@ void deinitialize_client() {
     
         serializer.serialize_packet_header(&header);
 
-        serializer.send_serialized_message(connection.server_address);
+        serializer.send_serialized_message(connection.server_address, CT_RELIABLE_ORDERED);
     }
 }
 
 
 #define MAX_MESSAGE_BUFFER_SIZE 40000
+#define MAX_RECEIVED_DATAGRAMS_PER_TICK 64
 
 
 static void s_simulate_packet_loss(raw_input_t *raw_input) {
@@ -111,6 +316,169 @@ static void s_simulate_packet_loss(raw_input_t *raw_input) {
     }
 }
 
+static void s_save_local_player_state(player_t *player, local_player_physics_state_t *state) {
+    state->ws_position = player->ws_position;
+    state->ws_direction = player->ws_direction;
+    state->ws_velocity = player->ws_velocity;
+    state->ws_up = player->ws_up;
+    state->ws_camera_up = player->camera.ws_current_up_vector;
+    state->ws_camera_next_up = player->camera.ws_next_vector;
+    state->previous_velocity = player->physics.previous_velocity;
+    state->entering_acceleration = player->entering_acceleration;
+    state->physics_state = (uint8_t)player->physics.state;
+    state->is_entering = player->is_entering;
+}
+
+static void s_restore_local_player_state(player_t *player, local_player_physics_state_t *state) {
+    player->ws_position = state->ws_position;
+    player->ws_direction = state->ws_direction;
+    player->ws_velocity = state->ws_velocity;
+    player->ws_up = state->ws_up;
+    player->camera.ws_current_up_vector = state->ws_camera_up;
+    player->camera.ws_next_vector = state->ws_camera_next_up;
+    player->physics.previous_velocity = state->previous_velocity;
+    player->entering_acceleration = state->entering_acceleration;
+    player->physics.state = (entity_physics_state_t)state->physics_state;
+    player->is_entering = state->is_entering;
+}
+
+// 0 = latest tick
+static local_player_tick_t *s_get_local_player_tick(uint32_t age) {
+    circular_buffer_t<local_player_tick_t> *ticks = &this_client.local_player_ticks;
+    return(&ticks->buffer[(ticks->head + ticks->buffer_size - 1 - age) % ticks->buffer_size]);
+}
+
+static void s_push_local_player_tick(player_t *player, player_state_t *player_state) {
+    circular_buffer_t<local_player_tick_t> *ticks = &this_client.local_player_ticks;
+
+    local_player_tick_t *tick = ticks->push_item();
+    // Oldest ticks just get overwritten
+    ticks->head_tail_difference = MIN(ticks->head_tail_difference, ticks->buffer_size);
+
+    tick->action_flags = player_state->action_flags;
+    tick->mouse_x_diff = player_state->mouse_x_diff;
+    tick->mouse_y_diff = player_state->mouse_y_diff;
+    tick->dt = player_state->dt;
+    tick->flags_byte = player_state->flags_byte;
+    tick->dropped = 0;
+    tick->sent_tick = 0;
+
+    s_save_local_player_state(player, &tick->state);
+}
+
+static void s_mark_local_player_ticks_sent(uint64_t sent_tick, bool dropped) {
+    for (uint32_t i = 0; i < this_client.local_player_ticks.head_tail_difference; ++i) {
+        local_player_tick_t *tick = s_get_local_player_tick(i);
+        if (tick->sent_tick) {
+            break;
+        }
+
+        tick->sent_tick = sent_tick;
+        tick->dropped = dropped;
+    }
+}
+
+// Server's state is the state of the player once it simulated the player states of the input packet which was sent at previous_tick
+// Restore it, then only go through the physics of the ticks which came after (no rendering, animation, terraforming or shooting)
+static void s_rollback_and_replay_local_player(player_t *player, game_snapshot_player_state_packet_t *correction, uint64_t previous_tick) {
+    local_player_physics_state_t corrected_state = {};
+
+    uint32_t tick_count = this_client.local_player_ticks.head_tail_difference;
+    uint32_t divergence_tick = 0;
+    local_player_tick_t *base = nullptr;
+    for (; divergence_tick < tick_count; ++divergence_tick) {
+        local_player_tick_t *tick = s_get_local_player_tick(divergence_tick);
+        if (tick->sent_tick && tick->sent_tick <= previous_tick) {
+            base = tick;
+            break;
+        }
+    }
+
+    if (base) {
+        corrected_state = base->state;
+    }
+    else {
+        // Correction is older than the ticks that were kept: can only snap to the server's state
+        s_save_local_player_state(player, &corrected_state);
+    }
+
+    corrected_state.ws_position = correction->ws_position;
+    corrected_state.ws_direction = correction->ws_direction;
+    corrected_state.ws_velocity = correction->ws_velocity;
+    corrected_state.ws_up = corrected_state.ws_camera_up = corrected_state.ws_camera_next_up = correction->ws_up_vector;
+    corrected_state.previous_velocity = correction->ws_previous_velocity;
+    corrected_state.physics_state = correction->physics_state;
+
+    if (base) {
+        // Voxel corrections don't necessarily mean that the player's prediction was wrong
+        float32_t precision = 0.1f;
+        vector3_t ws_position_difference = glm::abs(base->state.ws_position - corrected_state.ws_position);
+        vector3_t ws_direction_difference = glm::abs(base->state.ws_direction - corrected_state.ws_direction);
+        bool diverged = base->state.physics_state != corrected_state.physics_state ||
+            ws_position_difference.x > precision || ws_position_difference.y > precision || ws_position_difference.z > precision ||
+            ws_direction_difference.x > precision || ws_direction_difference.y > precision || ws_direction_difference.z > precision;
+
+        if (!diverged) {
+            return;
+        }
+
+        base->state = corrected_state;
+    }
+
+    s_restore_local_player_state(player, &corrected_state);
+    player->physics.axes = vector3_t(0);
+
+    for (int32_t i = (int32_t)divergence_tick - 1; base && i >= 0; --i) {
+        local_player_tick_t *tick = s_get_local_player_tick((uint32_t)i);
+
+        // Server never got these
+        if (!tick->dropped) {
+            player_state_t player_state = {};
+            player_state.action_flags = tick->action_flags;
+            player_state.mouse_x_diff = tick->mouse_x_diff;
+            player_state.mouse_y_diff = tick->mouse_y_diff;
+            player_state.flags_byte = tick->flags_byte;
+            player_state.dt = tick->dt;
+
+            float32_t dt = player->network.apply_player_state(player, &player_state);
+            player->physics.tick(player, dt);
+            player->camera.tick_up_vector(dt);
+        }
+
+        s_save_local_player_state(player, &tick->state);
+    }
+
+    player->action_flags = 0;
+}
+
+// Stores the "previous value" of the voxels so that revert is possible
+static void s_push_voxel_modification_history(chunk_t **chunks, uint32_t modified_chunks_count) {
+    voxel_modification_log_t *log = &this_client.vmod_log;
+
+    local_client_voxel_modification_history_t *history_instance = this_client.vmod_history.push_item();
+    history_instance->tick = *get_current_tick();
+    history_instance->log_start = log->head;
+
+    log->write_varint(modified_chunks_count);
+
+    for (uint32_t chunk_index = 0; chunk_index < modified_chunks_count; ++chunk_index) {
+        chunk_t *chunk = chunks[chunk_index];
+
+        log->write_varint(convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)(get_chunk_grid_size())));
+        log->write_varint(chunk->modified_voxels_list_count);
+
+        int32_t previous_voxel_index = 0;
+        for (uint32_t voxel = 0; voxel < chunk->modified_voxels_list_count; ++voxel) {
+            uint16_t voxel_index = chunk->list_of_modified_voxels[voxel];
+            // Terraforming modifies voxels which are close to each other: the deltas are small
+            log->write_signed_varint((int32_t)voxel_index - previous_voxel_index);
+            log->write_byte(chunk->voxel_history[voxel_index]);
+
+            previous_voxel_index = voxel_index;
+        }
+    }
+}
+
 static void s_send_commands(void) {
     player_t *user = get_user_player();    
     client_t *user_client = get_user_client();
@@ -128,79 +496,79 @@ static void s_send_commands(void) {
     uint32_t modified_chunks_count = 0;
     chunk_t **chunks = get_modified_chunks(&modified_chunks_count);
 
-    client_modified_voxels_packet_t voxel_packet = {};
-    voxel_packet.modified_chunk_count = modified_chunks_count;
-    voxel_packet.modified_chunks = (client_modified_chunk_t *)allocate_linear(sizeof(client_modified_chunk_t) * modified_chunks_count);
-
-    local_client_voxel_modification_history_t *history_instance = nullptr;
-    
     if (modified_chunks_count) {
-        history_instance = this_client.vmod_history.push_item();
-        history_instance->tick = *get_current_tick();
-
-        history_instance->modified_chunks_count = modified_chunks_count;
+        s_push_voxel_modification_history(chunks, modified_chunks_count);
     }
-    
-    for (uint32_t chunk_index = 0; chunk_index < modified_chunks_count; ++chunk_index) {
-        chunk_t *chunk = chunks[chunk_index];
-        client_modified_chunk_t *modified_chunk = &voxel_packet.modified_chunks[chunk_index];
-
-        modified_chunk->chunk_index = convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)(get_chunk_grid_size()));
-        modified_chunk->modified_voxels = (local_client_modified_voxel_t *)allocate_linear(sizeof(local_client_modified_voxel_t) * chunk->modified_voxels_list_count);
-        modified_chunk->modified_voxel_count = chunk->modified_voxels_list_count;
 
-        client_modified_chunk_nl_t *history_to_keep = &history_instance->modified_chunks[chunk_index];
-        history_to_keep->chunk_index = modified_chunk->chunk_index;
-        history_to_keep->modified_voxel_count = modified_chunk->modified_voxel_count;
-
-        for (uint32_t voxel = 0; voxel < chunk->modified_voxels_list_count; ++voxel) {
-            uint16_t voxel_index = chunk->list_of_modified_voxels[voxel];
-            voxel_coordinate_t coord = convert_1d_to_3d_coord(voxel_index, CHUNK_EDGE_LENGTH);
-            modified_chunk->modified_voxels[voxel].x = coord.x;
-            modified_chunk->modified_voxels[voxel].y = coord.y;
-            modified_chunk->modified_voxels[voxel].z = coord.z;
-            modified_chunk->modified_voxels[voxel].value = chunk->voxels[coord.x][coord.y][coord.z];
-
-            if (voxel < MAX_VOXELS_MODIFIED_PER_CHUNK) {
-                history_to_keep->modified_voxels[voxel].x = coord.x;
-                history_to_keep->modified_voxels[voxel].y = coord.y;
-                history_to_keep->modified_voxels[voxel].z = coord.z;
-                // Set it to the "previous" value so that revert is possible
-                history_to_keep->modified_voxels[voxel].value = chunk->voxel_history[convert_3d_to_1d_index(coord.x, coord.y, coord.z, CHUNK_EDGE_LENGTH)];
-            }
-        }
+    // Modified voxels get serialized straight from the chunks' lists
+    uint32_t modified_voxels_size = sizeof(client_modified_voxels_packet_t::modified_chunk_count);
+    for (uint32_t chunk_index = 0; chunk_index < modified_chunks_count; ++chunk_index) {
+        modified_voxels_size += sizeof_client_modified_chunk(chunks[chunk_index]->modified_voxels_list_count);
     }
         
         
-    header.total_packet_size = sizeof_packet_header() + sizeof(uint32_t) + sizeof_client_input_state_packet() * this_client.player_state_cbuffer.head_tail_difference + sizeof(vector3_t) * 2 + sizeof_modified_voxels_packet(modified_chunks_count, voxel_packet.modified_chunks);
+    uint32_t player_states_to_send = this_client.player_state_cbuffer.head_tail_difference;
+
+    // Command count, commands, position and direction get bit packed
+    uint32_t max_input_bits = max_varint_bits(32, 7) +
+        sizeof_max_client_input_state_packet_bits() * player_states_to_send +
+        max_varint_bits(32, 7) * 3 +
+        QUANTIZED_UNIT_VECTOR_BITS * 2;
+    uint32_t max_packet_size = sizeof_packet_header() + (max_input_bits + 7) / 8 + modified_voxels_size;
+
     header.client_id = user->network.client_state_index;
     header.current_tick = *get_current_tick();
     header.current_packet_id = ++(get_user_client()->current_packet_count);
 
     serializer_t serializer = {};
-    serializer.initialize(header.total_packet_size);
-    
-    serializer.serialize_packet_header(&header);
+    serializer.initialize(max_packet_size);
 
-    serializer.serialize_uint32(this_client.player_state_cbuffer.head_tail_difference);
+    // Header gets serialized at the end, once the size is known
+    serializer.grow_data_buffer(sizeof_packet_header());
 
-    uint32_t player_states_to_send = this_client.player_state_cbuffer.head_tail_difference;
+    bit_serializer_t input_bits = {};
+    input_bits.begin(&serializer);
+
+    input_bits.serialize_varint(player_states_to_send);
 
     player_state_t *state;
+    client_input_state_packet_t previous_input_packet = {};
     for (uint32_t i = 0; i < player_states_to_send; ++i) {
         state = this_client.player_state_cbuffer.get_next_item();
-        serializer.serialize_client_input_state_packet(state);
+
+        client_input_state_packet_t input_packet = {};
+        input_packet.action_flags = state->action_flags;
+        input_packet.mouse_x_diff = state->mouse_x_diff;
+        input_packet.mouse_y_diff = state->mouse_y_diff;
+        input_packet.flags_byte = state->flags_byte;
+        input_packet.dt = state->dt;
+        input_packet.command_id = state->current_state_count;
+
+        input_bits.serialize_client_input_state_packet(&input_packet, i ? &previous_input_packet : nullptr);
+        previous_input_packet = input_packet;
     }
 
+    s_mark_local_player_ticks_sent(header.current_tick, 0);
+
     player_state_t to_store = *state;
     to_store.ws_position = user->ws_position;
     to_store.ws_direction = user->ws_direction;
     to_store.tick = header.current_tick;
 
-    serializer.serialize_vector3(to_store.ws_position);
-    serializer.serialize_vector3(to_store.ws_direction);
+    for (uint32_t i = 0; i < 3; ++i) {
+        input_bits.serialize_fixed_point(to_store.ws_position[i], QUANTIZED_POSITION_SCALE);
+    }
+    input_bits.serialize_unit_vector(to_store.ws_direction);
+
+    input_bits.end(&serializer);
+
+    serializer.serialize_client_modified_chunks(chunks, modified_chunks_count);
 
-    serializer.serialize_client_modified_voxels_packet(&voxel_packet);
+    header.total_packet_size = serializer.data_buffer_head;
+    uint32_t packet_end = serializer.data_buffer_head;
+    serializer.data_buffer_head = 0;
+    serializer.serialize_packet_header(&header);
+    serializer.data_buffer_head = packet_end;
         
     serializer.send_serialized_message(connection.server_address);
 
@@ -233,6 +601,8 @@ static void s_send_commands_to_server_at_interval(float32_t dt) {
                 for (uint32_t i = 0; i < player_states_to_send; ++i) {
                     this_client.player_state_cbuffer.get_next_item();
                 }
+
+                s_mark_local_player_ticks_sent(*get_current_tick(), 1);
             }
 
             time_since_last_input_state = 0.0f;
@@ -252,16 +622,126 @@ struct client_data_base_t {
 
 static client_data_base_t data_base;
 
+
+// Adaptive playout delay for the remote players: render tick trails the latest snapshot by one snapshot interval
+// (need two snapshots to interpolate) + a margin for the jitter measured on the snapshot arrival times
+// Smoothed like RTP's interarrival jitter
+#define PLAYOUT_JITTER_SMOOTHING (1.0f / 16.0f)
+// Margin = multiple of the jitter
+#define PLAYOUT_JITTER_MARGIN 2.0f
+// In snapshot intervals
+#define PLAYOUT_MAX_DELAY 4.0f
+// Clock runs at most this much faster / slower to reach the target delay (doesn't look like the remote players accelerate)
+#define PLAYOUT_MAX_TIME_SCALE 0.05f
+// In snapshot intervals: clock jumps straight to the target if it's further away (joined, long stall)
+#define PLAYOUT_MAX_CLOCK_ERROR 4.0f
+
+struct playout_clock_t {
+    float64_t render_tick;
+    uint64_t latest_game_state_tick;
+    float32_t time_since_latest_snapshot;
+    // In seconds
+    float32_t jitter;
+};
+
+static playout_clock_t playout_clock;
+
+// In snapshot intervals
+static float32_t s_playout_delay(void) {
+    float32_t delay = 1.0f + PLAYOUT_JITTER_MARGIN * playout_clock.jitter * get_snapshot_server_rate();
+    return(MIN(delay, PLAYOUT_MAX_DELAY));
+}
+
+static void s_update_playout_clock(uint64_t game_state_tick) {
+    if (game_state_tick <= playout_clock.latest_game_state_tick) {
+        return;
+    }
+
+    if (playout_clock.latest_game_state_tick) {
+        float32_t expected_interval = (float32_t)(game_state_tick - playout_clock.latest_game_state_tick) / get_snapshot_server_rate();
+        float32_t deviation = fabs(playout_clock.time_since_latest_snapshot - expected_interval);
+        playout_clock.jitter += (deviation - playout_clock.jitter) * PLAYOUT_JITTER_SMOOTHING;
+    }
+    else {
+        playout_clock.render_tick = (float64_t)game_state_tick - (float64_t)s_playout_delay();
+    }
+
+    playout_clock.latest_game_state_tick = game_state_tick;
+    playout_clock.time_since_latest_snapshot = 0.0f;
+}
+
+static void s_tick_playout_clock(float32_t dt) {
+    if (!playout_clock.latest_game_state_tick) {
+        return;
+    }
+
+    playout_clock.time_since_latest_snapshot += dt;
+
+    float32_t elapsed_ticks = dt * get_snapshot_server_rate();
+    // Where the latest snapshot would be now if it arrived on time
+    float64_t target_tick = (float64_t)playout_clock.latest_game_state_tick + (float64_t)(playout_clock.time_since_latest_snapshot * get_snapshot_server_rate()) - (float64_t)s_playout_delay();
+    float32_t error = (float32_t)(target_tick - (playout_clock.render_tick + (float64_t)elapsed_ticks));
+
+    if (fabs(error) > PLAYOUT_MAX_CLOCK_ERROR) {
+        playout_clock.render_tick = target_tick;
+    }
+    else {
+        float32_t time_scale = 1.0f + MAX(MIN(error, 1.0f), -1.0f) * PLAYOUT_MAX_TIME_SCALE;
+        playout_clock.render_tick += (float64_t)(elapsed_ticks * time_scale);
+    }
+}
+
+float64_t get_remote_player_render_tick(void) {
+    return(playout_clock.render_tick);
+}
+
 static void s_handle_server_handshake(raw_input_t *raw_input, packet_header_t *header, serializer_t *in_serializer) {
     *get_current_tick() = header->current_tick;
+
+    // Ticks of the previous session mean nothing to this server
+    this_client.local_player_ticks.head = 0;
+    this_client.local_player_ticks.tail = 0;
+    this_client.local_player_ticks.head_tail_difference = 0;
                     
+    player_state_initialize_packet_t players[MAX_CLIENTS];
+    reused_chunk_t reused_chunks[MAX_CACHED_CHUNKS];
     game_state_initialize_packet_t game_state_init_packet = {};
+    game_state_init_packet.player = players;
+    game_state_init_packet.reused_chunks = reused_chunks;
     in_serializer->deserialize_game_state_initialize_packet(&game_state_init_packet);
+
+    // Cached chunks which the server has too don't get sent: they need to survive the reset of the game state (too big for the frame arena)
+    uint32_t chunk_voxel_count = CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH;
+    uint32_t chunk_count = (uint32_t)(get_chunk_grid_size() * get_chunk_grid_size() * get_chunk_grid_size());
+    uint8_t *reused_voxels = (uint8_t *)allocate_free_list(sizeof(uint8_t) * chunk_voxel_count * MAX(game_state_init_packet.reused_chunk_count, 1u));
+    for (uint32_t i = 0; i < game_state_init_packet.reused_chunk_count; ++i) {
+        if (game_state_init_packet.reused_chunks[i].chunk_index < chunk_count) {
+            chunk_t *chunk = *get_chunk((int32_t)game_state_init_packet.reused_chunks[i].chunk_index);
+            memcpy(reused_voxels + chunk_voxel_count * i, &chunk->voxels[0][0][0], sizeof(uint8_t) * chunk_voxel_count);
+        }
+    }
                     
     deinitialize_gamestate();
                     
     populate_gamestate(&game_state_init_packet, raw_input);
 
+    chunk_count = (uint32_t)(get_chunk_grid_size() * get_chunk_grid_size() * get_chunk_grid_size());
+    for (uint32_t i = 0; i < game_state_init_packet.reused_chunk_count; ++i) {
+        reused_chunk_t *reused = &game_state_init_packet.reused_chunks[i];
+        if (reused->chunk_index < chunk_count) {
+            chunk_t *chunk = *get_chunk((int32_t)reused->chunk_index);
+            memcpy(&chunk->voxels[0][0][0], reused_voxels + chunk_voxel_count * i, sizeof(uint8_t) * chunk_voxel_count);
+            chunk->version = reused->version;
+            ready_chunk_for_gpu_sync(chunk);
+        }
+    }
+    deallocate_free_list(reused_voxels);
+
+    // If some chunks still need to be received, the first hard update stops the meshes from getting updated until they all arrived
+    get_chunks_state_flags()->should_update_chunk_meshes_from_now = 1;
+
+    playout_clock = {};
+
     // Add client structs (indices of the structs on the server will be the same as on the client)
     data_base.client_count = game_state_init_packet.player_count;
 
@@ -274,10 +754,10 @@ static void s_handle_server_handshake(raw_input_t *raw_input, packet_header_t *h
         client->name = player->id.str;
         client->client_id = player_packet->client_id;
         client->player_handle = player->index;
+        client->last_game_state_tick = 0;
 
         if (client->client_id != game_state_init_packet.client_index) {
             player->network.is_remote = 1;
-            player->network.max_time = 1.0f / get_snapshot_server_rate();
         }
         else {
             this_client.user_client.name = player->id.str;
@@ -311,18 +791,32 @@ static void s_handle_chunk_voxel_hard_update(serializer_t *in_serializer) {
         flags->chunks_to_be_received = chunks_count.count;
     }
                     
-    uint32_t chunks_to_update = in_serializer->deserialize_uint32();
-    for (uint32_t i = 0; i < chunks_to_update; ++i) {
+    // Chunks may be split across several packets
+    uint32_t pieces_count = in_serializer->deserialize_uint32();
+    for (uint32_t i = 0; i < pieces_count; ++i) {
         voxel_chunk_values_packet_t packet = {};
         in_serializer->deserialize_voxel_chunk_values_packet(&packet);
                         
         chunk_t *chunk = *get_chunk(packet.chunk_coord_x, packet.chunk_coord_y, packet.chunk_coord_z);
-        memcpy(chunk->voxels, packet.voxels, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
 
-        ready_chunk_for_gpu_sync(chunk);
-    }
+        // Snapshots may already have brought the chunk to a more recent version: the voxels still need to be read
+        static uint8_t outdated_voxels[CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH];
+        bool is_outdated = packet.version < chunk->version;
+        uint8_t *dst = is_outdated ? outdated_voxels : &chunk->voxels[0][0][0];
+        in_serializer->deserialize_rle_voxels(dst + packet.first_voxel, packet.voxel_count);
 
-    flags->chunks_received_to_update_count += chunks_to_update;
+        if (packet.first_voxel + packet.voxel_count == CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH) {
+            if (!is_outdated) {
+                chunk->version = packet.version;
+                ready_chunk_for_gpu_sync(chunk);
+            }
+
+            // Chunks which got modified while the client was too far don't count (not part of the join)
+            if (!flags->should_update_chunk_meshes_from_now) {
+                ++flags->chunks_received_to_update_count;
+            }
+        }
+    }
 
     if (flags->chunks_received_to_update_count == flags->chunks_to_be_received) {
         flags->should_update_chunk_meshes_from_now = 1;
@@ -334,34 +828,15 @@ static void s_push_pending_modified_voxels(void) {
     chunk_t **chunks = get_modified_chunks(&modified_chunks_count);
     
     if (modified_chunks_count) {
-        local_client_voxel_modification_history_t *history_instance = this_client.vmod_history.push_item();
-        history_instance->tick = *get_current_tick();
-
-        history_instance->modified_chunks_count = modified_chunks_count;
-        
-        for (uint32_t chunk_index = 0; chunk_index < modified_chunks_count; ++chunk_index) {
-            chunk_t *chunk = chunks[chunk_index];
-            client_modified_chunk_nl_t *history_to_keep = &history_instance->modified_chunks[chunk_index];
-            
-            for (uint32_t voxel = 0; voxel < chunk->modified_voxels_list_count; ++voxel) {
-                uint16_t voxel_index = chunk->list_of_modified_voxels[voxel];
-                voxel_coordinate_t coord = convert_1d_to_3d_coord(voxel_index, CHUNK_EDGE_LENGTH);
-                
-                if (voxel < MAX_VOXELS_MODIFIED_PER_CHUNK) {
-                    history_to_keep->modified_voxels[voxel].x = coord.x;
-                    history_to_keep->modified_voxels[voxel].y = coord.y;
-                    history_to_keep->modified_voxels[voxel].z = coord.z;
-                    // Set it to the "previous" value so that revert is possible
-                    history_to_keep->modified_voxels[voxel].value = chunk->voxel_history[convert_3d_to_1d_index(coord.x, coord.y, coord.z, CHUNK_EDGE_LENGTH)];
-                }
-            }
-        }
+        s_push_voxel_modification_history(chunks, modified_chunks_count);
 
         clear_chunk_history();
     }
 }
 
 static void s_revert_voxels_against_modifications_until(uint64_t previous_tick) {
+    voxel_modification_log_t *log = &this_client.vmod_log;
+
     uint32_t current_history_instance_index = this_client.vmod_history.head;
     local_client_voxel_modification_history_t *instance = &this_client.vmod_history.buffer[current_history_instance_index];
 
@@ -373,14 +848,30 @@ static void s_revert_voxels_against_modifications_until(uint64_t previous_tick)
         
         instance = &this_client.vmod_history.buffer[current_history_instance_index];
 
-        for (uint32_t c = 0; c < instance->modified_chunks_count; ++c) {
-            client_modified_chunk_nl_t *modified_chunk = &instance->modified_chunks[c];
-            chunk_t *real_chunk = *get_chunk(modified_chunk->chunk_index);
-            
-            for (uint32_t v = 0 ; v < modified_chunk->modified_voxel_count; ++v) {
-                local_client_modified_voxel_t *vptr = &modified_chunk->modified_voxels[v];
-                // ->value = the "before" value of the voxel at tick
-                real_chunk->voxels[vptr->x][vptr->y][vptr->z] = vptr->value;
+        if (!log->is_valid(instance->log_start)) {
+            // Client terraformed more than the log can hold since then: the server's correction will fix the rest
+            output_to_debug_console("Voxel modification history got overwritten\n");
+
+            this_client.vmod_history.head_tail_difference = 0;
+            this_client.vmod_history.head = 0;
+            this_client.vmod_history.tail = 0;
+
+            break;
+        }
+
+        uint64_t position = instance->log_start;
+        uint32_t modified_chunks_count = log->read_varint(&position);
+
+        for (uint32_t c = 0; c < modified_chunks_count; ++c) {
+            chunk_t *real_chunk = *get_chunk(log->read_varint(&position));
+            uint32_t modified_voxel_count = log->read_varint(&position);
+
+            int32_t voxel_index = 0;
+            for (uint32_t v = 0 ; v < modified_voxel_count; ++v) {
+                voxel_index += log->read_signed_varint(&position);
+                voxel_coordinate_t coord = convert_1d_to_3d_coord((uint16_t)voxel_index, CHUNK_EDGE_LENGTH);
+                // Value = the "before" value of the voxel at tick
+                real_chunk->voxels[coord.x][coord.y][coord.z] = log->read_byte(&position);
             }
         }
 
@@ -397,50 +888,233 @@ static void s_revert_voxels_against_modifications_until(uint64_t previous_tick)
     }
 }
 
+static void s_send_game_state_acknowledgement(uint64_t game_state_tick) {
+    serializer_t serializer = {};
+    serializer.initialize(sizeof_packet_header() + sizeof(uint64_t));
+
+    player_t *user = get_user_player();
+    
+    packet_header_t header = {};
+    header.packet_mode = PM_CLIENT_MODE;
+    header.packet_type = CPT_ACKNOWLEDGED_GAME_STATE_RECEPTION;
+    header.total_packet_size = sizeof_packet_header() + sizeof(uint64_t);
+    header.current_tick = *get_current_tick();
+    header.client_id = user->network.client_state_index;
+    header.current_packet_id = ++(get_user_client()->current_packet_count);
+    
+    serializer.serialize_packet_header(&header);
+    serializer.serialize_uint64(game_state_tick);
+
+    serializer.send_serialized_message(connection.server_address);
+}
+
+// Snapshots are tagged with their game state tick: interpolation works across the snapshots that the server skipped (or that got lost)
+static void s_push_remote_player_snapshot(remote_client_t *rclient, player_t *player, remote_player_snapshot_t *snapshot, uint64_t game_state_tick) {
+    uint64_t skipped = game_state_tick - rclient->last_game_state_tick;
+
+    if (rclient->last_game_state_tick && game_state_tick > rclient->last_game_state_tick && skipped <= MAX_INTEREST_SEND_INTERVAL) {
+        // Players which are far get sent less often: they get rendered a bit further behind
+        player->network.snapshot_spacing = (float32_t)skipped;
+    }
+
+    snapshot->game_state_tick = game_state_tick;
+    player->network.remote_player_states.push_item(snapshot);
+
+    rclient->last_game_state_tick = game_state_tick;
+    rclient->last_snapshot = *snapshot;
+}
+
+// Server keeps sending the changes of a chunk until this client acknowledges them: drop the ones which were already received
+// Returns false if changes of a chunk can't be applied yet (whole chunk is still on its way): the game state can't be acknowledged
+static bool s_drop_received_chunk_versions(game_snapshot_voxel_delta_packet_t *voxel_delta) {
+    bool can_acknowledge = 1;
+    uint32_t kept_count = 0;
+    
+    for (uint32_t i = 0; i < voxel_delta->modified_count; ++i) {
+        modified_chunk_t *modified_chunk = &voxel_delta->modified_chunks[i];
+        chunk_t *chunk = *get_chunk(modified_chunk->chunk_index);
+
+        if (chunk->version < modified_chunk->base_version) {
+            can_acknowledge = 0;
+        }
+        else if (chunk->version < modified_chunk->version) {
+            chunk->version = modified_chunk->version;
+            voxel_delta->modified_chunks[kept_count++] = *modified_chunk;
+        }
+    }
+
+    voxel_delta->modified_count = kept_count;
+
+    return(can_acknowledge);
+}
+
+static void s_send_chunks_request(uint32_t chunk_count, uint16_t *chunk_indices) {
+    chunks_request_packet_t request = {};
+    request.chunk_count = chunk_count;
+    request.chunk_indices = chunk_indices;
+
+    packet_header_t header = {};
+    header.packet_mode = PM_CLIENT_MODE;
+    header.packet_type = CPT_CHUNKS_REQUEST;
+    header.total_packet_size = sizeof_packet_header() + sizeof(uint32_t) + sizeof(uint16_t) * chunk_count;
+    header.current_tick = *get_current_tick();
+    header.client_id = get_user_player()->network.client_state_index;
+    header.current_packet_id = ++(get_user_client()->current_packet_count);
+
+    serializer_t serializer = {};
+    serializer.initialize(header.total_packet_size);
+    serializer.serialize_packet_header(&header);
+    serializer.serialize_chunks_request_packet(&request);
+
+    // If it gets lost, the chunks will just get requested again the next time they get verified
+    serializer.send_serialized_message(connection.server_address);
+}
+
+// Chunks which don't hash to what the server has at the same version got out of sync: they get requested entirely
+static void s_verify_chunk_hashes(game_snapshot_voxel_delta_packet_t *voxel_delta, client_modified_voxels_packet_t *local_modifications) {
+    // Chunks of the join are still on their way
+    if (!get_chunks_state_flags()->should_update_chunk_meshes_from_now) {
+        return;
+    }
+
+    uint16_t mismatched_chunks[MAX_CHUNK_HASHES_PER_SNAPSHOT];
+    uint32_t mismatched_count = 0;
+
+    uint32_t chunk_count = (uint32_t)(get_chunk_grid_size() * get_chunk_grid_size() * get_chunk_grid_size());
+    uint32_t hash_count = MIN(voxel_delta->chunk_hash_count, (uint32_t)MAX_CHUNK_HASHES_PER_SNAPSHOT);
+    for (uint32_t i = 0; i < hash_count; ++i) {
+        chunk_hash_t *chunk_hash = &voxel_delta->chunk_hashes[i];
+        if (chunk_hash->chunk_index >= chunk_count) {
+            continue;
+        }
+
+        chunk_t *chunk = *get_chunk((int32_t)chunk_hash->chunk_index);
+        // Can only compare the same versions, and chunks which the local player is modifying are still being predicted
+        bool can_compare = chunk->version == chunk_hash->version && !chunk->added_to_history;
+        for (uint32_t modified = 0; modified < local_modifications->modified_chunk_count && can_compare; ++modified) {
+            can_compare = local_modifications->modified_chunks[modified].chunk_index != chunk_hash->chunk_index;
+        }
+
+        if (can_compare) {
+            chunk->compute_hash();
+            if (chunk->hash != chunk_hash->hash) {
+                mismatched_chunks[mismatched_count++] = chunk_hash->chunk_index;
+            }
+        }
+    }
+
+    if (mismatched_count) {
+        s_send_chunks_request(mismatched_count, mismatched_chunks);
+    }
+}
+
+// Copy voxel data to client_t struct
+// Voxel correction gets deferred to update_chunks_from_network if the flag need to do voxel correction is 1
+static void s_store_received_modified_voxels(client_modified_voxels_packet_t *modified_voxels) {
+    client_t *client = &this_client.user_client;
+    client->clear_modified_chunks();
+    for (uint32_t i = 0; i < modified_voxels->modified_chunk_count; ++i) {
+        client_modified_chunk_t *received_chunk = &modified_voxels->modified_chunks[i];
+        client_modified_chunk_nl_t *chunk = client->add_modified_chunk(received_chunk->chunk_index, received_chunk->modified_voxel_count);
+        if (!chunk) {
+            break;
+        }
+
+        if (received_chunk->modified_voxel_count) {
+            chunk->modified_voxel_count = received_chunk->modified_voxel_count;
+            memcpy(chunk->modified_voxels, received_chunk->modified_voxels, sizeof(local_client_modified_voxel_t) * chunk->modified_voxel_count);
+        }
+    }
+}
+
 static void s_handle_game_state_snapshot(serializer_t *in_serializer) {
-    linear_allocator_t *voxel_allocator = get_voxel_linear_allocator();
-    reset_voxel_interpolation();
-    in_serializer->deserialize_game_snapshot_voxel_delta_packet(get_previous_voxel_delta_packet(), voxel_allocator);
+    uint64_t game_state_tick = in_serializer->deserialize_uint64();
+    uint64_t baseline_tick = in_serializer->deserialize_uint64();
+
+    game_state_baseline_t *baseline = this_client.received_game_states.get(baseline_tick);
 
+    s_update_playout_clock(game_state_tick);
+    
+    // Section specific to this client comes first
     // Put this in the history - VERY IMPORTANT IF NEED TO REVERT VOXELS
     uint64_t previous_tick = in_serializer->deserialize_uint64();
 
+    client_modified_chunk_t modified_chunks[MAX_CHUNKS_MODIFIED_PER_SNAPSHOT];
     client_modified_voxels_packet_t modified_voxels = {};
-    in_serializer->deserialize_client_modified_voxels_packet(&modified_voxels);
+    modified_voxels.modified_chunks = modified_chunks;
+    in_serializer->deserialize_client_modified_voxels_packet(&modified_voxels, MAX_CHUNKS_MODIFIED_PER_SNAPSHOT);
+
+    // Correction flags for the local player (not in the shared part of the snapshot)
+    uint8_t local_player_flags = in_serializer->deserialize_uint8();
+
+    // Then the part which is the same for all clients
+    linear_allocator_t *voxel_allocator = get_voxel_linear_allocator();
+    reset_voxel_interpolation();
+    in_serializer->deserialize_game_snapshot_voxel_delta_packet(get_previous_voxel_delta_packet(), voxel_allocator);
+    bool can_acknowledge = s_drop_received_chunk_versions(get_previous_voxel_delta_packet());
+    s_verify_chunk_hashes(get_previous_voxel_delta_packet(), &modified_voxels);
+
+    if (baseline_tick && !baseline) {
+        // Can't decode the player snapshots (server will eventually send the whole state), the rest of the snapshot still applies
+        game_snapshot_player_state_packet_t local_player_state = {};
+        local_player_state.flags = local_player_flags;
+        if (!local_player_state.is_to_ignore && !local_player_state.need_to_do_correction) {
+            this_client.user_client.previous_client_tick = previous_tick;
+            s_store_received_modified_voxels(&modified_voxels);
+        }
+
+        // Game state doesn't get acknowledged: server can't use it as a baseline
+        return;
+    }
+
+    // Players are bit packed
+    bit_serializer_t player_bits = {};
+    player_bits.begin(in_serializer);
+
+    game_state_baseline_t *current_game_state = this_client.received_game_states.push(game_state_tick);
+    current_game_state->player_count = MIN((uint32_t)player_bits.deserialize_varint(), (uint32_t)MAX_CLIENTS);
+
+    bool is_corrupted = 0;
+    for (uint32_t i = 0; i < current_game_state->player_count; ++i) {
+        quantized_player_snapshot_t *quantized_player = &current_game_state->players[i];
+        quantized_player->client_id = (uint16_t)player_bits.deserialize_varint();
+        player_bits.deserialize_player_snapshot_delta(quantized_player, baseline ? baseline->find_player(quantized_player->client_id) : nullptr);
+
+        if (quantized_player->client_id >= MAX_CLIENTS) {
+            is_corrupted = 1;
+            break;
+        }
+    }
+
+    // Truncated / corrupted: can't be used as a baseline, and none of the players get updated
+    if (is_corrupted || player_bits.overflowed) {
+        output_to_debug_console("Dropped corrupted snapshot ", (int32_t)game_state_tick, "\n");
+        current_game_state->game_state_tick = 0;
+        return;
+    }
+
+    for (uint32_t i = 0; i < current_game_state->player_count; ++i) {
+        quantized_player_snapshot_t *quantized_player = &current_game_state->players[i];
 
-    for (uint32_t i = 0; i < data_base.client_count; ++i) {
         // This is the player state to compare with what the server sent
         game_snapshot_player_state_packet_t player_snapshot_packet = {};
-        in_serializer->deserialize_game_snapshot_player_state_packet(&player_snapshot_packet);
+        dequantize_player_snapshot(quantized_player, &player_snapshot_packet);
 
         remote_client_t *rclient = &data_base.clients[player_snapshot_packet.client_id];
         player_t *current_player = get_player(rclient->player_handle);
 
         player_t *local_user = get_user_player();
 
+        if (local_user->network.client_state_index == player_snapshot_packet.client_id) {
+            player_snapshot_packet.flags = local_player_flags;
+        }
+
         // We are dealing with the local client: we need to deal with the correction stuff
         if (local_user->network.client_state_index == player_snapshot_packet.client_id && !player_snapshot_packet.is_to_ignore) {
             client_t *client = &this_client.user_client;
                             
             client->previous_client_tick = previous_tick;
                             
-            if (player_snapshot_packet.need_to_do_correction) {
-                // Do correction here
-                // TODO: THIS NEEDS TO HAPPEN IN UPDATE_NETWORK_COMPONENT() WHEN THE VOXEL CORRECTIONS HAPPEN
-                player_t *player = get_user_player();
-                player->ws_position = player_snapshot_packet.ws_position;
-                player->ws_direction = player_snapshot_packet.ws_direction;
-
-                output_to_debug_console("position: ", player->ws_position, " direction: ", player->ws_direction, "\n");
-
-                player->ws_velocity = player_snapshot_packet.ws_velocity;
-                player->camera.ws_next_vector = player->camera.ws_current_up_vector = player->ws_up = player_snapshot_packet.ws_up_vector;
-                player->physics.state = (entity_physics_state_t)player_snapshot_packet.physics_state;
-                player->physics.previous_velocity = player_snapshot_packet.ws_previous_velocity;
-                player->physics.axes = vector3_t(0);
-                player->action_flags = 0;
-            }
-
             if (player_snapshot_packet.need_to_do_correction) {
                 if (player_snapshot_packet.need_to_do_voxel_correction) {
                     // Step 1: Push pending voxel modifications
@@ -465,44 +1139,34 @@ static void s_handle_game_state_snapshot(serializer_t *in_serializer) {
                             }
                         }
                     }
-
-                    *get_current_tick() = previous_tick;
-                    client->just_received_correction = 1;
                 }
-                else {
-                    // Send a prediction error correction packet
-                    *get_current_tick() = previous_tick;
-                    client->just_received_correction = 1;
-                }
-            }
 
-            // Copy voxel data to client_t struct
-            // Voxel correction gets deferred to update_chunks_from_network if the flag need to do voxel correction is 1
-            client->modified_chunks_count = modified_voxels.modified_chunk_count;
-            for (uint32_t i = 0; i < client->modified_chunks_count; ++i) {
-                client_modified_chunk_nl_t *chunk = &client->previous_received_voxel_modifications[i];
-                chunk->chunk_index = modified_voxels.modified_chunks[i].chunk_index;
-                chunk->modified_voxel_count = modified_voxels.modified_chunks[i].modified_voxel_count;
-                for (uint32_t voxel = 0; voxel < chunk->modified_voxel_count; ++voxel) {
-                    chunk->modified_voxels[voxel].x = modified_voxels.modified_chunks[i].modified_voxels[voxel].x;
-                    chunk->modified_voxels[voxel].y = modified_voxels.modified_chunks[i].modified_voxels[voxel].y;
-                    chunk->modified_voxels[voxel].z = modified_voxels.modified_chunks[i].modified_voxels[voxel].z;
-                    chunk->modified_voxels[voxel].value = modified_voxels.modified_chunks[i].modified_voxels[voxel].value;
-                }
+                // Player gets resimulated on top of the corrected voxels: stays at the current tick
+                s_rollback_and_replay_local_player(get_user_player(), &player_snapshot_packet, previous_tick);
+
+                // Next input state packet tells the server that its predictions can be checked again
+                client->just_received_correction = 1;
             }
+
+            s_store_received_modified_voxels(&modified_voxels);
         }
         // We are dealing with a remote client: we need to deal with entity interpolation stuff
         else {
             remote_player_snapshot_t remote_player_snapshot = {};
             remote_player_snapshot.ws_position = player_snapshot_packet.ws_position;
+            remote_player_snapshot.ws_velocity = player_snapshot_packet.ws_velocity;
             remote_player_snapshot.ws_direction = player_snapshot_packet.ws_direction;
             remote_player_snapshot.ws_rotation = player_snapshot_packet.ws_rotation;
             remote_player_snapshot.action_flags = player_snapshot_packet.action_flags;
             remote_player_snapshot.rolling_mode = player_snapshot_packet.is_rolling;
             remote_player_snapshot.ws_up_vector = player_snapshot_packet.ws_up_vector;
-            current_player->network.remote_player_states.push_item(&remote_player_snapshot);
+            s_push_remote_player_snapshot(rclient, current_player, &remote_player_snapshot, game_state_tick);
         }
-    }    
+    }
+
+    if (can_acknowledge) {
+        s_send_game_state_acknowledgement(game_state_tick);
+    }
 }
 
 static void s_handle_new_client_joined(serializer_t *in_serializer) {
@@ -525,39 +1189,55 @@ static void s_handle_new_client_joined(serializer_t *in_serializer) {
         rclient->name = player->id.str;
         rclient->client_id = new_client_init_packet.client_id;
         rclient->player_handle = player->index;
+        rclient->last_game_state_tick = 0;
 
         player->network.is_remote = 1;
-        player->network.max_time = 1.0f / get_snapshot_server_rate();
 
         console_out(rclient->name, " joined the game!\n");
     }
 }
 
 
+static void s_handle_received_packet(char *message, uint32_t message_size, network_address_t address, void *data) {
+    raw_input_t *raw_input = (raw_input_t *)data;
+
+    serializer_t in_serializer = {};
+    in_serializer.data_buffer = (uint8_t *)message;
+    in_serializer.data_buffer_size = message_size;
+
+    packet_header_t header = {};
+    in_serializer.deserialize_packet_header(&header);
+
+    if (header.packet_mode == packet_mode_t::PM_SERVER_MODE) {
+        switch(header.packet_type) {
+        case server_packet_type_t::SPT_SERVER_HANDSHAKE: { s_handle_server_handshake(raw_input, &header, &in_serializer); } break;
+        case server_packet_type_t::SPT_CHUNK_VOXELS_HARD_UPDATE: { s_handle_chunk_voxel_hard_update(&in_serializer); } break;
+        case server_packet_type_t::SPT_GAME_STATE_SNAPSHOT: { s_handle_game_state_snapshot(&in_serializer); } break;
+        case server_packet_type_t::SPT_CLIENT_JOINED: { s_handle_new_client_joined(&in_serializer); } break;
+        }
+    }
+}
+
+
 void tick_client(raw_input_t *raw_input, float32_t dt) {
     s_simulate_packet_loss(raw_input);
     s_send_commands_to_server_at_interval(dt);
+    s_tick_playout_clock(dt);
     
-    network_address_t received_address = {};
-    bool received = receive_from(message_buffer, sizeof(char) * MAX_MESSAGE_BUFFER_SIZE, &received_address);
-
-    if (received) {
-        serializer_t in_serializer = {};
-        in_serializer.data_buffer = (uint8_t *)message_buffer;
-        in_serializer.data_buffer_size = MAX_MESSAGE_BUFFER_SIZE;
+    // Messages which were fragmented need all their datagrams
+    for (uint32_t i = 0; i < MAX_RECEIVED_DATAGRAMS_PER_TICK; ++i) {
+        network_address_t received_address = {};
+        int32_t bytes_received = receive_from(message_buffer, sizeof(char) * MAX_MESSAGE_BUFFER_SIZE, &received_address);
 
-        packet_header_t header = {};
-        in_serializer.deserialize_packet_header(&header);
-
-        if (header.packet_mode == packet_mode_t::PM_SERVER_MODE) {
-            switch(header.packet_type) {
-            case server_packet_type_t::SPT_SERVER_HANDSHAKE: { s_handle_server_handshake(raw_input, &header, &in_serializer); } break;
-            case server_packet_type_t::SPT_CHUNK_VOXELS_HARD_UPDATE: { s_handle_chunk_voxel_hard_update(&in_serializer); } break;
-            case server_packet_type_t::SPT_GAME_STATE_SNAPSHOT: { s_handle_game_state_snapshot(&in_serializer); } break;
-            case server_packet_type_t::SPT_CLIENT_JOINED: { s_handle_new_client_joined(&in_serializer); } break;
-            }
+        if (bytes_received <= 0) {
+            break;
         }
+
+        receive_channel_datagram((uint8_t *)message_buffer, (uint32_t)bytes_received, received_address, &s_handle_received_packet, raw_input);
     }
+
+    // Acknowledgements and resends
+    tick_net_channels(dt);
 }
 
 
@@ -568,6 +1248,7 @@ void cache_player_state(float32_t dt) {
     player_state.current_state_count = (get_current_player_state_count())++;
 
     this_client.player_state_cbuffer.push_item(&player_state);
+    s_push_local_player_tick(user, &player_state);
 }
 
 
@@ -599,6 +1280,16 @@ client_t *get_user_client(void) {
 }
 
 
+// Server only sends the chunks which are different from the ones that the client has
+static void s_fill_join_packet_with_cached_chunks(client_join_packet_t *packet) {
+    // Only needs to live until the join packet is serialized
+    static cached_chunk_t cached_chunks[MAX_CACHED_CHUNKS];
+
+    packet->cached_grid_edge_size = (uint8_t)get_chunk_grid_size();
+    packet->cached_chunks = cached_chunks;
+    packet->cached_chunk_count = gather_cached_chunks(packet->cached_chunks, MAX_CACHED_CHUNKS);
+}
+
 void join_server(const char *ip_address, const char *client_name) {
     packet_header_t header = {};
     client_join_packet_t packet = {};
@@ -607,8 +1298,9 @@ void join_server(const char *ip_address, const char *client_name) {
         header.packet_type = client_packet_type_t::CPT_CLIENT_JOIN;
         packet.client_name = client_name;
     }
+    s_fill_join_packet_with_cached_chunks(&packet);
     header.total_packet_size = sizeof_packet_header();
-    header.total_packet_size += (uint32_t)strlen(packet.client_name) + 1;
+    header.total_packet_size += sizeof_client_join_packet(&packet);
 
     header.client_id = 0xFFFF;
 
@@ -620,7 +1312,9 @@ void join_server(const char *ip_address, const char *client_name) {
     serializer.serialize_client_join_packet(&packet);
     
     connection.server_address = network_address_t{ (uint16_t)host_to_network_byte_order(GAME_OUTPUT_PORT_SERVER), str_to_ipv4_int32(ip_address) };
-    serializer.send_serialized_message(connection.server_address);
+    // Start a new session with the server
+    remove_net_channel(connection.server_address);
+    serializer.send_serialized_message(connection.server_address, CT_RELIABLE_ORDERED);
 }
 
 static void s_join_loop_back(uint32_t client_index /* Will be the client name */) {
@@ -636,8 +1330,9 @@ static void s_join_loop_back(uint32_t client_index /* Will be the client name */
         header.packet_type = client_packet_type_t::CPT_CLIENT_JOIN;
         packet.client_name = client_name;
     }
+    s_fill_join_packet_with_cached_chunks(&packet);
     header.total_packet_size = sizeof_packet_header();
-    header.total_packet_size += (uint32_t)strlen(packet.client_name) + 1;
+    header.total_packet_size += sizeof_client_join_packet(&packet);
     header.current_packet_id = get_user_client()->current_packet_count = 0;
 
     header.client_id = 0xFFFF;
@@ -649,7 +1344,9 @@ static void s_join_loop_back(uint32_t client_index /* Will be the client name */
     serializer.serialize_client_join_packet(&packet);
     
     connection.server_address = network_address_t{ (uint16_t)host_to_network_byte_order(GAME_OUTPUT_PORT_SERVER), str_to_ipv4_int32(ip_address) };
-    serializer.send_serialized_message(connection.server_address);
+    // Start a new session with the server
+    remove_net_channel(connection.server_address);
+    serializer.send_serialized_message(connection.server_address, CT_RELIABLE_ORDERED);
 }
 
 static int32_t s_lua_join_server(lua_State *state) {
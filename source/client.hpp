@@ -21,15 +21,17 @@ struct local_client_modified_voxel_t {
 };
 
 
-#define MAX_VOXELS_MODIFIED_PER_CHUNK 100
-
 struct client_modified_chunk_nl_t {
     uint16_t chunk_index;
-    // TODO: Find way to vary this: maybe have its own linear allocator or something
-    local_client_modified_voxel_t modified_voxels[MAX_VOXELS_MODIFIED_PER_CHUNK]; // max 100
+    // Lives in the voxel modification arena of the client: only as big as what the client actually modified
+    local_client_modified_voxel_t *modified_voxels;
     uint32_t modified_voxel_count;
+    uint32_t max_voxel_count;
 };
 
+#define MAX_CHUNKS_MODIFIED_PER_SNAPSHOT 64
+#define INITIAL_VOXEL_MODIFICATION_ARENA_SIZE 1024
+
 
 struct client_t {
     // Name, id, etc...
@@ -54,11 +56,18 @@ struct client_t {
     // Client will most likely only ever be able to terraform 4 chunks per action flag packet
     uint32_t modified_chunks_count = 0;
     // Accumulates for every action flag packet
-    // Check if 30 is necessary
-    client_modified_chunk_nl_t previous_received_voxel_modifications[30];
+    client_modified_chunk_nl_t previous_received_voxel_modifications[MAX_CHUNKS_MODIFIED_PER_SNAPSHOT];
+
+    // Voxels of previous_received_voxel_modifications (cleared with them, grows if the client terraforms a lot in between two snapshots)
+    local_client_modified_voxel_t *voxel_modification_arena = nullptr;
+    uint32_t voxel_modification_arena_size = 0;
+    uint32_t voxel_modification_arena_used = 0;
 
     bool received_input_commands = 0;
 
+    // Latest game state that the client acknowledged (baseline for the delta compression of the snapshots, 0 = none)
+    uint64_t acknowledged_game_state_tick = 0;
+
     bool just_received_correction = 0;
     uint32_t last_received_correction_packet_count = 0;
 
@@ -66,6 +75,16 @@ struct client_t {
     bool needs_to_acknowledge_prediction_error = 0;
     bool needs_to_do_voxel_correction = 0;
     bool did_voxel_correction = 0;
+
+    // Server only: bots just send input, the server's state is always the right one
+    bool is_bot = 0;
+
+    // Returns nullptr if the client already modified MAX_CHUNKS_MODIFIED_PER_SNAPSHOT chunks
+    client_modified_chunk_nl_t *add_modified_chunk(uint16_t chunk_index, uint32_t voxel_count);
+    // Returns the new voxel (at the end of the chunk's list): moves the list to the end of the arena if it is full
+    local_client_modified_voxel_t *add_modified_voxel(client_modified_chunk_nl_t *chunk);
+    void clear_modified_chunks(void);
+    void deinitialize_voxel_modification_arena(void);
 };
 
 
@@ -73,6 +92,9 @@ void initialize_client(char *message_buffer, event_dispatcher_t *dispatcher);
 void deinitialize_client();
 void tick_client(raw_input_t *raw_input, float32_t dt);
 
+// (Fractional) game state tick at which remote players get rendered: trails the latest snapshot by as little as the snapshot jitter allows
+float64_t get_remote_player_render_tick(void);
+
 
 // Replace this with an event
 void cache_player_state(float32_t dt);
@@ -5,6 +5,7 @@
 #include "chunks_gstate.hpp"
 #include "entities_gstate.hpp"
 #include "particles_gstate.hpp"
+#include "net.hpp"
 #include <glm/gtx/projection.hpp>
 
 // Physics
@@ -272,16 +273,18 @@ void terraform_power_component_t::tick(player_t *affected_player, float32_t dt)
 
 
 // Camera
+void camera_component_t::tick_up_vector(float32_t dt) {
+    vector3_t diff_vector = ws_next_vector - ws_current_up_vector;
+    if (glm::dot(diff_vector, diff_vector) > 0.0001f) {
+        ws_current_up_vector = glm::normalize(ws_current_up_vector + diff_vector * dt * 3.0f);
+    }
+}
+
 void camera_component_t::tick(player_t *affected_player, float32_t dt) {
     camera_t *camera_ptr = get_camera(camera);
 
+    tick_up_vector(dt);
     vector3_t up = ws_current_up_vector;
-
-    vector3_t diff_vector = ws_next_vector - ws_current_up_vector;
-    if (glm::dot(diff_vector, diff_vector) > 0.0001f) {
-        up = glm::normalize(ws_current_up_vector + diff_vector * dt * 3.0f);
-        ws_current_up_vector = up;
-    }
         
     vector3_t camera_position = affected_player->ws_position + affected_player->size.x * up;
     if (is_third_person) {
@@ -382,8 +385,23 @@ void animation_component_t::tick(player_t *affected_player, float32_t dt) {
         affected_player->animated_state = new_state;
         switch_to_cycle(&animation_instance, new_state);
     }
-        
-    interpolate_skeleton_joints_into_instance(dt, &animation_instance);
+
+    accumulated_dt += dt;
+
+    // Off screen or skipped because of LOD - just keep track of the time
+    if (!is_visible) {
+        return;
+    }
+
+    if (frames_until_update > 0) {
+        --frames_until_update;
+        return;
+    }
+
+    interpolate_skeleton_joints_into_instance(accumulated_dt, &animation_instance);
+
+    accumulated_dt = 0.0f;
+    frames_until_update = update_interval - 1;
 }
 
 
@@ -493,11 +511,9 @@ void shoot_component_t::tick(player_t *affected_player, float32_t dt) {
 
 // Burnable
 void burnable_component_t::tick(bullet_t *affected_bullet, float32_t dt) {
-    if (burning) {
-        // Particle stuff
-        particle_t *fire_particle = get_fire_particle(particle_index);
-
-        fire_particle->ws_position = affected_bullet->ws_position;
+    // Fire spawner might have been full
+    if (burning && particle_index >= 0) {
+        set_fire_position(particle_index, affected_bullet->ws_position);
     }
 }
 
@@ -507,55 +523,78 @@ void burnable_component_t::set_on_fire(const vector3_t &position) {
 }
 
 void burnable_component_t::extinguish_fire(void) {
+    if (burning && particle_index >= 0) {
+        declare_fire_dead(particle_index);
+    }
     burning = 0;
-    declare_fire_dead(particle_index);
-    particle_index = 0;
+    particle_index = -1;
 }
 
 
 // Network
+// Remote players never get extrapolated further than this past their latest snapshot (snapshot lost / late)
+#define MAX_REMOTE_PLAYER_EXTRAPOLATION_TIME 0.1f
+// Remote player's render delay changes by at most this many ticks per tick
+#define REMOTE_PLAYER_DELAY_ADJUSTMENT_SPEED 0.25f
+
+static remote_player_snapshot_t *s_get_remote_player_snapshot(circular_buffer_t<remote_player_snapshot_t> *states, uint32_t offset_from_tail) {
+    return(&states->buffer[(states->tail + offset_from_tail) % states->buffer_size]);
+}
+
+static void s_apply_remote_player_snapshot(player_t *affected_player, remote_player_snapshot_t *snapshot) {
+    affected_player->ws_position = snapshot->ws_position;
+    affected_player->ws_direction = snapshot->ws_direction;
+    affected_player->ws_rotation = snapshot->ws_rotation;
+    affected_player->camera.ws_next_vector = affected_player->ws_up = snapshot->ws_up_vector;
+}
+
 float32_t network_component_t::tick(player_t *affected_player, float32_t dt) {
     if (is_remote) {
-        if (remote_player_states.head_tail_difference >= 3) {
-            uint32_t previous_snapshot_index = remote_player_states.tail;
-            uint32_t next_snapshot_index = remote_player_states.tail;
-            if (++next_snapshot_index == remote_player_states.buffer_size) {
-                next_snapshot_index = 0;
-            }
-        
-            elapsed_time += dt;
-            float32_t progression = elapsed_time / max_time;
+        if (remote_player_states.head_tail_difference) {
+            float32_t snapshot_interval = 1.0f / get_snapshot_server_rate();
 
-            if (progression >= 1.0f) {
-                elapsed_time = elapsed_time - max_time;
-                remote_player_states.get_next_item();
+            float32_t target_render_delay = snapshot_spacing - 1.0f;
+            float32_t max_delay_adjustment = REMOTE_PLAYER_DELAY_ADJUSTMENT_SPEED * dt / snapshot_interval;
+            render_delay += MAX(MIN(target_render_delay - render_delay, max_delay_adjustment), -max_delay_adjustment);
 
-                previous_snapshot_index = remote_player_states.tail;
-                next_snapshot_index = remote_player_states.tail;
-                if (++next_snapshot_index == remote_player_states.buffer_size) {
-                    next_snapshot_index = 0;
-                }
+            float64_t render_tick = get_remote_player_render_tick() - (float64_t)render_delay;
 
-                progression -= 1.0f;
+            // Drop the snapshots which the render tick went past (keeps the latest one to extrapolate from)
+            while (remote_player_states.head_tail_difference >= 2 && (float64_t)s_get_remote_player_snapshot(&remote_player_states, 1)->game_state_tick <= render_tick) {
+                remote_player_states.get_next_item();
             }
 
-            remote_player_snapshot_t *previous_remote_snapshot = &remote_player_states.buffer[previous_snapshot_index],
-                *next_remote_snapshot = &remote_player_states.buffer[next_snapshot_index];
+            remote_player_snapshot_t *previous_remote_snapshot = s_get_remote_player_snapshot(&remote_player_states, 0);
 
-            affected_player->ws_position = interpolate(previous_remote_snapshot->ws_position, next_remote_snapshot->ws_position, progression);
-            affected_player->ws_direction = interpolate(previous_remote_snapshot->ws_direction, next_remote_snapshot->ws_direction, progression);
-            affected_player->ws_rotation = glm::mix(previous_remote_snapshot->ws_rotation, next_remote_snapshot->ws_rotation, progression);
-            affected_player->camera.ws_next_vector = affected_player->ws_up = interpolate(previous_remote_snapshot->ws_up_vector, next_remote_snapshot->ws_up_vector, progression);
-
-            if (true) {
-                affected_player->action_flags = previous_remote_snapshot->action_flags;
-                affected_player->rolling_mode = previous_remote_snapshot->rolling_mode;
+            if (render_tick <= (float64_t)previous_remote_snapshot->game_state_tick) {
+                // Render tick hasn't reached the first snapshot yet
+                s_apply_remote_player_snapshot(affected_player, previous_remote_snapshot);
+            }
+            else if (remote_player_states.head_tail_difference >= 2) {
+                remote_player_snapshot_t *next_remote_snapshot = s_get_remote_player_snapshot(&remote_player_states, 1);
+
+                float32_t tick_count = (float32_t)(next_remote_snapshot->game_state_tick - previous_remote_snapshot->game_state_tick);
+                float32_t progression = (float32_t)(render_tick - (float64_t)previous_remote_snapshot->game_state_tick) / tick_count;
+
+                affected_player->ws_position = interpolate_hermite(previous_remote_snapshot->ws_position, previous_remote_snapshot->ws_velocity,
+                                                                   next_remote_snapshot->ws_position, next_remote_snapshot->ws_velocity,
+                                                                   tick_count * snapshot_interval, progression);
+                affected_player->ws_direction = interpolate(previous_remote_snapshot->ws_direction, next_remote_snapshot->ws_direction, progression);
+                affected_player->ws_rotation = glm::mix(previous_remote_snapshot->ws_rotation, next_remote_snapshot->ws_rotation, progression);
+                affected_player->camera.ws_next_vector = affected_player->ws_up = interpolate(previous_remote_snapshot->ws_up_vector, next_remote_snapshot->ws_up_vector, progression);
             }
             else {
-                affected_player->action_flags = next_remote_snapshot->action_flags;
-                affected_player->rolling_mode = next_remote_snapshot->rolling_mode;
+                // Next snapshot is late or got lost: keep going with the last known velocity for a little bit
+                float32_t extrapolation_time = (float32_t)(render_tick - (float64_t)previous_remote_snapshot->game_state_tick) * snapshot_interval;
+                extrapolation_time = MIN(extrapolation_time, MAX_REMOTE_PLAYER_EXTRAPOLATION_TIME);
+
+                s_apply_remote_player_snapshot(affected_player, previous_remote_snapshot);
+                affected_player->ws_position += previous_remote_snapshot->ws_velocity * extrapolation_time;
             }
 
+            affected_player->action_flags = previous_remote_snapshot->action_flags;
+            affected_player->rolling_mode = previous_remote_snapshot->rolling_mode;
+
             affected_player->rolling_rotation = glm::mat4_cast(affected_player->ws_rotation);
         }
     }
@@ -573,40 +612,42 @@ float32_t network_component_t::tick(player_t *affected_player, float32_t dt) {
             output_to_debug_console("direction: ", affected_player->ws_direction, "\n");
             output_to_debug_console("velocity: ",  affected_player->ws_velocity, "\n");
             
-            float32_t dt = player_state->dt;
+            return(apply_player_state(affected_player, player_state));
+        }
+    }
+    
+    return(-1.0f);
+}
 
-            player_state_t *next_player_state = player_state;
+float32_t network_component_t::apply_player_state(player_t *affected_player, player_state_t *player_state) {
+    float32_t dt = player_state->dt;
 
-            affected_player->action_flags = next_player_state->action_flags;
-            affected_player->previous_action_flags = affected_player->action_flags;
-            affected_player->rolling_mode = next_player_state->rolling_mode;
+    affected_player->action_flags = player_state->action_flags;
+    affected_player->previous_action_flags = affected_player->action_flags;
+    affected_player->rolling_mode = player_state->rolling_mode;
 
-            // Update view direction with mouse differences
-            vector3_t up = affected_player->camera.ws_current_up_vector;
+    // Update view direction with mouse differences
+    vector3_t up = affected_player->camera.ws_current_up_vector;
         
-            vector3_t res = affected_player->ws_direction;
-            vector2_t d = vector2_t(next_player_state->mouse_x_diff, next_player_state->mouse_y_diff);
+    vector3_t res = affected_player->ws_direction;
+    vector2_t d = vector2_t(player_state->mouse_x_diff, player_state->mouse_y_diff);
 
-            affected_player->camera.mouse_diff = d;
+    affected_player->camera.mouse_diff = d;
 
-            static constexpr float32_t SENSITIVITY = 15.0f;
+    static constexpr float32_t SENSITIVITY = 15.0f;
         
-            float32_t x_angle = glm::radians(-d.x) * SENSITIVITY * dt;// *elapsed;
-            float32_t y_angle = glm::radians(-d.y) * SENSITIVITY * dt;// *elapsed;
+    float32_t x_angle = glm::radians(-d.x) * SENSITIVITY * dt;// *elapsed;
+    float32_t y_angle = glm::radians(-d.y) * SENSITIVITY * dt;// *elapsed;
                 
-            res = matrix3_t(glm::rotate(x_angle, up)) * res;
-            vector3_t rotate_y = glm::cross(res, up);
-            res = matrix3_t(glm::rotate(y_angle, rotate_y)) * res;
+    res = matrix3_t(glm::rotate(x_angle, up)) * res;
+    vector3_t rotate_y = glm::cross(res, up);
+    res = matrix3_t(glm::rotate(y_angle, rotate_y)) * res;
 
-            res = glm::normalize(res);
+    res = glm::normalize(res);
             
-            affected_player->ws_direction = res;
+    affected_player->ws_direction = res;
 
-            return(dt);
-        }
-    }
-    
-    return(-1.0f);
+    return(dt);
 }
 
 
@@ -97,11 +97,12 @@ struct camera_component_t {
     smooth_linear_interpolation_t<float32_t> transition_first_third = {};
 
     void tick(struct player_t *affected_player, float32_t dt);
+    // Only the part of the tick which affects the simulation (client replays this when it gets corrected)
+    void tick_up_vector(float32_t dt);
 };
 
 
 struct animation_component_create_info_t {
-    uniform_layout_t *ubo_layout;
     skeleton_t *skeleton;
     animation_cycles_t *cycles;
 };
@@ -112,6 +113,15 @@ struct animation_component_t {
     animated_instance_t animation_instance;
     animation_cycles_t *cycles;
 
+    // Gets set every frame by the animation LOD pass (see entities_gstate.cpp)
+    // If not visible (not in camera frustum nor casting shadows), skeleton doesn't get sampled at all
+    uint8_t is_visible: 1;
+    // Skeleton gets sampled once every update_interval frames
+    uint8_t update_interval = 1;
+    uint8_t frames_until_update = 0;
+    // dt accumulated while the skeleton wasn't being sampled
+    float32_t accumulated_dt = 0.0f;
+
     void tick(struct player_t *affected_player, float32_t dt);
 };
 
@@ -162,7 +172,7 @@ struct shoot_component_t {
 struct burnable_component_t {
     bool burning = 0;
     // Going to have to update this every frame
-    int32_t particle_index = 0;
+    int32_t particle_index = -1;
 
     void tick(struct bullet_t *affected_bullet, float32_t dt);
     void set_on_fire(const vector3_t &position);
@@ -186,7 +196,11 @@ struct network_component_create_info_t {
 
 
 struct remote_player_snapshot_t {
+    // Game state tick of the snapshot (remote players get rendered at a fractional game state tick, see get_remote_player_render_tick())
+    uint64_t game_state_tick;
     vector3_t ws_position;
+    // Tangents for the Hermite interpolation / extrapolation when snapshots are late
+    vector3_t ws_velocity;
     vector3_t ws_direction;
     vector3_t ws_up_vector;
     quaternion_t ws_rotation;
@@ -243,19 +257,23 @@ struct network_component_t {
 
     // Stuff for remote players
     struct {
-        // Rendering time for the remote players will be 100ms behind (two snapshots - TODO: Make this depend on the snapshot rate of the server)
+        // Remote players get rendered at the client's playout tick (see get_remote_player_render_tick()): adapts to the snapshot jitter
         
         // This will only be allocated for remote players
         circular_buffer_t<struct remote_player_snapshot_t> remote_player_states;
-        // Previous = remote_player_states.tail
+        // Previous = remote_player_states.tail (latest snapshot which is older than the render tick)
 
-        float32_t elapsed_time = 0.0f;
-        float32_t max_time = 0.0f /* Set this depending on the snapshot rate of the server snapshot rate */;
+        // In game state ticks: players which the server sends less often need to be rendered further behind to have a snapshot to interpolate towards
+        float32_t snapshot_spacing = 1.0f;
+        // Extra delay on top of the render tick, moves towards snapshot_spacing - 1 (changes of interest level don't make the player jump)
+        float32_t render_delay = 0.0f;
     };
 
     bool is_remote = 0;
 
     float32_t tick(struct player_t *affceted_player, float32_t dt);
+    // Action flags, rolling mode and view direction: returns the dt of the player state
+    float32_t apply_player_state(struct player_t *affected_player, struct player_state_t *player_state);
 };
 
 
@@ -283,12 +283,6 @@ internal_function void glfw_char_input_proc(GLFWwindow *win, uint32_t code_point
 
 #include <chrono>
 
-internal_function void init_free_list_allocator_head(free_list_allocator_t *allocator = &free_list_allocator_global)
-{
-    allocator->free_block_head = (free_block_header_t *)allocator->start;
-    allocator->free_block_head->free_block_size = allocator->available_bytes;
-}
-
 internal_function bool32_t create_vulkan_surface_proc(VkInstance *instance, VkSurfaceKHR *dst_surface, void *window_data)
 {
     GLFWwindow **window = (GLFWwindow **)(window_data);
@@ -325,15 +319,7 @@ int32_t main(int32_t argc, char * argv[])
 	
     OUTPUT_DEBUG_LOG("%s\n", "starting session");
 
-    linear_allocator_global.capacity = megabytes(30);
-    linear_allocator_global.start = linear_allocator_global.current = malloc(linear_allocator_global.capacity);
-	
-    stack_allocator_global.capacity = megabytes(10);
-    stack_allocator_global.start = stack_allocator_global.current = malloc(stack_allocator_global.capacity);
-
-    free_list_allocator_global.available_bytes = megabytes(50);
-    free_list_allocator_global.start = malloc(free_list_allocator_global.available_bytes);
-    init_free_list_allocator_head(&free_list_allocator_global);
+    initialize_global_allocators();
 	
     OUTPUT_DEBUG_LOG("stack allocator start address : %p\n", stack_allocator_global.current);
     
@@ -395,7 +381,7 @@ int32_t main(int32_t argc, char * argv[])
         glfwPollEvents();
         game_tick(&input_state, g_dt);	   
 
-        clear_linear();
+        swap_frame_linear();
 
         input_state.cursor_moved = false;
 
@@ -14,10 +14,8 @@
 
 static int32_t player_count = 0;
 static player_t player_list[MAX_PLAYERS];
-static int32_t bullet_count = 0;
-static bullet_t bullet_list[MAX_BULLETS];
-static uint32_t removed_bullets_stack_head;
-static uint16_t removed_bullets_stack[MAX_BULLETS];
+// Dead bullets go back to the pool at the end of their tick (components still use them after destroy_bullet)
+static pool_allocator_t<bullet_t, MAX_BULLETS> bullet_pool;
 static hash_table_inline_t<player_handle_t, 30, 5, 5> name_map{"map.entities"};
 static pipeline_handle_t player_ppln;
 static pipeline_handle_t player_alpha_ppln;
@@ -41,6 +39,16 @@ static gpu_material_submission_queue_t rolling_player_submission_queue;
 static gpu_material_submission_queue_t rolling_player_submission_alpha_queue;
 static gpu_material_submission_queue_t rolling_player_submission_shadow_queue;
 
+// Animation LOD: distance (squared) from the camera under which the skeleton gets sampled every N frames
+struct animation_lod_t {
+    float32_t max_distance_squared;
+    uint8_t update_interval;
+};
+
+static constexpr animation_lod_t ANIMATION_LODS[] = { {40.0f * 40.0f, 1}, {120.0f * 120.0f, 2}, {250.0f * 250.0f, 4} };
+static constexpr uint8_t FARTHEST_ANIMATION_LOD_INTERVAL = 8;
+// Players that are only in the shadow caster set don't need to be sampled as often
+static constexpr uint8_t SHADOW_ONLY_ANIMATION_LOD_INTERVAL = 4;
 
 
 // Static declarations
@@ -48,12 +56,15 @@ static void handle_main_player_mouse_movement(player_t *player, game_input_t *ga
 static void handle_main_player_mouse_button_input(player_t *player, game_input_t *game_input, float32_t dt);
 static void handle_main_player_keyboard_input(player_t *player, game_input_t *game_input, float32_t dt);
 static player_handle_t add_player(const player_t &player);
+static void s_update_animation_lods(void);
 
 
 
 
 // "Public" definitions
 void initialize_entities_state(void) {
+    bullet_pool.initialize("bullet_t");
+
     switch (get_app_type()) {
     case application_type_t::WINDOW_APPLICATION_MODE: {
         VkCommandPool *cmdpool = get_global_command_pool();
@@ -71,9 +82,11 @@ void initialize_entities_state(void) {
         uniform_layout_handle_t animation_layout_hdl = g_uniform_layout_manager->add("uniform_layout.joint_ubo"_hash);
         uniform_layout_t *animation_layout_ptr = g_uniform_layout_manager->get(animation_layout_hdl);
         uniform_layout_info_t animation_ubo_info = {};
-        animation_ubo_info.push(1, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+        animation_ubo_info.push(1, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT);
         *animation_layout_ptr = make_uniform_layout(&animation_ubo_info);
 
+        initialize_joint_palette_buffer(animation_layout_ptr, MAX_PLAYERS, player_mesh_skeleton.joint_count);
+
         player_ppln = g_pipeline_manager->add("pipeline.model"_hash);
         auto *player_ppln_ptr = g_pipeline_manager->get(player_ppln);
         initialize_3d_animated_shader(player_ppln_ptr, "shaders/SPV/lp_notex_animated", &player_model, animation_layout_hdl);
@@ -183,16 +196,13 @@ void deinitialize_entities_state(void) {
         player_t *player = &player_list[i];
         deallocate_free_list(player->animation.animation_instance.interpolated_transforms);
         deallocate_free_list(player->animation.animation_instance.current_joint_transforms);
-        player->animation.animation_instance.interpolated_transforms_ubo.destroy();
-        push_uniform_group_to_destroyed_uniform_group_cache(&player_mesh_cycles, &player->animation.animation_instance);
         player->network.player_states_cbuffer.deinitialize();
         player->network.remote_player_states.deinitialize();
     }
 
     player_count = 0;
     main_player = -1;
-    bullet_count = 0;
-    removed_bullets_stack_head = 0;
+    bullet_pool.deinitialize();
 
     bind_camera_to_3d_output(-1);
     remove_all_cameras();
@@ -202,7 +212,10 @@ void deinitialize_entities_state(void) {
 void fill_game_state_initialize_packet_with_entities_state(struct game_state_initialize_packet_t *packet, player_handle_t new_client_index) {
     packet->client_index = new_client_index;
     packet->player_count = player_count;
-    packet->player = (player_state_initialize_packet_t *)allocate_linear(sizeof(player_state_initialize_packet_t) * player_count);
+
+    // Packet gets serialized straight away
+    static player_state_initialize_packet_t players[MAX_PLAYERS];
+    packet->player = players;
 
     for (uint32_t player = 0; player < (uint32_t)player_count; ++player) {
         player_t *p_player = &player_list[player];
@@ -232,6 +245,8 @@ void tick_entities_state(game_input_t *game_input, float32_t dt, application_typ
             handle_main_player_mouse_movement(main_player_ptr, game_input, dt);
             handle_main_player_mouse_button_input(main_player_ptr, game_input, dt);
         }
+
+        s_update_animation_lods();
     } break;
 
     default: break;
@@ -312,10 +327,10 @@ void tick_entities_state(game_input_t *game_input, float32_t dt, application_typ
         }
     }
 
-    for (uint32_t bullet_index = 0; bullet_index < (uint32_t)bullet_count; ++bullet_index) {
-        bullet_t *bullet = &bullet_list[bullet_index];
+    for (uint32_t bullet_index = 0; bullet_index < bullet_pool.get_capacity(); ++bullet_index) {
+        bullet_t *bullet = bullet_pool.get_live(bullet_index);
 
-        if (!bullet->dead) {
+        if (bullet) {
             switch (app_type) {
             case application_type_t::WINDOW_APPLICATION_MODE: {
                     bullet->rendering.tick(bullet, dt);
@@ -327,6 +342,10 @@ void tick_entities_state(game_input_t *game_input, float32_t dt, application_typ
                     bullet->burnable.tick(bullet, dt);
                 } break;
             }
+
+            if (bullet->dead) {
+                bullet_pool.deallocate(bullet);
+            }
         }
     }
 }
@@ -372,11 +391,17 @@ void render_transparent_entities(uniform_group_t *uniforms, gpu_command_queue_t
 
 
 void sync_gpu_with_entities_state(gpu_command_queue_t *queue) {
+    // All the palettes get written to the shared joint buffer, draws just use an offset into it
+    begin_joint_palette_updates();
+    
     for (uint32_t i = 0; i < (uint32_t)player_count; ++i) {
         player_t *player = &player_list[i];
         animation_component_t *animation = &player->animation;
 
-        update_animated_instance_ubo(queue, &animation->animation_instance);
+        // Culled by the LOD pass - won't get drawn
+        if (animation->is_visible) {
+            push_joint_palette(&animation->animation_instance);
+        }
     }
 }
 
@@ -402,7 +427,6 @@ player_handle_t create_player_from_player_init_packet(uint32_t local_user_client
         player_create_info.camera_info.distance_from_player = 15.0f;
     }
         
-    player_create_info.animation_info.ubo_layout = g_uniform_layout_manager->get(g_uniform_layout_manager->get_handle("uniform_layout.joint_ubo"_hash));
     player_create_info.animation_info.skeleton = &player_mesh_skeleton;
     player_create_info.animation_info.cycles = &player_mesh_cycles;
     player_create_info.shoot_info.cool_off = 0.0f;
@@ -442,7 +466,6 @@ void create_map_editor_entity(raw_input_t *raw_input) {
     player_create_info.camera_info.is_third_person = 0;
     player_create_info.camera_info.distance_from_player = 15.0f;
 
-    player_create_info.animation_info.ubo_layout = g_uniform_layout_manager->get(g_uniform_layout_manager->get_handle("uniform_layout.joint_ubo"_hash));
     player_create_info.animation_info.skeleton = &player_mesh_skeleton;
     player_create_info.animation_info.cycles = &player_mesh_cycles;
     player_create_info.shoot_info.cool_off = 0.0f;
@@ -479,7 +502,6 @@ player_handle_t spawn_player(const char *player_name, player_color_t color, uint
     player_create_info.camera_info.distance_from_player = 15.0f;
     switch (get_app_type()) {
     case application_type_t::WINDOW_APPLICATION_MODE: {
-        player_create_info.animation_info.ubo_layout = g_uniform_layout_manager->get(g_uniform_layout_manager->get_handle("uniform_layout.joint_ubo"_hash));
     } break;
     default: break;
     }
@@ -498,24 +520,15 @@ player_handle_t spawn_player(const char *player_name, player_color_t color, uint
 
 
 void spawn_bullet(player_t *shooter) {
-    bullet_t *new_bullet;
-    uint32_t bullet_index;
-    if (removed_bullets_stack_head > 0) {
-        bullet_index = removed_bullets_stack_head;
-        new_bullet = &bullet_list[removed_bullets_stack[removed_bullets_stack_head--]];
-        new_bullet->dead = 0;
-    }
-    else {
-        bullet_index = bullet_count;
-        new_bullet = &bullet_list[bullet_count++];
-    }
+    bullet_t *new_bullet = bullet_pool.allocate();
+
     bullet_create_info_t info = {};
     info.ws_position = shooter->ws_position;
     info.ws_direction = glm::normalize(shooter->ws_direction);
     info.ws_rotation = quaternion_t(glm::radians(45.0f), vector3_t(0, 1, 0));
     info.ws_size = vector3_t(0.7f);
     info.color = player_color_t::DARK_GRAY;
-    info.bullet_index = bullet_index;
+    info.bullet_index = bullet_pool.get_index(new_bullet);
     new_bullet->initialize(&info);
 
     new_bullet->ws_velocity = shooter->ws_direction * 50.0f;
@@ -527,25 +540,36 @@ void spawn_bullet(player_t *shooter) {
 
 void destroy_bullet(bullet_t *bullet) {
     bullet->dead = 1;
-    removed_bullets_stack[removed_bullets_stack_head++] = bullet->bullet_index;
 }
 
 
 void push_entity_to_skeletal_animation_queue(rendering_component_t *rendering, animation_component_t *animation) {
-    uniform_group_t *group = &animation->animation_instance.group;
-    player_submission_queue.push_material(&rendering->push_k, sizeof(rendering->push_k), &player_mesh, group);
+    // Joint palette doesn't get written for culled players
+    if (!animation->is_visible) {
+        return;
+    }
+    
+    player_submission_queue.push_material(&rendering->push_k, sizeof(rendering->push_k), &player_mesh, get_joint_palette_uniform_group(), &animation->animation_instance.joint_palette_offset);
 }
 
 
 void push_entity_to_skeletal_animation_alpha_queue(rendering_component_t *rendering, animation_component_t *animation) {
-    uniform_group_t *group = &animation->animation_instance.group;
-    player_submission_alpha_queue.push_material(&rendering->push_k_alpha, sizeof(rendering->push_k_alpha), &player_mesh, group);
+    // Joint palette doesn't get written for culled players
+    if (!animation->is_visible) {
+        return;
+    }
+    
+    player_submission_alpha_queue.push_material(&rendering->push_k_alpha, sizeof(rendering->push_k_alpha), &player_mesh, get_joint_palette_uniform_group(), &animation->animation_instance.joint_palette_offset);
 }
 
 
 void push_entity_to_skeletal_animation_shadow_queue(rendering_component_t *rendering, animation_component_t *animation) {
-    uniform_group_t *group = &animation->animation_instance.group;
-    player_submission_shadow_queue.push_material(&rendering->push_k, sizeof(rendering->push_k), &player_mesh, group);
+    // Joint palette doesn't get written for culled players
+    if (!animation->is_visible) {
+        return;
+    }
+    
+    player_submission_shadow_queue.push_material(&rendering->push_k, sizeof(rendering->push_k), &player_mesh, get_joint_palette_uniform_group(), &animation->animation_instance.joint_palette_offset);
 }
 
 
@@ -711,3 +735,95 @@ static player_handle_t add_player(const player_t &player) {
 
     return(view);
 }
+
+
+static bool s_sphere_in_frustum(const matrix4_t &clip, const vector3_t &ws_center, float32_t radius) {
+    // Extract the 6 frustum planes out of the view-projection matrix (Gribb / Hartmann)
+    vector4_t row0 = vector4_t(clip[0][0], clip[1][0], clip[2][0], clip[3][0]);
+    vector4_t row1 = vector4_t(clip[0][1], clip[1][1], clip[2][1], clip[3][1]);
+    vector4_t row2 = vector4_t(clip[0][2], clip[1][2], clip[2][2], clip[3][2]);
+    vector4_t row3 = vector4_t(clip[0][3], clip[1][3], clip[2][3], clip[3][3]);
+
+    vector4_t planes[6] = { row3 + row0, row3 - row0, row3 + row1, row3 - row1, row3 + row2, row3 - row2 };
+
+    for (uint32_t i = 0; i < 6; ++i) {
+        vector3_t normal = vector3_t(planes[i]);
+        float32_t distance = glm::dot(normal, ws_center) + planes[i].w;
+        
+        if (distance < -radius * glm::length(normal)) {
+            return(0);
+        }
+    }
+
+    return(1);
+}
+
+
+// Decides (in one pass over all animated players) which skeletons need to be sampled this frame, and how often
+static void s_update_animation_lods(void) {
+    camera_t *camera = camera_bound_to_3d_output();
+
+    shadow_matrices_t shadow_matrices = get_shadow_matrices();
+    matrix4_t shadow_clips[SHADOW_BOX_COUNT];
+    for (uint32_t i = 0; i < SHADOW_BOX_COUNT; ++i) {
+        shadow_clips[i] = shadow_matrices.boxes[i].projection_matrix * shadow_matrices.boxes[i].light_view_matrix;
+    }
+
+    matrix4_t camera_clip = camera ? camera->p_m * camera->v_m : matrix4_t(1.0f);
+    
+    for (uint32_t i = 0; i < (uint32_t)player_count; ++i) {
+        player_t *player = &player_list[i];
+        animation_component_t *animation = &player->animation;
+
+        // Always animate the user (and everything if there is no camera to cull against)
+        if (!camera || (int32_t)i == main_player) {
+            animation->is_visible = 1;
+            animation->update_interval = 1;
+            continue;
+        }
+
+        // Rendered as a ball, skeleton isn't used
+        if (player->rolling_mode) {
+            animation->is_visible = 0;
+            continue;
+        }
+
+        float32_t radius = glm::length(player->size);
+        
+        bool in_view = s_sphere_in_frustum(camera_clip, player->ws_position, radius);
+        bool casts_shadow = 0;
+
+        if (!in_view) {
+            for (uint32_t box = 0; box < SHADOW_BOX_COUNT && !casts_shadow; ++box) {
+                casts_shadow = s_sphere_in_frustum(shadow_clips[box], player->ws_position, radius);
+            }
+        }
+
+        animation->is_visible = in_view || casts_shadow;
+
+        if (!animation->is_visible) {
+            continue;
+        }
+
+        vector3_t diff = player->ws_position - camera->p;
+        float32_t distance_squared = glm::dot(diff, diff);
+
+        uint8_t update_interval = FARTHEST_ANIMATION_LOD_INTERVAL;
+        for (uint32_t lod = 0; lod < sizeof(ANIMATION_LODS) / sizeof(ANIMATION_LODS[0]); ++lod) {
+            if (distance_squared < ANIMATION_LODS[lod].max_distance_squared) {
+                update_interval = ANIMATION_LODS[lod].update_interval;
+                break;
+            }
+        }
+
+        if (!in_view) {
+            update_interval = MAX(update_interval, SHADOW_ONLY_ANIMATION_LOD_INTERVAL);
+        }
+
+        if (update_interval != animation->update_interval) {
+            animation->update_interval = update_interval;
+            // Stagger the updates so that players which share a LOD don't all get sampled on the same frame
+            animation->frames_until_update = (uint8_t)(i % update_interval);
+        }
+    }
+}
@@ -61,7 +61,11 @@ void initialize_game(game_memory_t *memory, raw_input_t *raw_input, create_vulka
     case application_type_t::CONSOLE_APPLICATION_MODE: {
         initialize_net(app_mode, &dispatcher);
         initialize_scripting();
-        initialize_gamestate(raw_input, &dispatcher);
+
+        // Bots don't have a world
+        if (app_mode != application_mode_t::BOT_MODE) {
+            initialize_gamestate(raw_input, &dispatcher);
+        }
     } break;
     }
 
@@ -70,6 +74,10 @@ void initialize_game(game_memory_t *memory, raw_input_t *raw_input, create_vulka
     memory->focus_stack.push_focus(element_focus_t::UI_ELEMENT_MENU);
 }
 
+static void s_memory_report_to_debug_console(const char *line) {
+    output_to_debug_console(line);
+}
+
 void destroy_game(game_memory_t *memory) {
     if (get_app_mode() == application_mode_t::CLIENT_MODE) {
         save_variables();
@@ -90,6 +98,8 @@ void destroy_game(game_memory_t *memory) {
     destroy_graphics();
 
     destroy_vulkan_state();
+
+    print_memory_leak_report(&s_memory_report_to_debug_console);
 }
 
 // Decides which element gets input focus
@@ -145,8 +155,16 @@ void game_tick(game_memory_t *memory, raw_input_t *raw_input, float32_t dt) {
         end_frame_rendering_and_refresh(raw_input);
     } break;
     case application_type_t::CONSOLE_APPLICATION_MODE: {
+        // Replaying a packet capture: frames get simulated with the dts they had when they were recorded
+        if (get_app_mode() == application_mode_t::SERVER_MODE && is_replaying_server_capture()) {
+            dt = begin_server_replay_frame();
+        }
+
         tick_net(nullptr, dt);
-        tick_gamestate(nullptr, dt, nullptr, memory->app_type, (element_focus_t)0);
+
+        if (get_app_mode() != application_mode_t::BOT_MODE) {
+            tick_gamestate(nullptr, dt, nullptr, memory->app_type, (element_focus_t)0);
+        }
     } break;
     }
 
@@ -15,6 +15,11 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 
+#if defined (__i386) || defined (__x86_64__) || defined (_M_IX86) || defined(_M_X64)
+#define PARTICLES_SSE 1
+#include <xmmintrin.h>
+#endif
+
 #include "game.hpp"
 
 #include "camera_view.hpp"
@@ -60,13 +65,14 @@ void end_command_queue(gpu_command_queue_t *queue) {
 // --------------------- Uniform stuff ---------------------
 
 static void make_uniform_pool(void) {
-    VkDescriptorPoolSize pool_sizes[3] = {};
+    VkDescriptorPoolSize pool_sizes[4] = {};
 
     init_descriptor_pool_size(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 20, &pool_sizes[0]);
     init_descriptor_pool_size(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 20, &pool_sizes[1]);
     init_descriptor_pool_size(VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 20, &pool_sizes[2]);
+    init_descriptor_pool_size(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 5, &pool_sizes[3]);
     
-    init_descriptor_pool(memory_buffer_view_t<VkDescriptorPoolSize>{3, pool_sizes}, 30, g_uniform_pool);
+    init_descriptor_pool(memory_buffer_view_t<VkDescriptorPoolSize>{4, pool_sizes}, 30, g_uniform_pool);
 }
 
 // Naming is better than Descriptor in case of people familiar with different APIs / also will be useful when introducing other APIs
@@ -109,12 +115,13 @@ uniform_group_t make_uniform_group(uniform_layout_t *layout, VkDescriptorPool *p
 
 
 // --------------------- Rendering stuff ---------------------
-uint32_t gpu_material_submission_queue_t::push_material(void *push_k_ptr, uint32_t push_k_size, mesh_t *mesh, uniform_group_t *ubo) {
+uint32_t gpu_material_submission_queue_t::push_material(void *push_k_ptr, uint32_t push_k_size, mesh_t *mesh, uniform_group_t *ubo, uint32_t *dynamic_offset) {
     material_t new_mtrl = {};
     new_mtrl.push_k_ptr = push_k_ptr;
     new_mtrl.push_k_size = push_k_size;
     new_mtrl.mesh = mesh;
     new_mtrl.ubo = ubo;
+    new_mtrl.dynamic_offset = dynamic_offset;
 
     mtrls[mtrl_count] = new_mtrl;
 
@@ -164,7 +171,12 @@ void gpu_material_submission_queue_t::submit_queued_materials(const memory_buffe
 
         bool32_t is_using_index_buffer = (mtrl->mesh->index_data.index_buffer != VK_NULL_HANDLE); 
         
-        command_buffer_bind_descriptor_sets(&graphics_pipeline->layout, { uniform_count, groups }, &dst_command_queue->q);
+        memory_buffer_view_t<uint32_t> dynamic_offsets = { 0, nullptr };
+        if (mtrl->dynamic_offset) {
+            dynamic_offsets = { 1, mtrl->dynamic_offset };
+        }
+        
+        command_buffer_bind_descriptor_sets(&graphics_pipeline->layout, { uniform_count, groups }, &dst_command_queue->q, dynamic_offsets);
         command_buffer_bind_vbos(mtrl->mesh->raw_buffer_list, {mtrl->mesh->raw_buffer_list.count, zero}, 0, mtrl->mesh->raw_buffer_list.count, &dst_command_queue->q);
         
         if (is_using_index_buffer) {
@@ -1851,17 +1863,10 @@ animation_cycles_t load_animations(const char *path) {
         }
     }
 
-    animation_cycles.destroyed_uniform_groups = (uniform_group_t *)allocate_free_list(sizeof(uniform_group_t) * 30);
-    
     return animation_cycles;
 }
 
-void push_uniform_group_to_destroyed_uniform_group_cache(animation_cycles_t *cycles, animated_instance_t *instance) {
-    cycles->destroyed_uniform_groups[cycles->destroyed_groups_count++] = instance->group;
-    instance->group = VK_NULL_HANDLE;
-}
-
-animated_instance_t initialize_animated_instance(gpu_command_queue_pool_t *pool, uniform_layout_t *gpu_ubo_layout, skeleton_t *skeleton, animation_cycles_t *cycles) {
+animated_instance_t initialize_animated_instance(skeleton_t *skeleton, animation_cycles_t *cycles) {
     animated_instance_t instance = {};
     
     instance.current_animation_time = 0.0f;
@@ -1875,20 +1880,7 @@ animated_instance_t initialize_animated_instance(gpu_command_queue_pool_t *pool,
         instance.interpolated_transforms[i] = matrix4_t(1.0f);
     }
 
-    make_unmappable_gpu_buffer(&instance.interpolated_transforms_ubo,
-                               sizeof(matrix4_t) * skeleton->joint_count,
-                               instance.interpolated_transforms,
-                               gpu_buffer_usage_t::UNIFORM_BUFFER,
-                               pool);
-
-    if (cycles->destroyed_groups_count) {
-        instance.group = cycles->destroyed_uniform_groups[--cycles->destroyed_groups_count];
-    }
-    else if (instance.group == VK_NULL_HANDLE) {
-        instance.group = make_uniform_group(gpu_ubo_layout, g_uniform_pool);
-    }
-    
-    update_uniform_group(&instance.group, update_binding_t{BUFFER, &instance.interpolated_transforms_ubo, 0});
+    instance.joint_palette_offset = 0;
     
     return(instance);
 }
@@ -1950,7 +1942,8 @@ void interpolate_skeleton_joints_into_instance(float32_t dt, animated_instance_t
         // Increase the animation time
         instance->current_animation_time += dt;
         if (instance->current_animation_time >= bound_cycle->total_animation_time) {
-            instance->current_animation_time = 0.0f;
+            // dt may span several cycles if the instance was skipped for a few frames (animation LOD)
+            instance->current_animation_time = fmodf(instance->current_animation_time, bound_cycle->total_animation_time);
         }
 
         // Get the frames to which the current time stamp is in between (frame_a and frame_b)
@@ -1986,14 +1979,62 @@ void interpolate_skeleton_joints_into_instance(float32_t dt, animated_instance_t
     }
 }
 
-void update_animated_instance_ubo(gpu_command_queue_t *queue, animated_instance_t *instance) {
-    update_gpu_buffer(&instance->interpolated_transforms_ubo,
-                      instance->interpolated_transforms,
-                      sizeof(matrix4_t) * instance->skeleton->joint_count,
-                      0,
-                      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
-                      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
-                      &queue->q);
+// Holds the joint palettes of every animated instance, for every frame in the ring
+static struct {
+    // Uniform buffer offsets need to be aligned to minUniformBufferOffsetAlignment (which is at most 256 bytes)
+    static constexpr uint32_t PALETTE_ALIGNMENT = 256;
+    // Don't write to the palettes the GPU may still be reading from
+    static constexpr uint32_t RING_SIZE = 2;
+
+    gpu_buffer_t buffer;
+    mapped_gpu_memory_t mapped;
+    uniform_group_t group;
+
+    uint32_t palette_stride;
+    uint32_t max_instances;
+    uint32_t max_joints;
+
+    uint32_t current_ring_index;
+    uint32_t palette_count;
+} joint_palettes;
+
+void initialize_joint_palette_buffer(uniform_layout_t *layout, uint32_t max_instances, uint32_t max_joints) {
+    uint32_t palette_size = sizeof(matrix4_t) * max_joints;
+    
+    joint_palettes.palette_stride = (palette_size + joint_palettes.PALETTE_ALIGNMENT - 1) & ~(joint_palettes.PALETTE_ALIGNMENT - 1);
+    joint_palettes.max_instances = max_instances;
+    joint_palettes.max_joints = max_joints;
+    joint_palettes.current_ring_index = 0;
+    joint_palettes.palette_count = 0;
+
+    uint32_t buffer_size = joint_palettes.palette_stride * max_instances * joint_palettes.RING_SIZE;
+    init_buffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_SHARING_MODE_EXCLUSIVE, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &joint_palettes.buffer);
+
+    // Stays mapped for the whole lifetime of the buffer (coherent memory, so no need to flush)
+    joint_palettes.mapped = joint_palettes.buffer.construct_map();
+    joint_palettes.mapped.begin();
+
+    joint_palettes.group = make_uniform_group(layout, g_uniform_pool);
+    update_uniform_group(&joint_palettes.group, update_binding_t{DYNAMIC_BUFFER, &joint_palettes.buffer, 0, palette_size});
+}
+
+void begin_joint_palette_updates(void) {
+    joint_palettes.current_ring_index = (joint_palettes.current_ring_index + 1) % joint_palettes.RING_SIZE;
+    joint_palettes.palette_count = 0;
+}
+
+void push_joint_palette(animated_instance_t *instance) {
+    assert(joint_palettes.palette_count < joint_palettes.max_instances);
+    assert(instance->skeleton->joint_count <= joint_palettes.max_joints);
+
+    uint32_t offset = (joint_palettes.current_ring_index * joint_palettes.max_instances + joint_palettes.palette_count++) * joint_palettes.palette_stride;
+    memcpy((uint8_t *)joint_palettes.mapped.data + offset, instance->interpolated_transforms, sizeof(matrix4_t) * instance->skeleton->joint_count);
+
+    instance->joint_palette_offset = offset;
+}
+
+uniform_group_t *get_joint_palette_uniform_group(void) {
+    return(&joint_palettes.group);
 }
 
 
@@ -2032,26 +2073,55 @@ void initialize_particle_rendering(void) {
 
 
 particle_spawner_t initialize_particle_spawner(uint32_t max_particle_count, particle_effect_function_t effect, pipeline_handle_t shader, float32_t max_life_length, const char *texture_atlas, uint32_t x_count, uint32_t y_count, uint32_t num_images) {
+    // Dead stack uses 16 bit indices
+    assert(max_particle_count <= 0xFFFF);
+    
     particle_spawner_t particles = {};
-    particles.max_particles = max_particle_count;
+    // Pad so that the kernels can always process 4 particles at a time
+    particles.max_particles = (max_particle_count + 3) & ~3;
     particles.particles_stack_head = 0;
-    particles.particles = (particle_t *)allocate_free_list(sizeof(particle_t) * particles.max_particles);
-    memset(particles.particles, 0, sizeof(particle_t) * particles.max_particles);
-    
-    particles.rendered_particles_stack_head = 0;
-    particles.rendered_particles = (rendered_particle_data_t *)allocate_free_list(sizeof(rendered_particle_data_t) * particles.max_particles);
-    memset(particles.rendered_particles, 0, sizeof(rendered_particle_data_t) * particles.max_particles);
 
-    particles.distances_from_camera = (float32_t *)allocate_free_list(sizeof(float32_t) * particles.max_particles);
-    memset(particles.distances_from_camera, 0, sizeof(float32_t) * particles.max_particles);
-    
-    particles.max_dead = max_particle_count / 2;
+    uint32_t array_size = sizeof(float32_t) * particles.max_particles;
+    uint8_t *soa = (uint8_t *)allocate_free_list(array_size * 9);
+    particles.ws_position_x = (float32_t *)(soa + array_size * 0);
+    particles.ws_position_y = (float32_t *)(soa + array_size * 1);
+    particles.ws_position_z = (float32_t *)(soa + array_size * 2);
+    particles.ws_velocity_x = (float32_t *)(soa + array_size * 3);
+    particles.ws_velocity_y = (float32_t *)(soa + array_size * 4);
+    particles.ws_velocity_z = (float32_t *)(soa + array_size * 5);
+    particles.life = (float32_t *)(soa + array_size * 6);
+    particles.life_rate = (float32_t *)(soa + array_size * 7);
+    particles.size = (float32_t *)(soa + array_size * 8);
+    memset(soa, 0, array_size * 9);
+    for (uint32_t i = 0; i < particles.max_particles; ++i) {
+        particles.life[i] = -1.0f;
+    }
+
+    uint32_t index_array_size = sizeof(uint16_t) * particles.max_particles;
+    uint8_t *sort_memory = (uint8_t *)allocate_free_list(index_array_size * 5 + sizeof(uint8_t) * particles.max_particles);
+    particles.depth_keys = (uint16_t *)(sort_memory + index_array_size * 0);
+    particles.sort_keys = (uint16_t *)(sort_memory + index_array_size * 1);
+    particles.sort_indices = (uint16_t *)(sort_memory + index_array_size * 2);
+    particles.sort_scratch_keys = (uint16_t *)(sort_memory + index_array_size * 3);
+    particles.sort_scratch_indices = (uint16_t *)(sort_memory + index_array_size * 4);
+    particles.is_rendered = (uint8_t *)(sort_memory + index_array_size * 5);
+    memset(sort_memory, 0, index_array_size * 5 + sizeof(uint8_t) * particles.max_particles);
+    particles.previous_sorted_count = 0;
+    
+    particles.max_dead = particles.max_particles;
     particles.dead_count = 0;
     particles.dead = (uint16_t *)allocate_free_list(sizeof(uint16_t) * particles.max_dead);
     
     particles.update = effect;
-    
-    make_unmappable_gpu_buffer(&particles.gpu_particles_buffer, sizeof(rendered_particle_data_t) * particles.max_particles, particles.particles, gpu_buffer_usage_t::VERTEX_BUFFER, get_global_command_pool());
+
+    // Live particles get compacted straight into this buffer (no extra copy / vkCmdUpdateBuffer)
+    init_buffer(sizeof(rendered_particle_data_t) * particles.max_particles * 2, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_SHARING_MODE_EXCLUSIVE, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &particles.gpu_particles_buffer);
+    particles.gpu_particles_mapped = particles.gpu_particles_buffer.construct_map();
+    particles.gpu_particles_mapped.begin();
+
+    particles.current_buffer_half = 0;
+    particles.rendered_particles_stack_head = 0;
+    particles.rendered_particles = (rendered_particle_data_t *)particles.gpu_particles_mapped.data;
     
     particles.shader = shader;
     particles.max_life_length = max_life_length;
@@ -2115,8 +2185,8 @@ void render_particles(gpu_command_queue_t *queue, uniform_group_t *camera_transf
     uniform_group_t groups[] { *camera_transforms, spawner->texture_uniform, g_particle_rendering->position_subpass_input };
     command_buffer_bind_descriptor_sets(&particle_pipeline->layout, {3, groups}, &queue->q);
 
-    VkDeviceSize zero = 0;
-    command_buffer_bind_vbos({1, &spawner->gpu_particles_buffer.buffer}, {1, &zero}, 0, 1, &queue->q);
+    VkDeviceSize offset = sizeof(rendered_particle_data_t) * spawner->max_particles * spawner->current_buffer_half;
+    command_buffer_bind_vbos({1, &spawner->gpu_particles_buffer.buffer}, {1, &offset}, 0, 1, &queue->q);
 
     command_buffer_push_constant(push_constant, push_constant_size, 0, VK_SHADER_STAGE_VERTEX_BIT, particle_pipeline->layout, &queue->q);
     
@@ -2125,75 +2195,350 @@ void render_particles(gpu_command_queue_t *queue, uniform_group_t *camera_transf
 
 
 void particle_spawner_t::clear(void) {
+    // Switch to the other half of the GPU buffer
+    current_buffer_half = !current_buffer_half;
+    rendered_particles = (rendered_particle_data_t *)gpu_particles_mapped.data + max_particles * current_buffer_half;
     rendered_particles_stack_head = 0;
 }
 
 
-void particle_spawner_t::push_for_render(uint32_t index) {
-    particle_t *particle = &particles[index];
-    rendered_particle_data_t *rendered_particle = &rendered_particles[rendered_particles_stack_head];
-    float32_t *distance_to_camera = &distances_from_camera[rendered_particles_stack_head++];
-    camera_t *bound_camera = camera_bound_to_3d_output();
-    vector3_t direction_to_camera = bound_camera->p - particle->ws_position;
-    *distance_to_camera = glm::dot(direction_to_camera, direction_to_camera);
-    rendered_particle->ws_position = particle->ws_position;
-    rendered_particle->size = particle->size;
-    rendered_particle->life = particle->life;
+// Insertion sort is only worth it if the particles are nearly in order already - gives up after max_moves
+static bool s_try_insertion_sort_particles(uint16_t *keys, uint16_t *indices, uint32_t count, uint32_t max_moves) {
+    uint32_t moves = 0;
+    
+    for (uint32_t i = 1; i < count; ++i) {
+        uint16_t key = keys[i];
+        uint16_t index = indices[i];
+        uint32_t j = i;
+
+        for (; j > 0 && keys[j - 1] > key; --j) {
+            keys[j] = keys[j - 1];
+            indices[j] = indices[j - 1];
+        }
+
+        keys[j] = key;
+        indices[j] = index;
+
+        moves += i - j;
+        if (moves > max_moves) {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+
+static void s_radix_sort_particles(uint16_t *keys, uint16_t *indices, uint16_t *scratch_keys, uint16_t *scratch_indices, uint32_t count) {
+    uint16_t *src_keys = keys, *src_indices = indices;
+    uint16_t *dst_keys = scratch_keys, *dst_indices = scratch_indices;
+    
+    // 2 passes of 8 bits (LSD), result ends up back in the keys / indices arrays
+    for (uint32_t shift = 0; shift < 16; shift += 8) {
+        uint32_t offsets[256] = {};
+        for (uint32_t i = 0; i < count; ++i) {
+            ++offsets[(src_keys[i] >> shift) & 0xFF];
+        }
+
+        uint32_t total = 0;
+        for (uint32_t bucket = 0; bucket < 256; ++bucket) {
+            uint32_t bucket_count = offsets[bucket];
+            offsets[bucket] = total;
+            total += bucket_count;
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t destination = offsets[(src_keys[i] >> shift) & 0xFF]++;
+            dst_keys[destination] = src_keys[i];
+            dst_indices[destination] = src_indices[i];
+        }
+
+        uint16_t *tmp_keys = src_keys; src_keys = dst_keys; dst_keys = tmp_keys;
+        uint16_t *tmp_indices = src_indices; src_indices = dst_indices; dst_indices = tmp_indices;
+    }
 }
 
 
 void particle_spawner_t::sort_for_render(void) {
-    for (uint32_t i = 1; i < rendered_particles_stack_head; ++i) {
-        for (uint32_t j = i; j > 0; --j) {
-            float32_t current_distance = distances_from_camera[j];
-            float32_t below_distance = distances_from_camera[j - 1];
-            if (current_distance > below_distance) {
-                // Swap
-                distances_from_camera[j - 1] = current_distance;
-                distances_from_camera[j] = below_distance;
-
-                rendered_particle_data_t below = rendered_particles[j - 1];
-                rendered_particles[j - 1] = rendered_particles[j];
-                rendered_particles[j] = below;
-            }
-            else {
-                break;
-            }
+    uint32_t count = rendered_particles_stack_head;
+
+    // Keys were laid out in last frame's order, most of the time they are still sorted, or nearly
+    uint32_t descents = 0;
+    for (uint32_t i = 1; i < count; ++i) {
+        descents += (sort_keys[i - 1] > sort_keys[i]);
+    }
+
+    if (descents) {
+        // If the insertion sort gives up half way, the radix sort doesn't care about the starting order
+        if (descents > count / 32 || !s_try_insertion_sort_particles(sort_keys, sort_indices, count, count * 4)) {
+            s_radix_sort_particles(sort_keys, sort_indices, sort_scratch_keys, sort_scratch_indices, count);
         }
     }
+
+    // Only time the particles get written to the GPU buffer
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t index = sort_indices[i];
+        rendered_particles[i].ws_position = vector3_t(ws_position_x[index], ws_position_y[index], ws_position_z[index]);
+        rendered_particles[i].life = life[index];
+        rendered_particles[i].size = size[index];
+    }
+
+    previous_sorted_count = count;
+}
+
+
+int32_t particle_spawner_t::spawn(const vector3_t &ws_position, const vector3_t &ws_velocity, float32_t particle_size) {
+    uint32_t index;
+    
+    if (dead_count) {
+        index = dead[--dead_count];
+    }
+    else if (particles_stack_head < max_particles) {
+        index = particles_stack_head++;
+    }
+    else {
+        return(-1);
+    }
+
+    ws_position_x[index] = ws_position.x;
+    ws_position_y[index] = ws_position.y;
+    ws_position_z[index] = ws_position.z;
+    ws_velocity_x[index] = ws_velocity.x;
+    ws_velocity_y[index] = ws_velocity.y;
+    ws_velocity_z[index] = ws_velocity.z;
+    life[index] = 0.0f;
+    life_rate[index] = 1.0f;
+    size[index] = particle_size;
+
+    return((int32_t)index);
+}
+
+
+void particle_spawner_t::set_position(uint32_t index, const vector3_t &ws_position) {
+    ws_position_x[index] = ws_position.x;
+    ws_position_y[index] = ws_position.y;
+    ws_position_z[index] = ws_position.z;
 }
 
 
 void particle_spawner_t::declare_dead(uint32_t index) {
-    particles[index].life = -1.0f;
+    if (life[index] < 0.0f) {
+        // Already dead
+        return;
+    }
+    
+    life[index] = -1.0f;
+    ws_velocity_x[index] = ws_velocity_y[index] = ws_velocity_z[index] = 0.0f;
     
-    if (index == particles_stack_head - 1) {
-        --particles_stack_head;
+    dead[dead_count++] = index;
+}
+
+
+// Number of particles the kernels need to go through (multiple of 4)
+static uint32_t s_particle_kernel_count(particle_spawner_t *spawner) {
+    return((spawner->particles_stack_head + 3) & ~3);
+}
+
+
+void integrate_particles(particle_spawner_t *spawner, float32_t dt) {
+    uint32_t count = s_particle_kernel_count(spawner);
+    
+#if PARTICLES_SSE
+    __m128 dt4 = _mm_set1_ps(dt);
+    
+    for (uint32_t i = 0; i < count; i += 4) {
+        _mm_storeu_ps(&spawner->ws_position_x[i], _mm_add_ps(_mm_loadu_ps(&spawner->ws_position_x[i]), _mm_mul_ps(_mm_loadu_ps(&spawner->ws_velocity_x[i]), dt4)));
+        _mm_storeu_ps(&spawner->ws_position_y[i], _mm_add_ps(_mm_loadu_ps(&spawner->ws_position_y[i]), _mm_mul_ps(_mm_loadu_ps(&spawner->ws_velocity_y[i]), dt4)));
+        _mm_storeu_ps(&spawner->ws_position_z[i], _mm_add_ps(_mm_loadu_ps(&spawner->ws_position_z[i]), _mm_mul_ps(_mm_loadu_ps(&spawner->ws_velocity_z[i]), dt4)));
     }
-    else if (dead_count < max_dead) {
-        dead[dead_count++] = index;
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+        spawner->ws_position_x[i] += spawner->ws_velocity_x[i] * dt;
+        spawner->ws_position_y[i] += spawner->ws_velocity_y[i] * dt;
+        spawner->ws_position_z[i] += spawner->ws_velocity_z[i] * dt;
     }
+#endif
 }
 
+
+void age_particles(particle_spawner_t *spawner, float32_t dt) {
+    uint32_t count = s_particle_kernel_count(spawner);
+
+#if PARTICLES_SSE
+    __m128 dt4 = _mm_set1_ps(dt);
+    __m128 zero = _mm_setzero_ps();
     
-particle_t *particle_spawner_t::fetch_next_dead_particle(uint32_t *index) {
-    if (dead_count) {
-        uint16_t next_dead = dead[dead_count - 1];
-        --dead_count;
-        *index = next_dead;
-        return(&particles[next_dead]);
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 life = _mm_loadu_ps(&spawner->life[i]);
+        __m128 alive = _mm_cmpge_ps(life, zero);
+        __m128 increment = _mm_and_ps(alive, _mm_mul_ps(_mm_loadu_ps(&spawner->life_rate[i]), dt4));
+        _mm_storeu_ps(&spawner->life[i], _mm_add_ps(life, increment));
     }
-    else if (particles_stack_head < max_particles) {
-        *index = particles_stack_head;
-        particle_t *next_dead = &particles[particles_stack_head++];
-        return(next_dead);
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+        if (spawner->life[i] >= 0.0f) {
+            spawner->life[i] += spawner->life_rate[i] * dt;
+        }
     }
-    return(nullptr);
+#endif
 }
 
 
-particle_t *particle_spawner_t::particle(uint32_t *index) {
-    return(fetch_next_dead_particle(index));
+void age_particles_back_and_forth(particle_spawner_t *spawner, float32_t dt) {
+    uint32_t count = s_particle_kernel_count(spawner);
+    float32_t max_life = spawner->max_life_length;
+
+#if PARTICLES_SSE
+    __m128 dt4 = _mm_set1_ps(dt);
+    __m128 zero = _mm_setzero_ps();
+    __m128 max4 = _mm_set1_ps(max_life);
+    __m128 twice_max4 = _mm_set1_ps(2.0f * max_life);
+    __m128 sign_bit = _mm_set1_ps(-0.0f);
+    
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 life = _mm_loadu_ps(&spawner->life[i]);
+        __m128 rate = _mm_loadu_ps(&spawner->life_rate[i]);
+        __m128 alive = _mm_cmpge_ps(life, zero);
+
+        __m128 new_life = _mm_add_ps(life, _mm_mul_ps(rate, dt4));
+
+        // Reflect against both ends and flip the direction
+        __m128 over = _mm_cmpgt_ps(new_life, max4);
+        __m128 under = _mm_cmplt_ps(new_life, zero);
+        __m128 bounced = _mm_or_ps(over, under);
+        new_life = _mm_or_ps(_mm_andnot_ps(over, new_life), _mm_and_ps(over, _mm_sub_ps(twice_max4, new_life)));
+        new_life = _mm_or_ps(_mm_andnot_ps(under, new_life), _mm_and_ps(under, _mm_xor_ps(new_life, sign_bit)));
+        __m128 new_rate = _mm_xor_ps(rate, _mm_and_ps(bounced, sign_bit));
+
+        _mm_storeu_ps(&spawner->life[i], _mm_or_ps(_mm_andnot_ps(alive, life), _mm_and_ps(alive, new_life)));
+        _mm_storeu_ps(&spawner->life_rate[i], _mm_or_ps(_mm_andnot_ps(alive, rate), _mm_and_ps(alive, new_rate)));
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+        if (spawner->life[i] >= 0.0f) {
+            float32_t new_life = spawner->life[i] + spawner->life_rate[i] * dt;
+
+            if (new_life > max_life) {
+                new_life = 2.0f * max_life - new_life;
+                spawner->life_rate[i] = -spawner->life_rate[i];
+            }
+            else if (new_life < 0.0f) {
+                new_life = -new_life;
+                spawner->life_rate[i] = -spawner->life_rate[i];
+            }
+
+            spawner->life[i] = new_life;
+        }
+    }
+#endif
+}
+
+
+void kill_expired_particles(particle_spawner_t *spawner) {
+    uint32_t count = s_particle_kernel_count(spawner);
+    
+#if PARTICLES_SSE
+    __m128 max4 = _mm_set1_ps(spawner->max_life_length);
+    
+    for (uint32_t i = 0; i < count; i += 4) {
+        int32_t expired = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(&spawner->life[i]), max4));
+
+        // Most of the time, none of the 4 particles expire
+        while (expired) {
+            uint32_t lane = 0;
+            while (!(expired & (1 << lane))) ++lane;
+            expired &= ~(1 << lane);
+            
+            spawner->declare_dead(i + lane);
+        }
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+        if (spawner->life[i] > spawner->max_life_length) {
+            spawner->declare_dead(i);
+        }
+    }
+#endif
+}
+
+
+// Quantized so that far particles come first - top 16 bits of a positive float keep the ordering
+static inline uint16_t s_particle_depth_key(float32_t distance_squared) {
+    uint32_t bits;
+    memcpy(&bits, &distance_squared, sizeof(bits));
+    return((uint16_t)(0xFFFF - (bits >> 16)));
+}
+
+
+void compact_particles_for_render(particle_spawner_t *spawner, const vector3_t &ws_camera_position) {
+    uint32_t count = s_particle_kernel_count(spawner);
+
+#if PARTICLES_SSE
+    __m128 zero = _mm_setzero_ps();
+    __m128 max4 = _mm_set1_ps(spawner->max_life_length);
+    __m128 camera_x = _mm_set1_ps(ws_camera_position.x);
+    __m128 camera_y = _mm_set1_ps(ws_camera_position.y);
+    __m128 camera_z = _mm_set1_ps(ws_camera_position.z);
+    
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 life = _mm_loadu_ps(&spawner->life[i]);
+        int32_t live = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(life, zero), _mm_cmple_ps(life, max4)));
+
+        if (!live) {
+            continue;
+        }
+
+        __m128 x = _mm_sub_ps(_mm_loadu_ps(&spawner->ws_position_x[i]), camera_x);
+        __m128 y = _mm_sub_ps(_mm_loadu_ps(&spawner->ws_position_y[i]), camera_y);
+        __m128 z = _mm_sub_ps(_mm_loadu_ps(&spawner->ws_position_z[i]), camera_z);
+        
+        float32_t distance_squared[4];
+        _mm_storeu_ps(distance_squared, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+
+        for (uint32_t lane = 0; lane < 4; ++lane) {
+            if (live & (1 << lane)) {
+                spawner->depth_keys[i + lane] = s_particle_depth_key(distance_squared[lane]);
+                spawner->is_rendered[i + lane] = 1;
+            }
+        }
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i) {
+        if (spawner->life[i] >= 0.0f && spawner->life[i] <= spawner->max_life_length) {
+            vector3_t diff = vector3_t(spawner->ws_position_x[i], spawner->ws_position_y[i], spawner->ws_position_z[i]) - ws_camera_position;
+            spawner->depth_keys[i] = s_particle_depth_key(glm::dot(diff, diff));
+            spawner->is_rendered[i] = 1;
+        }
+    }
+#endif
+
+    // Particles that are still alive keep last frame's order, new ones get appended
+    uint16_t *order = spawner->sort_scratch_indices;
+    uint32_t rendered_count = 0;
+    
+    for (uint32_t i = 0; i < spawner->previous_sorted_count; ++i) {
+        uint16_t index = spawner->sort_indices[i];
+        if (spawner->is_rendered[index]) {
+            spawner->is_rendered[index] = 0;
+            order[rendered_count++] = index;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (spawner->is_rendered[i]) {
+            spawner->is_rendered[i] = 0;
+            order[rendered_count++] = (uint16_t)i;
+        }
+    }
+
+    spawner->sort_scratch_indices = spawner->sort_indices;
+    spawner->sort_indices = order;
+    
+    for (uint32_t i = 0; i < rendered_count; ++i) {
+        spawner->sort_keys[i] = spawner->depth_keys[order[i]];
+    }
+
+    spawner->rendered_particles_stack_head = rendered_count;
 }
 
 
@@ -2225,10 +2570,6 @@ mesh_t initialize_mesh(memory_buffer_view_t<VkBuffer> &vbos, draw_indexed_data_t
     return(mesh);
 }
 
-void destroy_animation_instance(animated_instance_t *instance) {
-    instance->interpolated_transforms_ubo.destroy();
-}
-
 void switch_to_cycle(animated_instance_t *instance, uint32_t cycle_index, bool32_t force) {
     instance->current_animation_time = 0.0f;
     if (!force) {
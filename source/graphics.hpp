@@ -304,7 +304,7 @@ struct uniform_layout_info_t { // --> VkDescriptorSetLayout
 uniform_layout_t make_uniform_layout(uniform_layout_info_t *blueprint);
 uniform_group_t make_uniform_group(uniform_layout_t *layout, VkDescriptorPool *pool);
 
-enum binding_type_t { BUFFER, INPUT_ATTACHMENT, TEXTURE };
+enum binding_type_t { BUFFER, INPUT_ATTACHMENT, TEXTURE, DYNAMIC_BUFFER };
 
 struct update_binding_t {
     binding_type_t type;
@@ -337,6 +337,15 @@ update_uniform_group(uniform_group_t *group, const Update_Ts &...updates) {
                 ++buffer_info_count;
                 break;
             }
+        case binding_type_t::DYNAMIC_BUFFER: {
+                // For dynamic buffers, t_changing_data is the range that is visible to the shader (offset is given when binding)
+                gpu_buffer_t *ubo = (gpu_buffer_t *)bindings[i].object;
+                buffer_info_buffer[buffer_info_count] = ubo->make_descriptor_info(0);
+                buffer_info_buffer[buffer_info_count].range = bindings[i].t_changing_data;
+                init_buffer_descriptor_set_write(group, bindings[i].binding, bindings[i].dst_element, bindings[i].count, &buffer_info_buffer[buffer_info_count], &writes[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+                ++buffer_info_count;
+                break;
+            }
         case binding_type_t::TEXTURE: {
                 image2d_t *tx = (image2d_t *)bindings[i].object;
                 image_info_buffer[image_info_count] = tx->make_descriptor_info((VkImageLayout)bindings[i].t_changing_data);
@@ -369,6 +378,8 @@ struct material_t {
     struct mesh_t *mesh;
     // Some materials may have a ubo per instance (animated materials)
     uniform_group_t *ubo = nullptr;
+    // If the ubo is a dynamic uniform buffer, offset into it (read at submission time)
+    uint32_t *dynamic_offset = nullptr;
 };
 
 // Queue of materials to be submitted
@@ -381,7 +392,7 @@ struct gpu_material_submission_queue_t {
     // for multi-threaded rendering in the future when needed
     int32_t cmdbuf_index{-1};
 
-    uint32_t push_material(void *push_k_ptr, uint32_t push_k_size, mesh_t *mesh, uniform_group_t *ubo = nullptr);
+    uint32_t push_material(void *push_k_ptr, uint32_t push_k_size, mesh_t *mesh, uniform_group_t *ubo = nullptr, uint32_t *dynamic_offset = nullptr);
     gpu_command_queue_t *get_command_buffer(gpu_command_queue_t *queue = nullptr);
     void submit_queued_materials(const memory_buffer_view_t<uniform_group_t> &uniform_groups, graphics_pipeline_t *graphics_pipeline, gpu_command_queue_t *main_queue, submit_level_t level);
     void flush_queue(void);
@@ -570,14 +581,11 @@ struct animation_cycles_t {
     animation_cycle_t cycles[MAX_ANIMATIONS];
     uint32_t cycle_count;
 
-    uint32_t destroyed_groups_count = 0;
-    uniform_group_t *destroyed_uniform_groups;
 };
 
 joint_t *get_joint(uint32_t joint_id, skeleton_t *skeleton);
 skeleton_t load_skeleton(const char *path);
 animation_cycles_t load_animations(const char *path);
-void push_uniform_group_to_destroyed_uniform_group_cache(animation_cycles_t *cycles, struct animated_instance_t *instance);
 
 struct animated_instance_t {
     float32_t current_animation_time;
@@ -594,36 +602,21 @@ struct animated_instance_t {
     matrix4_t *interpolated_transforms;
     // Cached joint transforms used in case the player is interpolating between cycles
     key_frame_joint_transform_t *current_joint_transforms;
-    
-    gpu_buffer_t interpolated_transforms_ubo;
-    uniform_group_t group = VK_NULL_HANDLE;
+
+    // Offset of this instance's joint palette in the shared joint buffer (changes every frame)
+    uint32_t joint_palette_offset;
 };
 
-void destroy_animation_instance(animated_instance_t *instance);
 void switch_to_cycle(animated_instance_t *instance, uint32_t cycle_index, bool32_t force = 0);
-animated_instance_t initialize_animated_instance(gpu_command_queue_pool_t *pool, uniform_layout_t *gpu_ubo_layout, skeleton_t *skeleton, animation_cycles_t *cycles);
+animated_instance_t initialize_animated_instance(skeleton_t *skeleton, animation_cycles_t *cycles);
 void destroy_animated_instance(animated_instance_t *instance);
 void interpolate_skeleton_joints_into_instance(float32_t dt, animated_instance_t *instance);
-void update_animated_instance_ubo(gpu_command_queue_t *queue, animated_instance_t *instance);
-
-
-struct particle_t {
-    vector3_t ws_position;
-    vector3_t ws_velocity;
-    vector3_t ws_up;
-    // May dictate the texture being displayed
-    float32_t life;
-    float32_t size;
 
-    uint8_t flag0: 1;
-    uint8_t flag1: 1;
-    uint8_t flag2: 1;
-    uint8_t flag3: 1;
-    uint8_t flag4: 1;
-    uint8_t flag5: 1;
-    uint8_t flag6: 1;
-    uint8_t flag7: 1;
-};
+// The joint palettes of all the animated instances get packed in one buffer (dynamic UBO) which gets written once per frame
+void initialize_joint_palette_buffer(uniform_layout_t *layout, uint32_t max_instances, uint32_t max_joints);
+void begin_joint_palette_updates(void);
+void push_joint_palette(animated_instance_t *instance);
+uniform_group_t *get_joint_palette_uniform_group(void);
 
 
 struct rendered_particle_data_t {
@@ -637,21 +630,47 @@ typedef void(*particle_effect_function_t)(struct particle_spawner_t *spawner, fl
 
 
 // Each particle type will have a particle generator
+// Particles are stored as SoA (arrays are padded to a multiple of 4) so that the kernels can process 4 particles at a time
 struct particle_spawner_t {
+    // Returns -1 if there is no space left
+    int32_t spawn(const vector3_t &ws_position, const vector3_t &ws_velocity, float32_t size);
+    void set_position(uint32_t index, const vector3_t &ws_position);
     void declare_dead(uint32_t index);
-    particle_t *fetch_next_dead_particle(uint32_t *index);
-    particle_t *particle(uint32_t *index);
-    void push_for_render(uint32_t index);
-    void sort_for_render(void);
     void clear(void);
+    // Sorts the compacted particles back to front and gathers them into rendered_particles
+    void sort_for_render(void);
     
     uint32_t max_particles;
+    // Particles after the stack head have never been used (dead particles have a negative life)
     uint32_t particles_stack_head;
-    particle_t *particles;
 
+    float32_t *ws_position_x;
+    float32_t *ws_position_y;
+    float32_t *ws_position_z;
+    float32_t *ws_velocity_x;
+    float32_t *ws_velocity_y;
+    float32_t *ws_velocity_z;
+    // May dictate the texture being displayed
+    float32_t *life;
+    // How fast life goes up (or down)
+    float32_t *life_rate;
+    float32_t *size;
+
+    // Points straight into the (mapped) GPU particles buffer - live particles get gathered in here
     uint32_t rendered_particles_stack_head = 0;
     rendered_particle_data_t *rendered_particles;
-    float32_t *distances_from_camera;
+
+    // Depth sorting: 16 bit keys (quantized distance from camera) which index into the particles arrays
+    // Per particle
+    uint16_t *depth_keys;
+    uint8_t *is_rendered;
+    // Per rendered particle
+    uint16_t *sort_keys;
+    uint16_t *sort_indices;
+    uint16_t *sort_scratch_keys;
+    uint16_t *sort_scratch_indices;
+    // Last frame's sorted order is used as a starting point (particles don't move much between frames)
+    uint32_t previous_sorted_count = 0;
 
     uint32_t max_dead;
     uint32_t dead_count;
@@ -660,7 +679,10 @@ struct particle_spawner_t {
 
     particle_effect_function_t update;
     pipeline_handle_t shader;
+    // Holds max_particles * 2 rendered particles (don't write to the half that the GPU may still be reading)
     gpu_buffer_t gpu_particles_buffer;
+    mapped_gpu_memory_t gpu_particles_mapped;
+    uint32_t current_buffer_half;
 
     image2d_t texture_atlas;
     uniform_group_t texture_uniform;
@@ -670,6 +692,16 @@ struct particle_spawner_t {
 };
 
 
+// Particle kernels (used to build the particle effect functions)
+void integrate_particles(particle_spawner_t *spawner, float32_t dt);
+void age_particles(particle_spawner_t *spawner, float32_t dt);
+// Life goes back and forth between 0 and max_life_length (particle stays alive until declared dead)
+void age_particles_back_and_forth(particle_spawner_t *spawner, float32_t dt);
+void kill_expired_particles(particle_spawner_t *spawner);
+// Lists the live particles (in last frame's sorted order) with their depth keys, needs to be followed by sort_for_render()
+void compact_particles_for_render(particle_spawner_t *spawner, const vector3_t &ws_camera_position);
+
+
 struct particle_rendering_t {
     model_t particle_instanced_model;
     uniform_group_t position_subpass_input;
@@ -0,0 +1,338 @@
+#include "interest.hpp"
+#include "chunks_gstate.hpp"
+#include "net.hpp"
+
+
+static_assert(MAX_CLIENTS <= 64, "Sets of relevant players are stored in 64 bit masks");
+
+
+#define INTEREST_CELL_EDGE_LENGTH (CHUNK_EDGE_LENGTH * INTEREST_CELL_CHUNKS)
+
+// Grid only covers the map: players which are outside get put in the closest cell
+struct interest_grid_t {
+    uint32_t edge_length;
+    // Index of the first player in the cell (-1 = empty)
+    int32_t *cell_heads;
+
+    uint32_t player_count;
+    int32_t next_player[MAX_CLIENTS];
+    vector3_t xs_positions[MAX_CLIENTS];
+    uint16_t ids[MAX_CLIENTS];
+};
+
+static interest_grid_t grid = {};
+
+
+// Chunk which the client is missing changes of
+struct outdated_chunk_t {
+    uint16_t chunk_index;
+    // Version which last got sent (unreliably) and when (0 = never)
+    uint32_t sent_version;
+    uint64_t sent_game_state_tick;
+};
+
+// Chunk versions which went in a snapshot (get acknowledged with the snapshot)
+struct sent_chunk_versions_t {
+    uint64_t game_state_tick;
+    uint32_t count;
+    uint16_t chunk_indices[MAX_CHUNK_DELTAS_PER_SNAPSHOT];
+    uint32_t versions[MAX_CHUNK_DELTAS_PER_SNAPSHOT];
+};
+
+struct client_interest_t {
+    uint32_t chunk_count;
+    // Version of every chunk that the client has for sure
+    uint32_t *acknowledged_versions;
+
+    uint8_t *outdated_bits;
+    outdated_chunk_t *outdated_chunks;
+    uint32_t outdated_count;
+
+    // Indexed with the game state tick
+    sent_chunk_versions_t sent[MAX_GAME_STATE_BASELINES];
+
+    // Chunks get verified in order (next chunk index to look at)
+    uint32_t verify_cursor;
+};
+
+static client_interest_t client_interests[MAX_CLIENTS] = {};
+
+
+static ivector3_t s_xs_to_cell(const vector3_t &xs_position) {
+    ivector3_t cell = ivector3_t(glm::floor(xs_position / (float32_t)INTEREST_CELL_EDGE_LENGTH));
+    return(glm::clamp(cell, ivector3_t(0), ivector3_t(grid.edge_length - 1)));
+}
+
+static float32_t s_chunk_distance(const vector3_t &xs_position, chunk_t *chunk) {
+    vector3_t xs_chunk_center = vector3_t(chunk->xs_bottom_corner) + vector3_t((float32_t)CHUNK_EDGE_LENGTH / 2.0f);
+    return(glm::length(xs_chunk_center - xs_position) / (float32_t)CHUNK_EDGE_LENGTH);
+}
+
+static client_interest_t *s_get_client_interest(uint16_t client_id) {
+    client_interest_t *interest = &client_interests[client_id];
+
+    uint32_t chunk_grid_edge_length = (uint32_t)get_chunk_grid_size();
+    uint32_t chunk_count = chunk_grid_edge_length * chunk_grid_edge_length * chunk_grid_edge_length;
+
+    // Map changed (or first time)
+    if (interest->chunk_count != chunk_count) {
+        free(interest->acknowledged_versions);
+        free(interest->outdated_bits);
+        free(interest->outdated_chunks);
+
+        interest->chunk_count = chunk_count;
+        interest->acknowledged_versions = (uint32_t *)malloc(sizeof(uint32_t) * chunk_count);
+        interest->outdated_bits = (uint8_t *)malloc((chunk_count + 7) / 8);
+        interest->outdated_chunks = (outdated_chunk_t *)malloc(sizeof(outdated_chunk_t) * chunk_count);
+        interest->outdated_count = 0;
+        memset(interest->acknowledged_versions, 0, sizeof(uint32_t) * chunk_count);
+        memset(interest->outdated_bits, 0, (chunk_count + 7) / 8);
+        memset(interest->sent, 0, sizeof(interest->sent));
+    }
+
+    return(interest);
+}
+
+
+void build_interest_grid(uint32_t player_count, const vector3_t *ws_player_positions, const uint16_t *player_ids) {
+    uint32_t edge_length = ((uint32_t)get_chunk_grid_size() + INTEREST_CELL_CHUNKS - 1) / INTEREST_CELL_CHUNKS;
+    edge_length = MAX(edge_length, 1u);
+
+    if (edge_length != grid.edge_length) {
+        free(grid.cell_heads);
+        grid.edge_length = edge_length;
+        grid.cell_heads = (int32_t *)malloc(sizeof(int32_t) * edge_length * edge_length * edge_length);
+    }
+
+    memset(grid.cell_heads, 0xFF, sizeof(int32_t) * edge_length * edge_length * edge_length);
+
+    grid.player_count = player_count;
+    for (uint32_t i = 0; i < player_count; ++i) {
+        grid.xs_positions[i] = ws_to_xs(ws_player_positions[i]);
+        grid.ids[i] = player_ids[i];
+
+        ivector3_t cell = s_xs_to_cell(grid.xs_positions[i]);
+        int32_t *head = &grid.cell_heads[convert_3d_to_1d_index(cell.x, cell.y, cell.z, edge_length)];
+        grid.next_player[i] = *head;
+        *head = (int32_t)i;
+    }
+}
+
+
+uint32_t gather_relevant_players(const vector3_t &ws_position, const vector3_t &ws_direction, uint64_t game_state_tick, uint32_t *player_indices) {
+    vector3_t xs_position = ws_to_xs(ws_position);
+
+    // Only the cells which intersect with the far radius get visited
+    vector3_t xs_far_radius = vector3_t(INTEREST_FAR_RADIUS * (float32_t)CHUNK_EDGE_LENGTH);
+    ivector3_t min_cell = s_xs_to_cell(xs_position - xs_far_radius);
+    ivector3_t max_cell = s_xs_to_cell(xs_position + xs_far_radius);
+
+    uint32_t count = 0;
+    for (int32_t z = min_cell.z; z <= max_cell.z; ++z) {
+        for (int32_t y = min_cell.y; y <= max_cell.y; ++y) {
+            for (int32_t x = min_cell.x; x <= max_cell.x; ++x) {
+                for (int32_t player = grid.cell_heads[convert_3d_to_1d_index(x, y, z, grid.edge_length)]; player >= 0; player = grid.next_player[player]) {
+                    vector3_t difference = grid.xs_positions[player] - xs_position;
+                    float32_t distance = glm::length(difference) / (float32_t)CHUNK_EDGE_LENGTH;
+
+                    uint32_t level;
+                    if (distance < INTEREST_NEAR_RADIUS) level = IL_NEAR;
+                    else if (distance < INTEREST_MEDIUM_RADIUS) level = IL_MEDIUM;
+                    else if (distance < INTEREST_FAR_RADIUS) level = IL_FAR;
+                    else continue;
+
+                    // Players which are close enough can always hit the client, even from behind
+                    if (level != IL_NEAR && glm::dot(difference, ws_direction) < INTEREST_VIEW_CONE_COS * glm::length(difference) * glm::length(ws_direction)) {
+                        ++level;
+                    }
+
+                    // Offset by the id so that the players which get sent less often don't all get sent the same snapshot
+                    uint64_t interval = 1ull << level;
+                    if (((game_state_tick + grid.ids[player]) & (interval - 1)) == 0) {
+                        player_indices[count++] = (uint32_t)player;
+                    }
+                }
+            }
+        }
+    }
+
+    return(count);
+}
+
+
+static void s_flag_outdated_chunk(client_interest_t *interest, uint32_t chunk_index) {
+    uint8_t bit = (uint8_t)(1 << (chunk_index & 7));
+
+    if (!(interest->outdated_bits[chunk_index >> 3] & bit)) {
+        interest->outdated_bits[chunk_index >> 3] |= bit;
+
+        outdated_chunk_t *outdated = &interest->outdated_chunks[interest->outdated_count++];
+        outdated->chunk_index = (uint16_t)chunk_index;
+        outdated->sent_version = 0;
+        outdated->sent_game_state_tick = 0;
+    }
+}
+
+
+void flag_modified_chunks(uint32_t modified_chunk_count, chunk_t **modified_chunks) {
+    uint32_t grid_edge_length = (uint32_t)get_chunk_grid_size();
+
+    for (uint32_t client_id = 0; client_id < MAX_CLIENTS; ++client_id) {
+        client_interest_t *interest = &client_interests[client_id];
+
+        // Client never joined
+        if (!interest->chunk_count) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < modified_chunk_count; ++i) {
+            chunk_t *chunk = modified_chunks[i];
+            uint32_t chunk_index = (uint32_t)convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, grid_edge_length);
+            s_flag_outdated_chunk(interest, chunk_index);
+        }
+    }
+}
+
+
+uint32_t gather_outdated_chunks_in_range(uint16_t client_id, const vector3_t &ws_position, uint64_t game_state_tick, chunk_t **chunks, uint32_t *acknowledged_versions, uint32_t max_chunks) {
+    client_interest_t *interest = s_get_client_interest(client_id);
+    vector3_t xs_position = ws_to_xs(ws_position);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < interest->outdated_count && count < max_chunks;) {
+        outdated_chunk_t *outdated = &interest->outdated_chunks[i];
+        chunk_t *chunk = *get_chunk((int32_t)outdated->chunk_index);
+        uint32_t acknowledged_version = interest->acknowledged_versions[outdated->chunk_index];
+
+        // Client has everything
+        if (acknowledged_version >= chunk->version) {
+            interest->outdated_bits[outdated->chunk_index >> 3] &= (uint8_t)~(1 << (outdated->chunk_index & 7));
+            *outdated = interest->outdated_chunks[--interest->outdated_count];
+            continue;
+        }
+
+        // Changes which are on their way don't get sent again straight away
+        bool is_due = outdated->sent_version < chunk->version || game_state_tick - outdated->sent_game_state_tick >= CHUNK_RESEND_INTERVAL;
+
+        if (is_due && s_chunk_distance(xs_position, chunk) < INTEREST_FAR_RADIUS) {
+            chunks[count] = chunk;
+            acknowledged_versions[count] = acknowledged_version;
+            ++count;
+        }
+
+        ++i;
+    }
+
+    return(count);
+}
+
+
+static outdated_chunk_t *s_find_outdated_chunk(client_interest_t *interest, uint16_t chunk_index) {
+    if (!(interest->outdated_bits[chunk_index >> 3] & (1 << (chunk_index & 7)))) {
+        return(nullptr);
+    }
+
+    for (uint32_t i = 0; i < interest->outdated_count; ++i) {
+        if (interest->outdated_chunks[i].chunk_index == chunk_index) {
+            return(&interest->outdated_chunks[i]);
+        }
+    }
+
+    return(nullptr);
+}
+
+
+static uint16_t s_get_chunk_index(chunk_t *chunk) {
+    return((uint16_t)convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)get_chunk_grid_size()));
+}
+
+
+void record_sent_chunk_version(uint16_t client_id, uint64_t game_state_tick, chunk_t *chunk) {
+    client_interest_t *interest = s_get_client_interest(client_id);
+    uint16_t chunk_index = s_get_chunk_index(chunk);
+
+    sent_chunk_versions_t *sent = &interest->sent[game_state_tick % MAX_GAME_STATE_BASELINES];
+    if (sent->game_state_tick != game_state_tick) {
+        sent->game_state_tick = game_state_tick;
+        sent->count = 0;
+    }
+
+    if (sent->count < MAX_CHUNK_DELTAS_PER_SNAPSHOT) {
+        sent->chunk_indices[sent->count] = chunk_index;
+        sent->versions[sent->count] = chunk->version;
+        ++sent->count;
+    }
+
+    outdated_chunk_t *outdated = s_find_outdated_chunk(interest, chunk_index);
+    if (outdated) {
+        outdated->sent_version = chunk->version;
+        outdated->sent_game_state_tick = game_state_tick;
+    }
+}
+
+
+void acknowledge_chunk_version(uint16_t client_id, chunk_t *chunk) {
+    client_interest_t *interest = s_get_client_interest(client_id);
+    uint16_t chunk_index = s_get_chunk_index(chunk);
+
+    interest->acknowledged_versions[chunk_index] = MAX(interest->acknowledged_versions[chunk_index], chunk->version);
+}
+
+
+void acknowledge_game_state_chunk_versions(uint16_t client_id, uint64_t game_state_tick) {
+    client_interest_t *interest = s_get_client_interest(client_id);
+
+    sent_chunk_versions_t *sent = &interest->sent[game_state_tick % MAX_GAME_STATE_BASELINES];
+    if (sent->game_state_tick != game_state_tick) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < sent->count; ++i) {
+        uint32_t *acknowledged_version = &interest->acknowledged_versions[sent->chunk_indices[i]];
+        *acknowledged_version = MAX(*acknowledged_version, sent->versions[i]);
+    }
+
+    sent->game_state_tick = 0;
+    sent->count = 0;
+}
+
+
+void reset_interest_state(uint16_t client_id) {
+    client_interest_t *interest = s_get_client_interest(client_id);
+
+    memset(interest->outdated_bits, 0, (interest->chunk_count + 7) / 8);
+    interest->outdated_count = 0;
+    memset(interest->sent, 0, sizeof(interest->sent));
+    interest->verify_cursor = 0;
+
+    // Client starts from the map (version 0 of every chunk): the chunks which it gets sent / keeps from its cache get acknowledged afterwards
+    memset(interest->acknowledged_versions, 0, sizeof(uint32_t) * interest->chunk_count);
+    for (uint32_t i = 0; i < interest->chunk_count; ++i) {
+        if ((*get_chunk((int32_t)i))->version) {
+            s_flag_outdated_chunk(interest, i);
+        }
+    }
+}
+
+
+uint32_t gather_chunks_to_verify(uint16_t client_id, const vector3_t &ws_position, chunk_t **chunks, uint32_t max_chunks) {
+    client_interest_t *interest = s_get_client_interest(client_id);
+    vector3_t xs_position = ws_to_xs(ws_position);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < interest->chunk_count && count < max_chunks; ++i) {
+        uint32_t chunk_index = interest->verify_cursor;
+        interest->verify_cursor = (interest->verify_cursor + 1) % interest->chunk_count;
+
+        chunk_t *chunk = *get_chunk((int32_t)chunk_index);
+        bool is_outdated = interest->outdated_bits[chunk_index >> 3] & (1 << (chunk_index & 7));
+
+        // Only chunks with something in them, which the client has the current version of
+        if (chunk->hash && !is_outdated && interest->acknowledged_versions[chunk_index] == chunk->version &&
+            s_chunk_distance(xs_position, chunk) < INTEREST_FAR_RADIUS) {
+            chunks[count++] = chunk;
+        }
+    }
+
+    return(count);
+}
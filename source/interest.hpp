@@ -0,0 +1,60 @@
+#pragma once
+
+#include "utility.hpp"
+#include "chunk.hpp"
+
+
+// Interest management (server only): every client only gets what is around it
+// Players get sent at a rate which depends on their distance to the client and on whether they are in the client's view cone
+// Chunks are versioned: every client gets sent what changed since the version of the chunk that it acknowledged, once it is close enough
+// (changes which got lost / which happened while the client was far get coalesced, whole chunks only get sent if the client is too far behind)
+
+// Players get bucketed in cells of INTEREST_CELL_CHUNKS ^ 3 chunks
+#define INTEREST_CELL_CHUNKS 4
+// Distances are in chunks
+#define INTEREST_NEAR_RADIUS 3.0f
+#define INTEREST_MEDIUM_RADIUS 6.0f
+#define INTEREST_FAR_RADIUS 12.0f
+// cos(60 degrees): anything further than INTEREST_NEAR_RADIUS and outside of the view cone gets sent half as often
+#define INTEREST_VIEW_CONE_COS 0.5f
+
+
+// Player at interest level L gets sent every 2 ^ L snapshots
+enum interest_level_t : uint8_t { IL_NEAR, IL_MEDIUM, IL_FAR, IL_PERIPHERAL, IL_NOT_RELEVANT };
+
+#define MAX_INTEREST_SEND_INTERVAL (1 << IL_PERIPHERAL)
+
+
+// Needs to be called every snapshot, before gathering anything
+void build_interest_grid(uint32_t player_count, const vector3_t *ws_player_positions, const uint16_t *player_ids);
+
+// Fills player_indices with the indices (into the arrays given to build_interest_grid) of the players which need to be sent to this client this snapshot
+uint32_t gather_relevant_players(const vector3_t &ws_position, const vector3_t &ws_direction, uint64_t game_state_tick, uint32_t *player_indices);
+
+// Most chunks which a client gets sent changes of in one snapshot (others wait for the next snapshots)
+#define MAX_CHUNK_DELTAS_PER_SNAPSHOT 32
+// In snapshots: changes which weren't acknowledged get sent again after this long
+#define CHUNK_RESEND_INTERVAL 4
+
+// Needs to be called every snapshot, once the modified chunks got their new version: every client is now missing them
+void flag_modified_chunks(uint32_t modified_chunk_count, chunk_t **modified_chunks);
+
+// Chunks close to the client which it is missing changes of (and which weren't sent to it in the last CHUNK_RESEND_INTERVAL snapshots)
+// acknowledged_versions gets filled with the version of each chunk that the client has for sure
+uint32_t gather_outdated_chunks_in_range(uint16_t client_id, const vector3_t &ws_position, uint64_t game_state_tick, chunk_t **chunks, uint32_t *acknowledged_versions, uint32_t max_chunks);
+
+// Changes of the chunk (up to its current version) went in this snapshot: they count once the client acknowledges it
+void record_sent_chunk_version(uint16_t client_id, uint64_t game_state_tick, chunk_t *chunk);
+// Whole chunk went through the reliable channel: client will get this version no matter what
+void acknowledge_chunk_version(uint16_t client_id, chunk_t *chunk);
+void acknowledge_game_state_chunk_versions(uint16_t client_id, uint64_t game_state_tick);
+
+// When a client joins: client only has version 0 of every chunk until versions get acknowledged
+void reset_interest_state(uint16_t client_id);
+
+// In snapshots: how often a client gets sent the hashes of some of the chunks around it (to detect desyncs)
+#define CHUNK_VERIFY_INTERVAL 20
+#define MAX_CHUNK_HASHES_PER_SNAPSHOT 16
+
+// Goes through the chunks in range over several calls (only the ones which the client acknowledged the current version of)
+uint32_t gather_chunks_to_verify(uint16_t client_id, const vector3_t &ws_position, chunk_t **chunks, uint32_t max_chunks);
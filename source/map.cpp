@@ -42,7 +42,7 @@ void load_map(map_data_t *data, const char *src_path, model_t *chunk_model) {
             for (uint32_t x = 0; x < data->grid_edge_size; ++x) {
                 uint32_t i = convert_3d_to_1d_index(x, y, z, data->grid_edge_size);
                 chunk_t **chunk_pptr = &data->chunks[i];
-                *chunk_pptr = (chunk_t *)allocate_free_list(sizeof(chunk_t));
+                *chunk_pptr = allocate_chunk();
     
                 vector3_t position = vector3_t(x, y, z) * (float32_t)(CHUNK_EDGE_LENGTH) - vector3_t((float32_t)data->grid_edge_size / 2) * (float32_t)(CHUNK_EDGE_LENGTH);
 
@@ -71,6 +71,7 @@ void load_map(map_data_t *data, const char *src_path, model_t *chunk_model) {
         chunk_t *chunk_ptr = data->chunks[index];
         
         serializer.deserialize_bytes((uint8_t *)chunk_ptr->voxels, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+        chunk_ptr->compute_hash();
 
         data->to_update[i] = chunk_ptr;
 
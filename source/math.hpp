@@ -106,6 +106,17 @@ inline float32_t interpolate(float32_t a, float32_t b, float32_t x) {
 }
 
 
+// Cubic Hermite: goes through a (x = 0) and b (x = 1) with the given velocities (per second), duration = time it takes to go from a to b
+inline vector3_t interpolate_hermite(const vector3_t &a, const vector3_t &a_velocity, const vector3_t &b, const vector3_t &b_velocity, float32_t duration, float32_t x) {
+    float32_t x2 = x * x;
+    float32_t x3 = x2 * x;
+    return((2.0f * x3 - 3.0f * x2 + 1.0f) * a +
+           (x3 - 2.0f * x2 + x) * duration * a_velocity +
+           (-2.0f * x3 + 3.0f * x2) * b +
+           (x3 - x2) * duration * b_velocity);
+}
+
+
 inline float32_t squared(float32_t f) {
     return(f * f);
 }
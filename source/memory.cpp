@@ -1,8 +1,21 @@
 #include "utility.hpp"
 #include "memory.hpp"
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 #include <cassert>
 
+#if MEMORY_TRACKING
+#include <mutex>
+#endif
+
+#if defined (_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 inline uint8_t get_alignment_adjust(void *ptr, uint32_t alignment) {
     byte_t *byte_cast_ptr = (byte_t *)ptr;
     uint8_t adjustment = alignment - (uint8_t)(reinterpret_cast<uint64_t>(ptr) & static_cast<uint64_t>(alignment - 1));
@@ -11,18 +24,312 @@ inline uint8_t get_alignment_adjust(void *ptr, uint32_t alignment) {
     return(adjustment);
 }
 
-void *allocate_linear_impl(uint32_t alloc_size, alignment_t alignment, const char *name, linear_allocator_t *allocator) {
-    void *prev = allocator->current;
-    void *new_crnt = (byte_t *)allocator->current + alloc_size;
+#if MEMORY_TRACKING
+
+// Worker threads have their own linear allocators, but tracking is shared
+struct memory_tracker_t {
+    std::mutex mutex;
+
+    uint32_t tag_count;
+    allocation_tag_stats_t tags[MAX_ALLOCATION_TAGS];
+    // Open addressing: index + 1 of the tag (0 = empty slot)
+    uint16_t tag_table[MAX_ALLOCATION_TAGS * 2];
+
+    allocator_usage_t usages[(uint32_t)allocator_type_t::COUNT];
+};
+
+static memory_tracker_t tracker;
+
+struct linear_allocator_tracking_t {
+    uint64_t live_bytes[MAX_ALLOCATION_TAGS];
+    uint32_t live_count[MAX_ALLOCATION_TAGS];
+};
+
+// Mutex needs to be owned
+static uint32_t s_get_tag(allocator_type_t type, const char *name) {
+    if (!name || !name[0]) {
+        name = "untagged";
+    }
+
+    uint32_t hash = 2166136261 ^ (uint32_t)type;
+    for (const char *c = name; *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 16777619;
+    }
+
+    uint32_t table_size = MAX_ALLOCATION_TAGS * 2;
+    for (uint32_t i = hash & (table_size - 1);; i = (i + 1) & (table_size - 1)) {
+        uint32_t slot = tracker.tag_table[i];
+        if (!slot) {
+            // Last slots are reserved for all the names which didn't fit (one per allocator type)
+            const char *overflow_name = "(too many tags)";
+            if (tracker.tag_count >= MAX_ALLOCATION_TAGS - (uint32_t)allocator_type_t::COUNT && strcmp(name, overflow_name)) {
+                return(s_get_tag(type, overflow_name));
+            }
+
+            uint32_t tag_index = tracker.tag_count++;
+            allocation_tag_stats_t *tag = &tracker.tags[tag_index];
+            memset(tag, 0, sizeof(allocation_tag_stats_t));
+            strncpy(tag->name, name, MAX_ALLOCATION_TAG_NAME_LENGTH - 1);
+            tag->allocator = type;
 
-    allocator->current = new_crnt;
-    allocator->used_capacity += alloc_size;
+            tracker.tag_table[i] = (uint16_t)(tag_index + 1);
+            return(tag_index);
+        }
 
-    return(prev);
+        allocation_tag_stats_t *tag = &tracker.tags[slot - 1];
+        if (tag->allocator == type && !strncmp(tag->name, name, MAX_ALLOCATION_TAG_NAME_LENGTH - 1)) {
+            return(slot - 1);
+        }
+    }
+}
+
+// used = memory that the allocator is using after the allocation (for the high-water marks of the linear / stack allocators)
+static uint32_t s_track_allocation(allocator_type_t type, const char *name, uint64_t size, uint64_t used, linear_allocator_t *arena = nullptr) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    uint32_t tag_index = s_get_tag(type, name);
+
+    if (arena) {
+        if (!arena->tracking) {
+            arena->tracking = (linear_allocator_tracking_t *)calloc(1, sizeof(linear_allocator_tracking_t));
+        }
+
+        arena->tracking->live_bytes[tag_index] += size;
+        ++(arena->tracking->live_count[tag_index]);
+    }
+
+    allocation_tag_stats_t *tag = &tracker.tags[tag_index];
+    allocator_usage_t *usage = &tracker.usages[(uint32_t)type];
+
+    tag->live_bytes += size;
+    ++(tag->live_count);
+    ++(tag->allocation_count);
+    if (tag->live_bytes > tag->peak_bytes) {
+        tag->peak_bytes = tag->live_bytes;
+    }
+
+    usage->live_bytes += size;
+    ++(usage->live_count);
+    ++(usage->allocation_count);
+    if (usage->live_bytes > usage->peak_bytes) {
+        usage->peak_bytes = usage->live_bytes;
+    }
+    if (used > usage->frame_high_water) {
+        usage->frame_high_water = used;
+    }
+
+    return(tag_index);
+}
+
+static void s_track_resize(uint32_t tag_index, uint64_t extension_size, uint64_t used) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    allocation_tag_stats_t *tag = &tracker.tags[tag_index];
+    allocator_usage_t *usage = &tracker.usages[(uint32_t)tag->allocator];
+
+    tag->live_bytes += extension_size;
+    if (tag->live_bytes > tag->peak_bytes) {
+        tag->peak_bytes = tag->live_bytes;
+    }
+
+    usage->live_bytes += extension_size;
+    if (usage->live_bytes > usage->peak_bytes) {
+        usage->peak_bytes = usage->live_bytes;
+    }
+    if (used > usage->frame_high_water) {
+        usage->frame_high_water = used;
+    }
+}
+
+// Everything that was allocated from the arena stops being live
+static void s_track_linear_clear(linear_allocator_t *arena) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    if (!arena->tracking) {
+        return;
+    }
+
+    allocator_usage_t *usage = &tracker.usages[(uint32_t)allocator_type_t::LINEAR];
+    for (uint32_t i = 0; i < tracker.tag_count; ++i) {
+        allocation_tag_stats_t *tag = &tracker.tags[i];
+        tag->live_bytes -= arena->tracking->live_bytes[i];
+        tag->live_count -= arena->tracking->live_count[i];
+
+        usage->live_bytes -= arena->tracking->live_bytes[i];
+        usage->live_count -= arena->tracking->live_count[i];
+    }
+
+    memset(arena->tracking, 0, sizeof(linear_allocator_tracking_t));
+}
+
+static void s_track_deallocation(uint32_t tag_index, uint64_t size) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    allocation_tag_stats_t *tag = &tracker.tags[tag_index];
+    allocator_usage_t *usage = &tracker.usages[(uint32_t)tag->allocator];
+
+    tag->live_bytes -= size;
+    --(tag->live_count);
+
+    usage->live_bytes -= size;
+    --(usage->live_count);
+}
+
+#endif
+
+#if defined (_WIN32)
+
+void *reserve_virtual_memory(uint64_t size, uint32_t flags) {
+    return(VirtualAlloc(NULL, (SIZE_T)size, MEM_RESERVE, PAGE_NOACCESS));
+}
+
+bool commit_virtual_memory(void *address, uint64_t size) {
+    return(VirtualAlloc(address, (SIZE_T)size, MEM_COMMIT, PAGE_READWRITE) != NULL);
+}
+
+void decommit_virtual_memory(void *address, uint64_t size) {
+    VirtualFree(address, (SIZE_T)size, MEM_DECOMMIT);
+}
+
+void release_virtual_memory(void *address, uint64_t size) {
+    VirtualFree(address, 0, MEM_RELEASE);
+}
+
+#else
+
+void *reserve_virtual_memory(uint64_t size, uint32_t flags) {
+    void *address = mmap(NULL, (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (address == MAP_FAILED) {
+        return(nullptr);
+    }
+
+#if defined (MADV_HUGEPAGE)
+    if (flags & VIRTUAL_MEMORY_HUGE_PAGES) {
+        madvise(address, (size_t)size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return(address);
+}
+
+bool commit_virtual_memory(void *address, uint64_t size) {
+    return(mprotect(address, (size_t)size, PROT_READ | PROT_WRITE) == 0);
+}
+
+void decommit_virtual_memory(void *address, uint64_t size) {
+    // Gives the pages back, touching them again would fault
+    madvise(address, (size_t)size, MADV_DONTNEED);
+    mprotect(address, (size_t)size, PROT_NONE);
+}
+
+void release_virtual_memory(void *address, uint64_t size) {
+    munmap(address, (size_t)size);
+}
+
+#endif
+
+static uint64_t s_round_to_commit_granularity(uint64_t size, uint32_t flags) {
+    uint64_t granularity = (flags & VIRTUAL_MEMORY_HUGE_PAGES) ? VIRTUAL_MEMORY_HUGE_PAGE_SIZE : VIRTUAL_MEMORY_COMMIT_GRANULARITY;
+    return((size + granularity - 1) & ~(granularity - 1));
+}
+
+// Makes sure that the first `needed` bytes of the reserved range are committed
+static bool s_commit_up_to(void *start, uint64_t needed, uint64_t capacity, uint32_t flags, uint64_t *committed) {
+    if (needed <= *committed) {
+        return(1);
+    }
+
+    if (needed > capacity) {
+        return(0);
+    }
+
+    uint64_t new_committed = s_round_to_commit_granularity(needed, flags);
+    if (new_committed > capacity) {
+        new_committed = capacity;
+    }
+
+    if (!commit_virtual_memory((byte_t *)start + *committed, new_committed - *committed)) {
+        return(0);
+    }
+
+    *committed = new_committed;
+    return(1);
+}
+
+void initialize_linear_impl(uint64_t reserve_size, uint64_t retained_size, uint32_t flags, linear_allocator_t *allocator) {
+    allocator->capacity = reserve_size;
+    allocator->start = allocator->current = reserve_virtual_memory(reserve_size, flags);
+    allocator->used_capacity = 0;
+    allocator->committed = 0;
+    allocator->retained_size = retained_size;
+    allocator->flags = flags;
+
+    assert(allocator->start && "failed to reserve memory for linear allocator");
+}
+
+void *allocate_linear_impl(uint64_t alloc_size, alignment_t alignment, const char *name, linear_allocator_t *allocator) {
+    uint64_t address = (uint64_t)allocator->current;
+    if (alignment > 1) {
+        address = (address + (alignment - 1)) & ~(uint64_t)(alignment - 1);
+    }
+
+    uint64_t end = address + alloc_size;
+    if (!s_commit_up_to(allocator->start, end - (uint64_t)allocator->start, allocator->capacity, allocator->flags, &allocator->committed)) {
+        assert(0 && "linear allocator ran out of memory");
+        return(nullptr);
+    }
+
+    allocator->current = (void *)end;
+    allocator->used_capacity = end - (uint64_t)allocator->start;
+
+#if MEMORY_TRACKING
+    s_track_allocation(allocator_type_t::LINEAR, name, alloc_size, allocator->used_capacity, allocator);
+#endif
+
+    return((void *)address);
 }
 
 void clear_linear_impl(linear_allocator_t *allocator) {
+#if MEMORY_TRACKING
+    s_track_linear_clear(allocator);
+#endif
+
+    // Memory used past the high-water mark of the last cycle was a spike: give it back
+    uint64_t retained = allocator->used_capacity > allocator->retained_size ? allocator->used_capacity : allocator->retained_size;
+    retained = s_round_to_commit_granularity(retained, allocator->flags);
+
+    if (allocator->committed > retained) {
+        decommit_virtual_memory((byte_t *)allocator->start + retained, allocator->committed - retained);
+        allocator->committed = retained;
+    }
+
     allocator->current = allocator->start;
+    allocator->used_capacity = 0;
+}
+
+void initialize_double_buffered_linear_impl(uint64_t reserve_size_per_arena, uint64_t retained_size, uint32_t flags, double_buffered_linear_allocator_t *allocator) {
+    initialize_linear_impl(reserve_size_per_arena, retained_size, flags, &allocator->arenas[0]);
+    initialize_linear_impl(reserve_size_per_arena, retained_size, flags, &allocator->arenas[1]);
+    allocator->current = 0;
+}
+
+void initialize_stack_impl(uint64_t reserve_size, uint32_t flags, stack_allocator_t *allocator) {
+    allocator->capacity = reserve_size;
+    allocator->start = allocator->current = reserve_virtual_memory(reserve_size, flags);
+    allocator->allocation_count = 0;
+    allocator->committed = 0;
+    allocator->flags = flags;
+
+    assert(allocator->start && "failed to reserve memory for stack allocator");
+}
+
+linear_allocator_t *swap_double_buffered_linear_impl(double_buffered_linear_allocator_t *allocator) {
+    allocator->current ^= 1;
+
+    linear_allocator_t *current = &allocator->arenas[allocator->current];
+    clear_linear_impl(current);
+
+    return(current);
 }
 
 void *allocate_stack_impl(uint32_t allocation_size, alignment_t alignment, const char *name, stack_allocator_t *allocator) {
@@ -39,15 +346,24 @@ void *allocate_stack_impl(uint32_t allocation_size, alignment_t alignment, const
 
     // start address of (header + allocation)
     byte_t *start_address = (would_be_address + alignment_adjustment) - sizeof(stack_allocation_header_t);
-    assert((start_address + sizeof(stack_allocation_header_t) + allocation_size) < (uint8_t *)allocator->start + allocator->capacity);
+    // Room for the header of the next allocation too
+    uint64_t needed = (start_address + sizeof(stack_allocation_header_t) * 2 + allocation_size) - (byte_t *)allocator->start;
+    if (!s_commit_up_to(allocator->start, needed, allocator->capacity, allocator->flags, &allocator->committed)) {
+        assert(0 && "stack allocator ran out of memory");
+        return(nullptr);
+    }
 
     stack_allocation_header_t *header = (stack_allocation_header_t *)start_address;
     
 #if DEBUG
-    //header->allocation_name = name;
+    header->allocation_name = name;
     //    OUTPUT_DEBUG_LOG("stack allocation for \"%s\"\n", name);
 #endif
 
+#if MEMORY_TRACKING
+    header->tag = s_track_allocation(allocator_type_t::STACK, name, allocation_size, (start_address + sizeof(stack_allocation_header_t) + allocation_size) - (byte_t *)allocator->start);
+#endif
+
     header->size = allocation_size;
     header->prev = allocator->allocation_count == 0 ? nullptr : (stack_allocation_header_t *)allocator->current;
 
@@ -60,6 +376,15 @@ void *allocate_stack_impl(uint32_t allocation_size, alignment_t alignment, const
 void extend_stack_top_impl(uint32_t extension_size, stack_allocator_t *allocator) {
     stack_allocation_header_t *current_header = (stack_allocation_header_t *)allocator->current;
     current_header->size += extension_size;
+
+    uint64_t needed = ((byte_t *)(current_header + 2) + current_header->size) - (byte_t *)allocator->start;
+    if (!s_commit_up_to(allocator->start, needed, allocator->capacity, allocator->flags, &allocator->committed)) {
+        assert(0 && "stack allocator ran out of memory");
+    }
+
+#if MEMORY_TRACKING
+    s_track_resize(current_header->tag, extension_size, ((byte_t *)(current_header + 1) + current_header->size) - (byte_t *)allocator->start);
+#endif
 }
 
 void pop_stack_impl(stack_allocator_t *allocator) {
@@ -78,128 +403,542 @@ void pop_stack_impl(stack_allocator_t *allocator) {
     }
 #endif
 
+#if MEMORY_TRACKING
+    if (allocator->allocation_count) {
+        s_track_deallocation(current_header->tag, current_header->size);
+    }
+#endif
+
     if (allocator->allocation_count == 1) allocator->current = allocator->start;
     else allocator->current = current_header->prev;
     --(allocator->allocation_count);
 }
 
-void *allocate_free_list_impl(uint32_t allocation_size, alignment_t alignment, const char *name, free_list_allocator_t *allocator) {
-    uint32_t total_allocation_size = allocation_size + sizeof(free_list_allocation_header_t);
+#define BLOCK_FREE_BIT 1
+#define PREVIOUS_BLOCK_FREE_BIT 2
+#define BLOCK_FLAGS (BLOCK_FREE_BIT | PREVIOUS_BLOCK_FREE_BIT)
+#define BLOCK_HEADER_SIZE ((uint32_t)sizeof(free_block_header_t))
+// Free blocks need to be able to hold their links
+#define MIN_BLOCK_SIZE ((uint32_t)sizeof(free_block_links_t))
 
-    allocator->used_memory += total_allocation_size;
-    
-    // find best fit free block
-    // TODO(luc) : make free list allocator adjust the smallest free block according to the alignment as well
-    free_block_header_t *previous_free_block = nullptr;
-    free_block_header_t *smallest_free_block = allocator->free_block_head;
-
-    for (free_block_header_t *header = allocator->free_block_head; header; header = header->next_free_block) {
-	if (header->free_block_size >= total_allocation_size) {
-	    if (smallest_free_block->free_block_size >= header->free_block_size || smallest_free_block->free_block_size < total_allocation_size) {
-		smallest_free_block = header;
-		break;
-	    }
-	}
-	previous_free_block = header;
-    }
-    free_block_header_t *next = smallest_free_block->next_free_block;
-    if (previous_free_block) {
-	uint32_t previous_smallest_block_size = smallest_free_block->free_block_size;
-	previous_free_block->next_free_block = (free_block_header_t *)(((byte_t *)smallest_free_block) + total_allocation_size);
-	previous_free_block->next_free_block->free_block_size = previous_smallest_block_size - total_allocation_size;
-	previous_free_block->next_free_block->next_free_block = next;
+#ifndef __GNUC__
+#include <intrin.h>
+#endif
+
+static inline uint32_t s_find_last_set(uint32_t value) {
+#ifndef __GNUC__
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return((uint32_t)index);
+#else
+    return(31 - (uint32_t)__builtin_clz(value));
+#endif
+}
+
+static inline uint32_t s_find_first_set(uint32_t value) {
+#ifndef __GNUC__
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return((uint32_t)index);
+#else
+    return((uint32_t)__builtin_ctz(value));
+#endif
+}
+
+static inline free_block_header_t *s_get_block(free_list_allocator_t *allocator, uint32_t offset) {
+    return((free_block_header_t *)((byte_t *)allocator->start + offset));
+}
+
+static inline free_block_links_t *s_get_block_links(free_block_header_t *block) {
+    return((free_block_links_t *)(block + 1));
+}
+
+static inline uint32_t s_get_block_size(free_block_header_t *block) {
+    return(block->size_and_flags & ~BLOCK_FLAGS);
+}
+
+static inline uint32_t s_get_next_physical_block(free_list_allocator_t *allocator, uint32_t offset) {
+    return(offset + BLOCK_HEADER_SIZE + s_get_block_size(s_get_block(allocator, offset)));
+}
+
+static void s_get_list_of_size(uint32_t size, uint32_t *first_level, uint32_t *second_level) {
+    if (size < (1 << FREE_LIST_FIRST_LEVEL_SHIFT)) {
+        *first_level = 0;
+        *second_level = size >> FREE_LIST_ALIGNMENT_LOG2;
     }
     else {
-	free_block_header_t *new_block = (free_block_header_t *)(((byte_t *)smallest_free_block) + total_allocation_size);
-	allocator->free_block_head = new_block;
-	new_block->free_block_size = smallest_free_block->free_block_size - total_allocation_size;
-	new_block->next_free_block = smallest_free_block->next_free_block;
+        uint32_t last_set = s_find_last_set(size);
+        *second_level = (size >> (last_set - FREE_LIST_SECOND_LEVEL_COUNT_LOG2)) ^ (1 << FREE_LIST_SECOND_LEVEL_COUNT_LOG2);
+        *first_level = last_set - (FREE_LIST_FIRST_LEVEL_SHIFT - 1);
     }
-    
-    free_list_allocation_header_t *header = (free_list_allocation_header_t *)smallest_free_block;
-    header->size = allocation_size;
-#if DEBUG
-    //    header->name = name;
+}
+
+static void s_insert_free_block(free_list_allocator_t *allocator, uint32_t offset) {
+    free_block_header_t *block = s_get_block(allocator, offset);
+    uint32_t size = s_get_block_size(block);
+
+    uint32_t first_level, second_level;
+    s_get_list_of_size(size, &first_level, &second_level);
+
+    uint32_t *head = &allocator->free_blocks[first_level][second_level];
+
+    free_block_links_t *links = s_get_block_links(block);
+    links->previous_free_block = FREE_LIST_NULL_BLOCK;
+    links->next_free_block = *head;
+    if (*head != FREE_LIST_NULL_BLOCK) {
+        s_get_block_links(s_get_block(allocator, *head))->previous_free_block = offset;
+    }
+    *head = offset;
+
+    allocator->first_level_bitmap |= 1 << first_level;
+    allocator->second_level_bitmaps[first_level] |= 1 << second_level;
+
+    ++(allocator->free_block_count);
+    allocator->free_memory += size;
+}
+
+static void s_remove_free_block(free_list_allocator_t *allocator, uint32_t offset) {
+    free_block_header_t *block = s_get_block(allocator, offset);
+    uint32_t size = s_get_block_size(block);
+
+    uint32_t first_level, second_level;
+    s_get_list_of_size(size, &first_level, &second_level);
+
+    free_block_links_t *links = s_get_block_links(block);
+    if (links->next_free_block != FREE_LIST_NULL_BLOCK) {
+        s_get_block_links(s_get_block(allocator, links->next_free_block))->previous_free_block = links->previous_free_block;
+    }
+    if (links->previous_free_block != FREE_LIST_NULL_BLOCK) {
+        s_get_block_links(s_get_block(allocator, links->previous_free_block))->next_free_block = links->next_free_block;
+    }
+
+    uint32_t *head = &allocator->free_blocks[first_level][second_level];
+    if (*head == offset) {
+        *head = links->next_free_block;
+
+        if (*head == FREE_LIST_NULL_BLOCK) {
+            allocator->second_level_bitmaps[first_level] &= ~(1 << second_level);
+            if (!allocator->second_level_bitmaps[first_level]) {
+                allocator->first_level_bitmap &= ~(1 << first_level);
+            }
+        }
+    }
+
+    --(allocator->free_block_count);
+    allocator->free_memory -= size;
+}
+
+// Round up to the next list: any block in there is big enough (no need to go through the list)
+static uint32_t s_round_up_to_list_size(uint32_t size) {
+    if (size >= (1 << FREE_LIST_FIRST_LEVEL_SHIFT)) {
+        size += (1 << (s_find_last_set(size) - FREE_LIST_SECOND_LEVEL_COUNT_LOG2)) - 1;
+    }
+
+    return(size);
+}
+
+// Returns FREE_LIST_NULL_BLOCK if there is no block big enough (block gets removed from its list)
+static uint32_t s_find_free_block(free_list_allocator_t *allocator, uint32_t size) {
+    size = s_round_up_to_list_size(size);
+
+    uint32_t first_level, second_level;
+    s_get_list_of_size(size, &first_level, &second_level);
+
+    if (first_level >= FREE_LIST_FIRST_LEVEL_COUNT) {
+        return(FREE_LIST_NULL_BLOCK);
+    }
+
+    uint32_t second_level_map = allocator->second_level_bitmaps[first_level] & (~0u << second_level);
+    if (!second_level_map) {
+        // Lists with bigger blocks
+        uint32_t first_level_map = first_level + 1 < 32 ? allocator->first_level_bitmap & (~0u << (first_level + 1)) : 0;
+        if (!first_level_map) {
+            return(FREE_LIST_NULL_BLOCK);
+        }
+
+        first_level = s_find_first_set(first_level_map);
+        second_level_map = allocator->second_level_bitmaps[first_level];
+    }
+
+    second_level = s_find_first_set(second_level_map);
+
+    uint32_t offset = allocator->free_blocks[first_level][second_level];
+    s_remove_free_block(allocator, offset);
+
+    return(offset);
+}
+
+// What is left after size bytes becomes a free block of its own (if it is big enough to be one)
+static void s_split_block(free_list_allocator_t *allocator, uint32_t offset, uint32_t size) {
+    free_block_header_t *block = s_get_block(allocator, offset);
+    uint32_t block_size = s_get_block_size(block);
+
+    if (block_size >= size + BLOCK_HEADER_SIZE + MIN_BLOCK_SIZE) {
+        uint32_t remainder_offset = offset + BLOCK_HEADER_SIZE + size;
+        free_block_header_t *remainder = s_get_block(allocator, remainder_offset);
+        remainder->previous_physical_block = offset;
+        remainder->size_and_flags = (block_size - size - BLOCK_HEADER_SIZE) | BLOCK_FREE_BIT | (block->size_and_flags & BLOCK_FREE_BIT ? PREVIOUS_BLOCK_FREE_BIT : 0);
+
+        block->size_and_flags = size | (block->size_and_flags & BLOCK_FLAGS);
+
+        free_block_header_t *next = s_get_block(allocator, s_get_next_physical_block(allocator, remainder_offset));
+        next->previous_physical_block = remainder_offset;
+        next->size_and_flags |= PREVIOUS_BLOCK_FREE_BIT;
+
+        s_insert_free_block(allocator, remainder_offset);
+    }
+}
+
+// Commits more of the reserved range (at least doubles): the block at the end becomes a free block which can fit size bytes
+static bool s_grow_free_list(free_list_allocator_t *allocator, uint32_t size) {
+    uint64_t old_end = allocator->available_bytes;
+    uint64_t needed = old_end + s_round_up_to_list_size(size) + BLOCK_HEADER_SIZE * 2;
+    if (needed > allocator->reserved_bytes) {
+        return(0);
+    }
+
+    uint64_t new_end = s_round_to_commit_granularity(needed > old_end * 2 ? needed : old_end * 2, 0);
+    if (new_end > allocator->reserved_bytes) {
+        new_end = allocator->reserved_bytes & ~(uint64_t)(FREE_LIST_ALIGNMENT - 1);
+    }
+
+    if (!commit_virtual_memory((byte_t *)allocator->start + old_end, new_end - old_end)) {
+        return(0);
+    }
+
+    allocator->available_bytes = (uint32_t)new_end;
+
+    // Old end block turns into the new free memory
+    uint32_t offset = (uint32_t)old_end - BLOCK_HEADER_SIZE;
+    free_block_header_t *block = s_get_block(allocator, offset);
+    block->size_and_flags = ((uint32_t)(new_end - old_end) - BLOCK_HEADER_SIZE) | BLOCK_FREE_BIT | (block->size_and_flags & PREVIOUS_BLOCK_FREE_BIT);
+
+    if (block->size_and_flags & PREVIOUS_BLOCK_FREE_BIT) {
+        uint32_t previous_offset = block->previous_physical_block;
+        free_block_header_t *previous = s_get_block(allocator, previous_offset);
+        s_remove_free_block(allocator, previous_offset);
+
+        previous->size_and_flags = (s_get_block_size(previous) + BLOCK_HEADER_SIZE + s_get_block_size(block)) | (previous->size_and_flags & BLOCK_FLAGS);
+
+        offset = previous_offset;
+    }
+
+    free_block_header_t *last = s_get_block(allocator, (uint32_t)new_end - BLOCK_HEADER_SIZE);
+    last->previous_physical_block = offset;
+    last->size_and_flags = PREVIOUS_BLOCK_FREE_BIT;
+
+    s_insert_free_block(allocator, offset);
+
+    return(1);
+}
+
+void initialize_free_list_impl(free_list_allocator_t *allocator) {
+    allocator->first_level_bitmap = 0;
+    memset(allocator->second_level_bitmaps, 0, sizeof(allocator->second_level_bitmaps));
+    memset(allocator->free_blocks, 0xFF, sizeof(allocator->free_blocks));
+
+    allocator->allocation_count = 0;
+    allocator->used_memory = 0;
+    allocator->free_memory = 0;
+    allocator->free_block_count = 0;
+
+    uint32_t memory_size = allocator->available_bytes & ~(FREE_LIST_ALIGNMENT - 1);
+    allocator->available_bytes = memory_size;
+
+    free_block_header_t *block = s_get_block(allocator, 0);
+    block->previous_physical_block = FREE_LIST_NULL_BLOCK;
+    block->size_and_flags = (memory_size - BLOCK_HEADER_SIZE * 2) | BLOCK_FREE_BIT;
+
+    // Block of size 0 which is never free at the end: blocks never need to check whether there is a block after them
+    free_block_header_t *last = s_get_block(allocator, memory_size - BLOCK_HEADER_SIZE);
+    last->previous_physical_block = 0;
+    last->size_and_flags = PREVIOUS_BLOCK_FREE_BIT;
+
+    s_insert_free_block(allocator, 0);
+}
+
+void *allocate_free_list_impl(uint32_t allocation_size, alignment_t alignment, const char *name, free_list_allocator_t *allocator) {
+    uint32_t size = allocation_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : allocation_size;
+    size = (size + FREE_LIST_ALIGNMENT - 1) & ~(FREE_LIST_ALIGNMENT - 1);
+
+    // Bigger alignments: might need to put a free block in front of the allocation
+    uint32_t search_size = size;
+    if (alignment > FREE_LIST_ALIGNMENT) {
+        search_size += alignment + BLOCK_HEADER_SIZE + MIN_BLOCK_SIZE;
+    }
+
+    uint32_t offset = s_find_free_block(allocator, search_size);
+    if (offset == FREE_LIST_NULL_BLOCK) {
+        if (!s_grow_free_list(allocator, search_size)) {
+            assert(0 && "free list allocator ran out of memory");
+            return(nullptr);
+        }
+
+        offset = s_find_free_block(allocator, search_size);
+    }
+
+    if (alignment > FREE_LIST_ALIGNMENT) {
+        byte_t *memory = (byte_t *)(s_get_block(allocator, offset) + 1);
+        uint32_t gap = get_alignment_adjust(memory, alignment) % alignment;
+        // Gap needs to be big enough to be a free block
+        while (gap && gap < BLOCK_HEADER_SIZE + MIN_BLOCK_SIZE) {
+            gap += alignment;
+        }
+
+        if (gap) {
+            free_block_header_t *gap_block = s_get_block(allocator, offset);
+            uint32_t block_size = s_get_block_size(gap_block);
+
+            uint32_t aligned_offset = offset + gap;
+            free_block_header_t *aligned_block = s_get_block(allocator, aligned_offset);
+            aligned_block->previous_physical_block = offset;
+            aligned_block->size_and_flags = (block_size - gap) | BLOCK_FREE_BIT | PREVIOUS_BLOCK_FREE_BIT;
+
+            gap_block->size_and_flags = (gap - BLOCK_HEADER_SIZE) | BLOCK_FREE_BIT | (gap_block->size_and_flags & PREVIOUS_BLOCK_FREE_BIT);
+
+            s_get_block(allocator, s_get_next_physical_block(allocator, aligned_offset))->previous_physical_block = aligned_offset;
+
+            s_insert_free_block(allocator, offset);
+            offset = aligned_offset;
+        }
+    }
+
+    s_split_block(allocator, offset, size);
+
+    free_block_header_t *block = s_get_block(allocator, offset);
+    block->size_and_flags &= ~BLOCK_FREE_BIT;
+    s_get_block(allocator, s_get_next_physical_block(allocator, offset))->size_and_flags &= ~PREVIOUS_BLOCK_FREE_BIT;
+
+    ++(allocator->allocation_count);
+    allocator->used_memory += s_get_block_size(block);
+
+#if MEMORY_TRACKING
+    block->tag = s_track_allocation(allocator_type_t::FREE_LIST, name, s_get_block_size(block), allocator->used_memory);
 #endif
-    return((byte_t *)header + sizeof(free_list_allocation_header_t));
+
+    return(block + 1);
 }
 
-// TODO(luc) : optimize free list allocator so that all the blocks are stored in order
 void deallocate_free_list_impl(void *pointer, free_list_allocator_t *allocator) {
-    free_list_allocation_header_t *allocation_header = (free_list_allocation_header_t *)((byte_t *)pointer - sizeof(free_list_allocation_header_t));
-    free_block_header_t *new_free_block_header = (free_block_header_t *)allocation_header;
-    new_free_block_header->free_block_size = allocation_header->size + sizeof(free_block_header_t);
+    if (!pointer) {
+        return;
+    }
 
-    allocator->used_memory -= new_free_block_header->free_block_size;
+    free_block_header_t *block = (free_block_header_t *)pointer - 1;
+    uint32_t offset = (uint32_t)((byte_t *)block - (byte_t *)allocator->start);
 
-    free_block_header_t *previous = nullptr;
-    free_block_header_t *current_header = allocator->free_block_head;
+    --(allocator->allocation_count);
+    allocator->used_memory -= s_get_block_size(block);
 
-    free_block_header_t *viable_prev = nullptr;
-    free_block_header_t *viable_next = nullptr;
-    
-    // check if possible to merge free blocks
-    bool merged = false;
-    for (; current_header; current_header = current_header->next_free_block) {
-	if (new_free_block_header > previous && new_free_block_header < current_header) {
-	    viable_prev = previous;
-	    viable_next = current_header;
-	}
-	
-	// check if free blocks will overlap
-	// does the header go over the newly freed header
-	if (current_header->free_block_size + (byte_t *)current_header >= (byte_t *)new_free_block_header
-	    && (byte_t *)current_header < (byte_t *)new_free_block_header) {
-	    current_header->free_block_size = (uint32_t)(((byte_t *)new_free_block_header + new_free_block_header->free_block_size) - (byte_t *)current_header);
-	    new_free_block_header = current_header;
-	    previous = current_header;
-	    merged = true;
-	    continue;
-	}
-	// does the newly freed header go over the header
-	if ((byte_t *)current_header <= (byte_t *)new_free_block_header + new_free_block_header->free_block_size
-	    && (byte_t *)current_header > (byte_t *)new_free_block_header) {
-	    // if current header is not the head of the list
-        new_free_block_header->free_block_size = (uint32_t)((byte_t *)((byte_t *)current_header + current_header->free_block_size) - (byte_t *)new_free_block_header);
-	    /*if (previous) {
-	      previous->next_free_block = new_free_block_header;
-	      }*/
-        if (!previous) {
-		allocator->free_block_head = new_free_block_header;
-	    }
-	    new_free_block_header->next_free_block = current_header->next_free_block;
-	    merged = true;
-	    
-	    previous = current_header;
-	    continue;
-	}
-
-	if (merged) return;
-	
-	previous = current_header;
-    }
-
-    if (merged) return;
-
-    // put the blocks in order if no blocks merged
-    // if viable_prev == nullptr && viable_next != nullptr -> new block should be before the head
-    // if viable_prev != nullptr && viable_next != nullptr -> new block should be between prev and next
-    // if viable_prev == nullptr && viable_next == nullptr -> new block should be after the last header
-    if (!viable_prev && viable_next) {
-	free_block_header_t *old_head = allocator->free_block_head;
-	allocator->free_block_head = new_free_block_header;
-	allocator->free_block_head->next_free_block = old_head;
-    }
-    else if (viable_prev && viable_next) {
-	viable_prev->next_free_block = new_free_block_header;
-	new_free_block_header->next_free_block = viable_next;
-    }
-    else if (!viable_prev && !viable_next) {
-	// at the end of the loop, previous is that last current before current = nullptr
-	previous->next_free_block = new_free_block_header;
-    }
-
-    if (new_free_block_header->free_block_size == 2033) {
-        __debugbreak();
+#if MEMORY_TRACKING
+    s_track_deallocation(block->tag, s_get_block_size(block));
+#endif
+
+    block->size_and_flags |= BLOCK_FREE_BIT;
+
+    // Merge with the blocks right before and right after if they are free: free blocks are never next to each other
+    if (block->size_and_flags & PREVIOUS_BLOCK_FREE_BIT) {
+        uint32_t previous_offset = block->previous_physical_block;
+        free_block_header_t *previous = s_get_block(allocator, previous_offset);
+        s_remove_free_block(allocator, previous_offset);
+
+        previous->size_and_flags = (s_get_block_size(previous) + BLOCK_HEADER_SIZE + s_get_block_size(block)) | (previous->size_and_flags & BLOCK_FLAGS);
+
+        offset = previous_offset;
+        block = previous;
+    }
+
+    uint32_t next_offset = s_get_next_physical_block(allocator, offset);
+    free_block_header_t *next = s_get_block(allocator, next_offset);
+    if (next->size_and_flags & BLOCK_FREE_BIT) {
+        s_remove_free_block(allocator, next_offset);
+
+        block->size_and_flags = (s_get_block_size(block) + BLOCK_HEADER_SIZE + s_get_block_size(next)) | (block->size_and_flags & BLOCK_FLAGS);
+
+        next_offset = s_get_next_physical_block(allocator, offset);
+        next = s_get_block(allocator, next_offset);
+    }
+
+    next->previous_physical_block = offset;
+    next->size_and_flags |= PREVIOUS_BLOCK_FREE_BIT;
+
+    s_insert_free_block(allocator, offset);
+}
+
+free_list_stats_t get_free_list_stats_impl(free_list_allocator_t *allocator) {
+    free_list_stats_t stats = {};
+    stats.allocation_count = allocator->allocation_count;
+    stats.used_bytes = allocator->used_memory;
+    stats.free_bytes = allocator->free_memory;
+    stats.free_block_count = allocator->free_block_count;
+
+    // Biggest free block is in the list of the biggest blocks
+    if (allocator->first_level_bitmap) {
+        uint32_t first_level = s_find_last_set(allocator->first_level_bitmap);
+        uint32_t second_level = s_find_last_set(allocator->second_level_bitmaps[first_level]);
+
+        for (uint32_t offset = allocator->free_blocks[first_level][second_level]; offset != FREE_LIST_NULL_BLOCK;) {
+            free_block_header_t *block = s_get_block(allocator, offset);
+            if (s_get_block_size(block) > stats.largest_free_block) {
+                stats.largest_free_block = s_get_block_size(block);
+            }
+            offset = s_get_block_links(block)->next_free_block;
+        }
+    }
+
+    stats.fragmentation = stats.free_bytes ? 1.0f - (float)stats.largest_free_block / (float)stats.free_bytes : 0.0f;
+
+    return(stats);
+}
+
+#if MEMORY_TRACKING
+
+void end_memory_tracking_frame(void) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    for (uint32_t i = 0; i < (uint32_t)allocator_type_t::COUNT; ++i) {
+        allocator_usage_t *usage = &tracker.usages[i];
+        usage->last_frame_high_water = usage->frame_high_water;
+        if (usage->frame_high_water > usage->peak_frame_high_water) {
+            usage->peak_frame_high_water = usage->frame_high_water;
+        }
+        usage->frame_high_water = 0;
+    }
+
+    // Stack allocations stay alive across frames (linear allocations stop being live when their arena gets cleared)
+    tracker.usages[(uint32_t)allocator_type_t::STACK].frame_high_water = tracker.usages[(uint32_t)allocator_type_t::STACK].live_bytes;
+}
+
+allocator_usage_t get_allocator_usage(allocator_type_t type) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+    return(tracker.usages[(uint32_t)type]);
+}
+
+uint32_t get_allocation_tag_stats(allocation_tag_stats_t *dst, uint32_t max_tags) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    uint32_t count = tracker.tag_count < max_tags ? tracker.tag_count : max_tags;
+    memcpy(dst, tracker.tags, sizeof(allocation_tag_stats_t) * count);
+
+    return(count);
+}
+
+allocation_tag_stats_t find_allocation_tag_stats(const char *name) {
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+
+    allocation_tag_stats_t stats = {};
+    strncpy(stats.name, name, MAX_ALLOCATION_TAG_NAME_LENGTH - 1);
+    stats.allocator = allocator_type_t::COUNT;
+
+    for (uint32_t i = 0; i < tracker.tag_count; ++i) {
+        allocation_tag_stats_t *tag = &tracker.tags[i];
+        if (!strncmp(tag->name, name, MAX_ALLOCATION_TAG_NAME_LENGTH - 1)) {
+            stats.live_bytes += tag->live_bytes;
+            stats.peak_bytes += tag->peak_bytes;
+            stats.live_count += tag->live_count;
+            stats.allocation_count += tag->allocation_count;
+        }
+    }
+
+    return(stats);
+}
+
+static const char *s_allocator_type_name(allocator_type_t type) {
+    switch (type) {
+    case allocator_type_t::LINEAR: return("linear");
+    case allocator_type_t::STACK: return("stack");
+    case allocator_type_t::FREE_LIST: return("free list");
+    default: return("");
+    }
+}
+
+static int32_t s_compare_tags_by_peak(const void *a, const void *b) {
+    uint64_t peak_a = ((allocation_tag_stats_t *)a)->peak_bytes;
+    uint64_t peak_b = ((allocation_tag_stats_t *)b)->peak_bytes;
+    return(peak_a < peak_b ? 1 : (peak_a > peak_b ? -1 : 0));
+}
+
+static void s_print_tag(allocation_tag_stats_t *tag, memory_report_output_t output) {
+    char line[160];
+    snprintf(line, sizeof(line), "  %-32s %-9s live %10.1f KB (%u)  peak %10.1f KB  allocations %u\n",
+             tag->name, s_allocator_type_name(tag->allocator), (double)tag->live_bytes / 1024.0, tag->live_count, (double)tag->peak_bytes / 1024.0, tag->allocation_count);
+    output(line);
+}
+
+void print_memory_report(memory_report_output_t output) {
+    static allocation_tag_stats_t tags[MAX_ALLOCATION_TAGS];
+    uint32_t tag_count = get_allocation_tag_stats(tags, MAX_ALLOCATION_TAGS);
+
+    char line[160];
+    output("=== Memory report ===\n");
+    for (uint32_t i = 0; i < (uint32_t)allocator_type_t::COUNT; ++i) {
+        allocator_usage_t usage = get_allocator_usage((allocator_type_t)i);
+        snprintf(line, sizeof(line), "%-9s live %10.1f KB (%u)  peak %10.1f KB  allocations %u\n",
+                 s_allocator_type_name((allocator_type_t)i), (double)usage.live_bytes / 1024.0, usage.live_count, (double)usage.peak_bytes / 1024.0, usage.allocation_count);
+        output(line);
+
+        if ((allocator_type_t)i != allocator_type_t::FREE_LIST) {
+            snprintf(line, sizeof(line), "          high-water: last frame %10.1f KB  any frame %10.1f KB\n",
+                     (double)usage.last_frame_high_water / 1024.0, (double)usage.peak_frame_high_water / 1024.0);
+            output(line);
+        }
+    }
+
+    qsort(tags, tag_count, sizeof(allocation_tag_stats_t), s_compare_tags_by_peak);
+    for (uint32_t i = 0; i < tag_count; ++i) {
+        s_print_tag(&tags[i], output);
+    }
+}
+
+void print_memory_leak_report(memory_report_output_t output) {
+    static allocation_tag_stats_t tags[MAX_ALLOCATION_TAGS];
+    uint32_t tag_count = get_allocation_tag_stats(tags, MAX_ALLOCATION_TAGS);
+
+    uint32_t leaked_count = 0;
+    uint64_t leaked_bytes = 0;
+    for (uint32_t i = 0; i < tag_count; ++i) {
+        if (tags[i].allocator != allocator_type_t::LINEAR) {
+            leaked_count += tags[i].live_count;
+            leaked_bytes += tags[i].live_bytes;
+        }
     }
+
+    char line[160];
+    snprintf(line, sizeof(line), "=== Leak report: %u allocations (%.1f KB) still alive ===\n", leaked_count, (double)leaked_bytes / 1024.0);
+    output(line);
+
+    qsort(tags, tag_count, sizeof(allocation_tag_stats_t), s_compare_tags_by_peak);
+    for (uint32_t i = 0; i < tag_count; ++i) {
+        if (tags[i].allocator != allocator_type_t::LINEAR && tags[i].live_count) {
+            s_print_tag(&tags[i], output);
+        }
+    }
+}
+
+#else
+
+void end_memory_tracking_frame(void) {
 }
+
+allocator_usage_t get_allocator_usage(allocator_type_t /*type*/) {
+    allocator_usage_t usage = {};
+    return(usage);
+}
+
+uint32_t get_allocation_tag_stats(allocation_tag_stats_t */*dst*/, uint32_t /*max_tags*/) {
+    return(0);
+}
+
+allocation_tag_stats_t find_allocation_tag_stats(const char */*name*/) {
+    allocation_tag_stats_t stats = {};
+    return(stats);
+}
+
+void print_memory_report(memory_report_output_t output) {
+    output("Memory tracking is disabled (build with MEMORY_TRACKING=1)\n");
+}
+
+void print_memory_leak_report(memory_report_output_t /*output*/) {
+}
+
+#endif
@@ -3,31 +3,78 @@
 #include <stdint.h>
 
 inline constexpr uint64_t kilobytes(uint32_t kb) {
-    return(kb * 1024);
+    return((uint64_t)kb * 1024);
 }
 
 inline constexpr uint64_t megabytes(uint32_t mb) {
-    return(kilobytes(mb * 1024));
+    return(kilobytes(mb) * 1024);
+}
+
+inline constexpr uint64_t gigabytes(uint32_t gb) {
+    return(megabytes(gb) * 1024);
 }
 
 using alignment_t = uint8_t;
 
-// TODO: Sort out issues with allocating with this thing
+// Opt-in: every allocation gets accounted to its tag (the name passed to the allocator) - costs a lookup per allocation
+#ifndef MEMORY_TRACKING
+#define MEMORY_TRACKING 0
+#endif
+
+// Virtual memory: address space gets reserved up front, pages only use physical memory once they get committed
+// Huge pages are a hint (transparent huge pages on Linux, ignored on Windows where they can't be committed lazily)
+#define VIRTUAL_MEMORY_HUGE_PAGES (1 << 0)
+// Commits happen in steps of this (keeps the number of system calls down)
+#define VIRTUAL_MEMORY_COMMIT_GRANULARITY kilobytes(64)
+#define VIRTUAL_MEMORY_HUGE_PAGE_SIZE megabytes(2)
+
+void *reserve_virtual_memory(uint64_t size, uint32_t flags);
+bool commit_virtual_memory(void *address, uint64_t size);
+void decommit_virtual_memory(void *address, uint64_t size);
+void release_virtual_memory(void *address, uint64_t size);
+
+// Grows into its reserved address space: pages get committed when allocations reach them
 struct linear_allocator_t {
     void *start = nullptr;
     void *current = nullptr;
 
-    uint32_t capacity;
-    uint32_t used_capacity = 0;
+    // Reserved
+    uint64_t capacity;
+    uint64_t used_capacity = 0;
+    uint64_t committed = 0;
+    // On clear, whatever is committed past max(retained_size, memory used since the last clear) gets decommitted
+    uint64_t retained_size = 0;
+    uint32_t flags = 0;
+
+#if MEMORY_TRACKING
+    // What got allocated from this arena since it got cleared (gets created on the first allocation)
+    struct linear_allocator_tracking_t *tracking = nullptr;
+#endif
 };
 
-void *allocate_linear_impl(uint32_t alloc_size, alignment_t alignment, const char *name, linear_allocator_t *allocator);
+// Can be called from any thread
+void initialize_linear_impl(uint64_t reserve_size, uint64_t retained_size, uint32_t flags, linear_allocator_t *allocator);
+void *allocate_linear_impl(uint64_t alloc_size, alignment_t alignment, const char *name, linear_allocator_t *allocator);
 void clear_linear_impl(linear_allocator_t *allocator);
 
+// Two arenas which take turns: what gets allocated before a swap stays valid until the swap after that
+// (frame N allocations can still be read during frame N + 1)
+struct double_buffered_linear_allocator_t {
+    linear_allocator_t arenas[2];
+    uint32_t current = 0;
+};
+
+void initialize_double_buffered_linear_impl(uint64_t reserve_size_per_arena, uint64_t retained_size, uint32_t flags, double_buffered_linear_allocator_t *allocator);
+// Clears the arena that was used before the last swap and returns it (new current arena)
+linear_allocator_t *swap_double_buffered_linear_impl(double_buffered_linear_allocator_t *allocator);
+
 struct stack_allocation_header_t {
 #if DEBUG
     const char *allocation_name;
 #endif
+#if MEMORY_TRACKING
+    uint32_t tag;
+#endif
     
     uint32_t size;
     void *prev;
@@ -38,9 +85,14 @@ struct stack_allocator_t {
     void *current = nullptr;
     
     uint32_t allocation_count = 0;
-    uint32_t capacity;
+    // Reserved (pages get committed when the stack grows into them)
+    uint64_t capacity;
+    uint64_t committed = 0;
+    uint32_t flags = 0;
 };
 
+void initialize_stack_impl(uint64_t reserve_size, uint32_t flags, stack_allocator_t *allocator);
+
 void *allocate_stack_impl(uint32_t allocation_size, alignment_t alignment, const char *name, stack_allocator_t *allocator);
 
 // only applies to the allocation at the top of the stack
@@ -48,28 +100,110 @@ void extend_stack_top_impl(uint32_t extension_size, stack_allocator_t *allocator
 // contents in the allocation must be destroyed by the user
 void pop_stack_impl(stack_allocator_t *allocator);
 
+// Two level segregated fit: free blocks are in lists of blocks of similar sizes, the right list is found in O(1) with two levels of bitmaps
+// First level: powers of 2, second level: linear subdivisions of these
+#define FREE_LIST_SECOND_LEVEL_COUNT_LOG2 5
+#define FREE_LIST_SECOND_LEVEL_COUNT (1 << FREE_LIST_SECOND_LEVEL_COUNT_LOG2)
+#define FREE_LIST_ALIGNMENT_LOG2 3
+#define FREE_LIST_ALIGNMENT (1 << FREE_LIST_ALIGNMENT_LOG2)
+// Blocks smaller than 1 << FREE_LIST_FIRST_LEVEL_SHIFT (256 bytes) are all in the first list (split in steps of FREE_LIST_ALIGNMENT)
+#define FREE_LIST_FIRST_LEVEL_SHIFT (FREE_LIST_SECOND_LEVEL_COUNT_LOG2 + FREE_LIST_ALIGNMENT_LOG2)
+#define FREE_LIST_FIRST_LEVEL_COUNT (32 - FREE_LIST_FIRST_LEVEL_SHIFT + 1)
+#define FREE_LIST_NULL_BLOCK 0xFFFFFFFF
+
+// Right before every block (free or not). Blocks are referred to by their offset from the start of the allocator's memory
 struct free_block_header_t {
-    free_block_header_t *next_free_block = nullptr;
-    uint32_t free_block_size = 0;
+    // Only valid if the block right before this one in memory is free (to merge with it)
+    uint32_t previous_physical_block;
+    // Size of the block (header not included), the 2 lowest bits are flags: block is free / previous block is free
+    uint32_t size_and_flags;
+#if MEMORY_TRACKING
+    // Tag of the allocation (deallocations need to know what to account the block to). Header size stays a multiple of FREE_LIST_ALIGNMENT
+    uint32_t tag;
+    uint32_t padding;
+#endif
 };
 
-struct free_list_allocation_header_t {
-    uint32_t size;
-#if DEBUG
-    const char *name;
-#endif
+// Only free blocks have these (right after the header, in the memory that allocations would use)
+struct free_block_links_t {
+    uint32_t next_free_block;
+    uint32_t previous_free_block;
+};
+
+struct free_list_stats_t {
+    uint32_t allocation_count;
+    uint32_t used_bytes;
+    uint32_t free_bytes;
+    uint32_t free_block_count;
+    uint32_t largest_free_block;
+    // 0 = all the free memory is one block, close to 1 = free memory is scattered in small blocks
+    float fragmentation;
 };
 
 struct free_list_allocator_t {
-    free_block_header_t *free_block_head;
-    
     void *start;
+    // Memory that the blocks cover (committed)
     uint32_t available_bytes;
+    // Address space that available_bytes can grow into when no block is big enough (0 = can't grow)
+    uint32_t reserved_bytes = 0;
+
+    uint32_t first_level_bitmap;
+    uint32_t second_level_bitmaps[FREE_LIST_FIRST_LEVEL_COUNT];
+    uint32_t free_blocks[FREE_LIST_FIRST_LEVEL_COUNT][FREE_LIST_SECOND_LEVEL_COUNT];
 
     uint32_t allocation_count = 0;
 
+    // Sizes of the blocks (headers not included)
     uint32_t used_memory = 0;
+    uint32_t free_memory = 0;
+    uint32_t free_block_count = 0;
 };
 
+// start and available_bytes (and reserved_bytes if the memory was reserved with reserve_virtual_memory) need to be set
+void initialize_free_list_impl(free_list_allocator_t *allocator);
 void *allocate_free_list_impl(uint32_t allocation_size, alignment_t alignment, const char *name, free_list_allocator_t *allocator);
 void deallocate_free_list_impl(void *pointer, free_list_allocator_t *allocator);
+free_list_stats_t get_free_list_stats_impl(free_list_allocator_t *allocator);
+
+enum class allocator_type_t { LINEAR, STACK, FREE_LIST, COUNT };
+
+#define MAX_ALLOCATION_TAGS 256
+#define MAX_ALLOCATION_TAG_NAME_LENGTH 48
+
+// Linear allocations never get freed individually: "live" means allocated since their arena got last cleared
+struct allocation_tag_stats_t {
+    char name[MAX_ALLOCATION_TAG_NAME_LENGTH];
+    allocator_type_t allocator;
+
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    uint32_t live_count;
+    // Since the start
+    uint32_t allocation_count;
+};
+
+struct allocator_usage_t {
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    uint32_t live_count;
+    uint32_t allocation_count;
+
+    // Most memory that one linear allocator / the stack allocator was using at once: during this frame, the last frame and any frame
+    uint64_t frame_high_water;
+    uint64_t last_frame_high_water;
+    uint64_t peak_frame_high_water;
+};
+
+// All of these do nothing / return nothing if MEMORY_TRACKING is 0
+// Main thread, once per frame
+void end_memory_tracking_frame(void);
+allocator_usage_t get_allocator_usage(allocator_type_t type);
+uint32_t get_allocation_tag_stats(allocation_tag_stats_t *dst, uint32_t max_tags);
+// Tag stats of a name in every allocator added up
+allocation_tag_stats_t find_allocation_tag_stats(const char *name);
+
+typedef void(*memory_report_output_t)(const char *line);
+
+void print_memory_report(memory_report_output_t output);
+// Free list / stack allocations which are still alive
+void print_memory_leak_report(memory_report_output_t output);
@@ -43,20 +43,78 @@ void tick_net(raw_input_t *raw_input, float32_t dt) {
     switch(current_app_mode) {
     case application_mode_t::CLIENT_MODE: { tick_client(raw_input, dt); } break;
     case application_mode_t::SERVER_MODE: { tick_server(raw_input, dt); } break;
+    case application_mode_t::BOT_MODE: { tick_bots(dt); } break;
     }
 }
 
+// Debugging: percentage of the outgoing datagrams which get dropped
+static int32_t s_lua_simulate_packet_loss(lua_State *state) {
+    float32_t percentage = (float32_t)lua_tonumber(state, -1);
+    set_simulated_packet_loss(percentage / 100.0f);
+
+    return(0);
+}
+
+// Debugging: channel_test(message count, loss percentage) -> whether every message arrived intact and in order (details in the debug output)
+static int32_t s_lua_channel_test(lua_State *state) {
+    uint32_t message_count = (uint32_t)lua_tonumber(state, -2);
+    float32_t percentage = (float32_t)lua_tonumber(state, -1);
+
+    bool passed = run_channel_loopback_test(message_count, percentage / 100.0f);
+    console_out(passed ? "channel test passed\n" : "channel test failed\n");
+
+    lua_pushboolean(state, passed);
+    return(1);
+}
+
 void initialize_net(application_mode_t app_mode, event_dispatcher_t *dispatcher) {
     current_app_mode = app_mode;
 
+    initialize_net_channels();
+    add_global_to_lua(script_primitive_type_t::FUNCTION, "packet_loss", &s_lua_simulate_packet_loss);
+    add_global_to_lua(script_primitive_type_t::FUNCTION, "channel_test", &s_lua_channel_test);
+
     switch(current_app_mode) {
     case application_mode_t::CLIENT_MODE: { initialize_client(message_buffer, dispatcher); } break;
     case application_mode_t::SERVER_MODE: { initialize_server(message_buffer); } break;
+    case application_mode_t::BOT_MODE: { initialize_bots(); } break;
+    }
+}
+
+quantized_player_snapshot_t *game_state_baseline_t::find_player(uint16_t client_id) {
+    for (uint32_t i = 0; i < player_count; ++i) {
+        if (players[i].client_id == client_id) {
+            return(&players[i]);
+        }
+    }
+
+    return(nullptr);
+}
+
+
+game_state_baseline_t *game_state_baselines_t::get(uint64_t game_state_tick) {
+    if (!game_state_tick) {
+        return(nullptr);
     }
+    
+    game_state_baseline_t *baseline = &baselines[game_state_tick % MAX_GAME_STATE_BASELINES];
+    return(baseline->game_state_tick == game_state_tick ? baseline : nullptr);
 }
 
+
+game_state_baseline_t *game_state_baselines_t::push(uint64_t game_state_tick) {
+    game_state_baseline_t *baseline = &baselines[game_state_tick % MAX_GAME_STATE_BASELINES];
+    baseline->game_state_tick = game_state_tick;
+    baseline->player_count = 0;
+    memset(baseline->relevant_players, 0, sizeof(baseline->relevant_players));
+    return(baseline);
+}
+
+
 void deinitialize_net() {
     switch(current_app_mode) {
     case application_mode_t::CLIENT_MODE: { deinitialize_client(); } break;
+    case application_mode_t::SERVER_MODE: { deinitialize_server(); } break;
+    case application_mode_t::BOT_MODE: { deinitialize_bots(); } break;
     }
 }
@@ -6,17 +6,48 @@
 #include "serializer.hpp"
 #include "client.hpp"
 #include "server.hpp"
+#include "bots.hpp"
 
 
 #define MAX_CLIENTS 40
 #define MAX_MESSAGE_BUFFER_SIZE 40000
+// Anything bigger gets fragmented at the IP layer (losing one fragment = losing the whole packet)
+#define MAX_PACKET_SIZE 1400
 
 
 constexpr uint16_t GAME_OUTPUT_PORT_CLIENT = 6001;
 constexpr uint16_t GAME_OUTPUT_PORT_SERVER = 6000;
 
 
-enum application_mode_t { CLIENT_MODE, SERVER_MODE };
+// BOT_MODE: headless clients which connect to a server for load testing (see bots.hpp)
+enum application_mode_t { CLIENT_MODE, SERVER_MODE, BOT_MODE };
+
+
+// Server and client both keep the last few game states, player snapshots get delta compressed against the last one the client acknowledged
+#define MAX_GAME_STATE_BASELINES 32
+
+
+struct game_state_baseline_t {
+    // 0 = invalid
+    uint64_t game_state_tick;
+    uint32_t player_count;
+    quantized_player_snapshot_t players[MAX_CLIENTS];
+
+    // Server only: every client only gets sent some of the players (bit = client id of the player)
+    uint64_t relevant_players[MAX_CLIENTS];
+
+    quantized_player_snapshot_t *find_player(uint16_t client_id);
+};
+
+
+struct game_state_baselines_t {
+    game_state_baseline_t baselines[MAX_GAME_STATE_BASELINES];
+
+    // Returns null if the game state is too old (or was never received)
+    game_state_baseline_t *get(uint64_t game_state_tick);
+    // Overwrites the oldest game state
+    game_state_baseline_t *push(uint64_t game_state_tick);
+};
 
 
 
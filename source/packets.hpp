@@ -4,7 +4,7 @@
 #include "client.hpp"
 
 enum packet_mode_t { PM_CLIENT_MODE, PM_SERVER_MODE };
-enum client_packet_type_t { CPT_CLIENT_JOIN, CPT_INPUT_STATE, CPT_ACKNOWLEDGED_GAME_STATE_RECEPTION, CPT_PREDICTION_ERROR_CORRECTION, CPT_DISCONNECT };
+enum client_packet_type_t { CPT_CLIENT_JOIN, CPT_INPUT_STATE, CPT_ACKNOWLEDGED_GAME_STATE_RECEPTION, CPT_PREDICTION_ERROR_CORRECTION, CPT_DISCONNECT, CPT_CHUNKS_REQUEST };
 enum server_packet_type_t { SPT_SERVER_HANDSHAKE, SPT_CHUNK_VOXELS_HARD_UPDATE, SPT_GAME_STATE_SNAPSHOT, SPT_CLIENT_JOINED, SPT_CLIENT_DISCONNECTED };
 
 struct packet_header_t {
@@ -35,9 +35,23 @@ struct server_handshake_packet_t {
 };
 
 #define CLIENT_NAME_MAX_LENGTH 40
+// Most chunks which a client can tell the server it already has when joining (others just get sent)
+#define MAX_CACHED_CHUNKS 1024
+
+// Chunk that the client has from its previous session (or from its own copy of the map)
+struct cached_chunk_t {
+    uint16_t chunk_index;
+    uint64_t hash;
+};
 
 struct client_join_packet_t {
     const char *client_name;
+    // Headless load testing client (see bots.hpp): doesn't predict, so the server doesn't check its predictions
+    uint8_t is_bot;
+    // Cached chunks which are the same on the server don't get sent (only if the grids are the same size)
+    uint8_t cached_grid_edge_size;
+    uint32_t cached_chunk_count;
+    cached_chunk_t *cached_chunks;
 };
 
 struct voxel_state_initialize_packet_t {
@@ -75,6 +89,11 @@ struct voxel_chunk_values_packet_t {
     uint8_t chunk_coord_x;
     uint8_t chunk_coord_y;
     uint8_t chunk_coord_z;
+    // Version of the chunk which the voxels are from (client ignores them if it already got a more recent version)
+    uint32_t version;
+    // Voxels are RLE compressed, and chunks can get split across several packets
+    uint16_t first_voxel;
+    uint16_t voxel_count;
     uint8_t *voxels;
 };
 
@@ -83,11 +102,19 @@ struct voxel_chunks_hard_update_packet_t {
     voxel_chunk_values_packet_t *packets;
 };
 
+// Cached chunk that the client can keep (with the version that the server has of it)
+struct reused_chunk_t {
+    uint16_t chunk_index;
+    uint32_t version;
+};
+
 struct game_state_initialize_packet_t {
     voxel_state_initialize_packet_t voxels;
     uint32_t client_index;
     uint32_t player_count;
     player_state_initialize_packet_t *player;
+    uint32_t reused_chunk_count;
+    reused_chunk_t *reused_chunks;
 };
 
 
@@ -164,20 +191,64 @@ struct game_snapshot_player_state_packet_t {
     };
 };
 
+// Every field gets quantized before being delta compressed against the game state that the client last acknowledged
+// (server and client need to end up with the exact same values for the baselines to match)
+#define QUANTIZED_POSITION_SCALE 1024.0f
+// Bits per component of the octahedral encoded unit vectors
+#define QUANTIZED_UNIT_VECTOR_BITS 16
+// Bits for each of the 3 smallest components of a quaternion (2 more bits for the index of the largest one)
+#define QUANTIZED_QUATERNION_BITS 10
+// Differences in the snapshot deltas are usually tiny: varints made of small groups
+#define SNAPSHOT_DELTA_VARINT_GROUP_BITS 5
+
+struct quantized_player_snapshot_t {
+    uint16_t client_id;
+    int32_t ws_position[3];
+    // Octahedral encoding
+    int32_t ws_direction[2];
+    int32_t ws_velocity[3];
+    int32_t ws_previous_velocity[3];
+    int32_t ws_up_vector[2];
+    // Smallest three encoding
+    uint32_t ws_rotation;
+    uint32_t action_flags;
+    // Only flags which are the same for every client (is_rolling, physics_state)
+    uint8_t flags;
+};
+
 struct modified_voxel_t {
     uint8_t previous_value, next_value;
     uint16_t index;
 };
 
+// Every voxel which changed between the version that the client acknowledged (base) and this version
+// Client can only apply it if it has the base version (whole chunk may still be on its way through the reliable channel)
 struct modified_chunk_t {
     uint16_t chunk_index;
+    uint32_t base_version;
+    uint32_t version;
     modified_voxel_t *modified_voxels;
     uint32_t modified_voxel_count;
 };
 
+// Hash of a chunk at a version that the client acknowledged: client requests the chunk if its own doesn't match (desync)
+struct chunk_hash_t {
+    uint16_t chunk_index;
+    uint32_t version;
+    uint64_t hash;
+};
+
 struct game_snapshot_voxel_delta_packet_t {
     uint32_t modified_count;
     modified_chunk_t *modified_chunks;
+    uint32_t chunk_hash_count;
+    chunk_hash_t *chunk_hashes;
+};
+
+// Client asks for chunks to be sent entirely (through the reliable channel)
+struct chunks_request_packet_t {
+    uint32_t chunk_count;
+    uint16_t *chunk_indices;
 };
 
 struct client_prediction_error_correction_t {
@@ -193,15 +264,6 @@ constexpr uint32_t sizeof_packet_header(void)  {
         sizeof(packet_header_t::client_id));
 }
 
-constexpr uint32_t sizeof_client_input_state_packet(void) {
-    return(sizeof(client_input_state_packet_t::action_flags) +
-        sizeof(client_input_state_packet_t::mouse_x_diff) +
-        sizeof(client_input_state_packet_t::mouse_y_diff) +
-        sizeof(client_input_state_packet_t::flags_byte) +
-        sizeof(client_input_state_packet_t::dt) +
-        sizeof(client_input_state_packet_t::command_id));
-};
-
 constexpr uint32_t sizeof_game_snapshot_player_state_packet(void) { return(sizeof(game_snapshot_player_state_packet_t::client_id) +
                                                                            sizeof(game_snapshot_player_state_packet_t::ws_position) +
                                                                            sizeof(game_snapshot_player_state_packet_t::ws_direction) +
@@ -211,20 +273,49 @@ constexpr uint32_t sizeof_game_snapshot_player_state_packet(void) { return(sizeo
                                                                            sizeof(game_snapshot_player_state_packet_t::ws_rotation) +
                                                                            sizeof(game_snapshot_player_state_packet_t::action_flags) +
                                                                            sizeof(game_snapshot_player_state_packet_t::flags)); }
+// Varints are made of groups of (group_bits + 1) bits
+constexpr uint32_t max_varint_bits(uint32_t value_bits, uint32_t group_bits) { return(((value_bits + group_bits - 1) / group_bits) * (group_bits + 1)); }
+
+// Sizes of the bit packed structures are in bits
+// Action flags, mouse diffs, flags, dt and command id (each with a bit saying whether it needs to be sent)
+constexpr uint32_t sizeof_max_client_input_state_packet_bits(void) { return(1 + max_varint_bits(32, 7) +
+                                                                            (1 + 32) * 2 +
+                                                                            5 +
+                                                                            1 + 32 +
+                                                                            1 + max_varint_bits(64, 7)); }
+// client_id, changed bit + every component for each field, rotation, action flags and flags
+constexpr uint32_t sizeof_max_player_snapshot_delta_bits(void) { return(max_varint_bits(16, 7) +
+                                                                        5 + (3 + 2 + 3 + 3 + 2) * max_varint_bits(32, SNAPSHOT_DELTA_VARINT_GROUP_BITS) +
+                                                                        1 + 2 + 3 * QUANTIZED_QUATERNION_BITS +
+                                                                        1 + max_varint_bits(32, 7) + 8); }
 constexpr uint32_t sizeof_modified_voxel(void) { return(sizeof(modified_voxel_t::previous_value) +
                                                         sizeof(modified_voxel_t::next_value) +
                                                         sizeof(modified_voxel_t::index)); };
 inline uint32_t sizeof_modified_chunk(uint32_t modified_chunk_count) { return(sizeof(modified_chunk_t::chunk_index) +
+                                                                       sizeof(modified_chunk_t::base_version) +
+                                                                       sizeof(modified_chunk_t::version) +
                                                                        sizeof(modified_chunk_t::modified_voxel_count) +
                                                                        sizeof_modified_voxel() * modified_chunk_count); };
-inline uint32_t sizeof_game_snapshot_voxel_delta_packet(uint32_t modified_chunk_count, modified_chunk_t *chunks) {
+constexpr uint32_t sizeof_chunk_hash(void) { return(sizeof(chunk_hash_t::chunk_index) +
+                                                    sizeof(chunk_hash_t::version) +
+                                                    sizeof(chunk_hash_t::hash)); };
+inline uint32_t sizeof_game_snapshot_voxel_delta_packet(game_snapshot_voxel_delta_packet_t *packet) {
     uint32_t size = sizeof(game_snapshot_voxel_delta_packet_t::modified_count);
-    for (uint32_t chunk = 0; chunk < modified_chunk_count; ++chunk) {
-        size += sizeof_modified_chunk(chunks[chunk].modified_voxel_count);
+    for (uint32_t chunk = 0; chunk < packet->modified_count; ++chunk) {
+        size += sizeof_modified_chunk(packet->modified_chunks[chunk].modified_voxel_count);
     }
+    size += sizeof(uint8_t) + sizeof_chunk_hash() * packet->chunk_hash_count;
     return(size);
 }
 
+inline uint32_t sizeof_client_join_packet(client_join_packet_t *packet) {
+    return((uint32_t)strlen(packet->client_name) + 1 +
+           sizeof(client_join_packet_t::is_bot) +
+           sizeof(client_join_packet_t::cached_grid_edge_size) +
+           sizeof(client_join_packet_t::cached_chunk_count) +
+           (sizeof(cached_chunk_t::chunk_index) + sizeof(cached_chunk_t::hash)) * packet->cached_chunk_count);
+}
+
 
 constexpr uint32_t sizeof_local_client_modified_voxel(void) { return(sizeof(local_client_modified_voxel_t::x) +
                                                                      sizeof(local_client_modified_voxel_t::y) +
@@ -1,5 +1,6 @@
 #include "game.hpp"
 #include "graphics.hpp"
+#include "camera_view.hpp"
 #include "particles_gstate.hpp"
 
 
@@ -23,8 +24,8 @@ void initialize_particles_state(void) {
         uniform_layout_handle_t single_tx_layout_hdl = g_uniform_layout_manager->get_handle("descriptor_set_layout.2D_sampler_layout"_hash);
 
         pipeline_handle_t explosion_shader_handle = initialize_particle_rendering_shader("pipeline.explosion_particle_effect"_hash, "shaders/SPV/explosion_particle.vert.spv", "shaders/SPV/explosion_particle.frag.spv", single_tx_layout_hdl);
-        explosion_particle_spawner = initialize_particle_spawner(50, &particle_effect_explosion, explosion_shader_handle, 0.9f, "textures/particles/explosion.png", 4, 4, 14);
-        fire_particle_spawner = initialize_particle_spawner(50, &particle_effect_fire, explosion_shader_handle, 2.0f, "textures/particles/smoke.png", 6, 5, 30);
+        explosion_particle_spawner = initialize_particle_spawner(2000, &particle_effect_explosion, explosion_shader_handle, 0.9f, "textures/particles/explosion.png", 4, 4, 14);
+        fire_particle_spawner = initialize_particle_spawner(1000, &particle_effect_fire, explosion_shader_handle, 2.0f, "textures/particles/smoke.png", 6, 5, 30);
     } break;
 
     default: break;
@@ -35,17 +36,8 @@ void initialize_particles_state(void) {
 void tick_particles_state(float32_t dt) {
     switch (get_app_type()) {
     case application_type_t::WINDOW_APPLICATION_MODE: {
-        explosion_particle_spawner.clear();
-        {
-            (*explosion_particle_spawner.update)(&explosion_particle_spawner, dt);
-        }
-        explosion_particle_spawner.sort_for_render();
-
-        fire_particle_spawner.clear();
-        {
-            (*fire_particle_spawner.update)(&fire_particle_spawner, dt);
-        }
-        fire_particle_spawner.sort_for_render();
+        (*explosion_particle_spawner.update)(&explosion_particle_spawner, dt);
+        (*fire_particle_spawner.update)(&fire_particle_spawner, dt);
     } break;
 
     default: break;
@@ -75,20 +67,27 @@ void render_alpha_particles(uniform_group_t *uniform_groups, gpu_command_queue_t
 
 
 void sync_gpu_with_particles_state(gpu_command_queue_t *queue) {
-    update_gpu_buffer(&explosion_particle_spawner.gpu_particles_buffer, explosion_particle_spawner.rendered_particles, sizeof(rendered_particle_data_t) * explosion_particle_spawner.rendered_particles_stack_head, 0, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, &queue->q);
+    // Live particles get written straight into the (mapped) vertex buffers
+    camera_t *camera = camera_bound_to_3d_output();
+    if (!camera) {
+        // Depth sort needs the camera: buffers keep last frame's particles (nothing gets rendered without a camera anyway)
+        return;
+    }
+
+    vector3_t ws_camera_position = camera->p;
+    
+    explosion_particle_spawner.clear();
+    compact_particles_for_render(&explosion_particle_spawner, ws_camera_position);
+    explosion_particle_spawner.sort_for_render();
 
-    update_gpu_buffer(&fire_particle_spawner.gpu_particles_buffer, fire_particle_spawner.rendered_particles, sizeof(rendered_particle_data_t) * fire_particle_spawner.rendered_particles_stack_head, 0, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, &queue->q);
+    fire_particle_spawner.clear();
+    compact_particles_for_render(&fire_particle_spawner, ws_camera_position);
+    fire_particle_spawner.sort_for_render();
 }
 
 
 int32_t spawn_fire(const vector3_t &position) {
-    uint32_t index = 0;
-    particle_t *particle = fire_particle_spawner.particle(&index);
-    particle->ws_position = position;
-    particle->ws_velocity = vector3_t(0.0f);
-    particle->life = 0.0f;
-    particle->size = 3.0f;
-    return(index);    
+    return(fire_particle_spawner.spawn(position, vector3_t(0.0f), 3.0f));
 }
 
 
@@ -98,72 +97,26 @@ void declare_fire_dead(uint32_t index) {
 
 
 int32_t spawn_explosion(const vector3_t &position) {
-    uint32_t index;
-    particle_t *particle = explosion_particle_spawner.particle(&index);
-    particle->ws_position = position;
-    particle->ws_velocity = vector3_t(0.0f);
-    particle->life = 0.0f;
-    particle->size = 15.0f;
-    return index;
+    return(explosion_particle_spawner.spawn(position, vector3_t(0.0f), 15.0f));
 }
 
 
-particle_t *get_fire_particle(uint32_t index) {
-    return &fire_particle_spawner.particles[index];
+void set_fire_position(uint32_t index, const vector3_t &position) {
+    fire_particle_spawner.set_position(index, position);
 }
 
 
 
 // Static definitions
 static void particle_effect_fire(particle_spawner_t *spawner, float32_t dt) {
-    for (uint32_t i = 0; i < spawner->particles_stack_head; ++i) {
-        particle_t *particle = &spawner->particles[i];
-
-        if (particle->life >= 0.0f) {
-            if (particle->life < spawner->max_life_length) {
-                float32_t direction = 1.0f;
-
-                if (particle->flag0) {
-                    direction = -1.0f;
-                }
-                
-                particle->life += dt * direction;
-
-                // Doesn't die unless from another source
-                if (particle->life > spawner->max_life_length) {
-                    particle->flag0 = 1;
-                    particle->life -= dt * direction;
-                }
-                else if (particle->life < 0.0f) {
-                    particle->flag0 = 0;
-                    particle->life += dt * direction;
-                }
-
-                spawner->push_for_render(i);
-            }
-        }
-    }
+    integrate_particles(spawner, dt);
+    // Doesn't die unless from another source
+    age_particles_back_and_forth(spawner, dt);
 }
 
 
 static void particle_effect_explosion(particle_spawner_t *spawner, float32_t dt) {
-    for (uint32_t i = 0; i < spawner->particles_stack_head; ++i) {
-        particle_t *particle = &spawner->particles[i];
-
-        if (particle->life >= 0) {
-        
-            if (particle->life < spawner->max_life_length) {
-                particle->life += dt;
-            
-                if (particle->life > spawner->max_life_length) {
-                    particle->life += 10.0f;
-                    spawner->declare_dead(i);
-                }
-                else {
-                    spawner->push_for_render(i);
-                }
-            }
-
-        }
-    }
+    integrate_particles(spawner, dt);
+    age_particles(spawner, dt);
+    kill_expired_particles(spawner);
 }
@@ -13,4 +13,4 @@ int32_t spawn_fire(const vector3_t &position);
 void declare_fire_dead(uint32_t index);
 int32_t spawn_explosion(const vector3_t &position);
 
-particle_t *get_fire_particle(uint32_t index);
+void set_fire_position(uint32_t index, const vector3_t &position);
@@ -46,8 +46,9 @@ void player_t::initialize(player_create_info_t *info) {
 
     switch (get_app_type()) {
     case application_type_t::WINDOW_APPLICATION_MODE: {
-        animation.animation_instance = initialize_animated_instance(get_global_command_pool(), info->animation_info.ubo_layout, info->animation_info.skeleton, info->animation_info.cycles);
+        animation.animation_instance = initialize_animated_instance(info->animation_info.skeleton, info->animation_info.cycles);
         switch_to_cycle(&animation.animation_instance, player_t::animated_state_t::IDLE, 1);
+        animation.is_visible = 1;
     } break;
     }
     
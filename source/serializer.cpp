@@ -2,23 +2,207 @@
 #include "client.hpp"
 #include "allocators.hpp"
 #include "serializer.hpp"
+#include "net.hpp"
 
 #include "chunk.hpp"
+#include "chunks_gstate.hpp"
+
+// Packet buffers never come from the frame allocator: they come from pools of fixed size slabs and go back to the pools once sent
+// MTU sized slabs are for almost everything, the big ones are for the messages which get fragmented (snapshots, handshake, ...)
+struct packet_buffer_pool_t {
+    uint32_t slab_size;
+    // Free slabs are linked through their first bytes
+    uint8_t *free_slabs;
+    // Slabs only get allocated when the pool runs out (and never get freed)
+    uint32_t slab_count;
+    uint32_t used_count;
+};
+
+static packet_buffer_pool_t packet_buffer_pools[] = { { MAX_PACKET_SIZE }, { MAX_MESSAGE_BUFFER_SIZE } };
+// Buffers bigger than the biggest slab get their own heap allocation (slab_size = 0), freed on release
+static packet_buffer_pool_t heap_buffer_pool = {};
+
+// Overflowing reads / writes end up in there instead of outside of the buffer
+static uint8_t overflow_scratch[MAX_MESSAGE_BUFFER_SIZE];
+
+// Bodies of the unreliable messages which are waiting for the flush (queued datagrams point to them)
+#define MAX_BUFFERS_RELEASED_ON_FLUSH 256
+
+struct flushed_packet_buffer_t {
+    packet_buffer_pool_t *pool;
+    uint8_t *buffer;
+};
+
+static flushed_packet_buffer_t buffers_released_on_flush[MAX_BUFFERS_RELEASED_ON_FLUSH];
+static uint32_t buffers_released_on_flush_count = 0;
+
+static packet_buffer_pool_t *s_find_packet_buffer_pool(uint32_t size) {
+    for (uint32_t i = 0; i < sizeof(packet_buffer_pools) / sizeof(packet_buffer_pools[0]); ++i) {
+        if (size <= packet_buffer_pools[i].slab_size) {
+            return(&packet_buffer_pools[i]);
+        }
+    }
+
+    return(nullptr);
+}
+
+static uint8_t *s_acquire_packet_buffer(packet_buffer_pool_t *pool) {
+    uint8_t *slab = pool->free_slabs;
+
+    if (slab) {
+        memcpy(&pool->free_slabs, slab, sizeof(uint8_t *));
+    }
+    else {
+        slab = (uint8_t *)malloc(pool->slab_size);
+        ++pool->slab_count;
+    }
+
+    ++pool->used_count;
+
+    return(slab);
+}
+
+static void s_release_packet_buffer(packet_buffer_pool_t *pool, uint8_t *slab) {
+    if (pool == &heap_buffer_pool) {
+        free(slab);
+        --pool->used_count;
+        return;
+    }
+
+    memcpy(slab, &pool->free_slabs, sizeof(uint8_t *));
+    pool->free_slabs = slab;
+
+    --pool->used_count;
+}
 
 void serializer_t::initialize(uint32_t max_size) {
-    data_buffer = (uint8_t *)allocate_linear(max_size * sizeof(uint8_t));
+    release();
+
+    pool = s_find_packet_buffer_pool(max_size);
+    if (!pool) {
+        output_to_debug_console("Packet of ", (int32_t)max_size, " bytes is bigger than MAX_MESSAGE_BUFFER_SIZE\n");
+        pool = s_find_packet_buffer_pool(MAX_MESSAGE_BUFFER_SIZE);
+    }
+
+    data_buffer = s_acquire_packet_buffer(pool);
+    data_buffer_size = pool->slab_size;
 }
 
 uint8_t *serializer_t::grow_data_buffer(uint32_t bytes) {
     uint32_t previous = data_buffer_head;
+
+    if (!data_buffer) {
+        initialize(MAX_PACKET_SIZE);
+    }
+
+    if (previous + bytes > data_buffer_size) {
+        packet_buffer_pool_t *bigger_pool = pool ? s_find_packet_buffer_pool(previous + bytes) : nullptr;
+
+        if (!pool) {
+            // Reading past the end of a received packet
+            output_to_debug_console("Serializer overflow (", (int32_t)(previous + bytes), " bytes)\n");
+
+            assert(bytes <= sizeof(overflow_scratch));
+            memset(overflow_scratch, 0, MIN(bytes, (uint32_t)sizeof(overflow_scratch)));
+            return(overflow_scratch);
+        }
+        else if (!bigger_pool) {
+            // Writing more than MAX_MESSAGE_BUFFER_SIZE: the channel layer won't be able to send it, but the data stays valid
+            uint32_t heap_size = MAX(previous + bytes, data_buffer_size * 2);
+            uint8_t *heap_buffer;
+            if (pool == &heap_buffer_pool) {
+                heap_buffer = (uint8_t *)realloc(data_buffer, heap_size);
+            }
+            else {
+                output_to_debug_console("Packet of ", (int32_t)(previous + bytes), " bytes is bigger than MAX_MESSAGE_BUFFER_SIZE\n");
+
+                heap_buffer = (uint8_t *)malloc(heap_size);
+                memcpy(heap_buffer, data_buffer, previous);
+                s_release_packet_buffer(pool, data_buffer);
+
+                pool = &heap_buffer_pool;
+                ++heap_buffer_pool.used_count;
+            }
+
+            data_buffer = heap_buffer;
+            data_buffer_size = heap_size;
+        }
+        else {
+            // Size estimate was too small
+            uint8_t *bigger_buffer = s_acquire_packet_buffer(bigger_pool);
+            memcpy(bigger_buffer, data_buffer, previous);
+            s_release_packet_buffer(pool, data_buffer);
+
+            pool = bigger_pool;
+            data_buffer = bigger_buffer;
+            data_buffer_size = bigger_pool->slab_size;
+        }
+    }
+
     data_buffer_head += bytes;
     return(&data_buffer[previous]);
 }
 
-void serializer_t::send_serialized_message(network_address_t address) {
-    send_to(address,
-            (char *)data_buffer,
-            data_buffer_head);
+void serializer_t::release(void) {
+    if (pool && data_buffer) {
+        s_release_packet_buffer(pool, data_buffer);
+    }
+
+    pool = nullptr;
+    data_buffer = nullptr;
+    data_buffer_size = 0;
+}
+
+void serializer_t::release_after_flush(void) {
+    if (pool && data_buffer) {
+        if (buffers_released_on_flush_count == MAX_BUFFERS_RELEASED_ON_FLUSH) {
+            // Releases the previous ones
+            flush_channel_datagrams();
+        }
+
+        flushed_packet_buffer_t *flushed = &buffers_released_on_flush[buffers_released_on_flush_count++];
+        flushed->pool = pool;
+        flushed->buffer = data_buffer;
+    }
+
+    pool = nullptr;
+    data_buffer = nullptr;
+    data_buffer_size = 0;
+}
+
+void release_flushed_packet_buffers(void) {
+    for (uint32_t i = 0; i < buffers_released_on_flush_count; ++i) {
+        s_release_packet_buffer(buffers_released_on_flush[i].pool, buffers_released_on_flush[i].buffer);
+    }
+
+    buffers_released_on_flush_count = 0;
+}
+
+// Channel layer copies the data: buffers can go straight back to the pool
+void serializer_t::send_serialized_message(network_address_t address, channel_type_t channel, network_socket_t *socket) {
+    send_channel_message(address, channel, data_buffer, data_buffer_head, nullptr, 0, socket);
+    flush_channel_datagrams();
+
+    release();
+}
+
+void serializer_t::queue_serialized_message(network_address_t address, serializer_t *body, channel_type_t channel, network_socket_t *socket) {
+    if (body) {
+        send_channel_message(address, channel, data_buffer, data_buffer_head, body->data_buffer, body->data_buffer_head, socket);
+
+        // Unreliable bodies go out as they are (scatter / gather)
+        if (channel == CT_RELIABLE_ORDERED) {
+            body->release();
+        }
+        else {
+            body->release_after_flush();
+        }
+    }
+    else {
+        send_channel_message(address, channel, data_buffer, data_buffer_head, nullptr, 0, socket);
+    }
+
+    release();
 }
 
 void serializer_t::serialize_uint8(uint8_t u8) {
@@ -186,6 +370,90 @@ void serializer_t::deserialize_bytes(uint8_t *bytes, uint32_t size) {
 }
 
 
+// Most chunks are mostly uniform (all air, all solid)
+// Control byte < 128: (control + 1) literal bytes follow
+// Control byte >= 128: run of ((control & 0x7F) << 8 | next byte) + 1 voxels, followed by the value
+#define RLE_MAX_LITERAL_LENGTH 128
+#define RLE_MAX_RUN_LENGTH (1 << 15)
+#define RLE_MIN_RUN_LENGTH 3
+
+static uint32_t s_rle_run_length(uint8_t *voxels, uint32_t voxel_count, uint32_t max_length) {
+    uint32_t length = 1;
+    while (length < voxel_count && length < max_length && voxels[length] == voxels[0]) {
+        ++length;
+    }
+    return(length);
+}
+
+
+uint32_t serializer_t::serialize_rle_voxels(uint8_t *voxels, uint32_t voxel_count, uint32_t max_size) {
+    uint32_t voxel = 0;
+
+    while (voxel < voxel_count) {
+        uint32_t run_length = s_rle_run_length(&voxels[voxel], voxel_count - voxel, RLE_MAX_RUN_LENGTH);
+
+        if (run_length >= RLE_MIN_RUN_LENGTH) {
+            if (max_size < 3) {
+                break;
+            }
+
+            serialize_uint8((uint8_t)(0x80 | ((run_length - 1) >> 8)));
+            serialize_uint8((uint8_t)(run_length - 1));
+            serialize_uint8(voxels[voxel]);
+            max_size -= 3;
+
+            voxel += run_length;
+        }
+        else {
+            // Literals until the next run worth encoding
+            uint32_t literal_count = 0;
+            while (voxel + literal_count < voxel_count &&
+                   literal_count < RLE_MAX_LITERAL_LENGTH &&
+                   s_rle_run_length(&voxels[voxel + literal_count], voxel_count - voxel - literal_count, RLE_MIN_RUN_LENGTH) < RLE_MIN_RUN_LENGTH) {
+                ++literal_count;
+            }
+
+            if (max_size < 2) {
+                break;
+            }
+
+            literal_count = MIN(literal_count, max_size - 1);
+
+            serialize_uint8((uint8_t)(literal_count - 1));
+            serialize_bytes(&voxels[voxel], literal_count);
+            max_size -= 1 + literal_count;
+
+            voxel += literal_count;
+        }
+    }
+
+    return(voxel);
+}
+
+
+void serializer_t::deserialize_rle_voxels(uint8_t *dst, uint32_t voxel_count) {
+    uint32_t voxel = 0;
+
+    while (voxel < voxel_count) {
+        uint8_t control = deserialize_uint8();
+
+        if (control & 0x80) {
+            uint32_t run_length = (((uint32_t)(control & 0x7F) << 8) | deserialize_uint8()) + 1;
+            uint8_t value = deserialize_uint8();
+
+            run_length = MIN(run_length, voxel_count - voxel);
+            memset(&dst[voxel], value, run_length);
+            voxel += run_length;
+        }
+        else {
+            uint32_t literal_count = MIN((uint32_t)control + 1, voxel_count - voxel);
+            deserialize_bytes(&dst[voxel], literal_count);
+            voxel += literal_count;
+        }
+    }
+}
+
+
 void serializer_t::serialize_packet_header(packet_header_t *packet) {
     serialize_uint32(packet->bytes);
     serialize_uint64(packet->current_tick);
@@ -204,31 +472,43 @@ void serializer_t::deserialize_packet_header(packet_header_t *packet) {
 
 void serializer_t::serialize_client_join_packet(client_join_packet_t *packet) {
     serialize_string(packet->client_name);
+    serialize_uint8(packet->is_bot);
+    serialize_uint8(packet->cached_grid_edge_size);
+    serialize_uint32(packet->cached_chunk_count);
+    for (uint32_t i = 0; i < packet->cached_chunk_count; ++i) {
+        serialize_uint16(packet->cached_chunks[i].chunk_index);
+        serialize_uint64(packet->cached_chunks[i].hash);
+    }
 }
 
 
 void serializer_t::deserialize_client_join_packet(client_join_packet_t *packet) {
     packet->client_name = deserialize_string();
+    packet->is_bot = deserialize_uint8();
+    packet->cached_grid_edge_size = deserialize_uint8();
+    uint32_t cached_chunk_count = deserialize_uint32();
+    packet->cached_chunk_count = MIN(cached_chunk_count, (uint32_t)MAX_CACHED_CHUNKS);
+    for (uint32_t i = 0; i < packet->cached_chunk_count; ++i) {
+        packet->cached_chunks[i].chunk_index = deserialize_uint16();
+        packet->cached_chunks[i].hash = deserialize_uint64();
+    }
 }
 
 
-void serializer_t::serialize_client_input_state_packet(player_state_t *state) {
-    serialize_uint32(state->action_flags);
-    serialize_float32(state->mouse_x_diff);
-    serialize_float32(state->mouse_y_diff);
-    serialize_uint8(state->flags_byte);
-    serialize_float32(state->dt);
-    serialize_uint64(state->current_state_count);
+void serializer_t::serialize_chunks_request_packet(chunks_request_packet_t *packet) {
+    serialize_uint32(packet->chunk_count);
+    for (uint32_t i = 0; i < packet->chunk_count; ++i) {
+        serialize_uint16(packet->chunk_indices[i]);
+    }
 }
 
 
-void serializer_t::deserialize_client_input_state_packet(client_input_state_packet_t *packet) {
-    packet->action_flags = deserialize_uint32();
-    packet->mouse_x_diff = deserialize_float32();
-    packet->mouse_y_diff = deserialize_float32();
-    packet->flags_byte = deserialize_uint8();
-    packet->dt = deserialize_float32();
-    packet->command_id = deserialize_uint64();
+void serializer_t::deserialize_chunks_request_packet(chunks_request_packet_t *packet, uint32_t max_chunks) {
+    uint32_t chunk_count = deserialize_uint32();
+    packet->chunk_count = MIN(chunk_count, max_chunks);
+    for (uint32_t i = 0; i < packet->chunk_count; ++i) {
+        packet->chunk_indices[i] = deserialize_uint16();
+    }
 }
 
 
@@ -279,11 +559,25 @@ void serializer_t::deserialize_voxel_state_initialize_packet(voxel_state_initial
 }
 
 
-void serializer_t::serialize_voxel_chunk_values_packet(voxel_chunk_values_packet_t *packet) {
+void serializer_t::serialize_voxel_chunk_values_packet(voxel_chunk_values_packet_t *packet, uint32_t max_size) {
     serialize_uint8(packet->chunk_coord_x);
     serialize_uint8(packet->chunk_coord_y);
     serialize_uint8(packet->chunk_coord_z);
-    serialize_bytes(packet->voxels, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+    serialize_uint32(packet->version);
+    serialize_uint16(packet->first_voxel);
+
+    // Voxel count only gets known once the voxels were compressed
+    uint32_t voxel_count_head = data_buffer_head;
+    grow_data_buffer(sizeof(uint16_t));
+
+    uint32_t chunk_voxel_count = CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH;
+    uint32_t header_size = sizeof(uint8_t) * 3 + sizeof(uint32_t) + sizeof(uint16_t) * 2;
+    packet->voxel_count = serialize_rle_voxels(&packet->voxels[packet->first_voxel], chunk_voxel_count - packet->first_voxel, max_size - header_size);
+
+    uint32_t end_head = data_buffer_head;
+    data_buffer_head = voxel_count_head;
+    serialize_uint16(packet->voxel_count);
+    data_buffer_head = end_head;
 }
 
 
@@ -291,9 +585,9 @@ void serializer_t::deserialize_voxel_chunk_values_packet(voxel_chunk_values_pack
     packet->chunk_coord_x = deserialize_uint8();
     packet->chunk_coord_y = deserialize_uint8();
     packet->chunk_coord_z = deserialize_uint8();
-
-    packet->voxels = (uint8_t *)allocate_linear(sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
-    deserialize_bytes(packet->voxels, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+    packet->version = deserialize_uint32();
+    packet->first_voxel = deserialize_uint16();
+    packet->voxel_count = deserialize_uint16();
 }
 
 
@@ -304,11 +598,16 @@ void serializer_t::serialize_game_state_initialize_packet(game_state_initialize_
     for (uint32_t i = 0; i < packet->player_count; ++i) {
         serialize_player_state_initialize_packet(&packet->player[i]);
     }
+    serialize_uint32(packet->reused_chunk_count);
+    for (uint32_t i = 0; i < packet->reused_chunk_count; ++i) {
+        serialize_uint16(packet->reused_chunks[i].chunk_index);
+        serialize_uint32(packet->reused_chunks[i].version);
+    }
 }
 
 
 void serializer_t::serialize_game_snapshot_player_state_packet(game_snapshot_player_state_packet_t *packet) {
-    serialize_uint32(packet->client_id);
+    serialize_uint16(packet->client_id);
     
     serialize_float32(packet->ws_position.x);
     serialize_float32(packet->ws_position.y);
@@ -342,7 +641,7 @@ void serializer_t::serialize_game_snapshot_player_state_packet(game_snapshot_pla
 
 
 void serializer_t::deserialize_game_snapshot_player_state_packet(game_snapshot_player_state_packet_t *packet) {
-    packet->client_id = deserialize_uint32();
+    packet->client_id = deserialize_uint16();
     
     packet->ws_position.x = deserialize_float32();
     packet->ws_position.y = deserialize_float32();
@@ -391,32 +690,560 @@ void serializer_t::serialize_client_modified_voxels_packet(client_modified_voxel
 }
 
 
-void serializer_t::deserialize_client_modified_voxels_packet(client_modified_voxels_packet_t *packet) {
-    packet->modified_chunk_count = deserialize_uint32();
+void serializer_t::serialize_client_modified_chunks(chunk_t **chunks, uint32_t chunk_count) {
+    serialize_uint32(chunk_count);
 
-    packet->modified_chunks = (client_modified_chunk_t *)allocate_linear(sizeof(client_modified_chunk_t) * packet->modified_chunk_count);
+    for (uint32_t chunk_index = 0; chunk_index < chunk_count; ++chunk_index) {
+        chunk_t *chunk = chunks[chunk_index];
 
-    for (uint32_t chunk = 0; chunk < packet->modified_chunk_count; ++chunk) {
-        packet->modified_chunks[chunk].chunk_index = deserialize_uint16();
+        serialize_uint16((uint16_t)convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)(get_chunk_grid_size())));
+        serialize_uint32(chunk->modified_voxels_list_count);
+        for (uint32_t voxel = 0; voxel < chunk->modified_voxels_list_count; ++voxel) {
+            voxel_coordinate_t coord = convert_1d_to_3d_coord(chunk->list_of_modified_voxels[voxel], CHUNK_EDGE_LENGTH);
+            serialize_uint8(coord.x);
+            serialize_uint8(coord.y);
+            serialize_uint8(coord.z);
+            serialize_uint8(chunk->voxels[coord.x][coord.y][coord.z]);
+        }
+    }
+}
 
-        packet->modified_chunks[chunk].modified_voxel_count = deserialize_uint32();
-        
-        packet->modified_chunks[chunk].modified_voxels = (local_client_modified_voxel_t *)allocate_linear(sizeof(local_client_modified_voxel_t) * packet->modified_chunks[chunk].modified_voxel_count);
-        for (uint32_t voxel = 0; voxel < packet->modified_chunks[chunk].modified_voxel_count; ++voxel) {
-            packet->modified_chunks[chunk].modified_voxels[voxel].x = deserialize_uint8();
-            packet->modified_chunks[chunk].modified_voxels[voxel].y = deserialize_uint8();
-            packet->modified_chunks[chunk].modified_voxels[voxel].z = deserialize_uint8();
-            packet->modified_chunks[chunk].modified_voxels[voxel].value = deserialize_uint8();
+
+static_assert(sizeof(local_client_modified_voxel_t) == 4, "Modified voxels get read straight from the packet (x, y, z, value)");
+
+void serializer_t::deserialize_client_modified_voxels_packet(client_modified_voxels_packet_t *packet, uint32_t max_chunks) {
+    uint32_t modified_chunk_count = deserialize_uint32();
+    packet->modified_chunk_count = 0;
+
+    for (uint32_t chunk = 0; chunk < modified_chunk_count; ++chunk) {
+        uint16_t chunk_index = deserialize_uint16();
+        uint32_t modified_voxel_count = deserialize_uint32();
+
+        uint32_t remaining_size = data_buffer_size - MIN(data_buffer_head, data_buffer_size);
+        if (modified_voxel_count > remaining_size / sizeof(local_client_modified_voxel_t)) {
+            output_to_debug_console("Serializer overflow (", (int32_t)modified_voxel_count, " modified voxels)\n");
+            data_buffer_head = data_buffer_size;
+            return;
+        }
+
+        if (packet->modified_chunk_count < max_chunks) {
+            client_modified_chunk_t *modified_chunk = &packet->modified_chunks[packet->modified_chunk_count++];
+            modified_chunk->chunk_index = chunk_index;
+            modified_chunk->modified_voxel_count = modified_voxel_count;
+            modified_chunk->modified_voxels = (local_client_modified_voxel_t *)&data_buffer[data_buffer_head];
+        }
+
+        data_buffer_head += modified_voxel_count * sizeof(local_client_modified_voxel_t);
+    }
+}
+
+
+void bit_serializer_t::begin(serializer_t *serializer) {
+    uint32_t head = MIN(serializer->data_buffer_head, serializer->data_buffer_size);
+    data_buffer = &serializer->data_buffer[head];
+    data_buffer_size = serializer->data_buffer_size - head;
+    bit_head = 0;
+    overflowed = 0;
+}
+
+
+void bit_serializer_t::end(serializer_t *serializer) {
+    serializer->data_buffer_head += bytes_used();
+}
+
+
+uint32_t bit_serializer_t::bytes_used(void) {
+    return((bit_head + 7) / 8);
+}
+
+
+void bit_serializer_t::serialize_bits(uint32_t value, uint32_t bit_count) {
+    assert(bit_count <= 32 && bit_head + bit_count <= data_buffer_size * 8);
+
+    if (bit_head + bit_count > data_buffer_size * 8) {
+        overflowed = 1;
+        return;
+    }
+
+    while (bit_count) {
+        uint32_t byte = bit_head / 8;
+        uint32_t bit = bit_head % 8;
+        uint32_t bits_in_byte = MIN(8 - bit, bit_count);
+
+        // Bytes don't get cleared beforehand
+        if (bit == 0) {
+            data_buffer[byte] = 0;
+        }
+
+        data_buffer[byte] |= (uint8_t)((value & ((1 << bits_in_byte) - 1)) << bit);
+
+        value >>= bits_in_byte;
+        bit_count -= bits_in_byte;
+        bit_head += bits_in_byte;
+    }
+}
+
+
+void bit_serializer_t::serialize_bit_range(bit_serializer_t *src, uint32_t bit_offset, uint32_t bit_count) {
+    uint32_t src_bit_head = src->bit_head;
+    src->bit_head = bit_offset;
+
+    while (bit_count) {
+        uint32_t bits = MIN(32u, bit_count);
+        serialize_bits(src->deserialize_bits(bits), bits);
+        bit_count -= bits;
+    }
+
+    src->bit_head = src_bit_head;
+}
+
+
+uint32_t bit_serializer_t::deserialize_bits(uint32_t bit_count) {
+    assert(bit_count <= 32);
+
+    // Received packets can be anything
+    if (bit_head + bit_count > data_buffer_size * 8) {
+        overflowed = 1;
+        bit_head = data_buffer_size * 8;
+        return(0);
+    }
+
+    uint32_t value = 0;
+    uint32_t shift = 0;
+    while (bit_count) {
+        uint32_t byte = bit_head / 8;
+        uint32_t bit = bit_head % 8;
+        uint32_t bits_in_byte = MIN(8 - bit, bit_count);
+
+        value |= (uint32_t)((data_buffer[byte] >> bit) & ((1 << bits_in_byte) - 1)) << shift;
+
+        shift += bits_in_byte;
+        bit_count -= bits_in_byte;
+        bit_head += bits_in_byte;
+    }
+
+    return(value);
+}
+
+
+void bit_serializer_t::serialize_bool(bool b) {
+    serialize_bits(b, 1);
+}
+
+
+bool bit_serializer_t::deserialize_bool(void) {
+    return(deserialize_bits(1));
+}
+
+
+// Each group is followed by a bit which says whether there is another group after it
+void bit_serializer_t::serialize_varint(uint64_t value, uint32_t group_bits) {
+    uint32_t group_mask = (1 << group_bits) - 1;
+
+    for (;;) {
+        serialize_bits((uint32_t)value & group_mask, group_bits);
+        value >>= group_bits;
+
+        serialize_bool(value != 0);
+        if (!value) {
+            break;
         }
     }
 }
 
 
+uint64_t bit_serializer_t::deserialize_varint(uint32_t group_bits) {
+    uint64_t value = 0;
+    uint32_t shift = 0;
+
+    do {
+        value |= (uint64_t)deserialize_bits(group_bits) << shift;
+        shift += group_bits;
+    } while (deserialize_bool() && shift < 64);
+
+    return(value);
+}
+
+
+// Zigzag: small negative numbers also end up being small
+void bit_serializer_t::serialize_signed_varint(int32_t value, uint32_t group_bits) {
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    serialize_varint(zigzag, group_bits);
+}
+
+
+int32_t bit_serializer_t::deserialize_signed_varint(uint32_t group_bits) {
+    uint32_t zigzag = (uint32_t)deserialize_varint(group_bits);
+    return((int32_t)((zigzag >> 1) ^ (0 - (zigzag & 1))));
+}
+
+
+void bit_serializer_t::serialize_float32(float32_t f32) {
+    uint32_t bits;
+    memcpy(&bits, &f32, sizeof(uint32_t));
+    serialize_bits(bits, 32);
+}
+
+
+float32_t bit_serializer_t::deserialize_float32(void) {
+    uint32_t bits = deserialize_bits(32);
+    float32_t f32;
+    memcpy(&f32, &bits, sizeof(uint32_t));
+    return(f32);
+}
+
+
+uint32_t quantize_float(float32_t value, float32_t min, float32_t max, uint32_t bit_count) {
+    assert(bit_count <= 24);
+
+    float32_t normalized = (glm::clamp(value, min, max) - min) / (max - min);
+    float32_t steps = (float32_t)((1 << bit_count) - 1);
+    return((uint32_t)floorf(normalized * steps + 0.5f));
+}
+
+
+float32_t dequantize_float(uint32_t quantized, float32_t min, float32_t max, uint32_t bit_count) {
+    float32_t steps = (float32_t)((1 << bit_count) - 1);
+    return(min + ((float32_t)quantized / steps) * (max - min));
+}
+
+
+void bit_serializer_t::serialize_quantized_float(float32_t value, float32_t min, float32_t max, uint32_t bit_count) {
+    serialize_bits(quantize_float(value, min, max, bit_count), bit_count);
+}
+
+
+float32_t bit_serializer_t::deserialize_quantized_float(float32_t min, float32_t max, uint32_t bit_count) {
+    return(dequantize_float(deserialize_bits(bit_count), min, max, bit_count));
+}
+
+
+static inline int32_t s_quantize(float32_t value, float32_t scale) {
+    return((int32_t)floorf(value * scale + 0.5f));
+}
+
+
+static inline float32_t s_dequantize(int32_t value, float32_t scale) {
+    return((float32_t)value / scale);
+}
+
+
+void bit_serializer_t::serialize_fixed_point(float32_t value, float32_t scale) {
+    serialize_signed_varint(s_quantize(value, scale));
+}
+
+
+float32_t bit_serializer_t::deserialize_fixed_point(float32_t scale) {
+    return(s_dequantize(deserialize_signed_varint(), scale));
+}
+
+
+static inline float32_t s_sign_not_zero(float32_t value) {
+    return(value >= 0.0f ? 1.0f : -1.0f);
+}
+
+
+// Project onto the octahedron and unfold the bottom half onto the top: only 2 components in [-1, 1] to send
+void encode_octahedral_unit_vector(const vector3_t &v3, uint32_t bits_per_component, int32_t *dst) {
+    float32_t length = fabsf(v3.x) + fabsf(v3.y) + fabsf(v3.z);
+    if (length == 0.0f) {
+        length = 1.0f;
+    }
+
+    float32_t x = v3.x / length;
+    float32_t y = v3.y / length;
+
+    if (v3.z < 0.0f) {
+        float32_t folded_x = (1.0f - fabsf(y)) * s_sign_not_zero(x);
+        float32_t folded_y = (1.0f - fabsf(x)) * s_sign_not_zero(y);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    dst[0] = (int32_t)quantize_float(x, -1.0f, 1.0f, bits_per_component);
+    dst[1] = (int32_t)quantize_float(y, -1.0f, 1.0f, bits_per_component);
+}
+
+
+vector3_t decode_octahedral_unit_vector(const int32_t *encoded, uint32_t bits_per_component) {
+    float32_t x = dequantize_float((uint32_t)encoded[0], -1.0f, 1.0f, bits_per_component);
+    float32_t y = dequantize_float((uint32_t)encoded[1], -1.0f, 1.0f, bits_per_component);
+    float32_t z = 1.0f - fabsf(x) - fabsf(y);
+
+    if (z < 0.0f) {
+        float32_t unfolded_x = (1.0f - fabsf(y)) * s_sign_not_zero(x);
+        float32_t unfolded_y = (1.0f - fabsf(x)) * s_sign_not_zero(y);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+
+    return(glm::normalize(vector3_t(x, y, z)));
+}
+
+
+void bit_serializer_t::serialize_unit_vector(const vector3_t &v3, uint32_t bits_per_component) {
+    int32_t encoded[2];
+    encode_octahedral_unit_vector(v3, bits_per_component, encoded);
+    serialize_bits((uint32_t)encoded[0], bits_per_component);
+    serialize_bits((uint32_t)encoded[1], bits_per_component);
+}
+
+
+vector3_t bit_serializer_t::deserialize_unit_vector(uint32_t bits_per_component) {
+    int32_t encoded[2];
+    encoded[0] = (int32_t)deserialize_bits(bits_per_component);
+    encoded[1] = (int32_t)deserialize_bits(bits_per_component);
+    return(decode_octahedral_unit_vector(encoded, bits_per_component));
+}
+
+
+#define SQRT_1_OVER_2 0.70710678118f
+
+// Largest component gets dropped (can be recomputed because the quaternion is normalized), the others are within [-1/sqrt(2), 1/sqrt(2)]
+// q and -q are the same rotation: flip the quaternion so that the dropped component is positive
+uint32_t encode_smallest_three_quaternion(const quaternion_t &q) {
+    uint32_t largest = 0;
+    for (uint32_t i = 1; i < 4; ++i) {
+        if (fabsf(q[i]) > fabsf(q[largest])) {
+            largest = i;
+        }
+    }
+
+    float32_t sign = s_sign_not_zero(q[largest]);
+
+    uint32_t encoded = largest;
+    uint32_t shift = 2;
+    for (uint32_t i = 0; i < 4; ++i) {
+        if (i != largest) {
+            encoded |= quantize_float(q[i] * sign, -SQRT_1_OVER_2, SQRT_1_OVER_2, QUANTIZED_QUATERNION_BITS) << shift;
+            shift += QUANTIZED_QUATERNION_BITS;
+        }
+    }
+
+    return(encoded);
+}
+
+
+quaternion_t decode_smallest_three_quaternion(uint32_t encoded) {
+    uint32_t largest = encoded & 3;
+    uint32_t component_mask = (1 << QUANTIZED_QUATERNION_BITS) - 1;
+
+    quaternion_t q;
+    float32_t sum_of_squares = 0.0f;
+    uint32_t shift = 2;
+    for (uint32_t i = 0; i < 4; ++i) {
+        if (i != largest) {
+            q[i] = dequantize_float((encoded >> shift) & component_mask, -SQRT_1_OVER_2, SQRT_1_OVER_2, QUANTIZED_QUATERNION_BITS);
+            sum_of_squares += q[i] * q[i];
+            shift += QUANTIZED_QUATERNION_BITS;
+        }
+    }
+
+    q[largest] = sqrtf(glm::max(0.0f, 1.0f - sum_of_squares));
+
+    return(glm::normalize(q));
+}
+
+
+void bit_serializer_t::serialize_quaternion(const quaternion_t &q) {
+    serialize_bits(encode_smallest_three_quaternion(q), 2 + 3 * QUANTIZED_QUATERNION_BITS);
+}
+
+
+quaternion_t bit_serializer_t::deserialize_quaternion(void) {
+    return(decode_smallest_three_quaternion(deserialize_bits(2 + 3 * QUANTIZED_QUATERNION_BITS)));
+}
+
+
+// Mouse differences and dt stay as raw floats: the server needs to simulate with exactly what the client predicted with
+void bit_serializer_t::serialize_client_input_state_packet(client_input_state_packet_t *packet, client_input_state_packet_t *previous) {
+    client_input_state_packet_t zero = {};
+    if (!previous) {
+        previous = &zero;
+    }
+
+    bool action_flags_changed = (packet->action_flags != previous->action_flags);
+    serialize_bool(action_flags_changed);
+    if (action_flags_changed) {
+        serialize_varint(packet->action_flags);
+    }
+
+    serialize_bool(packet->mouse_x_diff != 0.0f);
+    if (packet->mouse_x_diff != 0.0f) {
+        serialize_float32(packet->mouse_x_diff);
+    }
+
+    serialize_bool(packet->mouse_y_diff != 0.0f);
+    if (packet->mouse_y_diff != 0.0f) {
+        serialize_float32(packet->mouse_y_diff);
+    }
+
+    // Only 5 bits are used
+    serialize_bits(packet->flags_byte, 5);
+
+    bool dt_changed = (packet->dt != previous->dt);
+    serialize_bool(dt_changed);
+    if (dt_changed) {
+        serialize_float32(packet->dt);
+    }
+
+    bool command_id_is_next = (packet->command_id == previous->command_id + 1);
+    serialize_bool(command_id_is_next);
+    if (!command_id_is_next) {
+        serialize_varint(packet->command_id);
+    }
+}
+
+
+void bit_serializer_t::deserialize_client_input_state_packet(client_input_state_packet_t *packet, client_input_state_packet_t *previous) {
+    client_input_state_packet_t zero = {};
+    if (!previous) {
+        previous = &zero;
+    }
+
+    packet->action_flags = deserialize_bool() ? (uint32_t)deserialize_varint() : previous->action_flags;
+    packet->mouse_x_diff = deserialize_bool() ? deserialize_float32() : 0.0f;
+    packet->mouse_y_diff = deserialize_bool() ? deserialize_float32() : 0.0f;
+    packet->flags_byte = (uint8_t)deserialize_bits(5);
+    packet->dt = deserialize_bool() ? deserialize_float32() : previous->dt;
+    packet->command_id = deserialize_bool() ? previous->command_id + 1 : deserialize_varint();
+}
+
+
+void quantize_player_snapshot(game_snapshot_player_state_packet_t *packet, quantized_player_snapshot_t *dst) {
+    dst->client_id = packet->client_id;
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        dst->ws_position[i] = s_quantize(packet->ws_position[i], QUANTIZED_POSITION_SCALE);
+        dst->ws_velocity[i] = s_quantize(packet->ws_velocity[i], QUANTIZED_POSITION_SCALE);
+        dst->ws_previous_velocity[i] = s_quantize(packet->ws_previous_velocity[i], QUANTIZED_POSITION_SCALE);
+    }
+
+    encode_octahedral_unit_vector(packet->ws_direction, QUANTIZED_UNIT_VECTOR_BITS, dst->ws_direction);
+    encode_octahedral_unit_vector(packet->ws_up_vector, QUANTIZED_UNIT_VECTOR_BITS, dst->ws_up_vector);
+
+    dst->ws_rotation = encode_smallest_three_quaternion(packet->ws_rotation);
+
+    dst->action_flags = packet->action_flags;
+
+    game_snapshot_player_state_packet_t shared_flags = {};
+    shared_flags.is_rolling = packet->is_rolling;
+    shared_flags.physics_state = packet->physics_state;
+    dst->flags = shared_flags.flags;
+}
+
+
+void dequantize_player_snapshot(quantized_player_snapshot_t *quantized, game_snapshot_player_state_packet_t *dst) {
+    dst->client_id = quantized->client_id;
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        dst->ws_position[i] = s_dequantize(quantized->ws_position[i], QUANTIZED_POSITION_SCALE);
+        dst->ws_velocity[i] = s_dequantize(quantized->ws_velocity[i], QUANTIZED_POSITION_SCALE);
+        dst->ws_previous_velocity[i] = s_dequantize(quantized->ws_previous_velocity[i], QUANTIZED_POSITION_SCALE);
+    }
+
+    dst->ws_direction = decode_octahedral_unit_vector(quantized->ws_direction, QUANTIZED_UNIT_VECTOR_BITS);
+    dst->ws_up_vector = decode_octahedral_unit_vector(quantized->ws_up_vector, QUANTIZED_UNIT_VECTOR_BITS);
+
+    dst->ws_rotation = decode_smallest_three_quaternion(quantized->ws_rotation);
+
+    dst->action_flags = quantized->action_flags;
+    dst->flags = quantized->flags;
+}
+
+
+// Changed bit for the whole field, then the differences of every component
+static void s_serialize_delta_field(bit_serializer_t *serializer, int32_t *current, int32_t *baseline, uint32_t count) {
+    bool changed = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        changed |= (current[i] != baseline[i]);
+    }
+
+    serializer->serialize_bool(changed);
+
+    if (changed) {
+        for (uint32_t i = 0; i < count; ++i) {
+            int32_t difference = (int32_t)((uint32_t)current[i] - (uint32_t)baseline[i]);
+            serializer->serialize_signed_varint(difference, SNAPSHOT_DELTA_VARINT_GROUP_BITS);
+        }
+    }
+}
+
+
+static void s_deserialize_delta_field(bit_serializer_t *serializer, int32_t *dst, int32_t *baseline, uint32_t count) {
+    bool changed = serializer->deserialize_bool();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t difference = changed ? serializer->deserialize_signed_varint(SNAPSHOT_DELTA_VARINT_GROUP_BITS) : 0;
+        dst[i] = (int32_t)((uint32_t)baseline[i] + (uint32_t)difference);
+    }
+}
+
+
+void bit_serializer_t::serialize_player_snapshot_delta(quantized_player_snapshot_t *current, quantized_player_snapshot_t *baseline) {
+    quantized_player_snapshot_t zero = {};
+    if (!baseline) {
+        baseline = &zero;
+    }
+
+    int32_t *current_fields[] = { current->ws_position, current->ws_direction, current->ws_velocity, current->ws_previous_velocity, current->ws_up_vector };
+    int32_t *baseline_fields[] = { baseline->ws_position, baseline->ws_direction, baseline->ws_velocity, baseline->ws_previous_velocity, baseline->ws_up_vector };
+    uint32_t field_sizes[] = { 3, 2, 3, 3, 2 };
+
+    for (uint32_t field = 0; field < 5; ++field) {
+        s_serialize_delta_field(this, current_fields[field], baseline_fields[field], field_sizes[field]);
+    }
+
+    // Encoded rotation isn't continuous: either the same or sent again
+    bool rotation_changed = (current->ws_rotation != baseline->ws_rotation);
+    serialize_bool(rotation_changed);
+    if (rotation_changed) {
+        serialize_bits(current->ws_rotation, 2 + 3 * QUANTIZED_QUATERNION_BITS);
+    }
+
+    bool flags_changed = (current->action_flags != baseline->action_flags || current->flags != baseline->flags);
+    serialize_bool(flags_changed);
+    if (flags_changed) {
+        serialize_varint(current->action_flags);
+        serialize_bits(current->flags, 8);
+    }
+}
+
+
+void bit_serializer_t::deserialize_player_snapshot_delta(quantized_player_snapshot_t *dst, quantized_player_snapshot_t *baseline) {
+    quantized_player_snapshot_t zero = {};
+    if (!baseline) {
+        baseline = &zero;
+    }
+
+    int32_t *dst_fields[] = { dst->ws_position, dst->ws_direction, dst->ws_velocity, dst->ws_previous_velocity, dst->ws_up_vector };
+    int32_t *baseline_fields[] = { baseline->ws_position, baseline->ws_direction, baseline->ws_velocity, baseline->ws_previous_velocity, baseline->ws_up_vector };
+    uint32_t field_sizes[] = { 3, 2, 3, 3, 2 };
+
+    for (uint32_t field = 0; field < 5; ++field) {
+        s_deserialize_delta_field(this, dst_fields[field], baseline_fields[field], field_sizes[field]);
+    }
+
+    dst->ws_rotation = deserialize_bool() ? deserialize_bits(2 + 3 * QUANTIZED_QUATERNION_BITS) : baseline->ws_rotation;
+
+    if (deserialize_bool()) {
+        dst->action_flags = (uint32_t)deserialize_varint();
+        dst->flags = (uint8_t)deserialize_bits(8);
+    }
+    else {
+        dst->action_flags = baseline->action_flags;
+        dst->flags = baseline->flags;
+    }
+}
+
+
 void serializer_t::serialize_game_snapshot_voxel_delta_packet(game_snapshot_voxel_delta_packet_t *packet) {
     serialize_uint32(packet->modified_count);
 
     for (uint32_t chunk = 0; chunk < packet->modified_count; ++chunk) {
         serialize_uint16(packet->modified_chunks[chunk].chunk_index);
+        serialize_uint32(packet->modified_chunks[chunk].base_version);
+        serialize_uint32(packet->modified_chunks[chunk].version);
         serialize_uint32(packet->modified_chunks[chunk].modified_voxel_count);
         for (uint32_t voxel = 0; voxel < packet->modified_chunks[chunk].modified_voxel_count; ++voxel) {
             serialize_uint8(packet->modified_chunks[chunk].modified_voxels[voxel].previous_value);
@@ -424,34 +1251,42 @@ void serializer_t::serialize_game_snapshot_voxel_delta_packet(game_snapshot_voxe
             serialize_uint16(packet->modified_chunks[chunk].modified_voxels[voxel].index);
         }
     }
+
+    serialize_uint8((uint8_t)packet->chunk_hash_count);
+    for (uint32_t i = 0; i < packet->chunk_hash_count; ++i) {
+        serialize_uint16(packet->chunk_hashes[i].chunk_index);
+        serialize_uint32(packet->chunk_hashes[i].version);
+        serialize_uint64(packet->chunk_hashes[i].hash);
+    }
 }
 
 
 void serializer_t::deserialize_game_snapshot_voxel_delta_packet(game_snapshot_voxel_delta_packet_t *packet, linear_allocator_t *allocator) {
     packet->modified_count = deserialize_uint32();
 
-    packet->modified_chunks = (modified_chunk_t *)allocate_linear(sizeof(modified_chunk_t) * packet->modified_count, 1, "", allocator);
+    packet->modified_chunks = (modified_chunk_t *)allocate_linear(sizeof(modified_chunk_t) * packet->modified_count, alignof(modified_chunk_t), "", allocator);
 
-    uint32_t output_count = 0;
-    
     for (uint32_t chunk = 0; chunk < packet->modified_count; ++chunk) {
         packet->modified_chunks[chunk].chunk_index = deserialize_uint16();
+        packet->modified_chunks[chunk].base_version = deserialize_uint32();
+        packet->modified_chunks[chunk].version = deserialize_uint32();
 
         packet->modified_chunks[chunk].modified_voxel_count = deserialize_uint32();
         
-        packet->modified_chunks[chunk].modified_voxels = (modified_voxel_t *)allocate_linear(sizeof(modified_voxel_t) * packet->modified_chunks[chunk].modified_voxel_count, 1, "", allocator);
+        packet->modified_chunks[chunk].modified_voxels = (modified_voxel_t *)allocate_linear(sizeof(modified_voxel_t) * packet->modified_chunks[chunk].modified_voxel_count, alignof(modified_voxel_t), "", allocator);
         for (uint32_t voxel = 0; voxel < packet->modified_chunks[chunk].modified_voxel_count; ++voxel) {
             packet->modified_chunks[chunk].modified_voxels[voxel].previous_value = deserialize_uint8();
             packet->modified_chunks[chunk].modified_voxels[voxel].next_value = deserialize_uint8();
             packet->modified_chunks[chunk].modified_voxels[voxel].index = deserialize_uint16();
-
-            ++output_count;
-            output_to_debug_console((int32_t)(packet->modified_chunks[chunk].modified_voxels[voxel].next_value), " ");
         }
     }
 
-    if (output_count) {
-        output_to_debug_console("\n");
+    packet->chunk_hash_count = deserialize_uint8();
+    packet->chunk_hashes = (chunk_hash_t *)allocate_linear(sizeof(chunk_hash_t) * packet->chunk_hash_count, alignof(chunk_hash_t), "", allocator);
+    for (uint32_t i = 0; i < packet->chunk_hash_count; ++i) {
+        packet->chunk_hashes[i].chunk_index = deserialize_uint16();
+        packet->chunk_hashes[i].version = deserialize_uint32();
+        packet->chunk_hashes[i].hash = deserialize_uint64();
     }
 }
 
@@ -459,9 +1294,15 @@ void serializer_t::deserialize_game_snapshot_voxel_delta_packet(game_snapshot_vo
 void serializer_t::deserialize_game_state_initialize_packet(game_state_initialize_packet_t *packet) {
     deserialize_voxel_state_initialize_packet(&packet->voxels);
     packet->client_index = deserialize_uint32();
-    packet->player_count = deserialize_uint32();
-    packet->player = (player_state_initialize_packet_t *)allocate_linear(sizeof(player_state_initialize_packet_t) * packet->player_count);
+    uint32_t player_count = deserialize_uint32();
+    packet->player_count = MIN(player_count, (uint32_t)MAX_CLIENTS);
     for (uint32_t i = 0; i < packet->player_count; ++i) {
         deserialize_player_state_initialize_packet(&packet->player[i]);
     }
+    uint32_t reused_chunk_count = deserialize_uint32();
+    packet->reused_chunk_count = MIN(reused_chunk_count, (uint32_t)MAX_CACHED_CHUNKS);
+    for (uint32_t i = 0; i < packet->reused_chunk_count; ++i) {
+        packet->reused_chunks[i].chunk_index = deserialize_uint16();
+        packet->reused_chunks[i].version = deserialize_uint32();
+    }
 }
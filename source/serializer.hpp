@@ -2,23 +2,42 @@
 
 #include "utils.hpp"
 #include "sockets.hpp"
+#include "channel.hpp"
 #include "packets.hpp"
 
+struct packet_buffer_pool_t;
+
+// Called by flush_channel_datagrams() once the queued datagrams went out
+void release_flushed_packet_buffers(void);
+
 struct serializer_t {
     uint32_t data_buffer_size;
     uint8_t *data_buffer;
     uint32_t data_buffer_head = 0;
+    // Pool which the buffer comes from (null if the serializer doesn't own the buffer, e.g. received datagrams)
+    packet_buffer_pool_t *pool = nullptr;
 
 
     
+    // Takes a buffer from the packet buffer pools (optional: a MTU sized buffer gets taken on the first write)
     void initialize(uint32_t max_size);
+    // Bounds checked: moves to a bigger pooled buffer if the data doesn't fit (heap buffer past MAX_MESSAGE_BUFFER_SIZE)
     uint8_t *grow_data_buffer(uint32_t bytes);
-    void send_serialized_message(network_address_t address);
+    // Gives the buffer back to its pool (the send functions do it once the data got copied by the channel layer)
+    void release(void);
+    // Same but only once the datagrams pointing to the buffer got flushed (unreliable bodies don't get copied)
+    void release_after_flush(void);
+    // Goes through the channel layer (gets fragmented if it doesn't fit in one datagram), socket = null: main socket
+    void send_serialized_message(network_address_t address, channel_type_t channel = CT_UNRELIABLE_SEQUENCED, network_socket_t *socket = nullptr);
+    // Gets sent with the next flush_channel_datagrams(), body (optional) gets sent right after this serializer's data, as part of the same message
+    void queue_serialized_message(network_address_t address, serializer_t *body = nullptr, channel_type_t channel = CT_UNRELIABLE_SEQUENCED, network_socket_t *socket = nullptr);
     void receive_serialized_message(network_address_t address);
     
     // Basic serialization
     void serialize_uint8(uint8_t u8);
     void serialize_bytes(uint8_t *bytes, uint32_t size);
+    // Returns how many voxels could be compressed within max_size bytes
+    uint32_t serialize_rle_voxels(uint8_t *voxels, uint32_t voxel_count, uint32_t max_size);
     void serialize_uint16(uint16_t u16);
     void serialize_uint32(uint32_t u32);
     void serialize_uint64(uint64_t u64);
@@ -34,6 +53,8 @@ struct serializer_t {
     vector3_t deserialize_vector3(void);
     const char *deserialize_string(void);
     void deserialize_bytes(uint8_t *bytes, uint32_t size);
+    // Decompresses straight into dst
+    void deserialize_rle_voxels(uint8_t *dst, uint32_t voxel_count);
 
     // Complex serialization
     void serialize_packet_header(packet_header_t *packet);
@@ -42,18 +63,89 @@ struct serializer_t {
     void deserialize_player_state_initialize_packet(player_state_initialize_packet_t *packet);
     void serialize_voxel_state_initialize_packet(voxel_state_initialize_packet_t *packet);
     void deserialize_voxel_state_initialize_packet(voxel_state_initialize_packet_t *packet);
-    void serialize_voxel_chunk_values_packet(voxel_chunk_values_packet_t *packet);
+    // Compresses as many voxels (from first_voxel) as fit in max_size bytes, sets voxel_count
+    void serialize_voxel_chunk_values_packet(voxel_chunk_values_packet_t *packet, uint32_t max_size);
+    // Doesn't deserialize the voxels: need to call deserialize_rle_voxels() with the chunk's voxels as destination
     void deserialize_voxel_chunk_values_packet(voxel_chunk_values_packet_t *packet);
     void serialize_game_state_initialize_packet(game_state_initialize_packet_t *packet);
+    // packet->player needs to point to MAX_CLIENTS entries, packet->reused_chunks to MAX_CACHED_CHUNKS entries
     void deserialize_game_state_initialize_packet(game_state_initialize_packet_t *packet);
     void serialize_client_join_packet(client_join_packet_t *packet);
+    // packet->cached_chunks needs to point to MAX_CACHED_CHUNKS entries
     void deserialize_client_join_packet(client_join_packet_t *packet);
-    void serialize_client_input_state_packet(struct player_state_t *packet);
-    void deserialize_client_input_state_packet(client_input_state_packet_t *packet);
+    void serialize_chunks_request_packet(chunks_request_packet_t *packet);
+    // Ignores the chunks after max_chunks, packet->chunk_indices needs to point to max_chunks entries
+    void deserialize_chunks_request_packet(chunks_request_packet_t *packet, uint32_t max_chunks);
     void serialize_game_snapshot_player_state_packet(game_snapshot_player_state_packet_t *packet);
     void deserialize_game_snapshot_player_state_packet(game_snapshot_player_state_packet_t *packet);
     void serialize_game_snapshot_voxel_delta_packet(game_snapshot_voxel_delta_packet_t *packet);
-    void deserialize_game_snapshot_voxel_delta_packet(game_snapshot_voxel_delta_packet_t *packet, linear_allocator_t *allocator = nullptr);
+    // Voxel lists get allocated from allocator (need to outlive the packet on the client)
+    void deserialize_game_snapshot_voxel_delta_packet(game_snapshot_voxel_delta_packet_t *packet, linear_allocator_t *allocator);
     void serialize_client_modified_voxels_packet(client_modified_voxels_packet_t *packet);
-    void deserialize_client_modified_voxels_packet(client_modified_voxels_packet_t *packet);    
+    // Ignores the chunks after max_chunks, packet->modified_chunks needs to point to max_chunks entries
+    // Voxels point into the serializer's buffer (same layout): only valid as long as the buffer is
+    void deserialize_client_modified_voxels_packet(client_modified_voxels_packet_t *packet, uint32_t max_chunks);
+    // Same format as serialize_client_modified_voxels_packet(), straight from the modified voxel lists of the chunks
+    void serialize_client_modified_chunks(struct chunk_t **chunks, uint32_t chunk_count);
+};
+
+
+// Reads / writes bit by bit (least significant bits first) inside of a serializer_t's buffer
+// Gets used for the packets which get sent all the time (input commands, snapshots)
+struct bit_serializer_t {
+    uint8_t *data_buffer;
+    uint32_t data_buffer_size;
+    uint32_t bit_head = 0;
+    // Got asked to read / write past the end of the buffer (reads return 0 from then on): packet is truncated or corrupted
+    bool overflowed = 0;
+
+    // Starts at the serializer's current head
+    void begin(serializer_t *serializer);
+    // Moves the serializer's head to the next byte after the bits which were read / written
+    void end(serializer_t *serializer);
+    uint32_t bytes_used(void);
+    
+    // Basic serialization
+    void serialize_bits(uint32_t value, uint32_t bit_count);
+    // Copies bits which were written by another bit serializer (e.g. encodings which are shared between several packets)
+    void serialize_bit_range(bit_serializer_t *src, uint32_t bit_offset, uint32_t bit_count);
+    void serialize_bool(bool b);
+    void serialize_varint(uint64_t value, uint32_t group_bits = 7);
+    void serialize_signed_varint(int32_t value, uint32_t group_bits = 7);
+    void serialize_float32(float32_t f32);
+    void serialize_quantized_float(float32_t value, float32_t min, float32_t max, uint32_t bit_count);
+    // Unbounded values: rounded to multiples of 1 / scale and sent as a signed varint
+    void serialize_fixed_point(float32_t value, float32_t scale);
+    void serialize_unit_vector(const vector3_t &v3, uint32_t bits_per_component = QUANTIZED_UNIT_VECTOR_BITS);
+    void serialize_quaternion(const quaternion_t &q);
+
+    uint32_t deserialize_bits(uint32_t bit_count);
+    bool deserialize_bool(void);
+    uint64_t deserialize_varint(uint32_t group_bits = 7);
+    int32_t deserialize_signed_varint(uint32_t group_bits = 7);
+    float32_t deserialize_float32(void);
+    float32_t deserialize_quantized_float(float32_t min, float32_t max, uint32_t bit_count);
+    float32_t deserialize_fixed_point(float32_t scale);
+    vector3_t deserialize_unit_vector(uint32_t bits_per_component = QUANTIZED_UNIT_VECTOR_BITS);
+    quaternion_t deserialize_quaternion(void);
+
+    // Complex serialization
+    // Previous input state (can be null) is used to skip whatever didn't change from one command to the next
+    void serialize_client_input_state_packet(client_input_state_packet_t *packet, client_input_state_packet_t *previous);
+    void deserialize_client_input_state_packet(client_input_state_packet_t *packet, client_input_state_packet_t *previous);
+    // Baseline can be null (full state - same as delta against 0)
+    void serialize_player_snapshot_delta(quantized_player_snapshot_t *current, quantized_player_snapshot_t *baseline);
+    void deserialize_player_snapshot_delta(quantized_player_snapshot_t *dst, quantized_player_snapshot_t *baseline);
 };
+
+
+// Integer encodings which the bit serializer uses (snapshots need them to compare against baselines)
+uint32_t quantize_float(float32_t value, float32_t min, float32_t max, uint32_t bit_count);
+float32_t dequantize_float(uint32_t quantized, float32_t min, float32_t max, uint32_t bit_count);
+void encode_octahedral_unit_vector(const vector3_t &v3, uint32_t bits_per_component, int32_t *dst);
+vector3_t decode_octahedral_unit_vector(const int32_t *encoded, uint32_t bits_per_component);
+uint32_t encode_smallest_three_quaternion(const quaternion_t &q);
+quaternion_t decode_smallest_three_quaternion(uint32_t encoded);
+
+void quantize_player_snapshot(game_snapshot_player_state_packet_t *packet, quantized_player_snapshot_t *dst);
+void dequantize_player_snapshot(quantized_player_snapshot_t *quantized, game_snapshot_player_state_packet_t *dst);
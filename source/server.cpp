@@ -1,3 +1,4 @@
+#include "game.hpp"
 #include "gamestate.hpp"
 #include "entities_gstate.hpp"
 #include "packets.hpp"
@@ -9,25 +10,29 @@
 
 #include "chunks_gstate.hpp"
 #include "chunk.hpp"
+#include "interest.hpp"
 
-#define MAX_RECEIVED_PACKETS_IN_QUEUE 60
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
 
-struct receiver_thread_t {
-    linear_allocator_t packet_allocator = {};
-    thread_process_t process;
-
-    // Pointers into the packet allocator
-    uint32_t packet_count;
-    void *packets[MAX_RECEIVED_PACKETS_IN_QUEUE];
-    uint32_t packet_sizes[MAX_RECEIVED_PACKETS_IN_QUEUE];
-    network_address_t addresses[MAX_RECEIVED_PACKETS_IN_QUEUE];
+// Needs to be a power of 2
+#define MAX_RECEIVED_DATAGRAMS_IN_QUEUE 1024
 
-    // Mutex
-    mutex_t *mutex;
+// Receiver thread drains the socket as soon as datagrams arrive and pushes them to the simulation thread
+// Single producer (receiver thread) / single consumer (simulation thread): no locks, each side only writes its own index
+struct receiver_thread_t {
+    // Datagram buffers get allocated once and get reused as the ring wraps around
+    datagram_t datagrams[MAX_RECEIVED_DATAGRAMS_IN_QUEUE];
 
-    uint32_t receiver_thread_loop_count = 0;
+    // Indices only ever increase (wrap around with the mask)
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
 
-    bool receiver_freezed = 0;
+    // Raised by the receiver thread when datagrams got pushed
+    signal_t *received_signal;
+    // Raised by the simulation thread when datagrams got consumed (in case the ring was full)
+    signal_t *consumed_signal;
 };
 
 static receiver_thread_t receiver_thread;
@@ -35,17 +40,347 @@ static receiver_thread_t receiver_thread;
 
 static char *message_buffer;
 
+static void s_receiver_thread_process(void *receiver_thread_data) {
+    output_to_debug_console("Started receiver thread\n");
+
+    receiver_thread_t *process_data = (receiver_thread_t *)receiver_thread_data;
+
+    for (;;) {
+        uint32_t head = process_data->head.load(std::memory_order_relaxed);
+        uint32_t tail = process_data->tail.load(std::memory_order_acquire);
+
+        uint32_t free_count = MAX_RECEIVED_DATAGRAMS_IN_QUEUE - (head - tail);
+        if (free_count == 0) {
+            // Simulation thread is behind: datagrams wait in the socket's buffer
+            wait_for_signal(process_data->consumed_signal, 1);
+            continue;
+        }
+
+        // Batches need to be contiguous in the ring
+        uint32_t first = head & (MAX_RECEIVED_DATAGRAMS_IN_QUEUE - 1);
+        uint32_t batch_size = MIN(MIN(free_count, MAX_RECEIVED_DATAGRAMS_IN_QUEUE - first), (uint32_t)MAX_DATAGRAM_BATCH);
+
+        uint32_t received_count = receive_from_batch(&process_data->datagrams[first], batch_size);
+
+        if (received_count) {
+            process_data->head.store(head + received_count, std::memory_order_release);
+            raise_signal(process_data->received_signal);
+        }
+        else {
+            // Socket has been drained
+            wait_for_incoming_data(100);
+        }
+    }
+}
+
+static void s_initialize_receiver_thread(void) {
+    // Bigger messages get fragmented by the channel layer
+    char *datagrams_memory = (char *)malloc(MAX_PACKET_SIZE * MAX_RECEIVED_DATAGRAMS_IN_QUEUE);
+    for (uint32_t i = 0; i < MAX_RECEIVED_DATAGRAMS_IN_QUEUE; ++i) {
+        receiver_thread.datagrams[i].buffer = datagrams_memory + MAX_PACKET_SIZE * i;
+        receiver_thread.datagrams[i].buffer_size = MAX_PACKET_SIZE;
+    }
+
+    receiver_thread.head.store(0);
+    receiver_thread.tail.store(0);
+    receiver_thread.received_signal = request_signal();
+    receiver_thread.consumed_signal = request_signal();
+
+    request_thread_for_process(&s_receiver_thread_process, &receiver_thread);
+}
+
+// Capture file: header, then for every server frame: dt and datagram count, followed by the datagrams (address, port, size, bytes)
+// Arrival tick of a datagram = index of the frame it's in. Everything is in host byte order (captures get replayed on the same kind of machine)
+#define PACKET_CAPTURE_MAGIC 0x50414b53
+#define PACKET_CAPTURE_VERSION 2
+#define PACKET_CAPTURE_FILE_BUFFER_SIZE (1024 * 1024)
+#define MAX_PACKET_CAPTURE_PATH_LENGTH 256
+
+struct packet_capture_t {
+    char path[MAX_PACKET_CAPTURE_PATH_LENGTH];
+    bool recording;
+    bool replaying;
+
+    // Recording
+    FILE *file;
+
+    // Replay: whole capture gets loaded before starting so that reading it doesn't show up in the timings
+    uint8_t *data;
+    uint32_t data_size;
+    uint32_t data_head;
+    float32_t frame_dt;
+    uint32_t frame_datagram_count;
+    bool finished;
+
+    uint64_t frame_count;
+    uint64_t datagram_count;
+    float32_t simulated_time;
+    std::chrono::steady_clock::time_point replay_start;
+    net_channel_stats_t stats_at_start;
+};
+
+static packet_capture_t packet_capture;
+
+static void s_write_capture(const void *data, uint32_t size) {
+    fwrite(data, 1, size, packet_capture.file);
+}
+
+static bool s_read_capture(void *dst, uint32_t size) {
+    if (packet_capture.data_head + size > packet_capture.data_size) {
+        return(0);
+    }
+
+    memcpy(dst, packet_capture.data + packet_capture.data_head, size);
+    packet_capture.data_head += size;
+    return(1);
+}
+
+static void s_open_packet_capture(void) {
+    packet_capture.file = fopen(packet_capture.path, "wb");
+    if (!packet_capture.file) {
+        output_to_debug_console("Failed to open packet capture file ", packet_capture.path, "\n");
+        packet_capture.recording = 0;
+        return;
+    }
+
+    setvbuf(packet_capture.file, nullptr, _IOFBF, PACKET_CAPTURE_FILE_BUFFER_SIZE);
+
+    // Session seed: replayed acknowledgements only match the sessions of the recorded run
+    uint32_t header[3] = { PACKET_CAPTURE_MAGIC, PACKET_CAPTURE_VERSION, get_net_channel_session_seed() };
+    s_write_capture(header, sizeof(header));
+
+    output_to_debug_console("Recording packet capture to ", packet_capture.path, "\n");
+}
+
+static void s_load_packet_capture(void) {
+    FILE *file = fopen(packet_capture.path, "rb");
+    if (!file) {
+        output_to_debug_console("Failed to open packet capture file ", packet_capture.path, "\n");
+        packet_capture.finished = 1;
+        return;
+    }
+
+    fseek(file, 0, SEEK_END);
+    packet_capture.data_size = (uint32_t)ftell(file);
+    rewind(file);
+
+    packet_capture.data = (uint8_t *)malloc(packet_capture.data_size);
+    packet_capture.data_size = (uint32_t)fread(packet_capture.data, 1, packet_capture.data_size, file);
+    packet_capture.data_head = 0;
+
+    fclose(file);
+
+    uint32_t header[3] = {};
+    if (!s_read_capture(header, sizeof(header)) || header[0] != PACKET_CAPTURE_MAGIC || header[1] != PACKET_CAPTURE_VERSION) {
+        output_to_debug_console("Not a (compatible) packet capture: ", packet_capture.path, "\n");
+        packet_capture.finished = 1;
+        return;
+    }
+
+    // No channel exists yet (they get created by the replayed datagrams)
+    set_net_channel_session_seed((uint16_t)header[2]);
+    packet_capture.stats_at_start = get_net_channel_stats();
+
+    output_to_debug_console("Replaying packet capture ", packet_capture.path, " (", (int32_t)(packet_capture.data_size / 1024), " KB)\n");
+
+    packet_capture.replay_start = std::chrono::steady_clock::now();
+}
+
+void configure_server_capture(const char *capture_path) {
+    strncpy(packet_capture.path, capture_path, MAX_PACKET_CAPTURE_PATH_LENGTH - 1);
+    packet_capture.recording = 1;
+}
+
+void configure_server_replay(const char *capture_path) {
+    strncpy(packet_capture.path, capture_path, MAX_PACKET_CAPTURE_PATH_LENGTH - 1);
+    packet_capture.replaying = 1;
+}
+
+bool is_replaying_server_capture(void) {
+    return(packet_capture.replaying);
+}
+
+static void s_report_replay_results(void) {
+    float32_t replay_time = std::chrono::duration<float32_t>(std::chrono::steady_clock::now() - packet_capture.replay_start).count();
+
+    output_to_debug_console("Replayed ", (int32_t)packet_capture.frame_count, " frames and ", (int32_t)packet_capture.datagram_count, " datagrams (",
+                            packet_capture.simulated_time, " s of game time) in ", replay_time, " s | ",
+                            "frame avg ", replay_time * 1000.0f / (float32_t)MAX(packet_capture.frame_count, 1ull), " ms | ",
+                            packet_capture.simulated_time / MAX(replay_time, 0.000001f), "x real time\n");
+
+    // The recorded acknowledgements need to match what the server sends now, otherwise the replay went a different way
+    net_channel_stats_t stats = get_net_channel_stats();
+    uint64_t reliable_sent = stats.reliable_messages_sent - packet_capture.stats_at_start.reliable_messages_sent;
+    uint64_t reliable_acknowledged = stats.reliable_messages_acknowledged - packet_capture.stats_at_start.reliable_messages_acknowledged;
+
+    output_to_debug_console("Replay: ", (int32_t)reliable_acknowledged, " / ", (int32_t)reliable_sent, " reliable messages acknowledged\n");
+
+    if (reliable_sent && !reliable_acknowledged) {
+        output_to_debug_console("Replay diverged from the recorded run: none of the reliable messages got acknowledged\n");
+    }
+}
+
+float32_t begin_server_replay_frame(void) {
+    packet_capture.frame_dt = 0.0f;
+    packet_capture.frame_datagram_count = 0;
+
+    if (packet_capture.finished) {
+        return(0.0f);
+    }
+
+    uint16_t datagram_count = 0;
+    if (!s_read_capture(&packet_capture.frame_dt, sizeof(packet_capture.frame_dt)) || !s_read_capture(&datagram_count, sizeof(datagram_count))) {
+        packet_capture.frame_dt = 0.0f;
+        packet_capture.finished = 1;
+
+        s_report_replay_results();
+        request_quit();
+
+        return(0.0f);
+    }
+
+    packet_capture.frame_datagram_count = datagram_count;
+    ++packet_capture.frame_count;
+    packet_capture.simulated_time += packet_capture.frame_dt;
+
+    return(packet_capture.frame_dt);
+}
+
+static void s_handle_received_packet(char *buffer, uint32_t bytes_received, network_address_t received_address, void *data);
+
+// Replay mode: datagrams of the current frame come straight from the capture
+static void s_handle_replayed_datagrams(void) {
+    for (uint32_t i = 0; i < packet_capture.frame_datagram_count; ++i) {
+        network_address_t address = {};
+        uint16_t size = 0;
+
+        if (!s_read_capture(&address.ipv4_address, sizeof(address.ipv4_address)) ||
+            !s_read_capture(&address.port, sizeof(address.port)) ||
+            !s_read_capture(&size, sizeof(size)) ||
+            packet_capture.data_head + size > packet_capture.data_size) {
+            // Truncated capture (server got killed while recording)
+            packet_capture.data_head = packet_capture.data_size;
+            break;
+        }
+
+        uint8_t *datagram = packet_capture.data + packet_capture.data_head;
+        packet_capture.data_head += size;
+        ++packet_capture.datagram_count;
+
+        receive_channel_datagram(datagram, size, address, &s_handle_received_packet);
+    }
+
+    packet_capture.frame_datagram_count = 0;
+}
+
+// Simulation thread: goes through everything the receiver thread pushed since last tick
+static void s_handle_received_datagrams(float32_t dt) {
+    if (packet_capture.replaying) {
+        s_handle_replayed_datagrams();
+        return;
+    }
+
+    uint32_t tail = receiver_thread.tail.load(std::memory_order_relaxed);
+    uint32_t head = receiver_thread.head.load(std::memory_order_acquire);
+
+    if (packet_capture.recording) {
+        // Frames without datagrams still need to be written: replay needs every dt
+        uint16_t datagram_count = (uint16_t)(head - tail);
+        s_write_capture(&dt, sizeof(dt));
+        s_write_capture(&datagram_count, sizeof(datagram_count));
+    }
+
+    if (tail == head) {
+        return;
+    }
+
+    for (; tail != head; ++tail) {
+        datagram_t *datagram = &receiver_thread.datagrams[tail & (MAX_RECEIVED_DATAGRAMS_IN_QUEUE - 1)];
+
+        if (packet_capture.recording) {
+            uint16_t size = (uint16_t)datagram->bytes_received;
+            s_write_capture(&datagram->address.ipv4_address, sizeof(datagram->address.ipv4_address));
+            s_write_capture(&datagram->address.port, sizeof(datagram->address.port));
+            s_write_capture(&size, sizeof(size));
+            s_write_capture(datagram->buffer, size);
+        }
+
+        receive_channel_datagram((uint8_t *)datagram->buffer, datagram->bytes_received, datagram->address, &s_handle_received_packet);
+    }
+
+    // Buffers can now get reused by the receiver thread
+    receiver_thread.tail.store(tail, std::memory_order_release);
+    raise_signal(receiver_thread.consumed_signal);
+}
+
+
+// For load testing (see bots.hpp): gets printed every SERVER_STATS_INTERVAL seconds while clients are connected
+#define SERVER_STATS_INTERVAL 5.0f
+
+struct server_stats_t {
+    float32_t time_since_report;
+
+    // Time between two waits for datagrams (whole frame if the server doesn't wait - window mode)
+    std::chrono::steady_clock::time_point tick_start;
+    uint32_t tick_count;
+    float32_t total_tick_time;
+    float32_t max_tick_time;
 
-static uint8_t dummy_voxels[CHUNK_EDGE_LENGTH][CHUNK_EDGE_LENGTH][CHUNK_EDGE_LENGTH];
+    uint32_t snapshot_count;
+    float32_t total_snapshot_time;
+    float32_t max_snapshot_time;
+
+    net_channel_stats_t previous_channel_stats;
+};
+
+static server_stats_t server_stats;
+
+
+// Index of the voxel in the list of voxels the client modified in a chunk (chunks can have up to 4096 modified voxels)
+#define NO_DUMMY_VOXEL 0xFFFF
+static uint16_t dummy_voxels[CHUNK_EDGE_LENGTH][CHUNK_EDGE_LENGTH][CHUNK_EDGE_LENGTH];
 
 void initialize_server(char *msg_buffer) {
     message_buffer = msg_buffer;
-    
-    initialize_socket_api(GAME_OUTPUT_PORT_SERVER);
 
-    memset(dummy_voxels, 255, sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+    if (packet_capture.replaying) {
+        // No sockets: whatever the server sends gets built but goes nowhere
+        s_load_packet_capture();
+        set_outgoing_datagrams_discarded(1);
+    }
+    else {
+        initialize_socket_api(GAME_OUTPUT_PORT_SERVER);
+
+        s_initialize_receiver_thread();
+
+        if (packet_capture.recording) {
+            s_open_packet_capture();
+        }
+    }
+
+    server_stats.tick_start = std::chrono::steady_clock::now();
+
+    memset(dummy_voxels, 0xFF, sizeof(uint16_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH);
+}
+
+void deinitialize_server(void) {
+    if (packet_capture.file) {
+        fclose(packet_capture.file);
+        packet_capture.file = nullptr;
+    }
+
+    if (packet_capture.data) {
+        free(packet_capture.data);
+        packet_capture.data = nullptr;
+    }
 }
 
+// Spreads the hard updates of the chunks which clients are too far behind on over several snapshots
+#define MAX_STALE_CHUNKS_PER_SNAPSHOT 8
+// Voxel changes of the chunks which don't fit in a snapshot wait for the next one (rest of the message is for the players)
+#define MAX_VOXEL_DELTA_BYTES_PER_SNAPSHOT (MAX_MESSAGE_BUFFER_SIZE / 2)
+#define MAX_VOXEL_DELTAS_PER_SNAPSHOT (MAX_VOXEL_DELTA_BYTES_PER_SNAPSHOT / sizeof_modified_voxel())
+
 struct server_data_base_t {
     stack_dynamic_container_t<client_t, MAX_CLIENTS> clients;
     hash_table_inline_t<uint16_t, MAX_CLIENTS * 2, 3, 3> client_table_by_name;
@@ -55,13 +390,19 @@ struct server_data_base_t {
 
 static server_data_base_t data_base;
 
+// Game states which were sent (quantized), used as baselines for the delta compression
+static uint64_t current_game_state_tick = 0;
+static game_state_baselines_t game_state_baselines;
+
 static client_t *s_get_client(uint32_t index) {
     return(&data_base.clients[index]);
 }
 
-static void s_send_chunks_hard_update_packets(network_address_t address) {
+// When the client joins, it waits for all the chunks before updating the meshes
+// Otherwise the chunks are stale chunks the client got close to (count = 0 tells the client to just update them)
+static void s_send_chunks_hard_update_packets(network_address_t address, voxel_chunk_values_packet_t *voxel_update_packets, uint32_t hard_update_count, bool is_join) {
     serializer_t chunks_serializer = {};
-    chunks_serializer.initialize(sizeof(uint32_t) + (sizeof(uint8_t) * 3 + sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH) * 8 /* Maximum amount of chunks to "hard update per packet" */);
+    chunks_serializer.initialize(MAX_PACKET_SIZE);
     
     packet_header_t header = {};
     header.packet_mode = packet_mode_t::PM_SERVER_MODE;
@@ -69,9 +410,6 @@ static void s_send_chunks_hard_update_packets(network_address_t address) {
     // TODO: Increment this with every packet sent
     header.current_tick = *get_current_tick();
 
-    uint32_t hard_update_count = 0;
-    voxel_chunk_values_packet_t *voxel_update_packets = initialize_chunk_values_packets(&hard_update_count);
-
     union {
         struct {
             uint32_t is_first: 1;
@@ -80,61 +418,52 @@ static void s_send_chunks_hard_update_packets(network_address_t address) {
         uint32_t to_update_count;
     } chunks_count;
 
-    chunks_count.is_first = 0;
-    chunks_count.count = hard_update_count;
-    
-    uint32_t loop_count = (hard_update_count / 8);
-    for (uint32_t packet = 0; packet < loop_count; ++packet) {
-        voxel_chunk_values_packet_t *pointer = &voxel_update_packets[packet * 8];
-
-        header.total_packet_size = sizeof_packet_header() + sizeof(uint32_t) + sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * 8;
-        chunks_serializer.serialize_packet_header(&header);
-
-        if (packet == 0) {
-            chunks_count.is_first = 1;
-            // This is the total amount of chunks that the client is waiting for
-            chunks_serializer.serialize_uint32(chunks_count.to_update_count);
-            chunks_count.is_first = 0;
-        }
-        else {
-            chunks_serializer.serialize_uint32(chunks_count.to_update_count);
-        }
+    chunks_count.is_first = is_join;
+    chunks_count.count = is_join ? hard_update_count : 0;
 
-        chunks_serializer.serialize_uint32(8);
-        
-        for (uint32_t chunk = 0; chunk < 8; ++chunk) {
-            chunks_serializer.serialize_voxel_chunk_values_packet(&pointer[chunk]);
-        }
+    // Chunk coordinates, version, first voxel, voxel count and at least one RLE run
+    uint32_t min_piece_size = sizeof(uint8_t) * 3 + sizeof(uint32_t) + sizeof(uint16_t) * 2 + 3;
 
-        chunks_serializer.send_serialized_message(address);
+    // Chunks get compressed and packed until the packet is full (chunks which don't fit get split across packets)
+    uint32_t chunk = 0;
+    uint32_t first_voxel = 0;
+    while (chunk < hard_update_count) {
         chunks_serializer.data_buffer_head = 0;
+        // Header gets serialized once the size is known
+        chunks_serializer.grow_data_buffer(sizeof_packet_header());
+
+        // This is the total amount of chunks that the client is waiting for
+        chunks_serializer.serialize_uint32(chunks_count.to_update_count);
+        chunks_count.is_first = 0;
+
+        uint32_t piece_count_head = chunks_serializer.data_buffer_head;
+        chunks_serializer.grow_data_buffer(sizeof(uint32_t));
+
+        uint32_t piece_count = 0;
+        while (chunk < hard_update_count && FRAGMENT_PAYLOAD_SIZE - chunks_serializer.data_buffer_head >= min_piece_size) {
+            voxel_chunk_values_packet_t *piece = &voxel_update_packets[chunk];
+            piece->first_voxel = first_voxel;
+            chunks_serializer.serialize_voxel_chunk_values_packet(piece, FRAGMENT_PAYLOAD_SIZE - chunks_serializer.data_buffer_head);
+            ++piece_count;
+
+            first_voxel += piece->voxel_count;
+            if (first_voxel == CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH) {
+                first_voxel = 0;
+                ++chunk;
+            }
+        }
 
-        hard_update_count -= 8;
-    }
+        uint32_t packet_end = chunks_serializer.data_buffer_head;
 
-    if (hard_update_count) {
-        voxel_chunk_values_packet_t *pointer = &voxel_update_packets[loop_count * 8];
+        chunks_serializer.data_buffer_head = piece_count_head;
+        chunks_serializer.serialize_uint32(piece_count);
 
-        header.total_packet_size = sizeof_packet_header() + sizeof(uint8_t) * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * CHUNK_EDGE_LENGTH * hard_update_count;
+        header.total_packet_size = packet_end;
+        chunks_serializer.data_buffer_head = 0;
         chunks_serializer.serialize_packet_header(&header);
 
-        if (loop_count == 0) {
-            chunks_count.is_first = 1;
-            chunks_serializer.serialize_uint32(chunks_count.to_update_count);
-            chunks_count.is_first = 0;
-        }
-        else {
-            chunks_serializer.serialize_uint32(chunks_count.to_update_count);
-        }
-        
-        chunks_serializer.serialize_uint32(hard_update_count);
-        
-        for (uint32_t chunk = 0; chunk < hard_update_count; ++chunk) {
-            chunks_serializer.serialize_voxel_chunk_values_packet(&pointer[chunk]);
-        }
-
-        
-        chunks_serializer.send_serialized_message(address);
+        chunks_serializer.data_buffer_head = packet_end;
+        chunks_serializer.send_serialized_message(address, CT_RELIABLE_ORDERED);
     }
 }
 
@@ -160,36 +489,94 @@ static void s_dispatch_newcoming_client_to_clients(uint32_t new_client_index) {
     
     serializer.serialize_player_state_initialize_packet(&player_initialize_packet);
 
+    // Same buffer for every client (the channel layer copies it)
     for (uint32_t client_index = 0; client_index < data_base.clients.data_count; ++client_index) {
         client_t *current_client = s_get_client(client_index);
 
-        serializer.send_serialized_message(current_client->network_address);
+        send_channel_message(current_client->network_address, CT_RELIABLE_ORDERED, serializer.data_buffer, serializer.data_buffer_head);
     }
+
+    flush_channel_datagrams();
+    serializer.release();
 }
 
-static void s_fill_dispatch_packet_with_modified_voxels(game_snapshot_voxel_delta_packet_t *voxel_packet) {
-    // Prepare voxel delta snapshot packets
-    uint32_t modified_chunks_count = 0;
-    chunk_t **chunks = get_modified_chunks(&modified_chunks_count);
+// Every chunk close to the client gets sent what changed since the version that the client acknowledged
+// Chunks which the client is too far behind on (history doesn't go back far enough) get sent entirely, through the reliable channel
+static void s_fill_dispatch_packet_with_outdated_chunks(client_t *client, const vector3_t &ws_position, game_snapshot_voxel_delta_packet_t *voxel_packet) {
+    chunk_t *outdated_chunks[MAX_CHUNK_DELTAS_PER_SNAPSHOT];
+    uint32_t acknowledged_versions[MAX_CHUNK_DELTAS_PER_SNAPSHOT];
+    uint32_t outdated_count = gather_outdated_chunks_in_range(client->client_id, ws_position, current_game_state_tick, outdated_chunks, acknowledged_versions, MAX_CHUNK_DELTAS_PER_SNAPSHOT);
+
+    // Client's voxel packet gets serialized before the next client's gets filled
+    static modified_chunk_t modified_chunks[MAX_CHUNK_DELTAS_PER_SNAPSHOT];
+    static modified_voxel_t modified_voxels[MAX_VOXEL_DELTAS_PER_SNAPSHOT];
+    uint32_t modified_voxel_count = 0;
+
+    voxel_packet->modified_count = 0;
+    voxel_packet->modified_chunks = modified_chunks;
+
+    voxel_chunk_values_packet_t voxel_update_packets[MAX_STALE_CHUNKS_PER_SNAPSHOT];
+    uint32_t stale_count = 0;
+
+    static modified_voxel_t gathered_voxels[chunk_t::MAX_MODIFIED_VOXELS];
+    uint32_t delta_bytes = 0;
 
-    voxel_packet->modified_count = modified_chunks_count;
-    voxel_packet->modified_chunks = (modified_chunk_t *)allocate_linear(sizeof(modified_chunk_t) * modified_chunks_count);
-
-    for (uint32_t chunk_index = 0; chunk_index < modified_chunks_count; ++chunk_index) {
-        chunk_t *chunk = chunks[chunk_index];
-        modified_chunk_t *modified_chunk = &voxel_packet->modified_chunks[chunk_index];
-
-        modified_chunk->chunk_index = convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)get_chunk_grid_size());
-        modified_chunk->modified_voxels = (modified_voxel_t *)allocate_linear(sizeof(modified_voxel_t) * chunk->modified_voxels_list_count);
-        modified_chunk->modified_voxel_count = chunk->modified_voxels_list_count;
-        for (uint32_t voxel = 0; voxel < chunk->modified_voxels_list_count; ++voxel) {
-            uint16_t voxel_index = chunk->list_of_modified_voxels[voxel];
-            modified_chunk->modified_voxels[voxel].previous_value = chunk->voxel_history[voxel_index];
-            voxel_coordinate_t coord = convert_1d_to_3d_coord(voxel_index, CHUNK_EDGE_LENGTH);
-            modified_chunk->modified_voxels[voxel].next_value = chunk->voxels[coord.x][coord.y][coord.z];
-            modified_chunk->modified_voxels[voxel].index = voxel_index;
+    // Reliable channel is backed up (e.g. still sending the join chunks): stale chunks stay outdated and get sent once it drained
+    bool can_send_stale_chunks = get_channel_pending_message_count(client->network_address) == 0;
+    
+    for (uint32_t i = 0; i < outdated_count; ++i) {
+        chunk_t *chunk = outdated_chunks[i];
+
+        uint32_t gathered_count = 0;
+        if (chunk->gather_modified_voxels_since(acknowledged_versions[i], gathered_voxels, chunk_t::MAX_MODIFIED_VOXELS, &gathered_count)) {
+            delta_bytes += sizeof_modified_chunk(gathered_count);
+            if (delta_bytes > MAX_VOXEL_DELTA_BYTES_PER_SNAPSHOT) {
+                break;
+            }
+            
+            modified_chunk_t *modified_chunk = &voxel_packet->modified_chunks[voxel_packet->modified_count++];
+            modified_chunk->chunk_index = convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)get_chunk_grid_size());
+            modified_chunk->base_version = acknowledged_versions[i];
+            modified_chunk->version = chunk->version;
+            modified_chunk->modified_voxel_count = gathered_count;
+            modified_chunk->modified_voxels = &modified_voxels[modified_voxel_count];
+            modified_voxel_count += gathered_count;
+            memcpy(modified_chunk->modified_voxels, gathered_voxels, sizeof(modified_voxel_t) * gathered_count);
+
+            record_sent_chunk_version(client->client_id, current_game_state_tick, chunk);
+        }
+        else if (can_send_stale_chunks && stale_count < MAX_STALE_CHUNKS_PER_SNAPSHOT) {
+            voxel_chunk_values_packet_t *voxel_update_packet = &voxel_update_packets[stale_count++];
+            *voxel_update_packet = {};
+            voxel_update_packet->chunk_coord_x = chunk->chunk_coord.x;
+            voxel_update_packet->chunk_coord_y = chunk->chunk_coord.y;
+            voxel_update_packet->chunk_coord_z = chunk->chunk_coord.z;
+            voxel_update_packet->version = chunk->version;
+            voxel_update_packet->voxels = &chunk->voxels[0][0][0];
+
+            acknowledge_chunk_version(client->client_id, chunk);
         }
     }
+
+    if (stale_count) {
+        s_send_chunks_hard_update_packets(client->network_address, voxel_update_packets, stale_count, 0);
+    }
+}
+
+// Client compares these with its own chunks, and requests the ones which don't match
+static void s_fill_dispatch_packet_with_chunk_hashes(client_t *client, const vector3_t &ws_position, game_snapshot_voxel_delta_packet_t *voxel_packet) {
+    chunk_t *chunks_to_verify[MAX_CHUNK_HASHES_PER_SNAPSHOT];
+    voxel_packet->chunk_hash_count = gather_chunks_to_verify(client->client_id, ws_position, chunks_to_verify, MAX_CHUNK_HASHES_PER_SNAPSHOT);
+
+    static chunk_hash_t chunk_hashes[MAX_CHUNK_HASHES_PER_SNAPSHOT];
+    voxel_packet->chunk_hashes = chunk_hashes;
+
+    for (uint32_t i = 0; i < voxel_packet->chunk_hash_count; ++i) {
+        chunk_t *chunk = chunks_to_verify[i];
+        voxel_packet->chunk_hashes[i].chunk_index = (uint16_t)convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)get_chunk_grid_size());
+        voxel_packet->chunk_hashes[i].version = chunk->version;
+        voxel_packet->chunk_hashes[i].hash = chunk->hash;
+    }
 }
 
 static void s_fill_dispatch_packet_with_player_info(game_snapshot_player_state_packet_t *player_snapshots) {
@@ -212,44 +599,109 @@ static void s_fill_dispatch_packet_with_player_info(game_snapshot_player_state_p
     }
 }
 
+// Most clients acknowledged one of the same few game states: every player gets encoded once per baseline which some client needs
+// Clients' bodies only get the encodings of their relevant players copied in
+#define MAX_PLAYER_ENCODINGS 4
+
+struct player_encoding_t {
+    // 0 = whole state
+    uint64_t baseline_tick;
+    uint32_t bit_offset;
+    uint32_t bit_count;
+};
+
+struct player_encoding_list_t {
+    uint32_t count;
+    player_encoding_t encodings[MAX_PLAYER_ENCODINGS];
+};
+
+struct snapshot_player_encodings_t {
+    serializer_t buffer;
+    bit_serializer_t bits;
+    player_encoding_list_t players[MAX_CLIENTS];
+};
+
+static void s_begin_player_encodings(snapshot_player_encodings_t *encodings, uint32_t player_count) {
+    memset(encodings->players, 0, sizeof(player_encoding_list_t) * player_count);
+
+    uint32_t max_bits = sizeof_max_player_snapshot_delta_bits() * MAX_PLAYER_ENCODINGS * player_count;
+    encodings->buffer.initialize((max_bits + 7) / 8);
+    encodings->bits.begin(&encodings->buffer);
+}
+
+// Client id + delta against the baseline (null = whole state)
+static void s_serialize_player_encoding(bit_serializer_t *dst, snapshot_player_encodings_t *encodings, uint32_t player_index, quantized_player_snapshot_t *current, game_state_baseline_t *baseline) {
+    quantized_player_snapshot_t *baseline_player = baseline ? baseline->find_player(current->client_id) : nullptr;
+    uint64_t baseline_tick = baseline_player ? baseline->game_state_tick : 0;
+
+    player_encoding_list_t *list = &encodings->players[player_index];
+    player_encoding_t *encoding = nullptr;
+    for (uint32_t i = 0; i < list->count; ++i) {
+        if (list->encodings[i].baseline_tick == baseline_tick) {
+            encoding = &list->encodings[i];
+            break;
+        }
+    }
+
+    if (!encoding) {
+        if (list->count == MAX_PLAYER_ENCODINGS) {
+            // Clients acknowledged too many different game states: this one doesn't get shared
+            dst->serialize_varint(current->client_id);
+            dst->serialize_player_snapshot_delta(current, baseline_player);
+            return;
+        }
+
+        encoding = &list->encodings[list->count++];
+        encoding->baseline_tick = baseline_tick;
+        encoding->bit_offset = encodings->bits.bit_head;
+
+        encodings->bits.serialize_varint(current->client_id);
+        encodings->bits.serialize_player_snapshot_delta(current, baseline_player);
+
+        encoding->bit_count = encodings->bits.bit_head - encoding->bit_offset;
+    }
+
+    dst->serialize_bit_range(&encodings->bits, encoding->bit_offset, encoding->bit_count);
+}
+
 static void s_dispatch_snapshot_to_clients(void) {
     packet_header_t header = {};
     header.packet_mode = packet_mode_t::PM_SERVER_MODE;
     header.packet_type = server_packet_type_t::SPT_GAME_STATE_SNAPSHOT;
 
     // First game snapshot voxel deltas, then game snapshot players
-    game_snapshot_voxel_delta_packet_t voxel_packet = {};
     game_snapshot_player_state_packet_t player_snapshots[MAX_CLIENTS] = {};
 
-    // Prepare voxel delta snapshot packets
-    s_fill_dispatch_packet_with_modified_voxels(&voxel_packet);
-
+    // Chunks modified since the last snapshot get a new version (every client is now missing it)
     uint32_t modified_chunks_count = 0;
     chunk_t **chunks = get_modified_chunks(&modified_chunks_count);
+    for (uint32_t i = 0; i < modified_chunks_count; ++i) {
+        chunks[i]->push_version();
+    }
+
+    flag_modified_chunks(modified_chunks_count, chunks);
 
     // Prepare the player snapshot packets
     s_fill_dispatch_packet_with_player_info(player_snapshots);
 
-    serializer_t out_serializer = {};
-    out_serializer.initialize(sizeof_packet_header() +
-                              sizeof(uint64_t) +
-                              sizeof_game_snapshot_voxel_delta_packet(modified_chunks_count, voxel_packet.modified_chunks) +
-                              sizeof_game_snapshot_player_state_packet() * data_base.clients.data_count);
-
-    // TODO: FIX THIS IS NOT THE ACTUAL PACKET SIZE: IT VARIES DEPENDING ON THE CLIENT
-    header.total_packet_size = sizeof_packet_header() +
-        sizeof(uint64_t) +
-        sizeof_game_snapshot_voxel_delta_packet(modified_chunks_count, voxel_packet.modified_chunks) +
-        sizeof_game_snapshot_player_state_packet() * data_base.clients.data_count;
-        
-    out_serializer.serialize_packet_header(&header);
+    // Remember what gets sent this snapshot (quantized) so that next snapshots can be delta compressed against it
+    game_state_baseline_t *current_game_state = game_state_baselines.push(++current_game_state_tick);
+    current_game_state->player_count = data_base.clients.data_count;
+
+    vector3_t ws_player_positions[MAX_CLIENTS];
+    uint16_t player_ids[MAX_CLIENTS];
+    for (uint32_t i = 0; i < data_base.clients.data_count; ++i) {
+        quantize_player_snapshot(&player_snapshots[i], &current_game_state->players[i]);
+        ws_player_positions[i] = player_snapshots[i].ws_position;
+        player_ids[i] = player_snapshots[i].client_id;
+    }
 
-    // These are the actual current voxel values
-    out_serializer.serialize_game_snapshot_voxel_delta_packet(&voxel_packet);
+    // Each client only gets what is around it
+    build_interest_grid(data_base.clients.data_count, ws_player_positions, player_ids);
 
-    uint32_t player_snapshots_start = out_serializer.data_buffer_head;
+    snapshot_player_encodings_t player_encodings = {};
+    s_begin_player_encodings(&player_encodings, data_base.clients.data_count);
 
-    // TODO: Find way so that sending packets to each client does not need packets to be reserialized
     for (uint32_t client_index = 0; client_index < data_base.clients.data_count; ++client_index) {
         client_t *client = s_get_client(client_index);
         player_t *player = get_player(client->player_handle);
@@ -257,7 +709,61 @@ static void s_dispatch_snapshot_to_clients(void) {
         if (client->received_input_commands) {
             game_snapshot_player_state_packet_t *player_snapshot_packet = &player_snapshots[client_index];
 
-            out_serializer.data_buffer_head = player_snapshots_start;
+            // If the baseline expired, the whole state gets sent (baseline tick = 0)
+            game_state_baseline_t *baseline = game_state_baselines.get(client->acknowledged_game_state_tick);
+            uint64_t baseline_tick = baseline ? baseline->game_state_tick : 0;
+
+            uint32_t relevant_players[MAX_CLIENTS];
+            uint32_t relevant_player_count = gather_relevant_players(player_snapshot_packet->ws_position, player_snapshot_packet->ws_direction, current_game_state_tick, relevant_players);
+
+            game_snapshot_voxel_delta_packet_t relevant_voxel_packet = {};
+            s_fill_dispatch_packet_with_outdated_chunks(client, player_snapshot_packet->ws_position, &relevant_voxel_packet);
+
+            // Clients get to check some of the chunks around them every now and then (spread across snapshots)
+            if (!client->is_bot && (current_game_state_tick + client->client_id) % CHUNK_VERIFY_INTERVAL == 0) {
+                s_fill_dispatch_packet_with_chunk_hashes(client, player_snapshot_packet->ws_position, &relevant_voxel_packet);
+            }
+
+            // Body gets serialized separately from the client's section (the client's section can only be serialized once the correction flags are known)
+            serializer_t body = {};
+            uint32_t max_player_bits = max_varint_bits(16, 7) + sizeof_max_player_snapshot_delta_bits() * relevant_player_count;
+            body.initialize(sizeof_game_snapshot_voxel_delta_packet(&relevant_voxel_packet) + (max_player_bits + 7) / 8);
+
+            body.serialize_game_snapshot_voxel_delta_packet(&relevant_voxel_packet);
+
+            // Players get bit packed
+            bit_serializer_t player_bits = {};
+            player_bits.begin(&body);
+
+            // Players only get delta compressed against the baseline if the client got sent them in that baseline
+            uint64_t baseline_players = baseline ? baseline->relevant_players[client->client_id] : 0;
+
+            player_bits.serialize_varint(relevant_player_count);
+            for (uint32_t i = 0; i < relevant_player_count; ++i) {
+                quantized_player_snapshot_t *current_player = &current_game_state->players[relevant_players[i]];
+                bool in_baseline = (baseline_players >> current_player->client_id) & 1;
+
+                s_serialize_player_encoding(&player_bits, &player_encodings, relevant_players[i], current_player, in_baseline ? baseline : nullptr);
+
+                current_game_state->relevant_players[client->client_id] |= 1ull << current_player->client_id;
+            }
+
+            player_bits.end(&body);
+
+            // Header, game state tick, baseline tick, previous tick, voxel corrections and the flags of the client's player
+            uint32_t client_section_size = sizeof_packet_header() + sizeof(uint64_t) * 3 + sizeof(uint32_t) + sizeof(uint8_t);
+            for (uint32_t chunk = 0; chunk < client->modified_chunks_count; ++chunk) {
+                client_section_size += sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t) * 4 * client->previous_received_voxel_modifications[chunk].modified_voxel_count;
+            }
+
+            serializer_t out_serializer = {};
+            out_serializer.initialize(client_section_size);
+
+            header.total_packet_size = client_section_size + body.data_buffer_head;
+            out_serializer.serialize_packet_header(&header);
+
+            out_serializer.serialize_uint64(current_game_state_tick);
+            out_serializer.serialize_uint64(baseline_tick);
 
             player_state_t *previous_received_player_state = &client->previous_received_player_state;
 
@@ -303,68 +809,68 @@ static void s_dispatch_snapshot_to_clients(void) {
                 player_snapshot_packet->need_to_do_correction = 1;
             }
             
-            for (uint32_t i = 0; i < data_base.clients.data_count; ++i) {
-                if (i == client_index) {
-                    if (client->received_input_commands && !client->needs_to_acknowledge_prediction_error) {
-                        // Do comparison to determine if client correction is needed
-                        float32_t precision = 0.1f;
-                        vector3_t ws_position_difference = glm::abs(previous_received_player_state->ws_position - player_snapshot_packet->ws_position);
-                        vector3_t ws_direction_difference = glm::abs(previous_received_player_state->ws_direction - player_snapshot_packet->ws_direction);
-
-                        bool position_is_different = (ws_position_difference.x > precision || ws_position_difference.y > precision || ws_position_difference.z > precision);
-                        bool direction_is_different = (ws_direction_difference.x > precision || ws_direction_difference.y > precision || ws_direction_difference.z > precision);
-
-                        // Debugging stuff
-                        if (position_is_different) {
-                            output_to_debug_console("pos-");
-                        }
-
-                        if (direction_is_different) {
-                            output_to_debug_console("dir-");
-                        }
-                        
-                        if (position_is_different || direction_is_different || player_snapshot_packet->need_to_do_voxel_correction) {
-                            output_to_debug_console("correction ########################################################\n");
-                            
-                            // Make sure that server invalidates all packets previously sent by the client
-                            player->network.player_states_cbuffer.tail = player->network.player_states_cbuffer.head;
-                            player->network.player_states_cbuffer.head_tail_difference = 0;
+            if (client->received_input_commands && !client->needs_to_acknowledge_prediction_error) {
+                // Do comparison to determine if client correction is needed
+                float32_t precision = 0.1f;
+                vector3_t ws_position_difference = glm::abs(previous_received_player_state->ws_position - player_snapshot_packet->ws_position);
+                vector3_t ws_direction_difference = glm::abs(previous_received_player_state->ws_direction - player_snapshot_packet->ws_direction);
+
+                // Bots don't predict anything: what they send is never compared
+                bool position_is_different = !client->is_bot && (ws_position_difference.x > precision || ws_position_difference.y > precision || ws_position_difference.z > precision);
+                bool direction_is_different = !client->is_bot && (ws_direction_difference.x > precision || ws_direction_difference.y > precision || ws_direction_difference.z > precision);
+
+                // Debugging stuff
+                if (position_is_different) {
+                    output_to_debug_console("pos-");
+                }
 
-                            player->action_flags = 0;
+                if (direction_is_different) {
+                    output_to_debug_console("dir-");
+                }
+                
+                if (position_is_different || direction_is_different || player_snapshot_packet->need_to_do_voxel_correction) {
+                    output_to_debug_console("correction ########################################################\n");
+                    
+                    // Player states which weren't simulated yet get dropped: client rolls back to the state the server has right now
+                    player->network.player_states_cbuffer.tail = player->network.player_states_cbuffer.head;
+                    player->network.player_states_cbuffer.head_tail_difference = 0;
 
-                            player->network.commands_to_flush = 0;
-                            
-                            // Force client to do correction
-                            player_snapshot_packet->need_to_do_correction = 1;
+                    player->action_flags = 0;
 
-                            output_to_debug_console("prev_pos: ", previous_received_player_state->ws_position, "   prev_dir: ", previous_received_player_state->ws_direction, "\n");
-                            output_to_debug_console("corr_pos: ", player_snapshot_packet->ws_position, "   corr_dir: ", player_snapshot_packet->ws_direction, "\n");
+                    player->network.commands_to_flush = 0;
+                    
+                    // Force client to do correction
+                    player_snapshot_packet->need_to_do_correction = 1;
 
-                            // Server will now wait until reception of a prediction error packet
-                            client->needs_to_acknowledge_prediction_error = 1;
+                    output_to_debug_console("prev_pos: ", previous_received_player_state->ws_position, "   prev_dir: ", previous_received_player_state->ws_direction, "\n");
+                    output_to_debug_console("corr_pos: ", player_snapshot_packet->ws_position, "   corr_dir: ", player_snapshot_packet->ws_direction, "\n");
 
-                            player->camera.ws_next_vector = player->camera.ws_current_up_vector = player->ws_up;
+                    // Server will now wait until reception of a prediction error packet before comparing again
+                    client->needs_to_acknowledge_prediction_error = 1;
 
-                            player->physics.axes = vector3_t(0);
-                        }
-                        
-                        player_snapshot_packet->is_to_ignore = 0;
-                    }
-                    else {
-                        player_snapshot_packet->is_to_ignore = 1;
+                    player->camera.ws_next_vector = player->camera.ws_current_up_vector = player->ws_up;
 
-                        output_to_debug_console("needs to do correction\n");
-                    }
+                    player->physics.axes = vector3_t(0);
                 }
+                
+                player_snapshot_packet->is_to_ignore = 0;
+            }
+            else {
+                player_snapshot_packet->is_to_ignore = 1;
 
-                out_serializer.serialize_game_snapshot_player_state_packet(&player_snapshots[i]);
+                output_to_debug_console("needs to do correction\n");
             }
 
-            client->modified_chunks_count = 0;
-            out_serializer.send_serialized_message(client->network_address);
+            out_serializer.serialize_uint8(player_snapshot_packet->flags);
+
+            client->clear_modified_chunks();
+            out_serializer.queue_serialized_message(client->network_address, &body);
        }
     }
 
+    flush_channel_datagrams();
+    player_encodings.buffer.release();
+
     clear_chunk_history();
 }
 
@@ -393,7 +899,7 @@ static void s_unflag_chunks_that_client_last_modified(client_t *client) {
 static void s_fill_dummy_voxels_last_modified_by_client(client_t *client, client_modified_chunk_nl_t *modified_chunk) {
     for (uint32_t i = 0; i < modified_chunk->modified_voxel_count; ++i) {
         local_client_modified_voxel_t vx = modified_chunk->modified_voxels[i];
-        dummy_voxels[vx.x][vx.y][vx.z] = i;
+        dummy_voxels[vx.x][vx.y][vx.z] = (uint16_t)i;
     }
 }
 
@@ -401,7 +907,7 @@ static void s_fill_dummy_voxels_last_modified_by_client(client_t *client, client
 static void s_unfill_dummy_voxels_last_modified_by_client(client_t *client, client_modified_chunk_nl_t *modified_chunk) {
     for (uint32_t i = 0; i < modified_chunk->modified_voxel_count; ++i) {
         local_client_modified_voxel_t vx = modified_chunk->modified_voxels[i];
-        dummy_voxels[vx.x][vx.y][vx.z] = 255;
+        dummy_voxels[vx.x][vx.y][vx.z] = NO_DUMMY_VOXEL;
     }
 }
 
@@ -418,22 +924,15 @@ static void s_update_client_modified_chunks_from_input_state_packet(client_t *cl
 
                 s_fill_dummy_voxels_last_modified_by_client(client, chunk);
                 {
-                    for (uint32_t voxel = 0; voxel < new_modified_chunk->modified_voxel_count && voxel < MAX_VOXELS_MODIFIED_PER_CHUNK; ++voxel) {
+                    for (uint32_t voxel = 0; voxel < new_modified_chunk->modified_voxel_count; ++voxel) {
                         local_client_modified_voxel_t *vptr = &new_modified_chunk->modified_voxels[voxel];
                         uint32_t index_in_permanent_modified_chunk_list = dummy_voxels[vptr->x][vptr->y][vptr->z];
-                        if (index_in_permanent_modified_chunk_list == 255) {
-                            // Hasn't been modified yet!
-                            if (chunk->modified_voxel_count < MAX_VOXELS_MODIFIED_PER_CHUNK) {
-                                local_client_modified_voxel_t *pmptr = &chunk->modified_voxels[chunk->modified_voxel_count++];
-                                pmptr->x = vptr->x;
-                                pmptr->y = vptr->y;
-                                pmptr->z = vptr->z;
-                                pmptr->value = vptr->value;
-                            }
-                            else {
-                                // TODO: Have a way to have client modifiy as many voxels as it wants
-                                output_to_debug_console("Client has modified too many voxels");
-                            }
+                        if (index_in_permanent_modified_chunk_list == NO_DUMMY_VOXEL) {
+                            // Hasn't been modified yet! (list grows in the client's voxel modification arena)
+                            local_client_modified_voxel_t *pmptr = client->add_modified_voxel(chunk);
+                            *pmptr = *vptr;
+
+                            dummy_voxels[vptr->x][vptr->y][vptr->z] = (uint16_t)(chunk->modified_voxel_count - 1);
                         }
                         else {
                             // Has been modified!
@@ -446,14 +945,19 @@ static void s_update_client_modified_chunks_from_input_state_packet(client_t *cl
             }
             else {
                 // Append this chunk to the list of chunks modified by the client
-                client_modified_chunk_nl_t *chunk = &client->previous_received_voxel_modifications[client->modified_chunks_count++];
-                chunk->chunk_index = new_modified_chunk->chunk_index;
-                chunk->modified_voxel_count = new_modified_chunk->modified_voxel_count;
-                for (uint32_t voxel = 0; voxel < new_modified_chunk->modified_voxel_count && voxel < MAX_VOXELS_MODIFIED_PER_CHUNK; ++voxel) {
-                    chunk->modified_voxels[voxel].x = new_modified_chunk->modified_voxels[voxel].x;
-                    chunk->modified_voxels[voxel].y = new_modified_chunk->modified_voxels[voxel].y;
-                    chunk->modified_voxels[voxel].z = new_modified_chunk->modified_voxels[voxel].z;
-                    chunk->modified_voxels[voxel].value = new_modified_chunk->modified_voxels[voxel].value;
+                client_modified_chunk_nl_t *chunk = client->add_modified_chunk(new_modified_chunk->chunk_index, new_modified_chunk->modified_voxel_count);
+                if (!chunk) {
+                    output_to_debug_console("Client has modified too many chunks\n");
+                    continue;
+                }
+
+                // In case the same chunk comes up again in this packet
+                real_chunk->was_previously_modified_by_client = 1;
+                real_chunk->index_of_modified_chunk = client->modified_chunks_count - 1;
+
+                if (new_modified_chunk->modified_voxel_count) {
+                    chunk->modified_voxel_count = new_modified_chunk->modified_voxel_count;
+                    memcpy(chunk->modified_voxels, new_modified_chunk->modified_voxels, sizeof(local_client_modified_voxel_t) * chunk->modified_voxel_count);
                 }
             }
         }
@@ -462,7 +966,9 @@ static void s_update_client_modified_chunks_from_input_state_packet(client_t *cl
 }
 
 static void s_handle_client_join(serializer_t *in_serializer, network_address_t received_address, client_t *&client) {
+    cached_chunk_t cached_chunks[MAX_CACHED_CHUNKS];
     client_join_packet_t client_join = {};
+    client_join.cached_chunks = cached_chunks;
     in_serializer->deserialize_client_join_packet(&client_join);
 
     // Add client
@@ -473,6 +979,8 @@ static void s_handle_client_join(serializer_t *in_serializer, network_address_t
     client->client_id = client_count;
     client->network_address = received_address;
     client->current_packet_count = 0;
+    client->acknowledged_game_state_tick = 0;
+    client->is_bot = client_join.is_bot;
 
 
     // Add the player to the actual entities list (spawn the player in the world)
@@ -495,22 +1003,68 @@ static void s_handle_client_join(serializer_t *in_serializer, network_address_t
     game_state_initialize_packet_t game_state_init_packet = {};
     fill_game_state_initialize_packet(&game_state_init_packet, client->client_id);
 
+    // Chunks which the client has cached and which didn't change don't need to be sent
+    uint32_t chunk_count = (uint32_t)(get_chunk_grid_size() * get_chunk_grid_size() * get_chunk_grid_size());
+    // Chunk indices are 16 bit
+    static uint8_t is_reused[UINT16_MAX + 1];
+    memset(is_reused, 0, sizeof(is_reused));
+
+    static reused_chunk_t reused_chunks[MAX_CACHED_CHUNKS];
+    game_state_init_packet.reused_chunks = reused_chunks;
+    if (client_join.cached_grid_edge_size == (uint32_t)get_chunk_grid_size()) {
+        for (uint32_t i = 0; i < client_join.cached_chunk_count; ++i) {
+            cached_chunk_t *cached = &client_join.cached_chunks[i];
+            if (cached->chunk_index < chunk_count && !is_reused[cached->chunk_index] && (*get_chunk((int32_t)cached->chunk_index))->hash == cached->hash) {
+                is_reused[cached->chunk_index] = 1;
+
+                reused_chunk_t *reused = &game_state_init_packet.reused_chunks[game_state_init_packet.reused_chunk_count++];
+                reused->chunk_index = cached->chunk_index;
+                reused->version = (*get_chunk((int32_t)cached->chunk_index))->version;
+            }
+        }
+    }
 
 
     packet_header_t handshake_header = {};
     handshake_header.packet_mode = packet_mode_t::PM_SERVER_MODE;
     handshake_header.packet_type = server_packet_type_t::SPT_SERVER_HANDSHAKE;
-    handshake_header.total_packet_size = sizeof_packet_header();
-    handshake_header.total_packet_size += sizeof(voxel_state_initialize_packet_t);
-    handshake_header.total_packet_size += sizeof(game_state_initialize_packet_t::client_index) + sizeof(game_state_initialize_packet_t::player_count);
-    handshake_header.total_packet_size += sizeof(player_state_initialize_packet_t) * game_state_init_packet.player_count;
     handshake_header.current_tick = *get_current_tick();
 
-    out_serializer.serialize_packet_header(&handshake_header);
+    // Header gets serialized once the size is known
+    out_serializer.grow_data_buffer(sizeof_packet_header());
     out_serializer.serialize_game_state_initialize_packet(&game_state_init_packet);
-    out_serializer.send_serialized_message(client->network_address);
 
-    s_send_chunks_hard_update_packets(client->network_address);
+    uint32_t packet_end = out_serializer.data_buffer_head;
+
+    handshake_header.total_packet_size = packet_end;
+    out_serializer.data_buffer_head = 0;
+    out_serializer.serialize_packet_header(&handshake_header);
+
+    out_serializer.data_buffer_head = packet_end;
+    out_serializer.send_serialized_message(client->network_address, CT_RELIABLE_ORDERED);
+
+    uint32_t map_chunk_count = 0;
+    voxel_chunk_values_packet_t *voxel_update_packets = initialize_chunk_values_packets(&map_chunk_count);
+
+    // Client starts from the map, and has the versions of the chunks which it got sent / kept
+    reset_interest_state(client->client_id);
+
+    uint32_t hard_update_count = 0;
+    for (uint32_t i = 0; i < map_chunk_count; ++i) {
+        chunk_t *chunk = *get_chunk(voxel_update_packets[i].chunk_coord_x, voxel_update_packets[i].chunk_coord_y, voxel_update_packets[i].chunk_coord_z);
+        uint32_t chunk_index = (uint32_t)convert_3d_to_1d_index(chunk->chunk_coord.x, chunk->chunk_coord.y, chunk->chunk_coord.z, (uint32_t)get_chunk_grid_size());
+
+        if (!is_reused[chunk_index]) {
+            voxel_update_packets[hard_update_count++] = voxel_update_packets[i];
+            acknowledge_chunk_version(client->client_id, chunk);
+        }
+    }
+
+    for (uint32_t i = 0; i < game_state_init_packet.reused_chunk_count; ++i) {
+        acknowledge_chunk_version(client->client_id, *get_chunk((int32_t)game_state_init_packet.reused_chunks[i].chunk_index));
+    }
+
+    s_send_chunks_hard_update_packets(client->network_address, voxel_update_packets, hard_update_count, 1);
 
     s_dispatch_newcoming_client_to_clients(client->client_id);
 }
@@ -540,55 +1094,125 @@ static void s_handle_input_state(packet_header_t *header, serializer_t *in_seria
             client->previous_client_tick = header->current_tick;
         }
 
-        if (!client->needs_to_acknowledge_prediction_error) {
-            client->received_input_commands = 1;
+        // Client replays the commands it sent before it got the correction on top of the corrected state: they still get simulated
+        // (only comparing the predictions waits for the acknowledgement)
+        client->received_input_commands = 1;
 
-            // Current client tick (will be used for the snapshot that will be sent to the clients)
-            // Clients will compare the state at the tick that the server recorded as being the last client tick at which server received input state (commands)
-            client->previous_client_tick = header->current_tick;
+        // Current client tick (will be used for the snapshot that will be sent to the clients)
+        // Clients will compare the state at the tick that the server recorded as being the last client tick at which server received input state (commands)
+        client->previous_client_tick = header->current_tick;
 
-            player_t *player = get_player(client->player_handle);
+        player_t *player = get_player(client->player_handle);
 
-            uint32_t player_state_count = in_serializer->deserialize_uint32();
+        bit_serializer_t input_bits = {};
+        input_bits.begin(in_serializer);
 
-            player_state_t last_player_state = {};
+        // Clients can't have more player states waiting to be sent than this
+        uint64_t player_state_count = input_bits.deserialize_varint();
+        if (player_state_count > MAX_PLAYER_STATES) {
+            output_to_debug_console("Dropped corrupted input state packet from ", client->name, "\n");
+            return;
+        }
 
-            for (uint32_t i = 0; i < player_state_count; ++i) {
-                client_input_state_packet_t input_packet = {};
-                player_state_t player_state = {};
-                in_serializer->deserialize_client_input_state_packet(&input_packet);
+        // Commands only get used once the whole packet got read
+        player_state_t player_states[MAX_PLAYER_STATES];
+        client_input_state_packet_t previous_input_packet = {};
+
+        for (uint32_t i = 0; i < player_state_count; ++i) {
+            client_input_state_packet_t input_packet = {};
+            player_state_t *player_state = &player_states[i];
+            *player_state = {};
+            input_bits.deserialize_client_input_state_packet(&input_packet, i ? &previous_input_packet : nullptr);
+            previous_input_packet = input_packet;
+
+            player_state->action_flags = input_packet.action_flags;
+            player_state->mouse_x_diff = input_packet.mouse_x_diff;
+            player_state->mouse_y_diff = input_packet.mouse_y_diff;
+            player_state->flags_byte = input_packet.flags_byte;
+            player_state->dt = input_packet.dt;
+            player_state->current_state_count = input_packet.command_id;
+        }
 
-                player_state.action_flags = input_packet.action_flags;
-                player_state.mouse_x_diff = input_packet.mouse_x_diff;
-                player_state.mouse_y_diff = input_packet.mouse_y_diff;
-                player_state.flags_byte = input_packet.flags_byte;
-                player_state.dt = input_packet.dt;
-                player_state.current_state_count = input_packet.command_id;
+        vector3_t ws_position;
+        for (uint32_t i = 0; i < 3; ++i) {
+            ws_position[i] = input_bits.deserialize_fixed_point(QUANTIZED_POSITION_SCALE);
+        }
+        vector3_t ws_direction = input_bits.deserialize_unit_vector();
 
-                player->network.player_states_cbuffer.push_item(&player_state);
+        // Truncated / corrupted: the position of the modified voxels isn't known either
+        if (input_bits.overflowed) {
+            output_to_debug_console("Dropped corrupted input state packet from ", client->name, "\n");
+            return;
+        }
 
-                last_player_state = player_state;
-            }
+        input_bits.end(in_serializer);
 
-            // Will use the data in here to check whether the client needs correction or not
-            client->previous_received_player_state = last_player_state;
+        player_state_t last_player_state = {};
+        for (uint32_t i = 0; i < player_state_count; ++i) {
+            player->network.player_states_cbuffer.push_item(&player_states[i]);
+            last_player_state = player_states[i];
+        }
 
-            client->previous_received_player_state.ws_position = in_serializer->deserialize_vector3();
-            client->previous_received_player_state.ws_direction = in_serializer->deserialize_vector3();
+        // Will use the data in here to check whether the client needs correction or not
+        client->previous_received_player_state = last_player_state;
+        client->previous_received_player_state.ws_position = ws_position;
+        client->previous_received_player_state.ws_direction = ws_direction;
 
-            player->network.commands_to_flush += player_state_count;
+        player->network.commands_to_flush += player_state_count;
 
-            client_modified_voxels_packet_t voxel_packet = {};
-            in_serializer->deserialize_client_modified_voxels_packet(&voxel_packet);
+        client_modified_chunk_t modified_chunks[MAX_CHUNKS_MODIFIED_PER_SNAPSHOT];
+        client_modified_voxels_packet_t voxel_packet = {};
+        voxel_packet.modified_chunks = modified_chunks;
+        in_serializer->deserialize_client_modified_voxels_packet(&voxel_packet, MAX_CHUNKS_MODIFIED_PER_SNAPSHOT);
 
-            s_update_client_modified_chunks_from_input_state_packet(client, &voxel_packet);
-        }
+        s_update_client_modified_chunks_from_input_state_packet(client, &voxel_packet);
     }
 }
 
 static void s_handle_game_state_reception(packet_header_t *header, serializer_t *in_serializer) {
     uint64_t game_state_acknowledged_tick = in_serializer->deserialize_uint64();
     client_t *client = s_get_client(header->client_id);
+
+    // Acknowledgements may arrive out of order
+    if (game_state_acknowledged_tick > client->acknowledged_game_state_tick) {
+        client->acknowledged_game_state_tick = game_state_acknowledged_tick;
+    }
+
+    // Voxel changes which went in that game state don't need to be sent again
+    acknowledge_game_state_chunk_versions(client->client_id, game_state_acknowledged_tick);
+}
+
+// Client's chunks didn't match the hashes that it got sent
+static void s_handle_chunks_request(client_t *client, serializer_t *in_serializer) {
+    uint16_t chunk_indices[MAX_CHUNK_HASHES_PER_SNAPSHOT];
+    chunks_request_packet_t request = {};
+    request.chunk_indices = chunk_indices;
+    in_serializer->deserialize_chunks_request_packet(&request, MAX_CHUNK_HASHES_PER_SNAPSHOT);
+
+    uint32_t chunk_count = (uint32_t)(get_chunk_grid_size() * get_chunk_grid_size() * get_chunk_grid_size());
+    voxel_chunk_values_packet_t voxel_update_packets[MAX_CHUNK_HASHES_PER_SNAPSHOT];
+    uint32_t hard_update_count = 0;
+
+    for (uint32_t i = 0; i < request.chunk_count; ++i) {
+        if (request.chunk_indices[i] >= chunk_count) {
+            continue;
+        }
+
+        chunk_t *chunk = *get_chunk((int32_t)request.chunk_indices[i]);
+        voxel_chunk_values_packet_t *voxel_update_packet = &voxel_update_packets[hard_update_count++];
+        *voxel_update_packet = {};
+        voxel_update_packet->chunk_coord_x = chunk->chunk_coord.x;
+        voxel_update_packet->chunk_coord_y = chunk->chunk_coord.y;
+        voxel_update_packet->chunk_coord_z = chunk->chunk_coord.z;
+        voxel_update_packet->version = chunk->version;
+        voxel_update_packet->voxels = &chunk->voxels[0][0][0];
+
+        acknowledge_chunk_version(client->client_id, chunk);
+    }
+
+    output_to_debug_console(client->name, " desynced on ", (int32_t)hard_update_count, " chunks\n");
+
+    s_send_chunks_hard_update_packets(client->network_address, voxel_update_packets, hard_update_count, 0);
 }
 
 static void s_handle_client_disconnect(client_t *client) {
@@ -597,113 +1221,129 @@ static void s_handle_client_disconnect(client_t *client) {
     data_base.client_table_by_address.remove(client->network_address.ipv4_address);
 
     data_base.clients.remove(client->client_id);
-}
-
-void tick_server(raw_input_t *raw_input, float32_t dt) {
-    //if (wait_for_mutex_and_own(receiver_thread.mutex))
-    {
-        // Send Snapshots (25 per second)
-        // Every 40ms (25 sps) - basically every frame
-        // TODO: Add function to send snapshot
-        static float32_t time_since_previous_snapshot = 0.0f;
-    
-        time_since_previous_snapshot += dt;
-        float32_t max_time = 1.0f / get_snapshot_server_rate(); // 20 per second
-        
-        if (time_since_previous_snapshot > max_time) {
-            // Dispath game state to all clients
-            s_dispatch_snapshot_to_clients();
-            
-            time_since_previous_snapshot = 0.0f;
-        }
-        
-        receiver_thread.receiver_thread_loop_count = 0;
+    client->deinitialize_voxel_modification_arena();
 
-        for (uint32_t i = 0; i < 1 + 2 * data_base.clients.data_count; ++i) {
-            network_address_t received_address = {};
-            int32_t bytes_received = receive_from(message_buffer, MAX_MESSAGE_BUFFER_SIZE, &received_address);
+    reset_interest_state(client->client_id);
+    remove_net_channel(client->network_address);
+}
 
-            if (bytes_received > 0) {
-                serializer_t in_serializer = {};
-                in_serializer.data_buffer = (uint8_t *)message_buffer;
-                in_serializer.data_buffer_size = bytes_received;
+static void s_handle_received_packet(char *buffer, uint32_t bytes_received, network_address_t received_address, void *data) {
+    serializer_t in_serializer = {};
+    in_serializer.data_buffer = (uint8_t *)buffer;
+    in_serializer.data_buffer_size = bytes_received;
                 
-                packet_header_t header = {};
-                in_serializer.deserialize_packet_header(&header);
+    packet_header_t header = {};
+    in_serializer.deserialize_packet_header(&header);
 
-                uint64_t client_current_packet_count = header.current_packet_id;
-                uint64_t actual_current_packet_count = 0;
+    uint64_t client_current_packet_count = header.current_packet_id;
+    uint64_t actual_current_packet_count = 0;
 
-                client_t *client = 0;
-                if (header.client_id == 0xFFFF) {
-                    output_to_debug_console("New client\n");
-                }
-                else {
-                    client = s_get_client(header.client_id);
-                    actual_current_packet_count = client->current_packet_count;
-                }
+    client_t *client = 0;
+    if (header.client_id == 0xFFFF) {
+        output_to_debug_console("New client\n");
+    }
+    else {
+        client = s_get_client(header.client_id);
+        actual_current_packet_count = client->current_packet_count;
+    }
 
-                //if (client_current_packet_count >= client->last_received_correction_packet_count)
-                {
-                    if (header.total_packet_size == in_serializer.data_buffer_size) {
-                        if (header.packet_mode == packet_mode_t::PM_CLIENT_MODE) {
-                            if (client_current_packet_count >= actual_current_packet_count || header.client_id  == 0xFFFF) {
-                                switch (header.packet_type) {
-                                case client_packet_type_t::CPT_CLIENT_JOIN: { s_handle_client_join(&in_serializer, received_address, client); } break;
-                                case client_packet_type_t::CPT_INPUT_STATE: { s_handle_input_state(&header, &in_serializer, (uint32_t)client_current_packet_count); } break;
-                                case client_packet_type_t::CPT_ACKNOWLEDGED_GAME_STATE_RECEPTION: { s_handle_game_state_reception(&header, &in_serializer); } break;
-                                case client_packet_type_t::CPT_DISCONNECT: { s_handle_client_disconnect(client); } break;
-                                }
-
-                                client->current_packet_count = client_current_packet_count;
-                            }
-                            else {
-                                output_to_debug_console("packet order is messed up\n");
-                            }
-                        }
-                    }
+    if (header.total_packet_size == in_serializer.data_buffer_size) {
+        if (header.packet_mode == packet_mode_t::PM_CLIENT_MODE) {
+            if (client_current_packet_count >= actual_current_packet_count || header.client_id  == 0xFFFF) {
+                switch (header.packet_type) {
+                case client_packet_type_t::CPT_CLIENT_JOIN: { s_handle_client_join(&in_serializer, received_address, client); } break;
+                case client_packet_type_t::CPT_INPUT_STATE: { s_handle_input_state(&header, &in_serializer, (uint32_t)client_current_packet_count); } break;
+                case client_packet_type_t::CPT_ACKNOWLEDGED_GAME_STATE_RECEPTION: { s_handle_game_state_reception(&header, &in_serializer); } break;
+                case client_packet_type_t::CPT_DISCONNECT: { s_handle_client_disconnect(client); } break;
+                case client_packet_type_t::CPT_CHUNKS_REQUEST: { s_handle_chunks_request(client, &in_serializer); } break;
                 }
+
+                client->current_packet_count = client_current_packet_count;
+            }
+            else {
+                output_to_debug_console("packet order is messed up\n");
             }
         }
     }
 }
 
-static void s_receiver_thread_process(void *receiver_thread_data) {
-    output_to_debug_console("Started receiver thread\n");
+static float32_t s_seconds_since(std::chrono::steady_clock::time_point start) {
+    return(std::chrono::duration<float32_t>(std::chrono::steady_clock::now() - start).count());
+}
+
+static void s_report_server_stats(float32_t dt) {
+    server_stats.time_since_report += dt;
+
+    if (server_stats.time_since_report < SERVER_STATS_INTERVAL) {
+        return;
+    }
+
+    net_channel_stats_t channel_stats = get_net_channel_stats();
+    net_channel_stats_t *previous = &server_stats.previous_channel_stats;
+    float32_t time = server_stats.time_since_report;
+
+    if (data_base.clients.data_count) {
+        float32_t average_tick_time = server_stats.total_tick_time / (float32_t)MAX(server_stats.tick_count, 1u);
+        float32_t average_snapshot_time = server_stats.total_snapshot_time / (float32_t)MAX(server_stats.snapshot_count, 1u);
+
+        output_to_debug_console("server: ", (int32_t)data_base.clients.data_count, " clients | ",
+                                "tick avg ", average_tick_time * 1000.0f, " ms max ", server_stats.max_tick_time * 1000.0f, " ms | ",
+                                "snapshot avg ", average_snapshot_time * 1000.0f, " ms max ", server_stats.max_snapshot_time * 1000.0f, " ms (", (float32_t)server_stats.snapshot_count / time, "/s) | ",
+                                "in ", (float32_t)(channel_stats.bytes_received - previous->bytes_received) * 8.0f / (1000.0f * time), " kbps ",
+                                (float32_t)(channel_stats.datagrams_received - previous->datagrams_received) / time, " datagrams/s | ",
+                                "out ", (float32_t)(channel_stats.bytes_sent - previous->bytes_sent) * 8.0f / (1000.0f * time), " kbps ",
+                                (float32_t)(channel_stats.datagrams_sent - previous->datagrams_sent) / time, " datagrams/s\n");
+    }
+
+    server_stats_t reset = {};
+    reset.tick_start = server_stats.tick_start;
+    reset.previous_channel_stats = channel_stats;
+    server_stats = reset;
+}
+
+void tick_server(raw_input_t *raw_input, float32_t dt) {
+    // Send Snapshots (25 per second)
+    // Every 40ms (25 sps) - basically every frame
+    // TODO: Add function to send snapshot
+    static float32_t time_since_previous_snapshot = 0.0f;
     
-    receiver_thread_t *process_data = (receiver_thread_t *)receiver_thread_data;
+    time_since_previous_snapshot += dt;
+    float32_t max_time = 1.0f / get_snapshot_server_rate(); // 20 per second
+        
+    if (time_since_previous_snapshot > max_time) {
+        std::chrono::steady_clock::time_point snapshot_start = std::chrono::steady_clock::now();
 
-    for (;;) {
-        if (wait_for_mutex_and_own(process_data->mutex) && !process_data->receiver_freezed) {
-            if (process_data->receiver_thread_loop_count == 0) {
-            }
+        // Dispath game state to all clients
+        s_dispatch_snapshot_to_clients();
+
+        float32_t snapshot_time = s_seconds_since(snapshot_start);
+        ++server_stats.snapshot_count;
+        server_stats.total_snapshot_time += snapshot_time;
+        server_stats.max_snapshot_time = MAX(server_stats.max_snapshot_time, snapshot_time);
             
-            ++(process_data->receiver_thread_loop_count);
-            // ^^^^^^^^^^ debug stuff ^^^^^^^^^^^^
+        time_since_previous_snapshot = 0.0f;
+    }
 
-            char *message_buffer = (char *)process_data->packet_allocator.current;
-        
-            network_address_t received_address = {};
-            int32_t bytes_received = receive_from(message_buffer, process_data->packet_allocator.capacity - process_data->packet_allocator.used_capacity, &received_address);
+    s_handle_received_datagrams(dt);
 
-            if (bytes_received > 0) {
-                // Actually officially allocate memory on linear allocator (even though it will already have been filled)
-                process_data->packets[process_data->packet_count] = allocate_linear(bytes_received, 1, "", &process_data->packet_allocator);
-                process_data->packet_sizes[process_data->packet_count] = bytes_received;
-                process_data->addresses[process_data->packet_count] = received_address;
+    // Acknowledgements and resends
+    tick_net_channels(dt);
 
-                ++(process_data->packet_count);
-            }
+    // Simulation of the previous frame and everything above
+    float32_t tick_time = s_seconds_since(server_stats.tick_start);
+    ++server_stats.tick_count;
+    server_stats.total_tick_time += tick_time;
+    server_stats.max_tick_time = MAX(server_stats.max_tick_time, tick_time);
+
+    s_report_server_stats(dt);
 
-            release_mutex(process_data->mutex);
+    // Dedicated server: sleep until datagrams arrive or until the next snapshot is due instead of spinning (replay runs as fast as possible)
+    if (get_app_type() == application_type_t::CONSOLE_APPLICATION_MODE && !packet_capture.replaying) {
+        float32_t time_until_snapshot = max_time - time_since_previous_snapshot;
+        if (time_until_snapshot > 0.0f) {
+            wait_for_signal(receiver_thread.received_signal, (uint32_t)(time_until_snapshot * 1000.0f));
         }
     }
-}
-
-static void s_initialize_receiver_thread(void) {
-    receiver_thread.packet_allocator.capacity = (uint32_t)megabytes(30);
-    receiver_thread.packet_allocator.start = receiver_thread.packet_allocator.current = malloc(receiver_thread.packet_allocator.capacity);
 
-    receiver_thread.mutex = request_mutex();
-    request_thread_for_process(&s_receiver_thread_process, &receiver_thread);
+    server_stats.tick_start = std::chrono::steady_clock::now();
 }
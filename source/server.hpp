@@ -3,4 +3,17 @@
 #include "utility.hpp"
 
 void initialize_server(char *message_buffer);
-void tick_server(struct raw_input_t *raw_input, float32_t dt);
\ No newline at end of file
+void deinitialize_server(void);
+void tick_server(struct raw_input_t *raw_input, float32_t dt);
+
+
+// Packet capture: every datagram the server handles gets written to a file, along with the frame it got handled in
+// Replay mode feeds a capture back through the server's handlers as fast as possible, without any socket
+// (to benchmark / profile the workload of a real match offline, and to compare builds against the exact same input)
+// Both need to be called before initialize_net()
+void configure_server_capture(const char *capture_path);
+void configure_server_replay(const char *capture_path);
+bool is_replaying_server_capture(void);
+// Replay mode: reads the next frame of the capture and returns its dt (the whole frame needs to get simulated with it)
+// Quits once the whole capture has been replayed
+float32_t begin_server_replay_frame(void);
\ No newline at end of file
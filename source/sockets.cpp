@@ -1,3 +1,6 @@
+// Linux backend is in unix_sockets.cpp
+#if defined (_WIN32)
+
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #define _WINSOCKAPI_ 
@@ -14,6 +17,19 @@
 static stack_dynamic_container_t<SOCKET, 50> sockets;
 static network_socket_t main_network_socket;
 
+// Sockets that wait_for_incoming_data() selects on (other than the main socket)
+static uint32_t watched_socket_count = 0;
+static SOCKET watched_sockets[MAX_SOCKETS];
+
+// Datagrams waiting for flush_queued_datagrams()
+static uint32_t queued_datagram_count = 0;
+static struct {
+    network_address_t address;
+    WSABUF buffers[2];
+    uint32_t buffer_count;
+    SOCKET socket;
+} queued_datagrams[MAX_DATAGRAM_BATCH];
+
 
 void initialize_socket_api(uint16_t output_port) {
     // This is only for Windows, make sure to change if using Linux / Mac
@@ -23,14 +39,7 @@ void initialize_socket_api(uint16_t output_port) {
         assert(0);
     }
 
-    add_network_socket(&main_network_socket);
-    initialize_network_socket(&main_network_socket, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    
-    network_address_t address = {};
-    address.port = host_to_network_byte_order(output_port);
-    
-    bind_network_socket_to_port(&main_network_socket, address);
-    set_socket_to_non_blocking_mode(&main_network_socket);
+    initialize_udp_socket(&main_network_socket, output_port);
 }
 
 
@@ -40,7 +49,7 @@ void add_network_socket(network_socket_t *socket) {
 
 
 SOCKET *get_network_socket(network_socket_t *socket) {
-    return(sockets.get(socket->socket));
+    return(sockets.get(socket ? socket->socket : main_network_socket.socket));
 }
 
 
@@ -83,6 +92,18 @@ void set_socket_to_non_blocking_mode(network_socket_t *socket) {
 }
 
 
+void initialize_udp_socket(network_socket_t *socket, uint16_t port) {
+    add_network_socket(socket);
+    initialize_network_socket(socket, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    
+    network_address_t address = {};
+    address.port = host_to_network_byte_order(port);
+    
+    bind_network_socket_to_port(socket, address);
+    set_socket_to_non_blocking_mode(socket);
+}
+
+
 int32_t receive_from(char *buffer, uint32_t buffer_size, network_address_t *address_dst) {
     SOCKET *sock = get_network_socket(&main_network_socket);
 
@@ -94,9 +115,6 @@ int32_t receive_from(char *buffer, uint32_t buffer_size, network_address_t *addr
     if (bytes_received == SOCKET_ERROR) {
         return 0;
     }
-    else {
-        buffer[bytes_received] = 0;
-    }
 
     network_address_t received_address = {};
     received_address.port = from_address.sin_port;
@@ -132,6 +150,105 @@ bool send_to(network_address_t address, char *buffer, uint32_t buffer_size) {
 }
 
 
+// Winsock doesn't have an equivalent to recvmmsg / sendmmsg, just loop
+uint32_t receive_from_batch(datagram_t *datagrams, uint32_t count, network_socket_t *socket) {
+    SOCKET *sock = get_network_socket(socket);
+
+    uint32_t received_count = 0;
+    for (; received_count < count; ++received_count) {
+        datagram_t *datagram = &datagrams[received_count];
+        
+        SOCKADDR_IN from_address = {};
+        int32_t from_size = sizeof(from_address);
+    
+        int32_t bytes_received = recvfrom(*sock, datagram->buffer, datagram->buffer_size, 0, (SOCKADDR *)&from_address, &from_size);
+
+        if (bytes_received == SOCKET_ERROR) {
+            break;
+        }
+
+        datagram->bytes_received = bytes_received;
+        datagram->address.port = from_address.sin_port;
+        datagram->address.ipv4_address = from_address.sin_addr.S_un.S_addr;
+    }
+
+    return(received_count);
+}
+
+
+void queue_send_to(network_address_t address, char *buffer, uint32_t buffer_size, char *body, uint32_t body_size, network_socket_t *socket) {
+    if (queued_datagram_count == MAX_DATAGRAM_BATCH) {
+        flush_queued_datagrams();
+    }
+
+    auto *datagram = &queued_datagrams[queued_datagram_count++];
+    datagram->address = address;
+    datagram->buffers[0].buf = buffer;
+    datagram->buffers[0].len = buffer_size;
+    datagram->buffers[1].buf = body;
+    datagram->buffers[1].len = body_size;
+    datagram->buffer_count = body ? 2 : 1;
+    datagram->socket = *get_network_socket(socket);
+}
+
+
+void flush_queued_datagrams(void) {
+    for (uint32_t i = 0; i < queued_datagram_count; ++i) {
+        SOCKADDR_IN address_struct = {};
+        address_struct.sin_family = AF_INET;
+        address_struct.sin_port = queued_datagrams[i].address.port;
+        address_struct.sin_addr.S_un.S_addr = queued_datagrams[i].address.ipv4_address;
+
+        DWORD bytes_sent = 0;
+        int32_t result = WSASendTo(queued_datagrams[i].socket, queued_datagrams[i].buffers, queued_datagrams[i].buffer_count, &bytes_sent, 0, (SOCKADDR *)&address_struct, sizeof(address_struct), NULL, NULL);
+
+        // Send buffer is full: wait for it to drain a bit and try again
+        if (result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            fd_set write_set;
+            FD_ZERO(&write_set);
+            FD_SET(queued_datagrams[i].socket, &write_set);
+
+            timeval timeout = {};
+            timeout.tv_usec = SEND_BUFFER_WAIT_MILLISECONDS * 1000;
+            if (select(0, NULL, &write_set, NULL, &timeout) > 0) {
+                result = WSASendTo(queued_datagrams[i].socket, queued_datagrams[i].buffers, queued_datagrams[i].buffer_count, &bytes_sent, 0, (SOCKADDR *)&address_struct, sizeof(address_struct), NULL, NULL);
+            }
+        }
+
+        if (result == SOCKET_ERROR) {
+            char error_n[32];
+            sprintf_s(error_n, "WSASendTo failed: %d\n", WSAGetLastError());
+            OutputDebugString(error_n);
+        }
+    }
+
+    queued_datagram_count = 0;
+}
+
+
+void watch_network_socket(network_socket_t *socket) {
+    watched_sockets[watched_socket_count++] = *get_network_socket(socket);
+}
+
+
+bool wait_for_incoming_data(uint32_t timeout_milliseconds) {
+    SOCKET *sock = get_network_socket(&main_network_socket);
+
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(*sock, &read_set);
+    for (uint32_t i = 0; i < watched_socket_count; ++i) {
+        FD_SET(watched_sockets[i], &read_set);
+    }
+
+    timeval timeout = {};
+    timeout.tv_sec = timeout_milliseconds / 1000;
+    timeout.tv_usec = (timeout_milliseconds % 1000) * 1000;
+
+    return(select(0, &read_set, nullptr, nullptr, &timeout) > 0);
+}
+
+
 uint32_t str_to_ipv4_int32(const char *address) {
     return(inet_addr(address));
 }
@@ -145,3 +262,5 @@ uint32_t host_to_network_byte_order(uint32_t bytes) {
 uint32_t network_to_host_byte_order(uint32_t bytes) {
     return(ntohl(bytes));
 }
+
+#endif
@@ -22,12 +22,43 @@ void add_network_socket(network_socket_t *socket);
 void initialize_network_socket(network_socket_t *socket, int32_t family, int32_t type, int32_t protocol);
 void bind_network_socket_to_port(network_socket_t *socket, network_address_t address);
 void set_socket_to_non_blocking_mode(network_socket_t *socket);
+// Non blocking UDP socket bound to port (host byte order, 0 = any free port)
+void initialize_udp_socket(network_socket_t *socket, uint16_t port);
 
 
 int32_t receive_from(char *buffer, uint32_t buffer_size, network_address_t *address_dst);
 bool send_to(network_address_t address, char *buffer, uint32_t buffer_size);
 
 
+// Batched versions (on Linux, these go through recvmmsg / sendmmsg - one syscall for the whole batch)
+#define MAX_DATAGRAM_BATCH 32
+// Flushing waits this long for a socket whose send buffer is full before dropping its datagrams (buffers are only valid until the flush returns)
+#define SEND_BUFFER_WAIT_MILLISECONDS 5
+
+
+struct datagram_t {
+    char *buffer;
+    // When receiving: capacity of buffer, when sending: amount of bytes to send
+    uint32_t buffer_size;
+    uint32_t bytes_received;
+    network_address_t address;
+};
+
+
+// The batched functions go through the main socket if socket is null (other sockets need to be bound and in non blocking mode)
+// Doesn't block - returns the amount of datagrams that were received (at most count)
+uint32_t receive_from_batch(datagram_t *datagrams, uint32_t count, network_socket_t *socket = nullptr);
+// Buffers need to stay valid until flush_queued_datagrams() gets called (flushes automatically if the queue is full)
+// body gets appended to buffer in the same datagram with scatter / gather (can be shared between datagrams without copying)
+void queue_send_to(network_address_t address, char *buffer, uint32_t buffer_size, char *body = nullptr, uint32_t body_size = 0, network_socket_t *socket = nullptr);
+// Only drops datagrams on hard errors, or if a full send buffer didn't drain within SEND_BUFFER_WAIT_MILLISECONDS
+void flush_queued_datagrams(void);
+// wait_for_incoming_data() also wakes up when something arrives on this socket
+void watch_network_socket(network_socket_t *socket);
+// Blocks until there is something to read on the main socket (or on a watched socket), returns false on timeout
+bool wait_for_incoming_data(uint32_t timeout_milliseconds);
+
+
 uint32_t str_to_ipv4_int32(const char *address);
 uint32_t host_to_network_byte_order(uint32_t bytes);
 uint32_t network_to_host_byte_order(uint32_t bytes);
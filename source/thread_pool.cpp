@@ -1,11 +1,16 @@
 #include <Windows.h>
 #include "thread_pool.hpp"
 #include "utils.hpp"
+#include "allocators.hpp"
 
 struct mutex_t {
     HANDLE mutex_handle;
 };
 
+struct signal_t {
+    HANDLE event_handle;
+};
+
 struct thread_t {
     HANDLE thread_handle;
     DWORD thread_id;
@@ -16,10 +21,17 @@ struct thread_t {
     void *input_data;
 
     mutex_t mutex;
+
+    // Scratch memory of whatever process runs on this thread
+    linear_allocator_t linear_allocator;
 };
 
 #define MAX_THREAD_COUNT 5
+// Reserved: only what gets used is committed
+#define THREAD_LINEAR_RESERVE_SIZE megabytes(256)
+#define THREAD_LINEAR_RETAINED_SIZE megabytes(1)
 #define MAX_MUTEX_COUNT 10
+#define MAX_SIGNAL_COUNT 10
 
 struct thread_pool_t {
     uint32_t active_thread_count = 0;
@@ -28,16 +40,23 @@ struct thread_pool_t {
     // Requestable mutexes
     uint32_t used_mutexes_count = 0;
     mutex_t mutexes[MAX_MUTEX_COUNT];
+
+    uint32_t used_signals_count = 0;
+    signal_t signals[MAX_SIGNAL_COUNT];
 } g_thread_pool;
 
 DWORD WINAPI thread_process_impl(LPVOID lp_parameter) {
     thread_t *thread = (thread_t *)lp_parameter;
+
+    initialize_thread_linear(THREAD_LINEAR_RESERVE_SIZE, THREAD_LINEAR_RETAINED_SIZE, &thread->linear_allocator);
     
     for (;;) {
         wait_for_mutex_and_own(&thread->mutex, "thread->requested"); // Mutex which acts on thread->requested
         if (thread->requested) {
             thread->process(thread->input_data);
             thread->requested = 0;
+
+            clear_linear(&thread->linear_allocator);
         }
         release_mutex(&thread->mutex, "thread->requested");
     }
@@ -92,6 +111,28 @@ void release_mutex(mutex_t *mutex, const char *mutex_name) {
     ReleaseMutex(mutex->mutex_handle);
 }
 
+signal_t *request_signal(void) {
+    if (g_thread_pool.used_signals_count < MAX_SIGNAL_COUNT) {
+        signal_t *signal = &g_thread_pool.signals[g_thread_pool.used_signals_count++];
+        signal->event_handle = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+        if (signal->event_handle) {
+            return(signal);
+        }
+        return(nullptr);
+    }
+
+    return(nullptr);
+}
+
+void raise_signal(signal_t *signal) {
+    SetEvent(signal->event_handle);
+}
+
+bool wait_for_signal(signal_t *signal, uint32_t timeout_milliseconds) {
+    return(WaitForSingleObject(signal->event_handle, timeout_milliseconds) == WAIT_OBJECT_0);
+}
+
 void request_thread_for_process(thread_process_t process, void *input_data) {
     thread_t *thread = get_next_available_thread();
     if (!thread) {
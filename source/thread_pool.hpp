@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 typedef void(*thread_process_t)(void *input_data);
 
 struct mutex_t;
@@ -8,6 +10,14 @@ mutex_t *request_mutex(void);
 bool wait_for_mutex_and_own(mutex_t *mutex, const char *mutex_name = "");
 void release_mutex(mutex_t *mutex, const char *mutex_name ="");
 
+// Auto reset: wakes up one waiting thread (or the next thread that waits)
+struct signal_t;
+
+signal_t *request_signal(void);
+void raise_signal(signal_t *signal);
+// Returns 0 if timed out
+bool wait_for_signal(signal_t *signal, uint32_t timeout_milliseconds);
+
 void request_thread_for_process(thread_process_t process, void *input_data);
 
 void initialize_thread_pool(void);
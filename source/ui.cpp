@@ -7,6 +7,7 @@
 #include "ui.hpp"
 
 #include "file_system.hpp"
+#include "allocators.hpp"
 
 #include "hud.hpp"
 #include "menu.hpp"
@@ -197,6 +198,9 @@ static int32_t lua_get_fps(lua_State *state);
 static int32_t lua_print_fps(lua_State *state);
 static int32_t lua_break(lua_State *state);
 static int32_t lua_quit(lua_State *state);
+static int32_t lua_memory_report(lua_State *state);
+static int32_t lua_memory_leaks(lua_State *state);
+static int32_t lua_memory_tag(lua_State *state);
 
 bool console_is_receiving_input(void) {
     return(g_console->receive_input);
@@ -306,6 +310,9 @@ static void initialize_console(void) {
     add_global_to_lua(script_primitive_type_t::FUNCTION, "print_fps", &lua_print_fps);
     add_global_to_lua(script_primitive_type_t::FUNCTION, "debug_break", &lua_break);
     add_global_to_lua(script_primitive_type_t::FUNCTION, "quit", &lua_quit);
+    add_global_to_lua(script_primitive_type_t::FUNCTION, "memory_report", &lua_memory_report);
+    add_global_to_lua(script_primitive_type_t::FUNCTION, "memory_leaks", &lua_memory_leaks);
+    add_global_to_lua(script_primitive_type_t::FUNCTION, "memory_tag", &lua_memory_tag);
 }
 
 static void handle_console_input(raw_input_t *raw_input, element_focus_t focus) {
@@ -840,6 +847,36 @@ static int32_t lua_break(lua_State *state) {
     return(0);
 }
 
+static void s_memory_report_to_console(const char *line) {
+    console_out(line);
+}
+
+static int32_t lua_memory_report(lua_State *state) {
+    print_memory_report(&s_memory_report_to_console);
+
+    free_list_stats_t free_list = get_free_list_stats();
+    console_out("free list: ", (int32_t)(free_list.used_bytes / 1024), " KB used | ", (int32_t)(free_list.free_bytes / 1024), " KB free | fragmentation ", free_list.fragmentation, "\n");
+
+    return(0);
+}
+
+static int32_t lua_memory_leaks(lua_State *state) {
+    print_memory_leak_report(&s_memory_report_to_console);
+    return(0);
+}
+
+// memory_tag("name") -> live bytes, peak bytes, allocation count (all allocators added up)
+static int32_t lua_memory_tag(lua_State *state) {
+    const char *name = lua_tostring(state, -1);
+    allocation_tag_stats_t stats = find_allocation_tag_stats(name ? name : "");
+
+    lua_pushnumber(state, (lua_Number)stats.live_bytes);
+    lua_pushnumber(state, (lua_Number)stats.peak_bytes);
+    lua_pushnumber(state, (lua_Number)stats.allocation_count);
+
+    return(3);
+}
+
 void initialize_ui_translation_unit(struct game_memory_t *memory) {
     g_console = &memory->user_interface_state.console;
 }
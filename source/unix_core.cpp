@@ -17,17 +17,7 @@ int32_t main(int32_t argc, char *argv[]) {
     output_to_debug_console("Starting session ----\n");
 
     // Initialize game's dynamic memory
-    linear_allocator_global.capacity = (uint32_t)megabytes(30);
-    linear_allocator_global.start = linear_allocator_global.current = malloc(linear_allocator_global.capacity);
-
-    stack_allocator_global.capacity = (uint32_t)megabytes(10);
-    stack_allocator_global.start = stack_allocator_global.current = malloc(stack_allocator_global.capacity);
-
-    free_list_allocator_global.available_bytes = (uint32_t)megabytes(30);
-    free_list_allocator_global.start = malloc(free_list_allocator_global.available_bytes);
-
-    free_list_allocator_global.free_block_head = (free_block_header_t *)free_list_allocator_global.start;
-    free_list_allocator_global.free_block_head->free_block_size = free_list_allocator_global.available_bytes;
+    initialize_global_allocators();
 
     application_type_t app_type = application_type_t::CONSOLE_APPLICATION_MODE;
     application_mode_t app_mode = application_mode_t::SERVER_MODE;
@@ -41,6 +31,8 @@ int32_t main(int32_t argc, char *argv[]) {
 
         game_tick(&game, nullptr, dt);
 
+        swap_frame_linear();
+
         clock_t end = clock();
 
         dt = (float32_t)(end - start) / CLOCKS_PER_SEC;
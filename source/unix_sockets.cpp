@@ -0,0 +1,293 @@
+// Windows backend is in sockets.cpp
+#if !defined (_WIN32)
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#include "core.hpp"
+#include "sockets.hpp"
+#include "containers.hpp"
+
+
+#define MAX_SOCKETS 50
+
+
+static stack_dynamic_container_t<int32_t, MAX_SOCKETS> sockets;
+static network_socket_t main_network_socket;
+// Only gets used by wait_for_incoming_data()
+static int32_t epoll_fd = -1;
+
+// Datagrams waiting for flush_queued_datagrams()
+static struct {
+    uint32_t count = 0;
+    mmsghdr headers[MAX_DATAGRAM_BATCH];
+    // Second vector is for the (optional) body
+    iovec vectors[MAX_DATAGRAM_BATCH][2];
+    sockaddr_in addresses[MAX_DATAGRAM_BATCH];
+    // File descriptor which each datagram goes out of
+    int32_t sockets[MAX_DATAGRAM_BATCH];
+} send_queue;
+
+
+void initialize_socket_api(uint16_t output_port) {
+    initialize_udp_socket(&main_network_socket, output_port);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        output_to_debug_console("Failed to create epoll instance\n");
+        assert(0);
+    }
+
+    watch_network_socket(&main_network_socket);
+}
+
+
+void add_network_socket(network_socket_t *socket) {
+    socket->socket = sockets.add();
+}
+
+
+static int32_t *s_get_network_socket(network_socket_t *socket) {
+    return(sockets.get(socket ? socket->socket : main_network_socket.socket));
+}
+
+
+void initialize_network_socket(network_socket_t *socket_p, int32_t family, int32_t type, int32_t protocol) {
+    int32_t new_socket = socket(family, type, protocol);
+
+    if (new_socket == -1) {
+        output_to_debug_console("Failed to initialize socket\n");
+        assert(0);
+    }
+
+    *(sockets.get(socket_p->socket)) = new_socket;
+}
+
+
+void bind_network_socket_to_port(network_socket_t *socket, network_address_t address) {
+    int32_t *sock = s_get_network_socket(socket);
+
+    sockaddr_in address_struct = {};
+    address_struct.sin_family = AF_INET;
+    // Needs to be in network byte order
+    address_struct.sin_port = address.port;
+    address_struct.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(*sock, (sockaddr *)&address_struct, sizeof(address_struct)) == -1) {
+        output_to_debug_console("Failed to bind socket to local port");
+
+        // Try again with different port
+        ++address.port;
+        bind_network_socket_to_port(socket, address);
+    }
+}
+
+
+void set_socket_to_non_blocking_mode(network_socket_t *socket) {
+    int32_t *sock = s_get_network_socket(socket);
+    int32_t flags = fcntl(*sock, F_GETFL, 0);
+    fcntl(*sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+void initialize_udp_socket(network_socket_t *socket, uint16_t port) {
+    add_network_socket(socket);
+    initialize_network_socket(socket, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    network_address_t address = {};
+    address.port = host_to_network_byte_order(port);
+
+    bind_network_socket_to_port(socket, address);
+    set_socket_to_non_blocking_mode(socket);
+}
+
+
+int32_t receive_from(char *buffer, uint32_t buffer_size, network_address_t *address_dst) {
+    int32_t *sock = s_get_network_socket(&main_network_socket);
+
+    sockaddr_in from_address = {};
+    socklen_t from_size = sizeof(from_address);
+
+    int32_t bytes_received = (int32_t)recvfrom(*sock, buffer, buffer_size, 0, (sockaddr *)&from_address, &from_size);
+
+    if (bytes_received == -1) {
+        return 0;
+    }
+
+    network_address_t received_address = {};
+    received_address.port = from_address.sin_port;
+    received_address.ipv4_address = from_address.sin_addr.s_addr;
+
+    *address_dst = received_address;
+
+    return(bytes_received);
+}
+
+
+bool send_to(network_address_t address, char *buffer, uint32_t buffer_size) {
+    int32_t *sock = s_get_network_socket(&main_network_socket);
+
+    sockaddr_in address_struct = {};
+    address_struct.sin_family = AF_INET;
+    // Needs to be in network byte order
+    address_struct.sin_port = address.port;
+    address_struct.sin_addr.s_addr = address.ipv4_address;
+
+    int32_t sendto_ret = (int32_t)sendto(*sock, buffer, buffer_size, 0, (sockaddr *)&address_struct, sizeof(address_struct));
+
+    if (sendto_ret == -1) {
+        output_to_debug_console("sendto failed: ", (int32_t)errno, "\n");
+        assert(0);
+    }
+
+    return(sendto_ret != -1);
+}
+
+
+uint32_t receive_from_batch(datagram_t *datagrams, uint32_t count, network_socket_t *socket) {
+    int32_t *sock = s_get_network_socket(socket);
+
+    mmsghdr headers[MAX_DATAGRAM_BATCH];
+    iovec vectors[MAX_DATAGRAM_BATCH];
+    sockaddr_in addresses[MAX_DATAGRAM_BATCH];
+
+    count = MIN(count, MAX_DATAGRAM_BATCH);
+    memset(headers, 0, sizeof(mmsghdr) * count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        vectors[i].iov_base = datagrams[i].buffer;
+        vectors[i].iov_len = datagrams[i].buffer_size;
+
+        headers[i].msg_hdr.msg_name = &addresses[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        headers[i].msg_hdr.msg_iov = &vectors[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int32_t received_count = recvmmsg(*sock, headers, count, MSG_DONTWAIT, nullptr);
+
+    if (received_count <= 0) {
+        return(0);
+    }
+
+    for (int32_t i = 0; i < received_count; ++i) {
+        datagrams[i].bytes_received = headers[i].msg_len;
+        datagrams[i].address.port = addresses[i].sin_port;
+        datagrams[i].address.ipv4_address = addresses[i].sin_addr.s_addr;
+    }
+
+    return((uint32_t)received_count);
+}
+
+
+void queue_send_to(network_address_t address, char *buffer, uint32_t buffer_size, char *body, uint32_t body_size, network_socket_t *socket) {
+    if (send_queue.count == MAX_DATAGRAM_BATCH) {
+        flush_queued_datagrams();
+    }
+
+    uint32_t index = send_queue.count++;
+    send_queue.sockets[index] = *s_get_network_socket(socket);
+
+    sockaddr_in *address_struct = &send_queue.addresses[index];
+    memset(address_struct, 0, sizeof(sockaddr_in));
+    address_struct->sin_family = AF_INET;
+    address_struct->sin_port = address.port;
+    address_struct->sin_addr.s_addr = address.ipv4_address;
+
+    send_queue.vectors[index][0].iov_base = buffer;
+    send_queue.vectors[index][0].iov_len = buffer_size;
+    send_queue.vectors[index][1].iov_base = body;
+    send_queue.vectors[index][1].iov_len = body_size;
+
+    mmsghdr *header = &send_queue.headers[index];
+    memset(header, 0, sizeof(mmsghdr));
+    header->msg_hdr.msg_name = address_struct;
+    header->msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    header->msg_hdr.msg_iov = send_queue.vectors[index];
+    header->msg_hdr.msg_iovlen = body ? 2 : 1;
+}
+
+
+void flush_queued_datagrams(void) {
+    uint32_t sent_count = 0;
+    bool waited_for_socket = 0;
+    while (sent_count < send_queue.count) {
+        // One sendmmsg per run of datagrams which go out of the same socket
+        int32_t sock = send_queue.sockets[sent_count];
+        uint32_t run_end = sent_count + 1;
+        while (run_end < send_queue.count && send_queue.sockets[run_end] == sock) {
+            ++run_end;
+        }
+
+        // sendmmsg may only send part of the batch
+        int32_t sent = sendmmsg(sock, &send_queue.headers[sent_count], run_end - sent_count, 0);
+
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // Send buffer is full: the rest of the run goes out once it drained
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && !waited_for_socket) {
+                waited_for_socket = 1;
+
+                pollfd poll_fd = {};
+                poll_fd.fd = sock;
+                poll_fd.events = POLLOUT;
+                if (poll(&poll_fd, 1, SEND_BUFFER_WAIT_MILLISECONDS) > 0) {
+                    continue;
+                }
+            }
+
+            // Datagrams of the other sockets can still go out
+            output_to_debug_console("sendmmsg failed: ", (int32_t)errno, " (", (int32_t)(run_end - sent_count), " datagrams dropped)\n");
+            sent_count = run_end;
+            waited_for_socket = 0;
+            continue;
+        }
+
+        sent_count += (uint32_t)sent;
+        waited_for_socket = 0;
+    }
+
+    send_queue.count = 0;
+}
+
+
+void watch_network_socket(network_socket_t *socket) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = *s_get_network_socket(socket);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event);
+}
+
+
+bool wait_for_incoming_data(uint32_t timeout_milliseconds) {
+    epoll_event event;
+    return(epoll_wait(epoll_fd, &event, 1, (int32_t)timeout_milliseconds) > 0);
+}
+
+
+uint32_t str_to_ipv4_int32(const char *address) {
+    return(inet_addr(address));
+}
+
+
+uint32_t host_to_network_byte_order(uint32_t bytes) {
+    return(htons(bytes));
+}
+
+
+uint32_t network_to_host_byte_order(uint32_t bytes) {
+    return(ntohl(bytes));
+}
+
+#endif
@@ -673,8 +673,8 @@ inline VkDescriptorSetLayoutBinding init_descriptor_set_layout_binding(VkDescrip
 
 void init_descriptor_set_layout(const memory_buffer_view_t<VkDescriptorSetLayoutBinding> &bindings, VkDescriptorSetLayout *dst);
 
-inline void command_buffer_bind_descriptor_sets(VkPipelineLayout *layout, const memory_buffer_view_t<VkDescriptorSet> &sets, VkCommandBuffer *command_buffer) {
-    vkCmdBindDescriptorSets(*command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, *layout, 0, sets.count, sets.buffer, 0, nullptr);
+inline void command_buffer_bind_descriptor_sets(VkPipelineLayout *layout, const memory_buffer_view_t<VkDescriptorSet> &sets, VkCommandBuffer *command_buffer, const memory_buffer_view_t<uint32_t> &dynamic_offsets = {0, nullptr}) {
+    vkCmdBindDescriptorSets(*command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, *layout, 0, sets.count, sets.buffer, dynamic_offsets.count, dynamic_offsets.buffer);
 }
     
 void allocate_descriptor_sets(memory_buffer_view_t<VkDescriptorSet> &descriptor_sets,const memory_buffer_view_t<VkDescriptorSetLayout> &layouts,VkDescriptorPool *descriptor_pool);
@@ -683,12 +683,12 @@ void destroy_descriptor_set(VkDescriptorSet *set);
 
 VkDescriptorSet allocate_descriptor_set(VkDescriptorSetLayout *layout, VkDescriptorPool *descriptor_pool);
     
-inline void init_buffer_descriptor_set_write(VkDescriptorSet *set, uint32_t binding, uint32_t dst_array_element, uint32_t count, VkDescriptorBufferInfo *infos, VkWriteDescriptorSet *write) {
+inline void init_buffer_descriptor_set_write(VkDescriptorSet *set, uint32_t binding, uint32_t dst_array_element, uint32_t count, VkDescriptorBufferInfo *infos, VkWriteDescriptorSet *write, VkDescriptorType type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
     write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
     write->dstSet = *set;
     write->dstBinding = binding;
     write->dstArrayElement = dst_array_element;
-    write->descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    write->descriptorType = type;
     write->descriptorCount = count;
     write->pBufferInfo = infos;
 }
@@ -23,6 +23,7 @@
 #include <xinput.h>
 
 #include "raw_input.hpp"
+#include "channel.hpp"
 
 // Global
 static bool running;
@@ -32,6 +33,11 @@ static raw_input_t raw_input = {};
 static game_memory_t game;
 static HCURSOR arrow;
 
+// "ct" mode: runs the channel loopback test instead of the game
+static bool run_channel_test = 0;
+static uint32_t channel_test_message_count = 1000;
+static float32_t channel_test_packet_loss_percentage = 10.0f;
+
 
 
 // Static declarations
@@ -48,7 +54,6 @@ static void handle_keyboard_event(WPARAM wparam, LPARAM lparam, int32_t action);
 static LRESULT CALLBACK win32_callback(HWND window_handle, UINT message, WPARAM wparam, LPARAM lparam);
 static void get_gamepad_state(void);
 static float32_t measure_time_difference(LARGE_INTEGER begin_time, LARGE_INTEGER end_time, LARGE_INTEGER frequency);
-static void init_free_list_allocator_head(free_list_allocator_t *allocator = &free_list_allocator_global);
 static void parse_command_line_args(LPSTR cmdline, application_type_t *app_type, application_mode_t *app_mode, const char **application_name);
 
 struct create_vulkan_surface_win32 : create_vulkan_surface {
@@ -94,15 +99,7 @@ int32_t CALLBACK WinMain(HINSTANCE hinstance, HINSTANCE prev_instance, LPSTR cmd
     }
 
     // Initialize game's dynamic memory
-    linear_allocator_global.capacity = (uint32_t)megabytes(30);
-    linear_allocator_global.start = linear_allocator_global.current = malloc(linear_allocator_global.capacity);
-	
-    stack_allocator_global.capacity = (uint32_t)megabytes(10);
-    stack_allocator_global.start = stack_allocator_global.current = malloc(stack_allocator_global.capacity);
-
-    free_list_allocator_global.available_bytes = (uint32_t)megabytes(50);
-    free_list_allocator_global.start = malloc(free_list_allocator_global.available_bytes);
-    init_free_list_allocator_head(&free_list_allocator_global);
+    initialize_global_allocators();
 
 
     application_type_t app_type;
@@ -110,6 +107,12 @@ int32_t CALLBACK WinMain(HINSTANCE hinstance, HINSTANCE prev_instance, LPSTR cmd
     const char *application_name;
     parse_command_line_args(cmdline, &app_type, &app_mode, &application_name);
 
+    if (run_channel_test) {
+        // Results are in the debug output, exit code is 0 if the test passed
+        initialize_socket_api(0);
+        initialize_net_channels();
+        return(run_channel_loopback_test(channel_test_message_count, channel_test_packet_loss_percentage / 100.0f) ? 0 : 1);
+    }
 
     if (app_type == application_type_t::WINDOW_APPLICATION_MODE) {
         SetProcessDPIAware();
@@ -239,7 +242,7 @@ int32_t CALLBACK WinMain(HINSTANCE hinstance, HINSTANCE prev_instance, LPSTR cmd
             } break;
         }
         
-        clear_linear();
+        swap_frame_linear();
 
         LARGE_INTEGER tick_end;
         QueryPerformanceCounter(&tick_end);
@@ -736,11 +739,31 @@ static void parse_command_line_args(LPSTR cmdline, application_type_t *app_type,
     parameter[2] = 0;
 
     if (strcmp("sv", parameter) == 0) {
+        // sv [packet capture file to record to]
         *app_type = application_type_t::WINDOW_APPLICATION_MODE;
         //*app_type = application_type_t::CONSOLE_APPLICATION_MODE;
         *app_mode = application_mode_t::SERVER_MODE;
 
         *application_name = "Server";
+
+        char capture_path[256] = {};
+        if (cmdline[0] && cmdline[1] && sscanf_s(cmdline + 2, "%255s", capture_path, (uint32_t)sizeof(capture_path)) == 1) {
+            configure_server_capture(capture_path);
+        }
+    }
+    else if (strcmp("rp", parameter) == 0) {
+        // rp <packet capture file>: replays a capture recorded by a server, as fast as possible
+        *app_type = application_type_t::CONSOLE_APPLICATION_MODE;
+        *app_mode = application_mode_t::SERVER_MODE;
+
+        *application_name = "Replay";
+
+        char capture_path[256] = "capture.bin";
+        if (cmdline[0] && cmdline[1]) {
+            sscanf_s(cmdline + 2, "%255s", capture_path, (uint32_t)sizeof(capture_path));
+        }
+
+        configure_server_replay(capture_path);
     }
     else if (strcmp("cl", parameter) == 0) {
         *app_type = application_type_t::WINDOW_APPLICATION_MODE;
@@ -748,20 +771,40 @@ static void parse_command_line_args(LPSTR cmdline, application_type_t *app_type,
 
         *application_name = "Saska";
     }
-}
+    else if (strcmp("bt", parameter) == 0) {
+        // bt <bot count> <server ip address>
+        *app_type = application_type_t::CONSOLE_APPLICATION_MODE;
+        *app_mode = application_mode_t::BOT_MODE;
 
+        *application_name = "Bots";
 
-static float32_t measure_time_difference(LARGE_INTEGER begin_time, LARGE_INTEGER end_time, LARGE_INTEGER frequency) {
-    return float32_t(end_time.QuadPart - begin_time.QuadPart) / float32_t(frequency.QuadPart);
-}
+        uint32_t bot_count = 1;
+        char server_ip_address[16] = "127.0.0.1";
+        if (cmdline[0] && cmdline[1]) {
+            sscanf_s(cmdline + 2, "%u %15s", &bot_count, server_ip_address, (uint32_t)sizeof(server_ip_address));
+        }
+
+        configure_bots(bot_count, server_ip_address);
+    }
+    else if (strcmp("ct", parameter) == 0) {
+        // ct [message count] [packet loss percentage]: channel loopback test (same as the channel_test console command), then quits
+        *app_type = application_type_t::CONSOLE_APPLICATION_MODE;
+        *app_mode = application_mode_t::SERVER_MODE;
 
+        *application_name = "Channel test";
 
-static void init_free_list_allocator_head(free_list_allocator_t *allocator) {
-    allocator->free_block_head = (free_block_header_t *)allocator->start;
-    allocator->free_block_head->free_block_size = allocator->available_bytes;
+        run_channel_test = 1;
+        if (cmdline[0] && cmdline[1]) {
+            sscanf_s(cmdline + 2, "%u %f", &channel_test_message_count, &channel_test_packet_loss_percentage);
+        }
+    }
 }
 
 
+static float32_t measure_time_difference(LARGE_INTEGER begin_time, LARGE_INTEGER end_time, LARGE_INTEGER frequency) {
+    return float32_t(end_time.QuadPart - begin_time.QuadPart) / float32_t(frequency.QuadPart);
+}
+
 
 // Public
 void request_quit(void) {